@@ -0,0 +1,217 @@
+#pragma once
+
+#include <time.h>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <utility>
+#include <vector>
+#include "types.h"
+#include "kmkTime.h"
+
+#ifndef _WINDOWS
+	#include <sys/utsname.h>
+	#include <unistd.h>
+#endif
+
+// Minimal benchmark harness shared by the driver benchmark executables. Each benchmark is run for a number of
+// repetitions of at least the minimum time and the results are written as JSON so they can be compared between
+// releases and targets.
+//
+// Command line:
+//   --filter <text>      Only run benchmarks whose name contains text
+//   --min-time <ms>      Minimum time for each repetition (default 200)
+//   --repetitions <n>    Repetitions of each benchmark (default 5)
+//   --output <file>      Write the JSON to a file rather than stdout
+
+namespace kmk
+{
+
+// Stop the compiler optimising away a result that is otherwise unused
+template <typename T>
+inline void DoNotOptimize(const T &value)
+{
+#if defined(__GNUC__)
+	asm volatile("" : : "r,m"(value) : "memory");
+#else
+	static volatile const void *sink;
+	sink = &value;
+#endif
+}
+
+class BenchmarkRunner
+{
+public:
+
+	struct Result
+	{
+		std::string name;
+		uint64_t iterations;		// Iterations in each repetition
+		double nsPerOpMedian;
+		double nsPerOpMin;
+		double nsPerOpMax;
+		double bytesPerSecond;		// From the median, 0 if the benchmark does not process bytes
+		std::vector<std::pair<std::string, double> > counters;	// Added by the benchmark, see AddCounter
+	};
+
+	BenchmarkRunner(int argc, char **argv)
+		: _minTimeMs(200)
+		, _repetitions(5)
+	{
+		for (int i = 1; i + 1 < argc; i += 2)
+		{
+			if (strcmp(argv[i], "--filter") == 0)
+				_filter = argv[i + 1];
+			else if (strcmp(argv[i], "--min-time") == 0)
+				_minTimeMs = std::max(1, atoi(argv[i + 1]));
+			else if (strcmp(argv[i], "--repetitions") == 0)
+				_repetitions = std::max(1, atoi(argv[i + 1]));
+			else if (strcmp(argv[i], "--output") == 0)
+				_outputPath = argv[i + 1];
+		}
+	}
+
+	// Run a benchmark. func(iterations) must perform the operation iterations times. bytesPerOp is the amount of data
+	// each operation processes, or 0. Returns false if the benchmark is filtered out
+	template <typename Func>
+	bool Run(const char *name, size_t bytesPerOp, Func func)
+	{
+		if (!_filter.empty() && strstr(name, _filter.c_str()) == NULL)
+			return false;
+
+		// Find an iteration count that takes at least the minimum time
+		uint64_t iterations = 1;
+		double elapsedMs = 0;
+		while (true)
+		{
+			elapsedMs = Time(func, iterations);
+			if (elapsedMs >= _minTimeMs || iterations >= (1ull << 40))
+				break;
+
+			// Aim a little over the minimum and never grow more than 10x at a time
+			double scale = (elapsedMs > 0) ? (_minTimeMs * 1.2) / elapsedMs : 10.0;
+			scale = std::min(std::max(scale, 2.0), 10.0);
+			iterations = (uint64_t)(iterations * scale);
+		}
+
+		std::vector<double> nsPerOp;
+		for (int i = 0; i < _repetitions; ++i)
+			nsPerOp.push_back(Time(func, iterations) * 1e6 / iterations);
+
+		std::sort(nsPerOp.begin(), nsPerOp.end());
+
+		Result result;
+		result.name = name;
+		result.iterations = iterations;
+		result.nsPerOpMedian = nsPerOp[nsPerOp.size() / 2];
+		result.nsPerOpMin = nsPerOp.front();
+		result.nsPerOpMax = nsPerOp.back();
+		result.bytesPerSecond = (bytesPerOp > 0 && result.nsPerOpMedian > 0) ? bytesPerOp * 1e9 / result.nsPerOpMedian : 0;
+		_results.push_back(result);
+
+		fprintf(stderr, "%-48s %12.1f ns/op\n", name, result.nsPerOpMedian);
+		return true;
+	}
+
+	// Add a figure to the last benchmark run, such as system calls for each operation, measured by the caller over
+	// every iteration Run made
+	void AddCounter(const char *name, double value)
+	{
+		if (_results.empty())
+			return;
+
+		_results.back().counters.push_back(std::make_pair(std::string(name), value));
+		fprintf(stderr, "%-48s %12.1f %s\n", "", value, name);
+	}
+
+	// Write the results. Returns the process exit code
+	int Finish(const char *executableName)
+	{
+		FILE *pFile = _outputPath.empty() ? stdout : fopen(_outputPath.c_str(), "w");
+		if (pFile == NULL)
+		{
+			fprintf(stderr, "Unable to open %s\n", _outputPath.c_str());
+			return 1;
+		}
+
+		fprintf(pFile, "{\n  \"context\": {\n");
+		fprintf(pFile, "    \"executable\": \"%s\",\n", executableName);
+		fprintf(pFile, "    \"date\": %lld,\n", (long long)(kmk::Time::GetSystemTime() / 10000000));
+		WriteHostContext(pFile);
+		fprintf(pFile, "    \"compiler\": \"%s\",\n", CompilerName().c_str());
+		fprintf(pFile, "    \"min_time_ms\": %d,\n", _minTimeMs);
+		fprintf(pFile, "    \"repetitions\": %d\n  },\n", _repetitions);
+
+		fprintf(pFile, "  \"benchmarks\": [");
+		for (size_t i = 0; i < _results.size(); ++i)
+		{
+			const Result &result = _results[i];
+			fprintf(pFile, "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, "
+				"\"ns_per_op_max\": %.3f, \"bytes_per_second\": %.0f",
+				(i == 0) ? "" : ",", result.name.c_str(), (unsigned long long)result.iterations, result.nsPerOpMedian,
+				result.nsPerOpMin, result.nsPerOpMax, result.bytesPerSecond);
+
+			for (size_t counter = 0; counter < result.counters.size(); ++counter)
+				fprintf(pFile, ", \"%s\": %.3f", result.counters[counter].first.c_str(), result.counters[counter].second);
+
+			fprintf(pFile, "}");
+		}
+		fprintf(pFile, "\n  ]\n}\n");
+
+		if (pFile != stdout)
+			fclose(pFile);
+
+		return 0;
+	}
+
+private:
+	std::string _filter;
+	std::string _outputPath;
+	int _minTimeMs;
+	int _repetitions;
+	std::vector<Result> _results;
+
+	// Time (ms) taken to run the benchmark for a number of iterations
+	template <typename Func>
+	static double Time(Func &func, uint64_t iterations)
+	{
+		int64_t start = kmk::Time::GetTime();
+		func(iterations);
+		return kmk::Time::TicksToSeconds(kmk::Time::GetTime() - start) * 1000.0;
+	}
+
+	static void WriteHostContext(FILE *pFile)
+	{
+#ifndef _WINDOWS
+		utsname name;
+		if (uname(&name) == 0)
+		{
+			fprintf(pFile, "    \"host\": \"%s\",\n", name.nodename);
+			fprintf(pFile, "    \"system\": \"%s %s\",\n", name.sysname, name.release);
+			fprintf(pFile, "    \"machine\": \"%s\",\n", name.machine);
+		}
+		fprintf(pFile, "    \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+#else
+		fprintf(pFile, "    \"system\": \"Windows\",\n");
+#endif
+	}
+
+	static std::string CompilerName()
+	{
+		char buffer[64];
+#if defined(__clang__)
+		snprintf(buffer, sizeof(buffer), "clang %d.%d.%d", __clang_major__, __clang_minor__, __clang_patchlevel__);
+#elif defined(__GNUC__)
+		snprintf(buffer, sizeof(buffer), "gcc %d.%d.%d", __GNUC__, __GNUC_MINOR__, __GNUC_PATCHLEVEL__);
+#elif defined(_MSC_VER)
+		snprintf(buffer, sizeof(buffer), "msvc %d", _MSC_VER);
+#else
+		snprintf(buffer, sizeof(buffer), "unknown");
+#endif
+		return buffer;
+	}
+};
+
+}
@@ -0,0 +1,862 @@
+// Microbenchmarks for the data paths that run for every report / packet received from a detector. Results are written as
+// JSON (see Benchmark.h) so they can be compared between releases and between targets (Pi, x86).
+//
+// kromek_benchmark [--filter <text>] [--min-time <ms>] [--repetitions <n>] [--output <file>]
+
+#include "stdafx.h"
+#include "Benchmark.h"
+#include "IDataInterface.h"
+#include "IntervalCountProcessor.h"
+#include "D3DataProcessor.h"
+#include "D3Structs.h"
+#include "PacketStreamers.h"
+#include "RollingQueue.h"
+#include "crc.h"
+#include "Heatshrink.hpp"
+#include "Event.h"
+
+extern "C"
+{
+#include "heatshrink_encoder.h"
+}
+
+#include <math.h>
+#ifndef _WINDOWS
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/resource.h>
+	#include <sys/stat.h>
+	#include <sys/time.h>
+	#include "USBKromekDataInterfaceLinux.h"
+#endif
+#include <atomic>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Report id, size of an interval count report and the number of events each one carries
+#define DATA_IN_REPORT 4
+#define REPORT_SIZE 63
+#define EVENTS_PER_REPORT 31
+
+// Component the interval count processor uses for detector data
+#define DETECTOR_COMPONENT_ID 0
+
+// Reports pushed through the interval count processor in each operation
+#define REPORTS_PER_BATCH 256
+
+// Chunk size used when streaming D3 packets, about what a USB bulk read returns
+#define PACKET_CHUNK_SIZE 512
+
+// Items passed from producer to consumer in each event throughput operation
+#define EVENT_ITEMS_PER_BATCH 1024
+
+// Reports written across the devices in each read backend operation
+#define REPORTS_PER_READ_OP 1000
+
+// Heatshrink parameters used by the D3 family
+#define D3_HEATSHRINK_WINDOW 9
+#define D3_HEATSHRINK_LOOKAHEAD 8
+
+using namespace kmk;
+
+// Data interface that passes data straight to the data processor on the calling thread, as the read thread would
+class BenchmarkDataInterface : public IDataInterface
+{
+public:
+	BenchmarkDataInterface()
+		: _dataReadyCallback(NULL)
+		, _dataReadyCallbackArg(NULL)
+	{
+	}
+
+	unsigned int GetHash() { return 0; }
+	bool Initialize() { return true; }
+	VID GetVendorID() { return 0; }
+	PID GetProductID() { return 0; }
+
+	bool BeginReading() { return true; }
+	bool StopReading() { return true; }
+
+	// Requests are not answered, the benchmarks only measure data coming from the device
+	bool GetConfigurationSetting(unsigned char * /*pReportdata*/, size_t /*dataLength*/) { return true; }
+	bool SetConfigurationSetting(unsigned char * /*pData*/, size_t /*dataLength*/) { return true; }
+
+	void SetDataReadyCallback(DataReadyCallbackFunc pFunc, void *pArg)
+	{
+		_dataReadyCallback = pFunc;
+		_dataReadyCallbackArg = pArg;
+	}
+
+	void SetErrorCallback(ErrorCallbackFunc /*func*/, void * /*pArg*/) {}
+
+	String GetInterfaceProperty(const String& /*name*/) { return String(); }
+
+	void Push(BYTE *pData, size_t dataSize)
+	{
+		if (_dataReadyCallback != NULL)
+			(*_dataReadyCallback)(_dataReadyCallbackArg, pData, dataSize);
+	}
+
+private:
+	DataReadyCallbackFunc _dataReadyCallback;
+	void *_dataReadyCallbackArg;
+};
+
+#ifndef _WINDOWS
+// The Linux kmk::Event before it moved to a futex, a mutex and condition variable waiting against the wall clock. Kept
+// so the benchmarks can compare the two
+class CondVarEvent
+{
+public:
+	CondVarEvent()
+		: _signalled(false)
+	{
+		pthread_mutex_init(&_mutex, NULL);
+		pthread_cond_init(&_condition, NULL);
+	}
+
+	~CondVarEvent()
+	{
+		pthread_cond_destroy(&_condition);
+		pthread_mutex_destroy(&_mutex);
+	}
+
+	void Signal()
+	{
+		pthread_mutex_lock(&_mutex);
+		_signalled = true;
+		pthread_cond_broadcast(&_condition);
+		pthread_mutex_unlock(&_mutex);
+	}
+
+	void Reset()
+	{
+		pthread_mutex_lock(&_mutex);
+		_signalled = false;
+		pthread_mutex_unlock(&_mutex);
+	}
+
+	bool Wait(uint32_t timeOut)
+	{
+		pthread_mutex_lock(&_mutex);
+		if (!_signalled)
+		{
+			timeval now;
+			gettimeofday(&now, NULL);
+			int64_t timeNs = (now.tv_usec * 1000) + ((int64_t)timeOut * 1000000);
+			timespec deadline;
+			deadline.tv_sec = now.tv_sec + (timeNs / 1000000000L);
+			deadline.tv_nsec = (timeNs % 1000000000L);
+
+			while (!_signalled && pthread_cond_timedwait(&_condition, &_mutex, &deadline) == 0)
+				;
+		}
+
+		bool signalled = _signalled;
+		pthread_mutex_unlock(&_mutex);
+		return signalled;
+	}
+
+private:
+	bool _signalled;
+	pthread_cond_t _condition;
+	pthread_mutex_t _mutex;
+};
+#endif
+
+// Interval count reports full of events on random channels
+static std::vector<BYTE> MakeIntervalCountReports(int numReports)
+{
+	std::mt19937 random(1);
+	std::vector<BYTE> reports(numReports * REPORT_SIZE, 0);
+
+	for (int i = 0; i < numReports; ++i)
+	{
+		BYTE *pReport = &reports[i * REPORT_SIZE];
+		pReport[0] = DATA_IN_REPORT;
+		for (int offset = 1; offset < REPORT_SIZE; offset += 2)
+		{
+			// 12 bit channel with the valid bit set
+			unsigned int channel = random() & 0xFFF;
+			pReport[offset] = (BYTE)(channel >> 4);
+			pReport[offset + 1] = (BYTE)(((channel & 0xF) << 4) | 0x1);
+		}
+	}
+
+	return reports;
+}
+
+// A one second spectrum shaped like a real background measurement. Mostly low counts with a falling continuum
+static void FillSpectrum(uint16_t *pSpectrum, int numChannels)
+{
+	std::mt19937 random(2);
+	for (int i = 0; i < numChannels; ++i)
+	{
+		std::poisson_distribution<int> counts(20.0 * exp(-i / 300.0));
+		pSpectrum[i] = (uint16_t)counts(random);
+	}
+}
+
+static void SetCrc(std::vector<BYTE> &packet)
+{
+	uint16_t crc = crc::CalculateCrc(&packet[0], packet.size() - sizeof(uint16_t));
+	memcpy(&packet[packet.size() - sizeof(uint16_t)], &crc, sizeof(crc));
+}
+
+static std::vector<BYTE> MakeRadiometricsV1Packet()
+{
+	std::vector<BYTE> packet(sizeof(D3RadiometricsV1ReponseHeader), 0);
+	D3RadiometricsV1ReponseHeader *pSpectrum = (D3RadiometricsV1ReponseHeader*)&packet[0];
+	pSpectrum->m_message.messageSize = (uint16_t)packet.size();
+	pSpectrum->m_message.contentHeader.componentID = D3DataProcessor::GammaComponentId;
+	pSpectrum->m_message.contentHeader.reportID = D3RadiometricsV1ReponseHeader::REPORT_ID;
+	pSpectrum->realTimeMS = 1000;
+	pSpectrum->neutronCounts = 1;
+	pSpectrum->spectrumBitsSize = 12;
+	FillSpectrum(pSpectrum->gammaSpectrum, D3RadiometricsV1ReponseHeader::SPECTRUM_SIZE);
+	SetCrc(packet);
+	return packet;
+}
+
+static std::vector<BYTE> MakeSpectrum16Packet()
+{
+	std::vector<BYTE> packet(sizeof(D3Spectrum16ResponseHeader), 0);
+	D3Spectrum16ResponseHeader *pSpectrum = (D3Spectrum16ResponseHeader*)&packet[0];
+	pSpectrum->m_message.messageSize = (uint16_t)packet.size();
+	pSpectrum->m_message.contentHeader.componentID = D3DataProcessor::GammaComponentId;
+	pSpectrum->m_message.contentHeader.reportID = D3Spectrum16ResponseHeader::REPORT_ID;
+	pSpectrum->realTimeMS = 1000;
+	pSpectrum->neutronCounts = 1;
+	FillSpectrum(pSpectrum->gammaSpectrum, D3Spectrum16ResponseHeader::SPECTRUM_SIZE);
+	SetCrc(packet);
+	return packet;
+}
+
+// Compress with the same parameters as the device firmware
+static std::vector<BYTE> Compress(const std::vector<BYTE> &data)
+{
+	std::vector<BYTE> compressed;
+	heatshrink_encoder *pEncoder = heatshrink_encoder_alloc(D3_HEATSHRINK_WINDOW, D3_HEATSHRINK_LOOKAHEAD);
+
+	BYTE buffer[512];
+	size_t sunk = 0;
+	size_t polled = 0;
+	while (sunk < data.size())
+	{
+		size_t count = 0;
+		heatshrink_encoder_sink(pEncoder, const_cast<BYTE*>(&data[sunk]), data.size() - sunk, &count);
+		sunk += count;
+
+		do
+		{
+			heatshrink_encoder_poll(pEncoder, buffer, sizeof(buffer), &polled);
+			compressed.insert(compressed.end(), buffer, buffer + polled);
+		} while (polled > 0);
+	}
+
+	while (heatshrink_encoder_finish(pEncoder) == HSER_FINISH_MORE)
+	{
+		heatshrink_encoder_poll(pEncoder, buffer, sizeof(buffer), &polled);
+		compressed.insert(compressed.end(), buffer, buffer + polled);
+	}
+
+	heatshrink_encoder_free(pEncoder);
+	return compressed;
+}
+
+// Feed a packet to a streamer in read sized chunks and read it back out
+static size_t StreamPacket(IPacketStreamer &streamer, const std::vector<BYTE> &data, std::vector<BYTE> &packetOut)
+{
+	for (size_t offset = 0; offset < data.size(); offset += PACKET_CHUNK_SIZE)
+		streamer.AddIncomingData(&data[offset], std::min((size_t)PACKET_CHUNK_SIZE, data.size() - offset));
+
+	size_t packets = 0;
+	while (streamer.ReadPacket(packetOut))
+		++packets;
+
+	return packets;
+}
+
+static void WaitForCount(const std::atomic<uint64_t> &counter, uint64_t target)
+{
+	while (counter.load(std::memory_order_acquire) < target)
+		std::this_thread::yield();
+}
+
+static void CountEventCallback(void *pArg, int64_t /*timestamp*/, int /*channel*/, uint32_t count)
+{
+	((std::atomic<uint64_t>*)pArg)->fetch_add(count, std::memory_order_release);
+}
+
+static void SpectrumEventCallback(void *pArg, int64_t /*timestamp*/, const uint16_t * /*pSpectrum*/, int /*numChannels*/)
+{
+	((std::atomic<uint64_t>*)pArg)->fetch_add(1, std::memory_order_release);
+}
+
+// Processors raise this when a forced stop completes
+static void FinishedCallback(void * /*pArg*/, bool /*wasForced*/)
+{
+}
+
+static void BenchmarkIntervalCountQueue(BenchmarkRunner &runner, const char *name, size_t chunkSize)
+{
+	BenchmarkDataInterface dataInterface;
+	IntervalCountProcessor processor(&dataInterface);
+	std::vector<BYTE> reports = MakeIntervalCountReports(64);
+
+	// Chunks that do not line up with the reports are split and rejoined by QueueData
+	runner.Run(name, reports.size(), [&](uint64_t iterations)
+	{
+		for (uint64_t i = 0; i < iterations; ++i)
+		{
+			for (size_t offset = 0; offset < reports.size(); offset += chunkSize)
+				processor.QueueData(0, &reports[offset], std::min(chunkSize, reports.size() - offset));
+
+			processor.Reset();
+		}
+	});
+}
+
+// ProcessDataReport is internal to the processor so it is measured from the data interface to the count callback
+static void BenchmarkIntervalCountDecode(BenchmarkRunner &runner)
+{
+	BenchmarkDataInterface dataInterface;
+	IntervalCountProcessor processor(&dataInterface);
+	std::vector<BYTE> reports = MakeIntervalCountReports(REPORTS_PER_BATCH);
+
+	std::atomic<uint64_t> counts(0);
+	processor.AddComponent(DETECTOR_COMPONENT_ID, NULL, CountEventCallback, &counts,
+		NULL, NULL, FinishedCallback, NULL, NULL, NULL);
+	processor.StartProcessing(DETECTOR_COMPONENT_ID);
+
+	runner.Run("IntervalCountProcessor/ProcessDataReport", reports.size(), [&](uint64_t iterations)
+	{
+		for (uint64_t i = 0; i < iterations; ++i)
+		{
+			uint64_t target = counts.load() + REPORTS_PER_BATCH * EVENTS_PER_REPORT;
+			for (int report = 0; report < REPORTS_PER_BATCH; ++report)
+				dataInterface.Push(&reports[report * REPORT_SIZE], REPORT_SIZE);
+
+			WaitForCount(counts, target);
+		}
+	});
+
+	processor.StopProcessing(DETECTOR_COMPONENT_ID, true);
+}
+
+static void BenchmarkRollingQueue(BenchmarkRunner &runner)
+{
+	std::vector<BYTE> reports = MakeIntervalCountReports(512);
+	BYTE buffer[REPORT_SIZE];
+	int64_t timestamp = 0;
+
+	{
+		RollingQueue queue(REPORT_SIZE, 30000);
+		runner.Run("RollingQueue/EnqueueDequeue", REPORT_SIZE, [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				queue.Enqueue(0, &reports[0], REPORT_SIZE);
+				queue.Dequeue(buffer, REPORT_SIZE, timestamp);
+			}
+			DoNotOptimize(buffer);
+		});
+	}
+
+	{
+		RollingQueue queue(REPORT_SIZE, 30000);
+		runner.Run("RollingQueue/Burst512", reports.size(), [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				for (int report = 0; report < 512; ++report)
+					queue.Enqueue(0, &reports[report * REPORT_SIZE], REPORT_SIZE);
+
+				while (queue.Dequeue(buffer, REPORT_SIZE, timestamp))
+					;
+			}
+			DoNotOptimize(buffer);
+		});
+	}
+}
+
+static void BenchmarkPacketStreamers(BenchmarkRunner &runner)
+{
+	std::vector<BYTE> packet = MakeRadiometricsV1Packet();
+	std::vector<BYTE> packetOut;
+
+	{
+		SerialPacketStreamer streamer;
+		runner.Run("SerialPacketStreamer/ReadPacket", packet.size(), [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+				DoNotOptimize(StreamPacket(streamer, packet, packetOut));
+		});
+	}
+
+	{
+		FramedPacketStreamer streamer;
+		std::vector<BYTE> framed;
+		streamer.PrepareForSend(packet, framed);
+
+		runner.Run("FramedPacketStreamer/ReadPacket", packet.size(), [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+				DoNotOptimize(StreamPacket(streamer, framed, packetOut));
+		});
+
+		runner.Run("FramedPacketStreamer/PrepareForSend", packet.size(), [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				streamer.PrepareForSend(packet, framed);
+				DoNotOptimize(framed.size());
+			}
+		});
+	}
+}
+
+// Feed corrupt data followed by a good packet to a serial streamer and read until it runs out. Returns the number of packets
+// that match the good one, the corruption error thrown on the way is expected
+static size_t StreamAfterFault(SerialPacketStreamer &streamer, const std::vector<BYTE> &data, const std::vector<BYTE> &packet, std::vector<BYTE> &packetOut)
+{
+	for (size_t offset = 0; offset < data.size(); offset += PACKET_CHUNK_SIZE)
+		streamer.AddIncomingData(&data[offset], std::min((size_t)PACKET_CHUNK_SIZE, data.size() - offset));
+
+	size_t packets = 0;
+	while (true)
+	{
+		try
+		{
+			if (!streamer.ReadPacket(packetOut))
+				break;
+
+			if (packetOut == packet)
+				++packets;
+		}
+		catch (const std::runtime_error &)
+		{
+			// The following reads skip to the next valid packet
+		}
+	}
+
+	return packets;
+}
+
+// Resync of the serial streamer after corrupt data. Each operation streams one fault then a good packet, which must be
+// recovered with the corrupt bytes skipped and counted
+static void BenchmarkPacketStreamerFaults(BenchmarkRunner &runner)
+{
+	std::vector<BYTE> packet = MakeRadiometricsV1Packet();
+
+	struct Fault
+	{
+		const char *name;
+		std::vector<BYTE> data;		// Corrupt data sent ahead of the good packet
+		uint64_t crcFailures;		// Crc failures each one should count
+	};
+
+	std::vector<Fault> faults(3);
+
+	// A whole packet with one bit flipped in the spectrum
+	faults[0].name = "SerialPacketStreamer/Resync/CorruptCrc";
+	faults[0].data = packet;
+	faults[0].data[packet.size() / 2] ^= 0x10;
+	faults[0].crcFailures = 1;
+
+	// The first half of a packet, as left by a read that was cut short. Its header claims the full size so the crc is
+	// checked over the start of the next packet
+	faults[1].name = "SerialPacketStreamer/Resync/Truncated";
+	faults[1].data.assign(packet.begin(), packet.begin() + packet.size() / 2);
+	faults[1].crcFailures = 1;
+
+	// Line noise. The first bytes are an impossible size so the streamer does not wait for the rest of a packet
+	faults[2].name = "SerialPacketStreamer/Resync/Garbage";
+	faults[2].data.resize(300);
+	std::mt19937 random(3);
+	for (size_t i = 0; i < faults[2].data.size(); ++i)
+		faults[2].data[i] = (BYTE)random();
+	faults[2].data[0] = 0xFF;
+	faults[2].data[1] = 0xFF;
+	faults[2].crcFailures = 0;
+
+	std::vector<BYTE> packetOut;
+	for (size_t i = 0; i < faults.size(); ++i)
+	{
+		std::vector<BYTE> data = faults[i].data;
+		data.insert(data.end(), packet.begin(), packet.end());
+
+		SerialPacketStreamer streamer;
+		uint64_t operations = 0;
+		uint64_t recovered = 0;
+		bool ran = runner.Run(faults[i].name, data.size(), [&](uint64_t iterations)
+		{
+			for (uint64_t iteration = 0; iteration < iterations; ++iteration)
+				recovered += StreamAfterFault(streamer, data, packet, packetOut);
+
+			operations += iterations;
+		});
+
+		if (!ran || operations == 0)
+			continue;
+
+		// Every fault must be detected once, skipped and counted, and the packet after it read intact
+		PacketStreamerStats stats;
+		streamer.GetStats(stats);
+		runner.AddCounter("bytes_skipped_per_op", (double)stats.bytesSkipped / operations);
+
+		if (recovered != operations || stats.packetsRead != operations || stats.resyncEvents != operations ||
+			stats.packetsRecovered != operations || stats.crcFailures != faults[i].crcFailures * operations ||
+			stats.bytesSkipped != faults[i].data.size() * operations)
+		{
+			fprintf(stderr, "%-48s failed to recover: %llu packets recovered of %llu, %llu resyncs, %llu recovered, %llu crc failures, "
+				"%llu bytes skipped\n", faults[i].name, (unsigned long long)recovered, (unsigned long long)operations,
+				(unsigned long long)stats.resyncEvents, (unsigned long long)stats.packetsRecovered,
+				(unsigned long long)stats.crcFailures, (unsigned long long)stats.bytesSkipped);
+		}
+	}
+}
+
+static void BenchmarkCrc(BenchmarkRunner &runner)
+{
+	std::vector<BYTE> packet = MakeRadiometricsV1Packet();
+	size_t dataSize = packet.size() - sizeof(uint16_t);
+
+	runner.Run("crc/CalculateCrc", dataSize, [&](uint64_t iterations)
+	{
+		for (uint64_t i = 0; i < iterations; ++i)
+			DoNotOptimize(crc::CalculateCrc(&packet[0], dataSize));
+	});
+}
+
+static void BenchmarkHeatshrink(BenchmarkRunner &runner)
+{
+	// Compressed packets carry everything after the message header
+	std::vector<BYTE> packet = MakeRadiometricsV1Packet();
+	std::vector<BYTE> content(packet.begin() + sizeof(MessageHeader), packet.end());
+	std::vector<BYTE> compressed = Compress(content);
+	std::vector<BYTE> expanded(std::max(compressed.size() * 2, content.size() + (1 << D3_HEATSHRINK_WINDOW)));
+
+	Heatshrink heatshrink(D3_HEATSHRINK_WINDOW, D3_HEATSHRINK_LOOKAHEAD);
+	uint32_t bytesOut = 0;
+	if (!heatshrink.Expand(&compressed[0], (uint32_t)compressed.size(), &expanded[0], (uint32_t)expanded.size(), &bytesOut) ||
+		bytesOut != content.size() || memcmp(&expanded[0], &content[0], content.size()) != 0)
+	{
+		fprintf(stderr, "Heatshrink/Expand: round trip failed, skipped\n");
+		return;
+	}
+
+	runner.Run("Heatshrink/Expand", content.size(), [&](uint64_t iterations)
+	{
+		for (uint64_t i = 0; i < iterations; ++i)
+		{
+			heatshrink.Expand(&compressed[0], (uint32_t)compressed.size(), &expanded[0], (uint32_t)expanded.size(), &bytesOut);
+			DoNotOptimize(bytesOut);
+		}
+	});
+}
+
+// Measured from the data interface to the spectrum callback, includes the hand over to the processing thread
+static void BenchmarkD3Spectrum(BenchmarkRunner &runner, const char *name, bool radiometricsV1, const std::vector<BYTE> &packet)
+{
+	BenchmarkDataInterface dataInterface;
+	D3DataProcessor processor(&dataInterface, radiometricsV1, std::make_shared<SerialPacketStreamer>());
+	std::vector<BYTE> data(packet);
+
+	std::atomic<uint64_t> spectra(0);
+	processor.AddComponent(D3DataProcessor::GammaComponentId, NULL, NULL, NULL, NULL, NULL, FinishedCallback, NULL, NULL, NULL);
+	processor.SetSpectrumEventCallback(D3DataProcessor::GammaComponentId, SpectrumEventCallback, &spectra);
+	processor.StartProcessing(D3DataProcessor::GammaComponentId);
+
+	// The first spectrum of an acquisition is dropped, the second confirms packets are getting through
+	dataInterface.Push(&data[0], data.size());
+	dataInterface.Push(&data[0], data.size());
+	int64_t giveUp = Time::GetTimeMs() + 1000;
+	while (spectra.load() == 0 && Time::GetTimeMs() < giveUp)
+		std::this_thread::yield();
+
+	if (spectra.load() == 0)
+	{
+		fprintf(stderr, "%s: no spectra processed, skipped\n", name);
+	}
+	else
+	{
+		runner.Run(name, data.size(), [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				uint64_t target = spectra.load() + 1;
+				dataInterface.Push(&data[0], data.size());
+				WaitForCount(spectra, target);
+			}
+		});
+	}
+
+	processor.StopProcessing(D3DataProcessor::GammaComponentId, true);
+}
+
+// Signalling costs on the data path, where the read thread signals for every report queued, and the time for a waiting
+// thread to wake. EventType is kmk::Event or the implementation it replaced
+template <typename EventType>
+static void BenchmarkEvent(BenchmarkRunner &runner, const std::string &prefix)
+{
+	{
+		EventType event;
+		event.Reset();
+		runner.Run((prefix + "/Signal/NoWaiter").c_str(), 0, [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				event.Signal();
+				event.Reset();
+			}
+		});
+
+		event.Signal();
+		runner.Run((prefix + "/Signal/AlreadySignalled").c_str(), 0, [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+				event.Signal();
+		});
+	}
+
+	// Round trip of two wakes: signal a waiting thread and wait for it to signal back
+	{
+		EventType ping;
+		EventType pong;
+		ping.Reset();
+		pong.Reset();
+		std::atomic<bool> keepRunning(true);
+
+		std::thread responder([&]()
+		{
+			while (true)
+			{
+				ping.Wait(INFINITE);
+				ping.Reset();
+				if (!keepRunning.load())
+					break;
+
+				pong.Signal();
+			}
+		});
+
+		runner.Run((prefix + "/WakeLatency").c_str(), 0, [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				ping.Signal();
+				pong.Wait(INFINITE);
+				pong.Reset();
+			}
+		});
+
+		keepRunning.store(false);
+		ping.Signal();
+		responder.join();
+	}
+
+	// A producer signalling for every item and a consumer that waits whenever it catches up, as the processing threads do
+	{
+		EventType event;
+		event.Reset();
+		std::atomic<uint64_t> produced(0);
+		std::atomic<uint64_t> consumed(0);
+		std::atomic<bool> keepRunning(true);
+
+		std::thread consumer([&]()
+		{
+			while (keepRunning.load())
+			{
+				event.Reset();
+				uint64_t available = produced.load(std::memory_order_acquire);
+				if (available == consumed.load(std::memory_order_relaxed))
+				{
+					event.Wait(100);
+					continue;
+				}
+
+				consumed.store(available, std::memory_order_release);
+			}
+		});
+
+		runner.Run((prefix + "/Throughput").c_str(), 0, [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations; ++i)
+			{
+				for (int item = 0; item < EVENT_ITEMS_PER_BATCH; ++item)
+				{
+					produced.fetch_add(1, std::memory_order_release);
+					event.Signal();
+				}
+
+				WaitForCount(consumed, produced.load());
+			}
+		});
+
+		keepRunning.store(false);
+		event.Signal();
+		consumer.join();
+	}
+}
+
+#ifndef _WINDOWS
+// Reports read from the devices, signalling once every report written has been read
+struct ReadCounter
+{
+	std::atomic<uint64_t> reportsRead;
+	std::atomic<uint64_t> reportsWritten;
+	Event allRead;
+};
+
+static void ReadReportCallback(void *pArg, unsigned char * /*pData*/, size_t dataLength)
+{
+	ReadCounter *pCounter = (ReadCounter*)pArg;
+	uint64_t reportsRead = pCounter->reportsRead.fetch_add(dataLength / REPORT_SIZE, std::memory_order_acq_rel) + dataLength / REPORT_SIZE;
+	if (reportsRead >= pCounter->reportsWritten.load(std::memory_order_acquire))
+		pCounter->allRead.Signal();
+}
+
+static double CpuTimeNs(const rusage &usage)
+{
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9 + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+}
+
+// Reading the devices through a read backend, REPORTS_PER_READ_OP reports written burst at a time to each device in
+// turn and waiting for them all to be read. The devices are FIFOs in packet mode (O_DIRECT) so each read returns a
+// single report, the same as the kromek driver nodes. Adds the system calls made reading, and the cpu time and context
+// switches of the whole process (including the writes) for each operation
+static void BenchmarkReadBackend(BenchmarkRunner &runner, const char *name, ReadBackend backend, int numDevices, int burst)
+{
+	if (!USBKromekDataInterface::SetReadBackend(backend))
+	{
+		fprintf(stderr, "%-48s not supported\n", name);
+		return;
+	}
+
+	char directory[] = "/tmp/kromek_benchmarkXXXXXX";
+	if (mkdtemp(directory) == NULL)
+		return;
+
+	ReadCounter counter;
+	counter.reportsRead = 0;
+	counter.reportsWritten = 0;
+
+	std::vector<std::string> paths;
+	std::vector<int> writeHandles;
+	std::vector<std::unique_ptr<USBKromekDataInterface> > interfaces;
+	bool ready = true;
+	for (int i = 0; i < numDevices && ready; ++i)
+	{
+		paths.push_back(std::string(directory) + "/device" + std::to_string(i));
+		if (mkfifo(paths.back().c_str(), 0600) != 0)
+		{
+			paths.pop_back();
+			ready = false;
+			break;
+		}
+
+		// Opened for reading too so the device never sees the writer go away. Room for a whole operation where allowed
+		int writeHandle = open(paths.back().c_str(), O_RDWR);
+		if (writeHandle < 0)
+		{
+			ready = false;
+			break;
+		}
+
+		writeHandles.push_back(writeHandle);
+		fcntl(writeHandle, F_SETPIPE_SZ, 1024 * 1024);
+		ready = fcntl(writeHandle, F_SETFL, O_DIRECT) == 0;
+
+		interfaces.push_back(std::unique_ptr<USBKromekDataInterface>(new USBKromekDataInterface(paths.back().c_str(), 0, 0, NULL, 0)));
+		interfaces.back()->SetDataReadyCallback(ReadReportCallback, &counter);
+		ready = ready && interfaces.back()->BeginReading();
+	}
+
+	unsigned char report[REPORT_SIZE] = { DATA_IN_REPORT };
+	uint64_t operations = 0;
+	rusage usageStart;
+	getrusage(RUSAGE_SELF, &usageStart);
+	uint64_t systemCallsStart = USBKromekDataInterface::GetReadSystemCalls();
+
+	bool ran = ready && runner.Run(name, REPORTS_PER_READ_OP * REPORT_SIZE, [&](uint64_t iterations)
+	{
+		for (uint64_t i = 0; i < iterations; ++i)
+		{
+			counter.allRead.Reset();
+			counter.reportsWritten.fetch_add(REPORTS_PER_READ_OP, std::memory_order_release);
+
+			for (int reportIndex = 0; reportIndex < REPORTS_PER_READ_OP; ++reportIndex)
+			{
+				if (write(writeHandles[(reportIndex / burst) % numDevices], report, REPORT_SIZE) != REPORT_SIZE)
+					counter.reportsWritten.fetch_sub(1, std::memory_order_release);
+			}
+
+			while (counter.reportsRead.load(std::memory_order_acquire) < counter.reportsWritten.load(std::memory_order_acquire))
+				counter.allRead.Wait(100);
+		}
+
+		operations += iterations;
+	});
+
+	if (ran && operations > 0)
+	{
+		rusage usageEnd;
+		getrusage(RUSAGE_SELF, &usageEnd);
+		uint64_t contextSwitches = (usageEnd.ru_nvcsw + usageEnd.ru_nivcsw) - (usageStart.ru_nvcsw + usageStart.ru_nivcsw);
+
+		runner.AddCounter("read_syscalls_per_op", (double)(USBKromekDataInterface::GetReadSystemCalls() - systemCallsStart) / operations);
+		runner.AddCounter("cpu_ns_per_op", (CpuTimeNs(usageEnd) - CpuTimeNs(usageStart)) / operations);
+		runner.AddCounter("context_switches_per_op", (double)contextSwitches / operations);
+	}
+	else if (!ready)
+	{
+		fprintf(stderr, "%-48s unable to create the devices\n", name);
+	}
+
+	for (size_t i = 0; i < interfaces.size(); ++i)
+		interfaces[i]->StopReading();
+
+	interfaces.clear();
+	for (size_t i = 0; i < writeHandles.size(); ++i)
+		close(writeHandles[i]);
+
+	for (size_t i = 0; i < paths.size(); ++i)
+		unlink(paths[i].c_str());
+
+	rmdir(directory);
+	USBKromekDataInterface::SetReadBackend(RB_EPOLL);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	BenchmarkRunner runner(argc, argv);
+
+	BenchmarkIntervalCountQueue(runner, "IntervalCountProcessor/QueueData/Aligned", REPORT_SIZE);
+	BenchmarkIntervalCountQueue(runner, "IntervalCountProcessor/QueueData/Chunk64", 64);
+	BenchmarkIntervalCountQueue(runner, "IntervalCountProcessor/QueueData/Chunk100", 100);
+	BenchmarkIntervalCountDecode(runner);
+	BenchmarkRollingQueue(runner);
+	BenchmarkPacketStreamers(runner);
+	BenchmarkPacketStreamerFaults(runner);
+	BenchmarkCrc(runner);
+	BenchmarkHeatshrink(runner);
+	BenchmarkD3Spectrum(runner, "D3DataProcessor/RadiometricsV1", true, MakeRadiometricsV1Packet());
+	BenchmarkD3Spectrum(runner, "D3DataProcessor/Spectrum16", false, MakeSpectrum16Packet());
+	BenchmarkEvent<Event>(runner, "Event");
+#ifndef _WINDOWS
+	BenchmarkEvent<CondVarEvent>(runner, "Event/CondVar");
+	BenchmarkReadBackend(runner, "ReadBackend/Epoll/4Devices", RB_EPOLL, 4, 1);
+	BenchmarkReadBackend(runner, "ReadBackend/IoUring/4Devices", RB_IO_URING, 4, 1);
+	BenchmarkReadBackend(runner, "ReadBackend/Epoll/4Devices/Burst8", RB_EPOLL, 4, 8);
+	BenchmarkReadBackend(runner, "ReadBackend/IoUring/4Devices/Burst8", RB_IO_URING, 4, 8);
+	BenchmarkReadBackend(runner, "ReadBackend/Epoll/16Devices", RB_EPOLL, 16, 1);
+	BenchmarkReadBackend(runner, "ReadBackend/IoUring/16Devices", RB_IO_URING, 16, 1);
+#endif
+
+	return runner.Finish("kromek_benchmark");
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "types.h"
+
+// Raw data captures of a device interface. A capture file is a CaptureFileHeader followed by a list of records, each a
+// CaptureRecordHeader and then dataSize bytes. All values are stored in host (little endian) byte order.
+
+#define CAPTURE_FILE_MAGIC "KCAP"
+#define CAPTURE_FILE_VERSION 2
+
+namespace kmk
+{
+
+enum CaptureRecordType
+{
+	CRT_DATA = 0,					// Bytes passed to the data ready callback
+	CRT_GET_CONFIGURATION = 1,		// Request passed to GetConfigurationSetting
+	CRT_SET_CONFIGURATION = 2,		// Data passed to SetConfigurationSetting
+	CRT_DROPPED = 3,				// CaptureDropInfo, records were lost here because the writer fell behind
+	CRT_CONFIGURATION_RESPONSE = 4	// Response to a CRT_GET_CONFIGURATION answered by the interface itself (version 2)
+};
+
+// Limits for capturing to file
+struct CaptureSettings
+{
+	size_t bufferSize;				// Bytes held in memory waiting to be written
+	uint64_t maxFileSize;			// Start a new file once this size is reached
+	unsigned int maxFiles;			// Delete the oldest file once there are more than this, 0 to keep them all
+	unsigned int flushInterval;		// Time (ms) between writes
+
+	CaptureSettings()
+		: bufferSize(4 * 1024 * 1024)
+		, maxFileSize(64 * 1024 * 1024)
+		, maxFiles(8)
+		, flushInterval(100)
+	{
+	}
+};
+
+#pragma pack(push, 1)
+
+struct CaptureFileHeader
+{
+	char magic[4];					// CAPTURE_FILE_MAGIC
+	uint16_t version;				// CAPTURE_FILE_VERSION
+	uint16_t headerSize;			// sizeof(CaptureFileHeader), records start at this offset
+	int vendorId;					// VID of the captured interface (D3S bluetooth ids do not fit in 16 bits)
+	int productId;					// PID of the captured interface
+	int64_t startTime;				// Time::GetSystemTime() when the capture started
+};
+
+struct CaptureRecordHeader
+{
+	int64_t timestamp;				// Ticks (100ns) since the start of the capture
+	uint8_t type;					// CaptureRecordType
+	uint32_t dataSize;				// Number of bytes following this header
+};
+
+struct CaptureDropInfo
+{
+	uint32_t records;				// Number of records lost
+	uint64_t bytes;					// Total data size of the lost records
+};
+
+#pragma pack(pop)
+
+}
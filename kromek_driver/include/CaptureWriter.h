@@ -0,0 +1,100 @@
+#pragma once
+
+#include "types.h"
+#include "CaptureFile.h"
+#include "Thread.h"
+#include "Event.h"
+#include "CriticalSection.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace kmk
+{
+
+struct CaptureStats
+{
+	uint64_t recordsWritten;
+	uint64_t bytesWritten;
+	uint64_t recordsDropped;
+	uint64_t bytesDropped;
+};
+
+// Writes capture files (see CaptureFile.h) from a separate thread. Records are copied into a lock free ring buffer by
+// Write, which never blocks, and the writer thread batches them out to disk. If the ring fills up records are dropped,
+// counted and a CRT_DROPPED record is written in their place.
+//
+// Write is intended for a single producer (the read thread). Other threads may also write records by passing
+// canWait = true, these briefly spin if the read thread is part way through a write
+class CaptureWriter
+{
+public:
+	CaptureWriter();
+	~CaptureWriter();
+
+	// Create the first file and start the writer thread. Returns false if already capturing or the file can not be created
+	bool Start(const char *pBasePath, VID vendorId, PID productId, const CaptureSettings &settings);
+
+	// Write everything still buffered and close the file
+	void Stop();
+
+	bool IsCapturing() const { return _enabled.load(std::memory_order_relaxed); }
+
+	// Add a record. Returns false if the record was dropped
+	bool Write(CaptureRecordType type, const BYTE *pData, size_t dataSize, bool canWait = false);
+
+	void GetStats(CaptureStats &statsOut);
+
+private:
+	std::atomic<bool> _enabled;
+	std::atomic_flag _producerFlag;
+
+	// Ring of serialised records (CaptureRecordHeader + data). Positions only increase, the ring index is pos & _ringMask
+	std::vector<BYTE> _ring;
+	size_t _ringMask;
+	std::atomic<uint64_t> _head;
+	std::atomic<uint64_t> _tail;
+
+	// Drops not yet marked by a CRT_DROPPED record
+	std::atomic<uint32_t> _pendingDroppedRecords;
+	std::atomic<uint64_t> _pendingDroppedBytes;
+
+	std::atomic<uint64_t> _recordsWritten;
+	std::atomic<uint64_t> _bytesWritten;
+	std::atomic<uint64_t> _recordsDropped;
+	std::atomic<uint64_t> _bytesDropped;
+
+	std::string _basePath;
+	CaptureSettings _settings;
+	CaptureFileHeader _header;
+	int64_t _startTime;
+
+	bool _started;
+
+	// Only used by the writer thread once started
+	int _fileHandle;
+	unsigned int _fileIndex;
+	uint64_t _fileSize;
+
+	kmk::Thread _writerThread;
+	kmk::Event _stopEvent;
+	kmk::CriticalSection _criticalSection;
+
+	std::string GetFileName(unsigned int index);
+	bool OpenFile();
+	void CloseFile();
+
+	void NoteDropped(size_t dataSize);
+	uint64_t PushRecord(uint64_t position, uint8_t type, int64_t timestamp, const void *pData, size_t dataSize);
+
+	// Copy into / out of the ring handling the wrap around
+	void CopyToRing(uint64_t position, const void *pData, size_t dataSize);
+	void CopyFromRing(uint64_t position, void *pDataOut, size_t dataSize);
+
+	// Write out all complete records in the ring, rotating files as needed. Returns false on a write error
+	bool Flush();
+
+	static int WriterThread(void *pArg);
+};
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.h"
+#include <map>
+#include <memory>
+#include <vector>
+#include "Lock.h"
+#include "Event.h"
+
+namespace kmk
+{
+
+// Configuration requests that have been sent to a device and are waiting for a response. Requests are keyed by component and
+// report id so several different requests can be in flight at once. Identical requests share the same response
+class ConfigurationQueryList
+{
+public:
+	typedef uint16_t Key;
+
+	static Key MakeKey(uint8_t componentId, uint8_t reportId) { return (Key)((componentId << 8) | reportId); }
+
+	// Register a request before it is sent. Returns false if the same request is already in flight and has no response yet,
+	// in which case it should not be sent again but the caller still waits for (and so releases) it as normal
+	bool Add(Key key);
+
+	// Store a response and wake any threads waiting for it. Returns false if nobody is waiting (probably timed out)
+	bool Complete(Key key, const BYTE *pData, size_t dataSize);
+
+	// Wait until the response arrives or the deadline (Time::GetTimeMs) passes then release the request. Returns true with the
+	// full response in dataOut if it arrived in time
+	bool Wait(Key key, int64_t deadlineMs, std::vector<BYTE> &dataOut);
+
+	// Release a request without waiting for it (e.g. it could not be sent)
+	void Remove(Key key);
+
+	// Return true if no requests are in flight
+	bool IsEmpty();
+
+private:
+	struct Query
+	{
+		int refCount;
+		bool complete;
+		std::vector<BYTE> data;
+		kmk::Event event;
+
+		Query()
+			: refCount(0)
+			, complete(false)
+			, event(false, false, L"")
+		{
+		}
+	};
+
+	typedef std::shared_ptr<Query> QueryPtr;
+	typedef std::map<Key, QueryPtr> QueryMap;
+
+	QueryMap _queries;
+	kmk::CriticalSection _criticalSection;
+
+	// Drop a reference to the query, removing it from the list once nobody is waiting on it
+	void Release(Key key, const QueryPtr &ptrQuery);
+};
+
+}
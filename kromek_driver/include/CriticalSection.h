@@ -7,6 +7,10 @@
 	#include <pthread.h>
 #endif
 
+#ifdef KMK_LOCK_PROFILING
+	#include "LockProfiler.h"
+#endif
+
 namespace kmk
 {
 
@@ -18,23 +22,39 @@ namespace kmk
 	class CriticalSection
 	{
 		friend class Lock;
+		friend class TryLock;
 
 	public:
 		
 		CriticalSection ();
+
+		// pName is a static string identifying the lock in the lock profiling statistics, see LockProfiler.h
+		explicit CriticalSection (const char *pName);
 		~CriticalSection ();
 
 	private:
 		
+		void Construct ();
 		void Enter ();
 		void Leave ();
 		bool TryEnter ();
+		void EnterUnprofiled ();
+		bool TryEnterUnprofiled ();
 
 #ifdef _WINDOWS
 		CRITICAL_SECTION m_cs;
 #else
 		pthread_mutex_t m_cs;		
 #endif
+
+#ifdef KMK_LOCK_PROFILING
+		// Only changed by the thread holding the lock. The hold time runs from the outermost Enter of a recursive lock
+		LockProfiler::Counters *m_pCounters;
+		int m_depth;
+		uint64_t m_holdStartNs;
+
+		void Acquired (bool contended, uint64_t waitTimeNs);
+#endif
 	};
 
 
@@ -4,12 +4,15 @@
 #include "IDevice.h"
 #include <vector>
 #include <map>
+#include <atomic>
 #include "Thread.h"
 #include "Lock.h"
 #include "Event.h"
 #include "RollingQueue.h"
 #include "D3Structs.h"
 #include "PacketStreamers.h"
+#include "ConfigurationQueryList.h"
+#include "Executor.h"
 
 
 namespace kmk
@@ -59,6 +62,9 @@ private:
 		CountEventCallbackFunc countEventCallback;
 		void *countEventCallbackArg;
 
+		SpectrumEventCallbackFunc spectrumEventCallback;
+		void *spectrumEventCallbackArg;
+
 		DoseEventCallbackFunc doseEventCallback;
 		void *doseEventCallbackArg;
 
@@ -79,6 +85,8 @@ private:
 			: pDevice(NULL)
 			, countEventCallback(NULL)
 			, countEventCallbackArg(NULL)
+			, spectrumEventCallback(NULL)
+			, spectrumEventCallbackArg(NULL)
 			, doseEventCallback(NULL)
 			, doseEventCallbackArg(NULL)
 			, finishedCallback(NULL)
@@ -97,6 +105,8 @@ private:
 			pDevice = NULL;
 			countEventCallback = NULL;
 			countEventCallbackArg = NULL;
+			spectrumEventCallback = NULL;
+			spectrumEventCallbackArg = NULL;
 			doseEventCallback = NULL;
 			doseEventCallbackArg = NULL;
 			finishedCallback = NULL;
@@ -128,18 +138,39 @@ private:
 		String message;
 	};
 
+	// Outcome of one pass of the processing loop
+	enum ProcessResult
+	{
+		PR_CONTINUE,	// Go straight round again
+		PR_WAIT,		// No report ready, wait for data or the returned wait time
+		PR_EXIT			// Processing has finished
+	};
+
 	// The data interface used for sending configuration requests
 	IDataInterface *_pDataInterface;
+	unsigned int _interfaceHash; // Identifies the interface in trace probes
 	IPacketStreamerPtr _ptrPacketBuffer;
 	ComponentDesc _gammaComponent;
 	ComponentDesc _neutronComponent;
 	ComponentDesc _doseComponent;
 	
-	// Thread status properties
+	// Thread status properties. Processing runs on its own thread, or as a strand on the shared executor when that is running
 	kmk::Thread _thread;
+	kmk::Strand _strand;
+	bool _onExecutor; // Where the current / last processing session runs
 	kmk::CriticalSection _criticalSection;
 	kmk::CriticalSection _eventSection;
 	kmk::Event _waitEvent;
+
+	// State of the processing loop kept between passes
+	std::vector<BYTE> _reportBuffer;
+	int64_t _lastQueryTime;
+	bool _newSession; // Compression settings still to be sent
+	bool _forcedStop; // Finished callbacks report a forced stop unless the loop finishes the queue
+
+	// Counts the times the thread has run out of data, signalling _idleEvent each time
+	std::atomic<uint64_t> _idleCount;
+	kmk::Event _idleEvent;
 	
 	ExecutionState _currentState;
 	RequestState _requiredState;
@@ -151,18 +182,10 @@ private:
 	int64_t _startAcquisitionTimestamp;
 	int64_t _accumilatedRealTimeMs;
 
-	// Variables used for querying a configuration variable. 
-	enum ConfigurationQueryState
-	{
-		CQS_IDLE,
-		CQS_WAITING,
-		CQS_SUCCESS,
-		CQS_ERROR
-	};
-
-	ConfigurationQueryState _configurationQueryState;
-	std::vector<BYTE> _configurationQueryResultData;
-	kmk::Event _configurationQueryEvent;
+	// Configuration requests waiting for a response. When only configuration queries are being served the processing
+	// thread is kept alive until _configurationSessionEndTime so a burst of queries does not restart it for each one
+	ConfigurationQueryList _configurationQueries;
+	int64_t _configurationSessionEndTime;
 
 	typedef std::vector<ErrorMessageDesc> ErrorList;
 	ErrorList _pendingErrors;
@@ -170,6 +193,12 @@ private:
 
 	int64_t _lastSpectrumRequestTime;
 	kmk::Event _spectrumQueryEvent;
+
+	// Time of the most recent read from the data interface
+	std::atomic<int64_t> _lastReceivedTime;
+
+	// Time of the latest read sampled for latency tracing, 0 once the next packet processed has taken it
+	std::atomic<int64_t> _sampledReceivedTime;
 	
 	enum SpectrumReportType
 	{
@@ -181,31 +210,92 @@ private:
 	SpectrumReportType _reportType;
 	bool _neutronIsGamma;
 
+	// Aligned copy of the spectrum in the latest packet (spectra are not aligned within the packed packets)
+	std::vector<uint16_t> _spectrumBuffer;
+
+	// Heatshrink compression requested from the device at the start of each acquisition
+	bool _compressionEnabled;
+	uint8_t _compressionWindowSize;
+	uint8_t _compressionLookAheadSize;
+
+	// Sizes the device has acknowledged, compressed packets are decoded with these until it acknowledges a new request
+	uint8_t _decodeWindowSize;
+	uint8_t _decodeLookAheadSize;
+
+	// Spectrum polling settings and the current interval (which only differs from the settings in adaptive mode)
+	SpectrumPollSettings _pollSettings;
+	uint32_t _pollIntervalMs;
+	uint32_t _quietSpectrumCount;
+	bool _alarmActive;
+
+	// Byte counts used to report the bandwidth saved by compression
+	uint64_t _compressedPackets;
+	uint64_t _wireBytes;
+	uint64_t _decodedBytes;
+
 	// Check the input buffer to see if a full report is ready to process. Return the data and remove it from the input buffer if its ready.
 	// Returns false if no report is ready
 	bool GetNextReport(std::vector<BYTE> &dataBufferOut, size_t &reportSizeOut);
 
-	// Processing thread routine
+	// Processing thread routine, and the same run in turns on the shared executor
     static int ProcessThreadProc(void *pArg);
+	static void ProcessStrandProc(void *pArg);
+
+	// One pass of the processing loop. waitTimeOut is set to the time to wait for data when PR_WAIT is returned
+	ProcessResult ProcessNext(uint32_t &waitTimeOut);
+
+	// Raise the finished callbacks once the processing loop has exited and go idle
+	void FinishProcessing();
+
+	// Wake the processing thread / strand, e.g. when data is received
+	void WakeProcessing();
+
+	// Wait for the processing thread (or strand) of the last session to finish
+	void WaitForProcessingThread();
 
 	// Callback routine called when data is received from the data interface
 	static void ReadDataCallbackProc(void *pArg, unsigned char *pData, size_t dataSize);
 
+	// Callback routine when the packet buffer is full and waiting for packets to be read
+	static void PacketsReadyCallbackProc(void *pArg);
+
 	// Callback routine when an error occurs on the data interface
 	static void DataInterfaceErrorCallbackProc(void *pArg, int errorCode, String message);
+	static void CollectMetricsProc(void *pArg, MetricsSnapshot &snapshotInOut);
 
 	// Process a single report
     void ProcessReport(BYTE *pData);
 
+	// Raise the count events for a gamma spectrum, either as a single spectrum event or one count event per channel. Returns
+	// the total counts in the spectrum
+	uint64_t RaiseSpectrumEvents(int64_t timestamp, const void *pSpectrum, int numChannels,
+		SpectrumEventCallbackFunc spectrumEventFunc, void *pSpectrumEventArg, CountEventCallbackFunc countEventFunc, void *pCountEventArg);
+
 	// Process a report containing the main spectrum data
 	void ProcessSpectrum16Report(D3Spectrum16ResponseHeader *pMessage);
 
 	// Process a report containing spectrum data for three detectors
 	void ProcessRadiometricsV1Report(D3RadiometricsV1ReponseHeader *pMessage);
 
+	// Update the adaptive poll interval given the counts and real time of the latest spectrum
+	void UpdatePollInterval(uint64_t counts, uint32_t realTimeMs);
+
+	// Return the number of ms to wait between spectrum requests
+	uint32_t GetPollInterval();
+
 	// Process the return data from a configuration request
 	void ProcessConfigurationReport(MessageHeader *pMessageHeader);
 
+	// Send a configuration request (unless the same request is already in flight) and register it as waiting for a response
+	bool SendConfigurationQuery(uint8_t componentId, uint16_t configurationIds, ConfigurationQueryList::Key &keyOut);
+
+	// Wait for the response to a request sent by SendConfigurationQuery and copy the data into the query
+	bool ReceiveConfigurationQuery(uint8_t componentId, ConfigurationQueryList::Key key, int64_t deadlineMs, ConfigurationQuery &query);
+
+	// Returns true (and requests the thread to finish) if the thread is only serving configuration queries, none are waiting
+	// and the configuration session has expired
+	bool CheckConfigurationSessionExpired();
+
 	// Execute the error callback routine. Do not call direct, Call Raise error instead
 	void ExecuteError(int errorCode, String message);
 
@@ -225,9 +315,10 @@ private:
 
 	bool StartProcessingThread();
 
-	bool Decompress(MessageHeader* pMessage, std::vector<BYTE> &dataOut);
+	bool Decompress(MessageHeader* pMessage, std::vector<BYTE> &dataOut, uint8_t windowSize, uint8_t lookAheadSize);
 
-	void EnableCompression(bool enabled);
+	// Send the current compression settings to the device
+	void SendCompressionRequest();
 
 public:
 
@@ -255,6 +346,9 @@ public:
 
 	// After a call to RemoveComponent the component device should never be accessed from within the data processor again (possibly deleted)
 	void RemoveComponent(uint8_t componentId, IDevice *pDevice);
+
+	// Raise the gamma spectrum once per packet rather than once per channel
+	void SetSpectrumEventCallback(uint8_t componentId, SpectrumEventCallbackFunc pSpectrumEventFunc, void *pSpectrumEventArg);
 	
 	float GetComponentProperty(uint8_t componentId, ComponentProperty prop);
 
@@ -273,9 +367,35 @@ public:
 	// Get a configuration setting. dataLength should be set as the size of the buffer in and will be set on return to the size of the data out
 	bool GetConfigurationData(uint8_t componentId, uint16_t configurationIds, BYTE *pDataOut, size_t &dataLength);
 
+	// Get several configuration settings in a single round trip
+	bool GetConfigurationDataBatch(uint8_t componentId, ConfigurationQuery *pQueries, size_t numQueries);
+
 	// Set a configuration setting. dataLength should be set to the length pDataIn
 	bool SetConfigurationData(uint8_t componentId, uint16_t configurationIds, BYTE *pDataIn, size_t dataLength);
 	void SendSpectrumRequest();
+
+	// Wait until the thread has processed all the data received and sent any spectrum request due by now
+	bool WaitForIdle(uint32_t timeoutMs);
+
+	bool SetExecutor(Executor &executor);
+
+	// Set the heatshrink compression used by the device. Window and lookahead sizes are in bits. If the processor is
+	// running the new settings are sent immediatly, otherwise they are sent when processing next starts. Packets are
+	// decoded with the previous sizes until the device acknowledges the request
+	bool SetCompression(bool enabled, uint8_t windowSize = D3CompressionRequest::HS_WINDOW_SIZE_DEFAULT, uint8_t lookAheadSize = D3CompressionRequest::HS_LOOKAHEAD_SIZE_DEFAULT);
+
+	// Return the current compression settings and the number of bytes received before and after decompression
+	void GetCompressionStatus(D3CompressionStatus &statusOut);
+
+	// Return the number of bytes skipped and packets recovered after corrupt data on the link
+	void GetPacketStreamerStats(PacketStreamerStats &statsOut);
+
+	// Set / get how often spectrum data is requested from the device
+	bool SetSpectrumPollSettings(const SpectrumPollSettings &settings);
+	SpectrumPollSettings GetSpectrumPollSettings();
+
+	// In adaptive mode an active alarm holds the poll interval at its minimum until the alarm is cleared
+	bool SetAlarmState(bool active);
 };
 
 }
@@ -235,6 +235,19 @@ struct D3CompressionRequest
 	uint16_t m_crc;
 };
 
+// Compression settings and byte counts for a device. This is not sent by the device, it is filled in by the
+// data processor when REPORT_ID_GET_COMPRESSION is requested
+struct D3CompressionStatus
+{
+	uint8_t m_enabled;
+	uint8_t m_windowSize;
+	uint8_t m_lookAheadSize;
+	uint8_t m_reserved;
+	uint64_t m_compressedPackets;	// Number of packets received with the compressed bit set
+	uint64_t m_wireBytes;			// Number of packet bytes received from the device
+	uint64_t m_decodedBytes;		// Number of packet bytes after decompression
+};
+
 #pragma pack (pop)
 
 }
\ No newline at end of file
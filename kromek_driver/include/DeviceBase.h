@@ -43,12 +43,20 @@ protected:
 	// Function raised when acquisition is stopped
 	void OnAcquisitionStopped();
 
+	// Query the serial and version numbers (whichever are not already cached, or both to refresh them) in a single batch.
+	// Both are stored in the device information cache once read
+	bool ReadDeviceInformation(bool refresh);
+
 private:
 
 	// Callback passed on from the data processor
 	CountEventDeviceCallbackFunc _countEventCallback;
 	void *_countEventCallbackArg;
 
+	// Callback passed on from the data processor for whole spectra
+	SpectrumEventDeviceCallbackFunc _spectrumEventCallback;
+	void *_spectrumEventCallbackArg;
+
 	// Callback passed on from the data processor
 	DoseEventDeviceCallbackFunc _doseEventCallback;
 	void *_doseEventCallbackArg;
@@ -64,6 +72,9 @@ private:
 	// Callback routine raised for every count received
 	static void CountEventCallbackProc(void *pThis, int64_t timestamp, int channel, uint32_t numCounts);
 
+	// Callback routine raised for every spectrum received
+	static void SpectrumEventCallbackProc(void *pThis, int64_t timestamp, const uint16_t *pCounts, int numChannels);
+
 	static void DoseEventCallbackProc(void * pArg, int64_t timestamp, float dose, float doseRate, float accumulatedDose);
 	
 	// Callback routine raised when acqusition completes
@@ -82,6 +93,9 @@ public:
 	virtual ~DeviceBase(void);
 	IDataInterface *GetInterface() {return _pInterface;}
 
+	// Return the data processor so processor specific settings can be changed (e.g. D3 spectrum polling)
+	IDataProcessor *GetDataProcessor() {return _pDataProcessor;}
+
 	virtual unsigned int GetHash() const;
 	
 	// Return the serial number associated with the device
@@ -89,12 +103,16 @@ public:
 
 	// Return the firmware version of the device
 	virtual unsigned short GetVersion();
+
+	virtual bool LoadCachedInformation();
+	virtual bool RefreshInformation();
 	
 	// Return a value from the interface
 	virtual String GetInterfaceProperty(const String& param);
 
 	// Set callbacks raised when certain events occur
 	void SetCountEventCallback(CountEventDeviceCallbackFunc func, void *pArg);
+	void SetSpectrumEventCallback(SpectrumEventDeviceCallbackFunc func, void *pArg);
 	void SetDoseEventCallback(DoseEventDeviceCallbackFunc func, void *pArg);
 	void SetFinishedAcquisitionCallback(FinishedAcquisitionCallbackFunc func, void *pArg);
 	void SetErrorCallback(DeviceErrorCallbackFunc func, void *pArg);
@@ -123,6 +141,12 @@ public:
 	virtual bool GetConfigurationSettingUInt16(ConfigurationID command, uint16_t &valOut);
 	virtual bool SetConfigurationData(ConfigurationID command, BYTE* buffer, int len);
 	virtual bool GetConfigurationData(ConfigurationID command, BYTE* buffer, int len);
+	virtual bool GetConfigurationDataBatch(ConfigurationQuery *pQueries, size_t numQueries);
+
+	virtual bool WaitForProcessing(uint32_t timeoutMs);
+	virtual bool SetExecutor(Executor &executor);
+	virtual bool SetSpectrumPollSettings(const SpectrumPollSettings &settings);
+	virtual bool SetAlarmState(bool active);
 };
 
 }
@@ -3,27 +3,66 @@
 #include "kromek.h"
 #include "IDataInterface.h"
 #include "Thread.h"
+#include <string>
 #include <vector>
-#include "Event.h"
+#include <unordered_set>
+
+struct udev;
+struct udev_device;
+struct udev_monitor;
 
 namespace kmk
 {
 
-typedef void (*DevicesChangedCallbackFunc)(void *pArg);
+// Raised for each supported device attached. The receiver takes ownership of the interface
+typedef void (*InterfaceAttachedCallbackFunc)(void *pArg, IDataInterface *pInterface);
+
+// Raised when the device of an interface (by hash) is removed
+typedef void (*InterfaceRemovedCallbackFunc)(void *pArg, unsigned int interfaceHash);
 
-// Object for enumerating devices on linux. Should raise the _deviceChangedCallbackFunc when a change is detected. 
-// The callback should then enumerate the supported devices by calling EnumerateDevices() for each device type
+// Object for enumerating devices on linux. Supported devices already attached are found with a single udev scan when
+// initialised, after that each device added or removed is reported from the udev event for it rather than by scanning
+// again. The device list lock is never needed while reading sysfs as interfaces are created before being passed on.
+// Devices bound to the kromek driver are read through its device nodes, those with a usb serial port (CDC-ACM) through the
+// tty
 class DeviceEnumerator
 {
 private:
-    DevicesChangedCallbackFunc _devicesChangedCallbackFunc;
-	void *_devicesChangedCallbackArg;
+    InterfaceAttachedCallbackFunc _interfaceAttachedCallbackFunc;
+    InterfaceRemovedCallbackFunc _interfaceRemovedCallbackFunc;
+	void *_callbackArg;
     kmk::Thread _deviceChangeMonitorThread;
-    kmk::Event _finishThreadEvent;
-    
-    void EnumerateUSBHIDDevices(const ValidDeviceIdentifier &deviceIdentifier, std::vector<IDataInterface*> &listOut);
-//	void EnumerateUSBSerialDevices(const ValidDeviceIdentifier &deviceIdentifier, std::vector<IDataInterface*> &listOut);
-    
+    int _shutdownFd; // eventfd written to stop the monitor thread
+
+    udev *_pUdev;
+    udev_monitor *_pMonitor;
+
+    // Supported devices by (vendor id << 16) | product id
+    std::unordered_set<uint32_t> _supportedDevices;
+
+    // Create an interface for a kromek device node or serial port if it is on a supported device, otherwise NULL
+    IDataInterface *CreateInterface(udev_device *pDevice);
+
+    // Report every supported device attached
+    void ScanDevices();
+
+    // Net change to a device node over a burst of udev events
+    struct PendingChange
+    {
+        std::string devicePath;
+        bool removed;           // Report a removal first, e.g. unplugged and plugged back in
+        udev_device *pAdded;    // Event of the last add if the device was attached at the end of the burst, else NULL
+    };
+    typedef std::vector<PendingChange> PendingChanges;
+
+    // Add the change made by a udev event to those waiting for the burst to end
+    void QueueDeviceEvent(udev_device *pDevice, PendingChanges &changes);
+
+    // Report the changes of a burst and release them
+    void ReportChanges(PendingChanges &changes);
+
+    void ReleaseUdev();
+
     // Thread func for monitoring device changes
     static int DeviceChangeMonitorThreadProc(void *pArg);
 
@@ -31,10 +70,11 @@ public:
     DeviceEnumerator();
 	~DeviceEnumerator();
 
-	bool Initialize(DevicesChangedCallbackFunc callbackFunc, void *pCallbackArg);
+	// Report the supported devices already attached then monitor for changes. Devices attached are reported on the
+	// calling thread before returning, later changes on the monitor thread
+	bool Initialize(const std::vector<ValidDeviceIdentifier> &supportedDevices, InterfaceAttachedCallbackFunc attachedFunc,
+		InterfaceRemovedCallbackFunc removedFunc, void *pCallbackArg);
 	void Shutdown();
-
-	void EnumerateDevices(const ValidDeviceIdentifier &deviceIdentifier, std::vector<IDataInterface*> &listOut);
 };
 
 }
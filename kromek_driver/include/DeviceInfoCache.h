@@ -0,0 +1,59 @@
+#pragma once
+
+#include "types.h"
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace kmk
+{
+
+// Serial and firmware version of each device seen before, kept in a flat file so they do not have to be read back from
+// the device (a configuration round trip) every time the driver starts. Devices are keyed by the hash of the device,
+// its ids and the serial of the usb device it is on, so a different device that later turns up at the same path is not
+// mistaken for it. Devices without a usb serial (e.g. simulated) are never cached.
+//
+// The values found are only a starting point, devices still read them again in the background and update the cache.
+class DeviceInfoCache
+{
+public:
+	struct DeviceInfo
+	{
+		String serial;
+		unsigned short version;
+	};
+
+	static DeviceInfoCache &GetInstance();
+
+	// Use the cache file at the path, loading the devices already in it. A file that does not exist yet is created
+	// once the first device is stored. Returns false if the file exists but can not be read
+	bool Open(const char *pFilePath);
+
+	// Stop using the file. Nothing is cached until opened again
+	void Close();
+
+	bool IsOpen();
+
+	bool Lookup(unsigned int deviceHash, VID vendorId, PID productId, const String &usbSerial, DeviceInfo &infoOut);
+
+	// Add or update a device, rewriting the file if anything changed
+	void Store(unsigned int deviceHash, VID vendorId, PID productId, const String &usbSerial, const DeviceInfo &info);
+
+private:
+	std::mutex _mutex;
+	std::string _filePath;
+	std::map<std::string, DeviceInfo> _devices;
+
+	DeviceInfoCache();
+	DeviceInfoCache(const DeviceInfoCache &);
+	DeviceInfoCache &operator=(const DeviceInfoCache &);
+
+	// Key of a device, empty if it can not be cached
+	static std::string MakeKey(unsigned int deviceHash, VID vendorId, PID productId, const String &usbSerial);
+
+	// Add or update a device and write every device to the file, merged with the devices other processes have written
+	// to it. Called with the mutex held
+	bool Save(const std::string &key, const DeviceInfo &info);
+};
+
+}
@@ -2,10 +2,12 @@
 
 #include "kromek.h"
 #include <map>
+#include <set>
 #include <vector>
 #include "IDataInterface.h"
 #include "IDevice.h"
 #include "CriticalSection.h"
+#include "PacketStreamers.h"
 
 #ifdef _WINDOWS
 #include "DeviceEnumeratorWindows.h"
@@ -15,28 +17,53 @@
 
 namespace kmk
 {
+class Executor;
+
 typedef void (*DeviceChangedCallbackFunc)(IDevice *pDevice, bool added, void *pArg);
 typedef std::vector<ValidDeviceIdentifier> ValidDeviceIdentifierVector;
 typedef std::map<unsigned int, IDevice*> DeviceMap;
+typedef std::map<unsigned int, IDataInterface*> DataInterfaceMap;
 
 // Manage all devices attached to the machine
 class DeviceMgr
 {
 private:
 	DeviceMap _deviceList;
+	DataInterfaceMap _registeredInterfaces;
 	ValidDeviceIdentifierVector _supportedDeviceList;
 	DeviceEnumerator _deviceEnumerator;
 	DeviceChangedCallbackFunc _deviceChangedCallbackFunc;
 	void *_deviceChangedCallbackArg;
 
+	// Usb serials / device paths of the enumerated devices to add, all are added if empty
+	std::set<String> _allowedDevices;
+
+	// Executor new devices process on, NULL for the shared one
+	Executor *_pExecutor;
+
+	// Packet pool of the framed packet streamers of new devices
+	PacketPoolSettings _packetPoolSettings;
+
 	CriticalSection _deviceListCS;
 
+#ifdef _WINDOWS
+	// Enumerate every supported device and add / remove devices to match
 	void UpdateAttachedDevices();
 	static void DevicesChangedCallbackFuncProc(void *pArg);
+#else
+	// Devices added and removed one at a time as the enumerator reports them
+	void AddEnumeratedInterface(IDataInterface *pInterface);
+	void RemoveEnumeratedInterface(unsigned int interfaceHash);
+	static void InterfaceAttachedCallbackProc(void *pArg, IDataInterface *pInterface);
+	static void InterfaceRemovedCallbackProc(void *pArg, unsigned int interfaceHash);
+#endif
 
 	std::vector<IDevice*> CreateDevices(IDataInterface *pInterface);
+	IPacketStreamerPtr CreateFramedPacketStreamer();
 	std::vector<IDevice*> AddInterface(IDataInterface *pDevice);
 	void RemoveDevice(IDevice *pDevice);
+	bool IsRegisteredInterface(IDataInterface *pInterface);
+	bool IsAllowed(IDataInterface *pInterface);
 
 public:
 	DeviceMgr(void);
@@ -44,9 +71,30 @@ public:
 	bool Initialize(ValidDeviceIdentifierVector &supportedDevices);
 	bool ShutDown();
 
+	// Stop adding and removing enumerated devices as they are attached and detached, waiting for a change in progress. The
+	// devices already added stay until ShutDown
+	void StopEnumerating();
+
+	// Add devices for an interface that is not found by enumeration (e.g. a ReplayDataInterface). The manager takes ownership
+	// of the interface and deletes it once unregistered. Returns false if the interface can not be initialised or no devices
+	// support it, in which case the caller keeps ownership
+	bool RegisterInterface(IDataInterface *pInterface);
+	void UnregisterInterface(IDataInterface *pInterface);
+
 	// Callbacks
 	void SetDeviceChangedCallback(DeviceChangedCallbackFunc func, void *pArg);
 
+	// Only add enumerated devices with one of these usb serials or device paths. Registered interfaces are always added.
+	// An enumerated device is only added by one manager in the process, the first to find it. Must be set before
+	// initializing
+	void SetAllowedDevices(const std::vector<String> &allowedDevices);
+
+	// Process the data of devices added from now on with an executor other than the shared one
+	void SetExecutor(Executor *pExecutor);
+
+	// Size, overflow policy and dropped callback of the packet pool of framed devices added from now on
+	void SetPacketPoolSettings(const PacketPoolSettings &settings);
+
 	IDevice *GetNextDevice(IDevice *pPrevious);
 	bool GetDetectorProperties(VID vendorID, PID productID, DetectorProperties &propsOut);
 };
@@ -4,6 +4,7 @@
 
 #ifndef _WINDOWS
     #include <pthread.h>
+    #include <atomic>
     #define INFINITE 0xFFFFFFFF
 #endif
 
@@ -35,10 +36,9 @@ namespace kmk
 #ifdef _WINDOWS
 		HANDLE m_event;
 #else
-        // Linux
-        bool m_signalled;
-        pthread_cond_t m_condition;
-        pthread_mutex_t m_mutex;
+        // Linux. A futex word holding one of the EVENT_ states. The event stays signalled until Reset whatever autoReset
+        // says, as it always has on Linux, and timed waits run on the monotonic clock
+        std::atomic<int> m_state;
 #endif
 	};
 
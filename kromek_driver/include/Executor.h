@@ -0,0 +1,136 @@
+#pragma once
+
+#include "types.h"
+#include "Thread.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace kmk
+{
+
+class Strand;
+
+// A fixed set of worker threads shared by the data processors, so a device waiting for data does not tie up a thread of
+// its own. Work is posted to strands, each of which only ever runs on one worker at a time.
+//
+// With work stealing each worker keeps its own queue. A strand that posts itself again (e.g. a busy processor) stays on
+// the worker that ran it, keeping the device on one core, and idle workers take work queued on busy ones
+class Executor
+{
+public:
+	// Shared by the default driver context. Other contexts each have an executor of their own
+	static Executor &GetInstance();
+
+	Executor();
+	~Executor();
+
+	// Start numWorkers worker threads. Returns false if already running or no thread could be started
+	bool Start(unsigned int numWorkers, bool workStealing);
+
+	// Refuse new strands, wait for the attached strands to detach then stop the workers
+	void Stop();
+
+	bool IsRunning();
+
+private:
+	friend class Strand;
+
+	typedef std::chrono::steady_clock Clock;
+	typedef std::multimap<Clock::time_point, Strand*> TimerMap;
+
+	struct Worker
+	{
+		Executor *pExecutor;
+		kmk::Thread thread;
+		std::deque<Strand*> queue; // Only used with work stealing
+	};
+
+	std::mutex _mutex;
+	std::condition_variable _workCondition; // Work queued, a timer set or stopping
+	std::condition_variable _strandCondition; // A strand finished a turn or detached
+
+	std::vector<Worker*> _workers;
+	bool _workStealing;
+	bool _running; // Accepting strands
+	bool _stopping; // Workers should exit
+	unsigned int _numAttached;
+
+	std::deque<Strand*> _queue;
+	TimerMap _timers;
+
+	// Called with _mutex held. pWorker is the worker queueing the strand, or NULL if not queued from a worker
+	void Enqueue(Strand *pStrand, Worker *pWorker);
+	Strand *TakeNext(Worker *pWorker);
+	void RemoveFromQueues(Strand *pStrand);
+	void CancelTimer(Strand *pStrand);
+	void QueueExpiredTimers();
+	void DetachStrand(Strand *pStrand);
+
+	static int WorkerThreadProc(void *pArg);
+
+	Executor(const Executor &);
+	Executor &operator=(const Executor &);
+};
+
+// Work run in turns on an executor. A turn is never run on two workers at once, so posting from any thread keeps the
+// work as serialised as it would be on a thread of its own
+class Strand
+{
+public:
+	typedef void (*StrandFunc)(void *pArg);
+
+	Strand(Executor &executor, StrandFunc func, void *pArg);
+	~Strand();
+
+	// Attach to the executor. Returns false if it is not running, nothing posted to a detached strand is run
+	bool Attach();
+
+	// Release the executor, dropping any turns posted. Waits for a running turn to return, unless called from that turn
+	// in which case the strand is released once it returns (or stays attached if Attach is called again first)
+	void Detach();
+
+	// Wait until the strand has been released, e.g. by its final turn. Returns at once if called from a turn
+	void WaitForDetach();
+
+	bool IsAttached() { return _attached.load(std::memory_order_acquire); }
+
+	// Move to another executor. Returns false while attached
+	bool SetExecutor(Executor &executor);
+
+	// Run a turn as soon as a worker is free. Posting while a turn is running runs another once it returns
+	void Post();
+
+	// Run a turn after delayMs, unless one is run before then
+	void PostAfter(uint32_t delayMs);
+
+private:
+	friend class Executor;
+
+	Executor *_pExecutor;
+	StrandFunc _func;
+	void *_pArg;
+
+	// Guarded by the executor's mutex. _attached is also read without it to make posting to a detached strand cheap
+	std::atomic<bool> _attached;
+	bool _queued;
+	bool _running;
+	bool _runAgain;
+	bool _detachOnReturn;
+	std::thread::id _runningThread;
+	bool _hasTimer;
+	Executor::TimerMap::iterator _timer;
+
+	// Called with the executor's mutex held
+	bool IsRunningOnThisThread() { return _running && _runningThread == std::this_thread::get_id(); }
+
+	Strand(const Strand &);
+	Strand &operator=(const Strand &);
+};
+
+}
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "types.h"
+#include "CaptureFile.h"
+#include "LatencyTrace.h"
+#include "Metrics.h"
 #include <map>
 
 namespace kmk
@@ -54,6 +57,21 @@ public:
 
 	// Get a value from a list of properties
 	virtual String GetInterfaceProperty(const String& name) = 0;
+
+	// Record everything passed to the data ready callback, along with configuration requests, into capture files named
+	// <pBasePath>_NNNN.kcap. Returns false if the interface does not support capturing
+	virtual bool StartCapture(const char * /*pBasePath*/, const CaptureSettings & /*settings*/) { return false; }
+	virtual void StopCapture() {}
+
+	// Latency statistics for the data read through this interface. Recorded by the data processor and detectors
+	LatencyTracer &GetLatencyTracer() { return _latencyTracer; }
+
+	// Counters for the data read through this interface. Updated by the data processor and detectors
+	Metrics &GetMetrics() { return _metrics; }
+
+private:
+	LatencyTracer _latencyTracer;
+	Metrics _metrics;
 };
 
 }
\ No newline at end of file
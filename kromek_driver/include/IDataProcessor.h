@@ -10,6 +10,10 @@ class IDevice;
 
 // Event raised when counts come in from a detector. An event should be raised for each channel that contains new counts
 typedef void (*CountEventCallbackFunc)(void *pArg, int64_t timestamp, int channel, uint32_t numCounts);
+
+// Event raised once per spectrum by processors that receive whole spectra. pCounts holds the counts added to every channel
+// since the previous spectrum
+typedef void (*SpectrumEventCallbackFunc)(void *pArg, int64_t timestamp, const uint16_t *pCounts, int numChannels);
 typedef void(*DoseEventCallbackFunc)(void *pArg, int64_t timestamp, float dose, float doseRate, float accumulatedDose);
 typedef void (*FinishedProcessingCallbackFunc)(void *pArg, bool wasForced);
 typedef void (*ErrorCallbackFunc)(void *pArg, int code, String message);
@@ -21,6 +25,41 @@ enum ComponentProperty
 	CP_LiveTime, // Reported live time from hardware rather than software calculated by driver
 };
 
+// A single request passed to GetConfigurationDataBatch
+struct ConfigurationQuery
+{
+	uint16_t configurationId;
+	BYTE *pDataOut;
+	size_t dataLength;	// Length of the pDataOut buffer in, length of the returned data out
+	bool success;
+};
+
+// Settings controlling how often spectrum data is requested from the device. In adaptive mode the interval moves
+// between minIntervalMs and maxIntervalMs depending on the count rate seen in each spectrum
+struct SpectrumPollSettings
+{
+	uint32_t intervalMs;		// Interval used when adaptive polling is disabled
+	bool adaptive;
+	uint32_t minIntervalMs;		// Fastest interval used in adaptive mode
+	uint32_t maxIntervalMs;		// Slowest interval used in adaptive mode
+	float fastCountRate;		// Count rate (cps) at or above which polling drops straight to minIntervalMs
+	float slowCountRate;		// Count rate (cps) below which polling backs off. Keep below fastCountRate to give hysteresis
+	uint32_t slowSpectrumCount;	// Number of consecutive quiet spectra before the interval is doubled
+
+	SpectrumPollSettings()
+		: intervalMs(100)
+		, adaptive(false)
+		, minIntervalMs(20)
+		, maxIntervalMs(1000)
+		, fastCountRate(1000.0f)
+		, slowCountRate(200.0f)
+		, slowSpectrumCount(10)
+	{
+	}
+};
+
+class Executor;
+
 class IDataProcessor
 {
 public:
@@ -51,6 +90,10 @@ public:
 	// After a call to RemoveComponent the component device should never be accessed from within the data processor again (possibly deleted)
 	virtual void RemoveComponent(uint8_t componentId, IDevice *pDevice) = 0;
 
+	// Set a callback raised once per spectrum instead of once per channel. Only used by processors that receive whole
+	// spectra, when set the count event callback is not raised for that spectrum
+	virtual void SetSpectrumEventCallback(uint8_t componentId, SpectrumEventCallbackFunc pSpectrumEventFunc, void *pSpectrumEventArg) = 0;
+
 	virtual float GetComponentProperty(uint8_t componentId, ComponentProperty prop) = 0;
 
 	virtual bool StartProcessing(uint8_t componentId) = 0;
@@ -75,8 +118,24 @@ public:
 	// dataLength should be passed in with the length of the pDataOut buffer
 	virtual bool GetConfigurationData(uint8_t componentId, uint16_t configurationId, BYTE *pDataOut, size_t &dataLength) = 0;
 
+	// Get several configuration settings at once. Every request is sent before waiting for the responses so the whole batch
+	// costs a single round trip. Returns true only if every query succeeded, check each query's success flag otherwise
+	virtual bool GetConfigurationDataBatch(uint8_t componentId, ConfigurationQuery *pQueries, size_t numQueries) = 0;
+
 	// Set a configuration setting. dataLength should be set to the length pDataIn
 	virtual bool SetConfigurationData(uint8_t componentId, uint16_t configurationId, BYTE *pDataIn, size_t dataLength) = 0;
+
+	// Wait until all the data received so far has been processed and any work due at the current time has been done.
+	// Used to keep processing in step with the virtual clock. timeoutMs is real time. Returns false on timeout
+	virtual bool WaitForIdle(uint32_t timeoutMs) = 0;
+
+	// Executor to process on when processing threads are shared. Only changed between acquisitions
+	virtual bool SetExecutor(Executor &executor) = 0;
+
+	// How often spectrum data is requested, and whether an alarm is active (holding adaptive polling at its fastest). Only
+	// used by processors that poll the device for spectra, others return false
+	virtual bool SetSpectrumPollSettings(const SpectrumPollSettings &settings) = 0;
+	virtual bool SetAlarmState(bool active) = 0;
 };
 
 }
@@ -30,6 +30,7 @@ namespace kmk
 	class IDevice;
 
 	typedef void (*CountEventDeviceCallbackFunc)(IDevice *pDevice, int64_t timestamp, int channel, uint32_t numCounts, void *pArg);
+	typedef void (*SpectrumEventDeviceCallbackFunc)(IDevice *pDevice, int64_t timestamp, const uint16_t *pCounts, int numChannels, void *pArg);
 	typedef void(*DoseEventDeviceCallbackFunc)(IDevice *pDevice, int64_t timestamp, float dose, float doseRate, float accumulatedDose, void *pArg);
 	typedef void (*FinishedAcquisitionCallbackFunc)(IDevice *pDevice, bool forced, void *pArg);
 	typedef void (*DeviceErrorCallbackFunc)(IDevice *pDevice, int errorCode, const String &message, void *pArg);
@@ -66,6 +67,7 @@ namespace kmk
 		CONFIGURATION_SETSWLLD_CHANNEL = 0x12,
 		CONFIGURATION_SETDFUMODE = 0x47,
 		CONFIGURATION_SETACTUALBIAS = 0x0B, // UNIBASE PMT/SiPM
+		CONFIGURATION_SETCOMPRESSION = 0x4F, // D3 family only. Data is enabled, window size, lookahead size
 
 		// USB HID in reports
 		CONFIGURATION_GETSETTINGS = 0x05, // K102 only
@@ -84,6 +86,7 @@ namespace kmk
 		CONFIGURATION_GETSTATUS = 0xc5,
 		CONFIGURATION_GETDEVICEINFO = 0xc8,
 		CONFIGURATION_GETACTUALBIAS = 0x8B,
+		CONFIGURATION_GETCOMPRESSION = 0xCF, // D3 family only. Returns a D3CompressionStatus
 
 		CONFIGURATION_GETVERSION = 0x8a, // Return firmware version
 
@@ -127,6 +130,7 @@ namespace kmk
 	const String IFPROP_LOCATION = L"LocationInformation";
 	const String IFPROP_CONNECTION = L"Connection";
 	const String IFPROP_DEVICEPATH = L"DevicePath";
+	const String IFPROP_SERIAL = L"SerialNumber";		// Serial of the usb device, not the one the device reports
 
 	class IDevice
 	{
@@ -146,6 +150,14 @@ namespace kmk
 		virtual String GetManufacturer() const = 0;
 		virtual String GetProductName() const = 0;
 		virtual unsigned short GetVersion() = 0;
+
+		// Take the serial and version from the device information cache if it has them, so they are not read from the
+		// device. Returns true if both were found
+		virtual bool LoadCachedInformation() = 0;
+
+		// Read the serial and version from the device even if they are cached, and update the cache. Returns false if
+		// the device did not answer
+		virtual bool RefreshInformation() = 0;
 		virtual String GetInterfaceProperty(const String& param) = 0;
 		
 		// Detector defaults / consts
@@ -161,6 +173,10 @@ namespace kmk
 		virtual float GetTemperature() const = 0;
 
 		virtual void SetCountEventCallback(CountEventDeviceCallbackFunc func, void *pArg) = 0;
+
+		// Devices that receive whole spectra (D3 family) raise this once per spectrum instead of raising the count event for
+		// every channel. Other devices always use the count event
+		virtual void SetSpectrumEventCallback(SpectrumEventDeviceCallbackFunc func, void *pArg) = 0;
 		virtual void SetDoseEventCallback(DoseEventDeviceCallbackFunc func, void *pArg) = 0;
 		virtual void SetFinishedAcquisitionCallback(FinishedAcquisitionCallbackFunc func, void *pArg) = 0;
 		virtual void SetErrorCallback(DeviceErrorCallbackFunc func, void *pArg) = 0;
@@ -175,5 +191,20 @@ namespace kmk
 		virtual bool GetConfigurationSettingUInt16(ConfigurationID command, uint16_t &valOut) = 0;
 		virtual bool SetConfigurationData(ConfigurationID command, BYTE* buffer, int len) = 0;
 		virtual bool GetConfigurationData(ConfigurationID command, BYTE* buffer, int len) = 0;
+
+		// Get several configuration settings in a single round trip to the device. configurationId in each query is a
+		// ConfigurationID. Returns true only if every query succeeded
+		virtual bool GetConfigurationDataBatch(ConfigurationQuery *pQueries, size_t numQueries) = 0;
+
+		// Wait (up to timeoutMs real time) until the data received so far has been processed. See VirtualClock.h
+		virtual bool WaitForProcessing(uint32_t timeoutMs) = 0;
+
+		// Executor the device's data is processed on when processing threads are shared. Only changed between acquisitions
+		virtual bool SetExecutor(Executor &executor) = 0;
+
+		// Spectrum polling of devices that are polled for spectra (D3 family), shared by every component of the device.
+		// Return false for other devices
+		virtual bool SetSpectrumPollSettings(const SpectrumPollSettings &settings) = 0;
+		virtual bool SetAlarmState(bool active) = 0;
 	};
 }
@@ -7,6 +7,9 @@
 #include "Event.h"
 #include "RollingQueue.h"
 #include "IDataInterface.h"
+#include "ConfigurationQueryList.h"
+#include "Executor.h"
+#include <atomic>
 
 namespace kmk
 {
@@ -38,6 +41,14 @@ private:
 		RS_STOP,
 	};
 
+	// Outcome of one pass of the processing loop
+	enum ProcessResult
+	{
+		PR_CONTINUE,	// Go straight round again
+		PR_WAIT,		// Queue is empty, wait for data or the returned wait time
+		PR_EXIT			// Processing has finished
+	};
+
 	struct ErrorMessageDesc
 	{
 		int errorCode;
@@ -46,6 +57,7 @@ private:
 
 	// Data interface to write to
 	IDataInterface *_pDataInterface;
+	unsigned int _interfaceHash; // Identifies the interface in trace probes
 
 	// Event callback raised for every count received
 	CountEventCallbackFunc _countEventCallback;
@@ -62,10 +74,17 @@ private:
 	ErrorList _pendingErrors;
 	kmk::CriticalSection _errorSection;
 
-	// Thread members
+	// Thread members. Processing runs on its own thread, or as a strand on the shared executor when that is running
 	kmk::Thread _thread;
+	kmk::Strand _strand;
+	bool _onExecutor; // Where the current / last processing session runs
 	kmk::CriticalSection _criticalSection;
 	kmk::Event _waitEvent;
+	std::vector<BYTE> _reportBuffer;
+
+	// Set while a report taken from the queue is being processed, signals _idleEvent once the queue is empty
+	std::atomic<bool> _processingReport;
+	kmk::Event _idleEvent;
 	
 	ThreadStatus _componentRunning;
 	ExecutionState _currentState;
@@ -81,23 +100,30 @@ private:
 	int64_t _startAcquisitionTime; // Time at which the current / last acquisition was started
 	int64_t _endAcquisitionTime; // Time at which acquisition was last stopped
  
-	// Variables used for querying a configuration variable. 
-	enum ConfigurationQueryState
-	{
-		CQS_IDLE,
-		CQS_WAITING,
-		CQS_SUCCESS,
-		CQS_ERROR
-	};
-	ConfigurationQueryState _configurationQueryState;
-	std::vector<BYTE> _configurationQueryResultData;
-	kmk::Event _configurationQueryEvent;
+	// Configuration requests waiting for a response. When only configuration queries are being served the processing
+	// thread is kept alive until _configurationSessionEndTime so a burst of queries does not restart it for each one
+	ConfigurationQueryList _configurationQueries;
+	int64_t _configurationSessionEndTime;
 
-	// Main processing thread routine
+	// Main processing thread routine, and the same run in turns on the shared executor
     static int ProcessThreadProc(void *pArg);
+	static void ProcessStrandProc(void *pArg);
+
+	// One pass of the processing loop. waitTimeOut is set to the time to wait for data when PR_WAIT is returned
+	ProcessResult ProcessNext(uint32_t &waitTimeOut);
+
+	// Raise the finished callback once the processing loop has exited and go idle
+	void FinishProcessing();
+
+	// Wake the processing thread / strand, e.g. when data is queued
+	void WakeProcessing();
+
+	// Wait for the processing thread (or strand) of the last session to finish
+	void WaitForProcessingThread();
 
 	static void ReadDataCallbackProc(void *pThis, unsigned char *pData, size_t dataSize);
 	static void DataInterfaceErrorCallbackProc(void *pArg, int errorCode, String message);
+	static void CollectMetricsProc(void *pArg, MetricsSnapshot &snapshotInOut);
 
 	// Return the size of a packet based on its report id as the size is not contained in the report
 	int DeterminePacketSize(BYTE reportId);
@@ -110,6 +136,13 @@ private:
 
 	// Process a reponse to a configuration request
 	void ProcessConfigurationReport(BYTE *pData, size_t dataSize);
+
+	// Send a configuration request (unless the same request is already in flight) and register it as waiting for a response
+	bool SendConfigurationQuery(uint16_t configurationIds, size_t dataLength, ConfigurationQueryList::Key &keyOut);
+
+	// Returns true (and requests the thread to finish) if the thread is only serving configuration queries, none are waiting
+	// and the configuration session has expired
+	bool CheckConfigurationSessionExpired();
 	
 	// Execute error callback on data processor thread. Do not call direct, call RaiseError
 	void ExecuteError(int errorCode, String message);
@@ -137,8 +170,8 @@ public:
 
     kmk::Endian::Order GetEndian() const { return kmk::Endian::BigEndian; }
 
-	// Queue data received from the data interface. 
-	void QueueData(int64_t timeStamp, BYTE *pData, size_t dataLength);
+	// Queue data received from the data interface. If traced is set the first report completed by the data is latency traced
+	void QueueData(int64_t timeStamp, BYTE *pData, size_t dataLength, bool traced = false);
 	
 	// Reset the data processor ready to start again
 	void Reset();
@@ -153,6 +186,9 @@ public:
 	// After a call to RemoveComponent the component device should never be accessed from within the data processor again (possibly deleted)
 	void RemoveComponent(uint8_t componentId, IDevice *pDevice);
 
+	// Interval count reports are made of individual counts so there are no whole spectra to pass on
+	void SetSpectrumEventCallback(uint8_t /*componentId*/, SpectrumEventCallbackFunc /*pSpectrumEventFunc*/, void * /*pSpectrumEventArg*/) {}
+
 	float GetComponentProperty(uint8_t componentId, ComponentProperty prop);
 
 	// Start the processing thread (if not already running) and acquire data for the given component until StopProcessing is called.
@@ -177,8 +213,20 @@ public:
 	// Get a configuration setting. dataLength should be set as the size of the buffer in and will be set on return to the size of the data out
 	bool GetConfigurationData(uint8_t componentId, uint16_t configurationIds, BYTE *pDataOut, size_t &dataLength);
 
+	// Get several configuration settings in a single round trip
+	bool GetConfigurationDataBatch(uint8_t componentId, ConfigurationQuery *pQueries, size_t numQueries);
+
 	// Set a configuration setting. dataLength should be set to the length pDataIn
 	bool SetConfigurationData(uint8_t componentId, uint16_t configurationIds, BYTE *pDataIn, size_t dataLength);
+
+	// Wait until every queued report has been processed
+	bool WaitForIdle(uint32_t timeoutMs);
+
+	bool SetExecutor(Executor &executor);
+
+	// Interval count devices send their counts unasked, there is nothing to poll
+	bool SetSpectrumPollSettings(const SpectrumPollSettings & /*settings*/) { return false; }
+	bool SetAlarmState(bool /*active*/) { return false; }
 };
 
 }
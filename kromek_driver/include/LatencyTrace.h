@@ -0,0 +1,129 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+
+namespace kmk
+{
+
+// Points along the data path that a traced report is timed at. Each is measured from when the read thread passed the data
+// to the data processor. Values match LatencyStageEnum in the spectrometer driver
+enum LatencyStage
+{
+	LS_ENQUEUED = 0,	// Added to the processing queue / packet streamer by the read thread
+	LS_DEQUEUED,		// Taken from the queue by the processing thread
+	LS_DECODED,			// Counts decoded from the report / spectrum packet
+	LS_ACCUMULATED,		// Added to the acquired data of a detector
+	LS_CALLBACK,		// Returned from the user data callback
+	LS_COUNT
+};
+
+// Summary of a latency histogram, all times are in microseconds
+struct LatencyStatistics
+{
+	uint64_t count;
+	double min;
+	double mean;
+	double p50;
+	double p90;
+	double p99;
+	double p999;
+	double max;
+};
+
+// Log linear histogram of latencies in the style of HdrHistogram. Values below 64 ticks are exact and above that each power
+// of 2 is split into 32 buckets, so any value is within ~3%. Recording is lock free and can be done from any thread
+class LatencyHistogram
+{
+public:
+	LatencyHistogram();
+
+	// Record a latency in kmk::Time ticks
+	void Record(int64_t ticks);
+
+	void Reset();
+	void GetStatistics(LatencyStatistics &statsOut) const;
+
+private:
+	static const int SUB_BUCKET_BITS = 6;
+	static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+	static const int SUB_BUCKET_HALF = SUB_BUCKET_COUNT / 2;
+
+	// Largest recordable value is 2^MAX_VALUE_BITS ticks (~2 hours), anything longer is counted as that
+	static const int MAX_VALUE_BITS = 36;
+	static const int NUM_BUCKETS = SUB_BUCKET_COUNT + (MAX_VALUE_BITS - SUB_BUCKET_BITS) * SUB_BUCKET_HALF;
+
+	std::atomic<uint64_t> _buckets[NUM_BUCKETS];
+	std::atomic<uint64_t> _count;
+	std::atomic<uint64_t> _sum;
+	std::atomic<uint64_t> _min;
+	std::atomic<uint64_t> _max;
+
+	static int BucketIndex(uint64_t value);
+
+	// Value representing everything in a bucket (the middle of its range)
+	static uint64_t BucketValue(int index);
+};
+
+// Collects latency histograms for the data read through one data interface. Only 1 in every sample interval reports is traced
+// so it is cheap enough to leave enabled, and when disabled the cost is a single relaxed load per report.
+//
+// The read and processing threads record the early stages directly. Later stages are reached through the device and detector
+// callbacks, so the processing thread makes a sampled report the current trace of the thread with a LatencyTraceScope and
+// callbacks mark their stage with LatencyTracer::Mark without needing to know which report or tracer is involved
+class LatencyTracer
+{
+public:
+	LatencyTracer();
+
+	// Trace 1 in sampleInterval reports, 0 to turn tracing off. Clears the statistics
+	void SetSampleInterval(uint32_t sampleInterval);
+	uint32_t GetSampleInterval() const { return _sampleInterval.load(std::memory_order_relaxed); }
+
+	// Returns true if the next report should be traced
+	bool ShouldSample()
+	{
+		uint32_t sampleInterval = _sampleInterval.load(std::memory_order_relaxed);
+		if (sampleInterval == 0)
+			return false;
+
+		return (_sampleCounter.fetch_add(1, std::memory_order_relaxed) % sampleInterval) == 0;
+	}
+
+	// Record the time taken from receipt of the data (kmk::Time::GetTime) to a stage
+	void Record(LatencyStage stage, int64_t receivedTime);
+
+	void GetStatistics(LatencyStage stage, LatencyStatistics &statsOut) const;
+	void Reset();
+
+	// Mark a stage of the current trace of the calling thread, if any
+	static void Mark(LatencyStage stage);
+
+private:
+	std::atomic<uint32_t> _sampleInterval;
+	std::atomic<uint32_t> _sampleCounter;
+	LatencyHistogram _histograms[LS_COUNT];
+};
+
+// Makes a traced report the current trace of the calling thread for the lifetime of the scope. Each stage is recorded once per
+// trace, the first time it is marked. Does nothing if pTracer is NULL, so it can be created for every report with the tracer
+// only passed for the sampled ones
+class LatencyTraceScope
+{
+public:
+	LatencyTraceScope(LatencyTracer *pTracer, int64_t receivedTime);
+	~LatencyTraceScope();
+
+	void Mark(LatencyStage stage);
+
+private:
+	LatencyTracer *_pTracer;
+	int64_t _receivedTime;
+	uint32_t _markedStages;
+	LatencyTraceScope *_pPreviousScope;
+
+	LatencyTraceScope(const LatencyTraceScope &);
+	LatencyTraceScope &operator=(const LatencyTraceScope &);
+};
+
+}
@@ -37,5 +37,26 @@ namespace kmk
 
 	};
 
+	/** @brief As Lock but never waits for the critical section. Check IsLocked before touching the protected data.
+	*/
+	class TryLock
+	{
+	public:
+
+		TryLock (CriticalSection &cs);
+		~TryLock ();
+
+		// Try again to enter if not already locked. Returns IsLocked()
+		bool Retry ();
+
+		bool IsLocked () const { return m_locked; }
+
+	private:
+
+		CriticalSection &m_cs;
+		bool m_locked;
+
+	};
+
 
 } // namespace kmk
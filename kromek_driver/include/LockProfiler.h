@@ -0,0 +1,73 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Lock contention profiling, compiled in with KMK_LOCK_PROFILING (cmake -DKROMEK_LOCK_PROFILING=ON). Each critical
+// section constructed with a name then records its acquisitions, how many of them had to wait, and histograms of the
+// time spent waiting for the lock and holding it. Critical sections sharing a name (e.g. one per detector) share their
+// statistics. Unnamed critical sections are never profiled.
+//
+// The setting changes the layout of CriticalSection so it must be the same for everything built against the driver.
+
+// Histogram bucket i holds times up to 256ns * 4^i, the last bucket holds everything longer
+#define LOCK_HISTOGRAM_BUCKETS 12
+
+namespace kmk
+{
+
+// Statistics of all the critical sections with a name
+struct LockStatistics
+{
+	std::string name;
+	uint64_t acquisitions;
+	uint64_t contended;			// Acquisitions that found the lock held by another thread
+	uint64_t waitTimeNs;
+	uint64_t holdTimeNs;
+	uint64_t waitHistogram[LOCK_HISTOGRAM_BUCKETS];
+	uint64_t holdHistogram[LOCK_HISTOGRAM_BUCKETS];
+};
+
+class LockProfiler
+{
+public:
+	// Shared by the critical sections with the same name. Updated with relaxed atomic adds
+	struct Counters
+	{
+		const char *pName;
+		std::atomic<uint64_t> acquisitions;
+		std::atomic<uint64_t> contended;
+		std::atomic<uint64_t> waitTimeNs;
+		std::atomic<uint64_t> holdTimeNs;
+		std::atomic<uint64_t> waitHistogram[LOCK_HISTOGRAM_BUCKETS];
+		std::atomic<uint64_t> holdHistogram[LOCK_HISTOGRAM_BUCKETS];
+	};
+
+	// True if the driver was built with KMK_LOCK_PROFILING
+	static bool IsEnabled();
+
+	// Counters for a name, created on first use and kept for the life of the process. pName must be a static string
+	static Counters *Register(const char *pName);
+
+	static void RecordAcquisition(Counters *pCounters, bool contended, uint64_t waitTimeNs);
+	static void RecordHold(Counters *pCounters, uint64_t holdTimeNs);
+
+	// Monotonic time (ns) used for the wait and hold times
+	static uint64_t GetTimeNs();
+
+	// Upper bound (ns) of a histogram bucket, 0 for the last (unbounded) bucket
+	static uint64_t GetBucketBound(int bucket);
+
+	// Statistics of every named lock, in the order they were first constructed
+	static void GetStatistics(std::vector<LockStatistics> &statisticsOut);
+
+	// Zero the statistics of every named lock
+	static void Reset();
+
+	// Write the statistics as OpenMetrics histograms labelled with the lock name. Writes nothing unless enabled
+	static void WriteOpenMetrics(std::string &textOut);
+};
+
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "types.h"
+#include "CriticalSection.h"
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace kmk
+{
+
+// Counters and gauges kept for each data interface. Values match the fields of SMetrics in the spectrometer driver.
+// Metrics of the same OpenMetrics family must be kept next to each other
+enum MetricId
+{
+	METRIC_BYTES_READ = 0,				// Bytes passed to the data processor by the read thread
+	METRIC_REPORTS_DECODED,				// Data reports / packets decoded by the processing thread
+	METRIC_EVENTS_COUNTED,				// Counts decoded from the data reports
+	METRIC_QUEUE_DEPTH,					// Reports / packets waiting to be processed (gauge)
+	METRIC_QUEUE_HIGH_WATER,			// Most reports / packets ever waiting to be processed (gauge)
+	METRIC_DROPPED_QUEUE,				// Reports / packets lost because the processing thread was not keeping up
+	METRIC_DROPPED_STREAM,				// Corrupt runs of data thrown away by the packet streamer
+	METRIC_CRC_FAILURES,				// Packets that failed their crc check
+	METRIC_DECOMPRESSION_FAILURES,		// Compressed packets that could not be decompressed
+	METRIC_CONFIG_QUERIES,				// Configuration queries completed or timed out
+	METRIC_CONFIG_QUERY_TIME,			// Total time spent waiting for configuration queries (us)
+	METRIC_CONFIG_QUERY_FAILURES,		// Configuration queries that failed or timed out
+	METRIC_ACQUISITIONS_STARTED,		// Acquisitions started on any detector of the device
+	METRIC_COUNT
+};
+
+enum MetricType
+{
+	MT_COUNTER,
+	MT_GAUGE,
+	MT_SUMMARY
+};
+
+// How a metric is written as OpenMetrics text
+struct MetricDescriptor
+{
+	const char *pFamily;	// Family name shared by metrics that only differ in their labels / suffix
+	MetricType type;
+	const char *pSuffix;	// Appended to the family name for the sample, e.g. _total
+	const char *pLabel;		// Extra label for the sample, or NULL
+	double scale;			// Multiplier applied when writing, converts units to the OpenMetrics base unit
+	const char *pHelp;
+};
+
+struct MetricsSnapshot
+{
+	uint64_t values[METRIC_COUNT];
+};
+
+// Snapshot of a device along with the labels identifying it, e.g. device="1",serial="ABC"
+struct LabelledMetricsSnapshot
+{
+	std::string labels;
+	MetricsSnapshot snapshot;
+};
+
+// Registry of the metrics for a data interface. Updates are a single relaxed atomic add so they can be made from the read
+// and processing threads without affecting them. Values the data processor already keeps (queue depths, packet streamer
+// counts) are not duplicated, instead the processor sets a collector that fills them in whenever a snapshot is taken
+class Metrics
+{
+public:
+	typedef void (*CollectorFunc)(void *pArg, MetricsSnapshot &snapshotInOut);
+
+	Metrics();
+
+	void Add(MetricId id, uint64_t value = 1) { _values[id].fetch_add(value, std::memory_order_relaxed); }
+
+	// Record the outcome of a configuration query sent at startTime (kmk::Time::GetTime)
+	void AddConfigurationQuery(int64_t startTime, bool success);
+
+	// Set the function called to fill in collected metrics when a snapshot is taken. NULL to remove it
+	void SetCollector(CollectorFunc func, void *pArg);
+
+	void GetSnapshot(MetricsSnapshot &snapshotOut);
+
+	static const MetricDescriptor &GetDescriptor(MetricId id);
+
+	// Write snapshots as OpenMetrics text, one sample per device for each metric
+	static void WriteOpenMetrics(const std::vector<LabelledMetricsSnapshot> &snapshots, std::string &textOut);
+
+private:
+	std::atomic<uint64_t> _values[METRIC_COUNT];
+
+	kmk::CriticalSection _collectorSection;
+	CollectorFunc _collector;
+	void *_collectorArg;
+
+	Metrics(const Metrics &);
+	Metrics &operator=(const Metrics &);
+};
+
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "types.h"
+#include "Thread.h"
+#include <atomic>
+#include <string>
+
+namespace kmk
+{
+
+// Serves OpenMetrics text on a Unix domain socket for local scraping (Linux only). Each connection gets a fresh copy of
+// the text and is then closed. Clients that send an HTTP request (e.g. curl --unix-socket) get an HTTP response, anything
+// else (e.g. socat) just gets the text
+class MetricsServer
+{
+public:
+	typedef void (*TextCallbackFunc)(void *pArg, std::string &textOut);
+
+	MetricsServer();
+	~MetricsServer();
+
+	// Create the socket, replacing any stale socket file at the path, and start serving. Returns false if already
+	// running or the socket can not be created
+	bool Start(const char *pSocketPath, TextCallbackFunc func, void *pArg);
+
+	// Stop serving and remove the socket file
+	void Stop();
+
+	bool IsRunning() const { return _keepRunning.load(std::memory_order_relaxed); }
+
+private:
+	kmk::Thread _thread;
+	std::atomic<bool> _keepRunning;
+	int _listenSocket;
+	std::string _socketPath;
+
+	TextCallbackFunc _textCallback;
+	void *_textCallbackArg;
+
+	void ServeClient(int clientSocket);
+
+	static int ServeThreadProc(void *pArg);
+
+	MetricsServer(const MetricsServer &);
+	MetricsServer &operator=(const MetricsServer &);
+};
+
+}
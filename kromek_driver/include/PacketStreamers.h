@@ -5,9 +5,44 @@
 #include <mutex>
 #include <memory>
 #include <list>
+#include <condition_variable>
 
 namespace kmk
 {
+	// Counters describing how a packet stream has coped with corrupt data
+	struct PacketStreamerStats
+	{
+		uint64_t packetsRead;
+		uint64_t bytesSkipped;		// Bytes thrown away while looking for the next valid packet
+		uint64_t resyncEvents;		// Number of times corrupt data was detected
+		uint64_t crcFailures;		// Packets whose crc did not match, each also causes a resync
+		uint64_t packetsRecovered;	// Number of times a valid packet was found again after corrupt data
+		uint64_t packetsDropped;	// Valid packets thrown away because the consumer was not keeping up
+		uint64_t bytesDropped;		// Bytes thrown away because the consumer was not keeping up
+		uint64_t packetsQueued;		// Complete packets waiting to be read (0 if packets are not queued)
+		uint64_t queueHighWater;	// Most complete packets ever waiting to be read
+
+		PacketStreamerStats()
+			: packetsRead(0)
+			, bytesSkipped(0)
+			, resyncEvents(0)
+			, crcFailures(0)
+			, packetsRecovered(0)
+			, packetsDropped(0)
+			, bytesDropped(0)
+			, packetsQueued(0)
+			, queueHighWater(0)
+		{
+		}
+	};
+
+	// Raised by a packet streamer when data has to be thrown away because the consumer is not keeping up
+	typedef void (*PacketsDroppedCallbackFunc)(void *pArg, size_t bytesDropped, uint64_t totalPacketsDropped);
+
+	// Raised by a packet streamer that is about to wait for the consumer to read packets, so a consumer that has not been
+	// told about them yet can be woken
+	typedef void (*PacketsReadyCallbackFunc)(void *pArg);
+
 	// Represents a buffer in which streamed raw data is added and packets can be read out of as chunks of bytes
 	class IPacketStreamer
 	{
@@ -19,6 +54,11 @@ namespace kmk
 		// Convert raw data to send over the comms
 		virtual void PrepareForSend(const std::vector<BYTE>& dataToSend, std::vector<BYTE>& preparedDataOut) = 0;
 
+		virtual void GetStats(PacketStreamerStats &statsOut) = 0;
+
+		// Set the callback raised (on the producer thread, with no locks held) before AddIncomingData waits for packets
+		// to be read
+		virtual void SetPacketsReadyCallback(PacketsReadyCallbackFunc func, void *pArg) = 0;
 	};
 
 	typedef std::shared_ptr<IPacketStreamer> IPacketStreamerPtr;
@@ -31,49 +71,106 @@ namespace kmk
 		size_t _writeIndex;
 		std::mutex _bufferMutex;
 
-		// Whether we are trying to recover from data corruption on the pipe
-		bool _enableDataRecovery;
-
-		// Time of the last packet that was received
-		std::chrono::steady_clock::time_point _lastDataTime;
-
-		// Returns true if the data should be accepted and false if it should be thrown away
-		bool UpdateDataRecoveryStatus(std::chrono::steady_clock::time_point tpNow);
+		// Set once corrupt data has been detected. While set the buffer is scanned a byte at a time for the next plausible
+		// header whose crc verifies
+		bool _resyncing;
+		PacketStreamerStats _stats;
 
 	public:
 		SerialPacketStreamer(size_t maxBufferSize = 204800);
 
 		virtual bool AddIncomingData(const BYTE* pData, size_t dataSize) override;
+
+		// Read the next packet. Throws std::runtime_error when corrupt data is first detected, the following calls then
+		// skip forward to the next valid packet so the caller can carry on reading
 		virtual bool ReadPacket(std::vector<BYTE> &dataOut) override;
 		virtual void Clear() override;
 
 		virtual void PrepareForSend(const std::vector<BYTE>& dataToSend, std::vector<BYTE>& preparedDataOut) override;
+
+		virtual void GetStats(PacketStreamerStats &statsOut) override;
+
+		// Packets are read straight out of the input buffer, the producer never waits for them
+		virtual void SetPacketsReadyCallback(PacketsReadyCallbackFunc /*func*/, void * /*pArg*/) override {}
 	};
 
 	// Stream of framed data that needs to be unescaped on receipt
 	class FramedPacketStreamer : public IPacketStreamer
 	{
-	private:
-		const size_t PacketPoolSize = 5;
+	public:
+		// What to do with a complete packet when every pool slot is waiting to be read
+		enum OverflowPolicy
+		{
+			OP_DROP,	// Drop the packet, count it and fail AddIncomingData
+			OP_BLOCK,	// Block the producer until a slot is read (up to the block timeout) then drop as above
+		};
+
+		// Enough packets for (approx) a seconds worth of spectra
+		static const size_t DEFAULT_POOL_SIZE = 20;
+		static const uint32_t DEFAULT_BLOCK_TIMEOUT = 500;
 
+	private:
 		std::vector<BYTE> _buffer;
 		size_t _writeIndex;
 		std::mutex _bufferMutex;
 		bool _firstByteEscaped;
 
+		// Set when a corrupt frame has been thrown away and cleared by the next valid frame
+		bool _recovering;
+		PacketStreamerStats _stats;
+
+		// Complete packets are held in a pool of non overlapping, cache line aligned slots
 		std::mutex _poolMutex;
+		std::condition_variable _slotFreedCondition;
 		std::vector<BYTE> _poolBuffer;
 		std::list<BYTE*> _packetsReady;
 		std::list<BYTE*> _packetPool;
 
+		OverflowPolicy _overflowPolicy;
+		uint32_t _blockTimeoutMs;
+		PacketsDroppedCallbackFunc _droppedCallback;
+		void *_droppedCallbackArg;
+		PacketsReadyCallbackFunc _readyCallback;
+		void *_readyCallbackArg;
+
+		// Move a complete packet from the input buffer into a pool slot. Returns false if it had to be dropped, with the total
+		// number of packets dropped in totalDroppedOut. bufferLock holds the buffer mutex, which is released while waiting
+		// for a slot under OP_BLOCK
+		bool QueuePacket(std::unique_lock<std::mutex> &bufferLock, size_t packetSize, uint64_t &totalDroppedOut);
+
 	public:
-		FramedPacketStreamer();
+		FramedPacketStreamer(size_t poolSize = DEFAULT_POOL_SIZE, OverflowPolicy overflowPolicy = OP_DROP, uint32_t blockTimeoutMs = DEFAULT_BLOCK_TIMEOUT);
 		virtual ~FramedPacketStreamer();
 
+		// Set a callback raised (on the producer thread, with no locks held) after AddIncomingData drops packets
+		void SetPacketsDroppedCallback(PacketsDroppedCallbackFunc func, void *pArg);
+
 		virtual bool AddIncomingData(const BYTE* pData, size_t dataSize) override;
 		virtual bool ReadPacket(std::vector<BYTE>& dataOut) override;
 		virtual void Clear() override;
 		virtual void PrepareForSend(const std::vector<BYTE>& dataToSend, std::vector<BYTE>& preparedDataOut) override;
+
+		virtual void GetStats(PacketStreamerStats &statsOut) override;
+		virtual void SetPacketsReadyCallback(PacketsReadyCallbackFunc func, void *pArg) override;
+	};
+
+	// How the framed packet streamers of new devices hold complete packets, see FramedPacketStreamer
+	struct PacketPoolSettings
+	{
+		size_t poolSize;
+		FramedPacketStreamer::OverflowPolicy overflowPolicy;
+		uint32_t blockTimeoutMs;
+		PacketsDroppedCallbackFunc droppedCallback;		// NULL for none
+		void *droppedCallbackArg;
+
+		PacketPoolSettings()
+			: poolSize(FramedPacketStreamer::DEFAULT_POOL_SIZE)
+			, overflowPolicy(FramedPacketStreamer::OP_DROP)
+			, blockTimeoutMs(FramedPacketStreamer::DEFAULT_BLOCK_TIMEOUT)
+			, droppedCallback(NULL)
+			, droppedCallbackArg(NULL)
+		{
+		}
 	};
 
 }
\ No newline at end of file
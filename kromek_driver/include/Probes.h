@@ -0,0 +1,41 @@
+#pragma once
+
+// USDT (user level statically defined tracing) probes for perf, bpftrace and SystemTap. A probe is a single nop until a
+// tracer attaches to it, so they are always compiled in when sys/sdt.h is available. Define KMK_NO_PROBES (cmake
+// -DKROMEK_ENABLE_PROBES=OFF) to leave them out. Arguments are evaluated even when nothing is attached so only pass
+// values that are already at hand.
+//
+// All probes belong to the kromek provider:
+//   read_complete(interfaceHash, bytesRead)                   Read thread has read data from the device
+//   report_enqueued(interfaceHash, reportSize, queueDepth)   Interval count report added to the processing queue
+//   report_begin(interfaceHash, receivedTime)               Processing thread starts on a report
+//   report_end(interfaceHash, numEvents)                    Processing thread has raised the events of a report
+//   count_event(deviceHash, channel, numCounts)             Detector has added counts to its acquired data. channel is -1
+//                                                           for a whole spectrum (D3 family), numCounts its total
+//   get_acquired_data_begin(deviceHash)
+//   get_acquired_data_end(deviceHash, totalCounts)
+//   device_changed(deviceHash, added, vendorId, productId)   Device attached to / removed from the driver. The ids are 0
+//                                                           when removed
+//
+// Times are kmk::Time ticks (100ns). See tools/bpftrace for example scripts.
+
+#if !defined(KMK_NO_PROBES) && defined(__linux__) && defined(__has_include)
+	#if __has_include(<sys/sdt.h>)
+		#define KMK_HAVE_PROBES
+	#endif
+#endif
+
+#ifdef KMK_HAVE_PROBES
+	#include <sys/sdt.h>
+
+	#define KMK_PROBE1(name, a1) DTRACE_PROBE1(kromek, name, a1)
+	#define KMK_PROBE2(name, a1, a2) DTRACE_PROBE2(kromek, name, a1, a2)
+	#define KMK_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(kromek, name, a1, a2, a3)
+	#define KMK_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(kromek, name, a1, a2, a3, a4)
+#else
+	// sizeof keeps the arguments "used" without evaluating them
+	#define KMK_PROBE1(name, a1) ((void)sizeof(a1))
+	#define KMK_PROBE2(name, a1, a2) ((void)sizeof(a1), (void)sizeof(a2))
+	#define KMK_PROBE3(name, a1, a2, a3) ((void)sizeof(a1), (void)sizeof(a2), (void)sizeof(a3))
+	#define KMK_PROBE4(name, a1, a2, a3, a4) ((void)sizeof(a1), (void)sizeof(a2), (void)sizeof(a3), (void)sizeof(a4))
+#endif
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "types.h"
+#include "Thread.h"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// The ring is built whenever the kernel headers have io_uring. Whether the running kernel supports it is only known at
+// run time, see ReadRing::IsAvailable. Define KMK_NO_IO_URING (cmake -DKROMEK_ENABLE_IO_URING=OFF) to leave it out
+#if !defined(KMK_NO_IO_URING) && defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define KMK_HAVE_IO_URING
+	#endif
+#endif
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace kmk
+{
+
+// Called on the ring thread with each read made from a file. bytesRead is negative (-errno), or 0 once the file has hung
+// up, when reading has failed, no more reads are made from the file after that. The data is in a buffer of the ring
+// that is only valid until the callback returns
+typedef void (*RingReadCallbackFunc)(void *pArg, unsigned char *pData, int bytesRead);
+
+// A single io_uring reading every file added to it on one thread, in place of a read thread for each device. Each file
+// has a poll linked to a run of reads into buffers registered with the ring, so one wake up reads everything the device
+// has buffered, and a single system call both resubmits the runs that have finished and waits for the next for every
+// file. The reads of a run are made one after the other, so data is passed on in the order it arrived.
+//
+// Files must be open non blocking. A run ends at the first read that returns less than the read length, i.e. nothing
+// left to read, which suits devices that return a whole report for each read such as the kromek driver nodes
+class ReadRing
+{
+public:
+	static ReadRing &GetInstance();
+
+	~ReadRing();
+
+	// Whether the kernel supports everything the ring needs. The ring is set up by the first call
+	bool IsAvailable();
+
+	// Start reading a file, readLength bytes at a time. Returns false if the ring is not available, the read length is
+	// too long or every buffer is in use, in which case the caller has to read the file itself
+	bool Add(int fileHandle, size_t readLength, RingReadCallbackFunc func, void *pArg);
+
+	// Stop reading a file. No callback is made for it once this returns and the file can be closed. When called from
+	// a callback the reads in flight are cancelled without waiting for them
+	void Remove(int fileHandle);
+
+	// io_uring_enter calls made by the ring thread
+	uint64_t GetSystemCalls();
+
+private:
+	// A file being read, only used by the ring thread once added
+	struct File
+	{
+		int fileHandle;
+		size_t readLength;
+		RingReadCallbackFunc func;
+		void *pArg;
+		int completionsDue;		// Completions still to come for the run in flight, 0 if none is
+		bool hungUp;			// Poll of the run in flight saw the file hang up
+		bool failed;			// Reported an error, no more runs are submitted
+		bool removing;
+	};
+
+	std::mutex _mutex;
+	std::condition_variable _removedCondition;
+
+	// File handle of each slot, -1 if free or REMOVING_SLOT until the reads in flight have finished. Changed under _mutex
+	std::vector<int> _slotFiles;
+
+	// Slots waiting for the ring thread to start / stop reading them. Changed under _mutex
+	std::vector<int> _pendingAdds;
+	std::vector<int> _pendingRemoves;
+
+	// Filled in by Add for a free slot, then only used by the ring thread
+	std::vector<File> _files;
+	// Slots stopped by the ring thread, released once their runs have finished. Ring thread only
+	std::vector<int> _removingSlots;
+
+	bool _setUp;
+	bool _available;
+	bool _stopping;
+	int _ringFd;
+	int _wakeFd;		// eventfd read through the ring, written to wake the thread for the pending changes
+	uint64_t _wakeValue;
+	kmk::Thread _thread;
+	std::thread::id _threadId;
+	std::atomic<uint64_t> _systemCalls;
+
+	// Mapped rings
+	void *_pSqRing;
+	size_t _sqRingSize;
+	void *_pCqRing;
+	size_t _cqRingSize;
+	io_uring_sqe *_pSqes;
+	size_t _sqesSize;
+	unsigned *_pSqHead;
+	unsigned *_pSqTail;
+	unsigned *_pSqArray;
+	unsigned _sqMask;
+	unsigned _sqEntries;
+	unsigned *_pCqHead;
+	unsigned *_pCqTail;
+	io_uring_cqe *_pCqes;
+	unsigned _cqMask;
+	unsigned _toSubmit;		// Queued since the last submit
+
+	// Registered buffers, RING_READS_PER_POLL for each slot
+	unsigned char *_pBuffers;
+
+	ReadRing();
+	ReadRing(const ReadRing &);
+	ReadRing &operator=(const ReadRing &);
+
+	// Set up the ring and start the thread, false if the kernel lacks anything needed. Called with _mutex held
+	bool SetUp();
+	void TearDown();
+
+	// Next free submission entry, submitting those queued if the ring is full
+	io_uring_sqe *GetSqe();
+
+	// Queue the poll and run of reads for a slot
+	void SubmitRun(int slot);
+
+	void QueueWakeRead();
+
+	// Mark a slot as being removed and cancel the run in flight for it. Ring thread only
+	void StopFile(int slot);
+	void ReleaseSlot(int slot);
+
+	// Start and stop the files waiting on the ring thread, then release the stopped slots with nothing in flight. Returns
+	// false when the thread should exit
+	bool ProcessPendingChanges();
+
+	void HandleCompletion(uint64_t userData, int result);
+
+	static int RingThreadProc(void *pArg);
+};
+
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "IDataInterface.h"
+#include "CaptureFile.h"
+#include "types.h"
+#include "Thread.h"
+#include "Event.h"
+#include "CriticalSection.h"
+#include "VirtualClock.h"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace kmk
+{
+
+// Data interface that plays back a capture file (see CaptureFile.h) instead of reading from hardware. Register it with
+// DeviceMgr::RegisterInterface and the usual devices and data processors are created for the recorded VID / PID.
+//
+// Playback behaves like a tape: BeginReading plays data records from where the last StopReading left off. Configuration
+// requests are answered with the response recorded for an identical request and those responses are not played again
+// as part of the data stream.
+//
+// If reading starts while the virtual clock is enabled (see VirtualClock.h) records are played as the clock is advanced
+// instead of from the read thread, and PM_AS_FAST_AS_POSSIBLE plays the whole capture in a single step.
+class ReplayDataInterface : public IDataInterface
+{
+public:
+
+	enum PlaybackMode
+	{
+		PM_ORIGINAL_TIMING,			// Records are delivered at the times they were captured
+		PM_SCALED_TIMING,			// Capture time is divided by the speed, i.e 2.0 plays at double speed
+		PM_AS_FAST_AS_POSSIBLE		// No waits between records
+	};
+
+	ReplayDataInterface(const char *pCaptureFilePath, PlaybackMode mode = PM_ORIGINAL_TIMING, double speed = 1.0, bool loop = false);
+	~ReplayDataInterface();
+
+	unsigned int GetHash();
+
+	// Load the capture file. Returns false if it can not be read or is not a capture file
+	bool Initialize();
+
+	VID GetVendorID();
+	PID GetProductID();
+
+	bool BeginReading();
+	bool StopReading();
+
+	// Configuration requests are answered from the capture. Settings are accepted and ignored
+	bool GetConfigurationSetting(unsigned char *pDataBuffer, size_t dataLength);
+	bool SetConfigurationSetting(unsigned char *pData, size_t dataLength);
+
+	void SetDataReadyCallback(DataReadyCallbackFunc pFunc, void *pArg);
+	void SetErrorCallback(ErrorCallbackFunc func, void *pArg);
+
+	String GetInterfaceProperty(const String& name);
+
+	// Returns true once every data record has been played (never when looping)
+	bool IsPlaybackComplete();
+
+private:
+
+	// A record held in _captureData
+	struct Record
+	{
+		int64_t timestamp;
+		size_t offset;
+		size_t size;
+	};
+
+	// Recorded responses to a request, handed out in order with the last one repeating
+	struct ResponseList
+	{
+		std::vector<Record> responses;
+		size_t next;
+
+		ResponseList() : next(0) {}
+	};
+
+	typedef std::map<std::vector<BYTE>, ResponseList> ResponseMap;
+
+	std::string _captureFilePath;
+	PlaybackMode _playbackMode;
+	double _speed;
+	bool _loop;
+
+	CaptureFileHeader _header;
+	std::vector<BYTE> _captureData;
+	std::vector<Record> _timeline;
+	ResponseMap _responses;
+
+	// Playback position and the time (ms) the record at _timelineOrigin is due
+	size_t _position;
+	int64_t _timelineOrigin;
+	int64_t _playbackStartTime;
+
+	kmk::Thread _readThread;
+	bool _reading;
+	kmk::Event _stopEvent;
+
+	// Clock playing the records in place of the read thread
+	VirtualClock *_pClock;
+
+	// Held while any data is passed to the data ready callback so responses are never delivered part way through a record
+	kmk::CriticalSection _callbackCriticalSection;
+	kmk::CriticalSection _readCriticalSection;
+
+	DataReadyCallbackFunc _dataReadyCallback;
+	void *_dataReadyCallbackArg;
+
+	ErrorCallbackFunc _errorCallback;
+	void *_errorCallbackArg;
+
+	InterfaceProperties _ifProperties;
+
+	bool LoadCaptureFile();
+
+	// Start timing playback from the current position
+	void RestartTimeline();
+
+	// Take the next record if it is due by nowMs, returning 0. Otherwise returns the time (ms) to wait before trying
+	// again. Called with _readCriticalSection held
+	int64_t TakeNextRecord(int64_t nowMs, Record &recordOut);
+
+	// Pass a record to the data ready callback
+	void Deliver(const Record &record);
+
+	static int ReadDataThread(void *pArg);
+	static void AdvanceProc(void *pArg, int64_t timeMs);
+};
+
+}
@@ -13,11 +13,14 @@ class RollingQueue
 private:
 	std::vector<unsigned char> _data;
 	std::vector<int64_t> _timestamps;
+	std::vector<unsigned char> _traced;
 	int _bufferSize;
 	int _totalBuffers;
 	int _readIndex;
 	int _writeIndex;
 	int _numEntries; 
+	int _highWater;
+	uint64_t _numOverwritten;
 	kmk::CriticalSection _criticalSection;
 
 	// Increment the value and rollover to the start if necessary
@@ -27,11 +30,16 @@ public:
 	RollingQueue(int bufferSize, int numBuffers);
 	~RollingQueue();
 
-	bool Enqueue(int64_t timeStamp, unsigned char *pData, size_t dataSize);
-	bool Dequeue(unsigned char *pDataOut, size_t dataSize, int64_t &timestampOut);
+	// pNumEntriesOut (optional) receives the number of entries queued once the data has been added. traced marks an entry
+	// chosen for latency tracing, returned through pTracedOut (optional) when it is dequeued
+	bool Enqueue(int64_t timeStamp, unsigned char *pData, size_t dataSize, int *pNumEntriesOut = NULL, bool traced = false);
+	bool Dequeue(unsigned char *pDataOut, size_t dataSize, int64_t &timestampOut, bool *pTracedOut = NULL);
 
 	void Clear();
 	bool IsEmpty();
+
+	// Entries currently queued, the most ever queued and the number of unread entries replaced because the queue was full
+	void GetStats(int &numEntriesOut, int &highWaterOut, uint64_t &numOverwrittenOut);
 };
 
 }
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "IDataInterface.h"
+#include "PacketStreamers.h"
+#include "D3Structs.h"
+#include "types.h"
+#include "CriticalSection.h"
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace kmk
+{
+
+// A gaussian photopeak in a simulated spectrum
+struct SimulationPeak
+{
+	double channel;					// Centre of the peak
+	double sigma;					// Width (channels)
+	double weight;					// Fraction of all gamma counts that fall in this peak
+
+	SimulationPeak(double c = 0, double s = 1, double w = 0) : channel(c), sigma(s), weight(w) {}
+};
+
+// What a simulated detector measures. Counts follow a poisson distribution about the given rates and gamma events are
+// spread over an exponentially falling background continuum plus any photopeaks
+struct SimulationSettings
+{
+	double countRate;				// Mean gamma (or neutron only detector) count rate, counts per second
+	double neutronRate;				// Mean neutron count rate of D3 family devices, counts per second
+	double doseRate;				// Dose rate reported by D3 family devices, uSv/h
+	double continuumScale;			// Continuum falls off as exp(-channel / continuumScale)
+	std::vector<SimulationPeak> peaks;
+	unsigned int seed;				// Random seed, 0 to seed each device differently
+	bool radiometricsV1;			// D3 family devices answer radiometrics spectrum requests, otherwise only 16 bit spectra
+
+	SimulationSettings()
+		: countRate(100)
+		, neutronRate(1)
+		, doseRate(0.1)
+		, continuumScale(400)
+		, seed(0)
+		, radiometricsV1(true)
+	{
+	}
+};
+
+// Base for data interfaces that generate protocol correct data for a VID / PID instead of reading from hardware. Register
+// one with DeviceMgr::RegisterInterface and the usual devices and data processors are created for it.
+//
+// Simulated interfaces do not have their own threads. Every reading simulated interface in the process is driven by one
+// shared thread that ticks them in turn, so hundreds of them can be run at once. Data and configuration responses are passed to
+// the data ready callback from that thread, the same as a read thread would for real hardware. Under the virtual clock (see
+// VirtualClock.h) they are ticked by whichever thread advances the clock instead
+class SimulatedDataInterface : public IDataInterface
+{
+public:
+
+	static const int NUM_CHANNELS = 4096;
+
+	SimulatedDataInterface(VID vendorId, PID productId, const SimulationSettings &settings);
+	virtual ~SimulatedDataInterface();
+
+	// Create the simulated interface that matches the protocol used by a VID / PID. Returns NULL if not supported
+	static SimulatedDataInterface *Create(VID vendorId, PID productId, const SimulationSettings &settings);
+
+	unsigned int GetHash();
+	bool Initialize();
+
+	VID GetVendorID();
+	PID GetProductID();
+
+	bool BeginReading();
+	bool StopReading();
+
+	void SetDataReadyCallback(DataReadyCallbackFunc pFunc, void *pArg);
+	void SetErrorCallback(ErrorCallbackFunc func, void *pArg);
+
+	String GetInterfaceProperty(const String& name);
+
+	// Called by the simulation thread or virtual clock. Generate data for the time since the last tick and deliver anything queued
+	void Tick(int64_t timeMs);
+
+protected:
+
+	typedef std::map<uint16_t, std::vector<BYTE> > ConfigurationMap;
+
+	SimulationSettings _settings;
+	std::mt19937 _random;
+	std::string _serialNumber;
+
+	// Last value set for each configuration report, keyed by component id and get report id
+	ConfigurationMap _configuration;
+
+	// Held while generating data or changing settings
+	kmk::CriticalSection _criticalSection;
+
+	// Queue a packet for delivery on the next tick
+	void QueueOutput(const BYTE *pData, size_t dataSize);
+
+	// Number of gamma / neutron events expected over a period
+	unsigned int SampleCounts(double rate, int64_t periodMs);
+
+	// Pick a channel from the spectral shape
+	unsigned int SampleChannel();
+
+	// Generate data for the time elapsed since the last tick. Called with _criticalSection held, only while reading
+	virtual void Generate(int64_t periodMs) = 0;
+
+private:
+
+	std::string _name;
+	VID _vendorId;
+	PID _productId;
+	bool _reading;
+	int64_t _lastTickTime;
+
+	// Cumulative distribution of the spectral shape over the channels
+	std::vector<double> _channelDistribution;
+
+	std::vector<BYTE> _pendingOutput;
+	std::vector<BYTE> _deliveryBuffer;
+
+	kmk::CriticalSection _callbackCriticalSection;
+	DataReadyCallbackFunc _dataReadyCallback;
+	void *_dataReadyCallbackArg;
+
+	ErrorCallbackFunc _errorCallback;
+	void *_errorCallbackArg;
+
+	InterfaceProperties _ifProperties;
+
+	void BuildChannelDistribution();
+};
+
+// Simulates the 63 byte interval count reports of the single detector devices (GR1, SIGMA, TN15 etc)
+class IntervalCountSimulator : public SimulatedDataInterface
+{
+public:
+	IntervalCountSimulator(VID vendorId, PID productId, const SimulationSettings &settings);
+	~IntervalCountSimulator();
+
+	bool GetConfigurationSetting(unsigned char *pReportdata, size_t dataLength);
+	bool SetConfigurationSetting(unsigned char *pData, size_t dataLength);
+
+protected:
+	void Generate(int64_t periodMs);
+};
+
+// Simulates the D3 family packet protocol. Spectra are generated on request from the counts accumulated since the last
+// request. Packets are framed for devices that use the framed protocol
+class D3Simulator : public SimulatedDataInterface
+{
+public:
+	D3Simulator(VID vendorId, PID productId, bool framed, const SimulationSettings &settings);
+	~D3Simulator();
+
+	bool GetConfigurationSetting(unsigned char *pReportdata, size_t dataLength);
+	bool SetConfigurationSetting(unsigned char *pData, size_t dataLength);
+
+protected:
+	void Generate(int64_t periodMs);
+
+private:
+	bool _framed;
+	IPacketStreamerPtr _packetStreamer;
+
+	// Counts accumulated since the last spectrum request
+	std::vector<uint16_t> _gammaSpectrum;
+	uint32_t _gammaCounts;
+	uint32_t _neutronCounts;
+	uint32_t _spectrumTimeMs;
+	double _dose;
+
+	// Remove the framing from a request
+	bool DecodeRequest(const BYTE *pData, size_t dataLength, std::vector<BYTE> &requestOut);
+
+	// Fill in the size and crc and queue a response
+	void QueueResponse(std::vector<BYTE> &response);
+
+	void SendSpectrum(const MessageHeader &request);
+	void SendConfiguration(const MessageHeader &request);
+	void SendError(const MessageHeader &request, uint8_t errorId);
+};
+
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "types.h"
+
+namespace kmk
+{
+
+// Add a spectrum of 16 bit counts into a 32 bit histogram (pHistogram[i] += pCounts[i]). Uses AVX2 / SSE2 / NEON where
+// available with a scalar fallback. Neither pointer needs to be aligned. Returns the total number of counts added
+uint64_t AccumulateSpectrum(uint32_t *pHistogram, const uint16_t *pCounts, size_t numChannels);
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "CriticalSection.h"
+#include "types.h"
 
 #ifndef _WINDOWS
     #include <pthread.h>
@@ -11,6 +12,52 @@ namespace kmk
 
 	typedef int (*ThreadProcFunc)(void *);
 
+	// What a thread is used for. Each role has its own placement policy, matching ThreadRoleEnum of the spectrometer driver
+	enum ThreadRole
+	{
+		TR_READER = 0,		// Reads from a device
+		TR_PROCESSOR,		// Processes the data read, including the executor workers
+		TR_UPDATER,			// Updates the detectors
+		TR_ENUMERATOR,		// Watches for devices being attached and removed
+		TR_OTHER,			// Helpers off the data path, e.g. capture writer and metrics server
+		TR_COUNT
+	};
+
+	enum SchedulingPolicy
+	{
+		SP_DEFAULT = 0,		// Inherit from the creating thread
+		SP_FIFO,			// Real time, runs until it blocks or something of higher priority is ready
+		SP_RR				// Real time, time sliced between threads of the same priority
+	};
+
+	// Settings of a policy that could not be applied to a thread
+	#define TPF_AFFINITY		0x01
+	#define TPF_SCHEDULING		0x02
+	#define TPF_STACK_SIZE		0x04
+	#define TPF_NAME			0x08
+
+	// Where and how threads of a role run. The defaults start a thread as the system would
+	struct ThreadPolicy
+	{
+		unsigned long long cpuMask;	// Bit n set to allow cpu n, 0 for any cpu
+		SchedulingPolicy scheduling;
+		int priority;				// Real time priority for SP_FIFO / SP_RR
+		size_t stackSize;			// Bytes, 0 for the default
+
+		ThreadPolicy() : cpuMask(0), scheduling(SP_DEFAULT), priority(0), stackSize(0) {}
+	};
+
+	// How well the policy of a role has been applied to the threads started since it was set
+	struct ThreadPolicyStatus
+	{
+		unsigned int threadsStarted;	// Counted once the thread is running and has been placed
+		unsigned int threadsFailed;		// Threads that did not get the whole policy
+		unsigned int failedSettings;	// TPF_ flags of every setting that could not be applied
+		int lastError;					// errno (GetLastError on Windows) of the last failure
+
+		ThreadPolicyStatus() : threadsStarted(0), threadsFailed(0), failedSettings(0), lastError(0) {}
+	};
+
 	/** @brief A wrapper around the windows thread API.
 	*/
 	class Thread
@@ -20,7 +67,9 @@ namespace kmk
 		Thread();
 		~Thread ();
 
-        bool Start (ThreadProcFunc func, void *pArg);
+        // Start a thread placed by the policy of its role. The name (max 15 chars on Linux) defaults to one for the role.
+        // The thread is started even if the policy can not be fully applied, see GetPolicyStatus
+        bool Start (ThreadProcFunc func, void *pArg, ThreadRole role = TR_OTHER, const char *pName = NULL);
 
         int WaitForTermination();
 
@@ -30,6 +79,12 @@ namespace kmk
 
 		bool IsRunning();
 
+		// Set the policy of threads of a role started from now on, and reset its status. Returns false if the policy can
+		// never be applied, e.g. a priority out of range for the scheduling policy
+		static bool SetPolicy(ThreadRole role, const ThreadPolicy &policy);
+		static ThreadPolicy GetPolicy(ThreadRole role);
+		static ThreadPolicyStatus GetPolicyStatus(ThreadRole role);
+
 	private:
 
 		struct CallbackArgs
@@ -37,6 +92,13 @@ namespace kmk
 			Thread *pThread;
 			ThreadProcFunc callbackProc;
 			void *pArg;
+
+			// Placement the new thread applies to itself before calling callbackProc
+			ThreadRole role;
+			ThreadPolicy policy;
+			char name[16];
+			unsigned int failedSettings;	// Settings that already failed when the thread was created
+			int error;
 		};
 
 		CallbackArgs _callbackArgs;
@@ -52,6 +114,12 @@ namespace kmk
 #endif
 		
 
+		// Apply the parts of the policy set once the thread exists to the calling thread, so it is placed before its
+		// function runs. Records the result for the role
+		static void ApplyPolicy(CallbackArgs &args);
+
+		static void RecordPolicyResult(ThreadRole role, unsigned int failedSettings, int error);
+
 #ifdef _WINDOWS
 		static DWORD WINAPI CallbackProc(void *pArg);
 #else
@@ -4,18 +4,28 @@
 #include "types.h"
 #include "Thread.h"
 #include "CriticalSection.h"
+#include "CaptureWriter.h"
 
 namespace kmk
 {
 
+// How the devices are read, see USBKromekDataInterface::SetReadBackend
+enum ReadBackend
+{
+    RB_EPOLL = 0,       // A thread for each device sleeping in epoll between reads
+    RB_IO_URING         // One io_uring reading every device on a single thread, see ReadRing
+};
+
 // Data reading interface for devices using the linux kromek usb driver
 class USBKromekDataInterface : public IDataInterface
 {
 private:
     std::string _devicePath;
+    unsigned int _hash;
     int _fileHandle;
     kmk::Thread _readThread;
     bool _readThreadRunning;
+    bool _readingOnRing; // Read by the ReadRing rather than _readThread
 
     // Callback to pass data to once read from the port
     DataReadyCallbackFunc _dataReadyCallback;
@@ -35,6 +45,9 @@ private:
     kmk::CriticalSection _readCriticalSection;
     InterfaceProperties _ifProperties;
 
+    // Optional tap recording everything passed to _dataReadyCallback
+    kmk::CaptureWriter _captureWriter;
+
     // Open the file device
     bool OpenDevice();
 
@@ -47,12 +60,28 @@ private:
     // Main thread routine
     static int ReadDataThread(void *pThis);
 
+    // Each read made by the ReadRing
+    static void RingReadProc(void *pArg, unsigned char *pData, int bytesRead);
+
 public:
 
     unsigned int GetHash();
     VID GetVendorID();
+
+    // Hash of the interface for a device node, for finding the interface of a device that has been removed
+    static unsigned int HashDevicePath(const char *pDevicePath);
+
     PID GetProductID();
 
+    // Select how devices are read from the next time one starts reading. Returns false, leaving the devices read by
+    // epoll, if io_uring is asked for but the kernel does not support it. A device the ring has no room for is read
+    // by epoll regardless
+    static bool SetReadBackend(ReadBackend backend);
+    static ReadBackend GetReadBackend();
+
+    // System calls made reading every device so far, by both backends. For comparing them
+    static uint64_t GetReadSystemCalls();
+
     USBKromekDataInterface(const char *pDevicePath, PID productID, VID vendorID, const char *pSerial, unsigned short firmwareVersion);
     ~USBKromekDataInterface();
 
@@ -76,6 +105,9 @@ public:
     void SetErrorCallback(ErrorCallbackFunc func, void *pArg);
 
     String GetInterfaceProperty(const String& name);
+
+    bool StartCapture(const char *pBasePath, const CaptureSettings &settings);
+    void StopCapture();
 };
 
 }
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "IDataInterface.h"
+#include "types.h"
+#include "Thread.h"
+#include "CriticalSection.h"
+#include "CaptureWriter.h"
+
+namespace kmk
+{
+
+// Data reading interface for devices with a usb serial port (CDC-ACM, i.e. '/dev/ttyACM0') such as the D3S, D3M and D4. The
+// port is put into raw mode so the packet stream reaches the data processor exactly as the device sent it, and the read
+// thread sleeps in epoll until data arrives rather than polling the port
+class USBSerialDataInterface : public IDataInterface
+{
+private:
+    std::string _devicePath;
+    int _fileHandle;
+    int _stopFd; // eventfd written to wake the read thread when it is stopped
+    kmk::Thread _readThread;
+    bool _readThreadRunning;
+
+    // Callback to pass data to once read from the port
+    DataReadyCallbackFunc _dataReadyCallback;
+    void *_dataReadyCallbackArg;
+
+    // Callback raised whenever an error occurs
+    ErrorCallbackFunc _errorCallback;
+    void *_errorCallbackArg;
+
+    // Product and vendor id of the usb device the port is on, a serial port does not have access to these values directly
+    VID _vendorID;
+    PID _productID;
+
+    kmk::CriticalSection _readCriticalSection;
+    InterfaceProperties _ifProperties;
+
+    // Optional tap recording everything passed to _dataReadyCallback
+    kmk::CaptureWriter _captureWriter;
+
+    // Open the port and set it up for the packet stream
+    bool OpenDevice();
+
+    // Close the port
+    bool Close();
+
+    // Write all the data to the open port
+    bool SendDataToDevice(const unsigned char *pData, size_t dataLength);
+
+    // Raise the error callback
+    void RaiseError(int errorCode, String message);
+
+    // Main thread routine
+    static int ReadDataThread(void *pThis);
+
+public:
+
+    unsigned int GetHash();
+    VID GetVendorID();
+    PID GetProductID();
+
+    // The usb serial is optional, it is only used to recognise the device again (see DeviceInfoCache)
+    USBSerialDataInterface(const char *pDevicePath, PID productID, VID vendorID, const char *pSerial);
+    ~USBSerialDataInterface();
+
+    // Initialise the device once detected but before being opened
+    bool Initialize();
+
+    // Returns if the port is open
+    bool IsOpen();
+
+    // Begin reading data from the device until StopReading is called
+    bool BeginReading();
+
+    // Stop reading data from the device
+    bool StopReading();
+
+    // Get and set configuration settings. The actual response data is returned in the main data stream
+    bool GetConfigurationSetting(unsigned char *pDataBuffer, size_t dataLength);
+    bool SetConfigurationSetting(unsigned char *pData, size_t dataLength);
+
+    void SetDataReadyCallback(DataReadyCallbackFunc pFunc, void *pArg);
+    void SetErrorCallback(ErrorCallbackFunc func, void *pArg);
+
+    String GetInterfaceProperty(const String& name);
+
+    bool StartCapture(const char *pBasePath, const CaptureSettings &settings);
+    void StopCapture();
+};
+
+}
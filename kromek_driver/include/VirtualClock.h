@@ -0,0 +1,63 @@
+#pragma once
+
+#include "kmkTime.h"
+#include "CriticalSection.h"
+#include <atomic>
+#include <vector>
+
+namespace kmk
+{
+
+// A clock that only moves when it is advanced. Once enabled it is the kmk::Time source for the whole process, so
+// acquisition times, timeouts and timestamps all follow it. Simulated and replay interfaces that start reading while it
+// is enabled are driven by it rather than their own threads, generating / playing the data for each step as the clock
+// is advanced. Advancing in fixed steps from one thread, with a fixed simulation seed, gives the same data every run.
+//
+// Enable before any interface starts reading. Interfaces keep the timing they started with until they are stopped
+class VirtualClock : public ITimeSource
+{
+public:
+	// Called each time the clock is advanced, with the new time in ms
+	typedef void (*AdvanceCallbackFunc)(void *pArg, int64_t timeMs);
+
+	static VirtualClock &GetInstance();
+
+	// Returns the clock if it is enabled, otherwise NULL
+	static VirtualClock *GetEnabled();
+
+	// Make this the kmk::Time source. Starts from the current time so time does not go backwards
+	void Enable();
+
+	// Go back to the performance counter. Times taken while enabled are not comparable with times taken after
+	void Disable();
+
+	bool IsEnabled();
+
+	int64_t GetTime() { return _time.load(std::memory_order_acquire); }
+
+	// Move time forward and call every listener in turn on this thread. Returns once they have all been called
+	void Advance(int64_t timeMs);
+
+	// Listeners may be removed from within their own callback. Once RemoveListener returns the listener is not called again
+	void AddListener(AdvanceCallbackFunc func, void *pArg);
+	void RemoveListener(AdvanceCallbackFunc func, void *pArg);
+
+private:
+	struct Listener
+	{
+		AdvanceCallbackFunc func;
+		void *pArg;
+	};
+
+	std::atomic<int64_t> _time;
+
+	// Held while advancing so listeners are never called concurrently or after being removed
+	kmk::CriticalSection _listenerSection;
+	std::vector<Listener> _listeners;
+
+	VirtualClock();
+	VirtualClock(const VirtualClock &);
+	VirtualClock &operator=(const VirtualClock &);
+};
+
+}
@@ -5,6 +5,7 @@
 #include <windows.h>
 #endif
 
+#include <atomic>
 #include <cmath>
 
 #include "types.h"
@@ -28,9 +29,22 @@
 // Helper class / static methods for time
 namespace kmk
 {
+	// Replaces the performance counter as the source of GetTime / GetTimeMs, e.g. with a VirtualClock
+	class ITimeSource
+	{
+	public:
+		virtual ~ITimeSource() {}
+
+		// Current time in ticks
+		virtual int64_t GetTime() = 0;
+	};
+
 	class Time
 	{
 	private:
+		// Time source in use, NULL for the performance counter
+		static std::atomic<ITimeSource*> s_pTimeSource;
+
 	#ifdef _WINDOWS
 		static LARGE_INTEGER GetPerformanceFreq()
 		{
@@ -41,9 +55,25 @@ namespace kmk
 		#endif
 	public:
 
+		// Replace the performance counter with a time source (NULL to go back to the performance counter). The source
+		// must outlive its use. GetSystemTime is not affected
+		static void SetTimeSource(ITimeSource *pSource)
+		{
+			s_pTimeSource.store(pSource, std::memory_order_release);
+		}
+
+		static ITimeSource *GetTimeSource()
+		{
+			return s_pTimeSource.load(std::memory_order_acquire);
+		}
+
 		// Get time from performance counter in ticks
 		static int64_t GetTime()
 		{
+			ITimeSource *pSource = GetTimeSource();
+			if (pSource != NULL)
+				return pSource->GetTime();
+
 		#ifdef _WINDOWS
 			static LARGE_INTEGER freq = GetPerformanceFreq();
 			LARGE_INTEGER now;
@@ -53,13 +83,17 @@ namespace kmk
 		#else
 			timespec now;
 			clock_gettime(CLOCK_TYPE, &now);
-			return static_cast<int64_t>(now.tv_nsec) + SecondsToTicks(now.tv_sec);
+			return (static_cast<int64_t>(now.tv_nsec) / TICK_TIME_NS) + SecondsToTicks(now.tv_sec);
 		#endif
 		}
 
 		// Get time from the performance counter in milliseconds
 		static int64_t GetTimeMs()
 		{
+			ITimeSource *pSource = GetTimeSource();
+			if (pSource != NULL)
+				return TicksToMs(pSource->GetTime());
+
 		#ifdef _WINDOWS
 			static LARGE_INTEGER freq = GetPerformanceFreq();
 			LARGE_INTEGER now;
@@ -84,7 +118,7 @@ namespace kmk
 		#else
 			timespec now;
 			clock_gettime(CLOCK_REALTIME, &now); // TODO: Check this is UTC?
-			return static_cast<int64_t>(now.tv_nsec) + SecondsToTicks(now.tv_sec);
+			return (static_cast<int64_t>(now.tv_nsec) / TICK_TIME_NS) + SecondsToTicks(now.tv_sec);
 		#endif
 		}
 
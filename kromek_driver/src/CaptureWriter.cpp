@@ -0,0 +1,383 @@
+#include "stdafx.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <thread>
+
+#include "CaptureWriter.h"
+#include "kmkTime.h"
+#include "Lock.h"
+
+namespace kmk
+{
+
+// Write all of the spans, retrying after partial writes and signals
+static bool WriteAll(int fileHandle, iovec *pSpans, int numSpans)
+{
+	while (numSpans > 0)
+	{
+		ssize_t bytesOut = writev(fileHandle, pSpans, numSpans);
+		if (bytesOut < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			return false;
+		}
+
+		// Skip past whatever was written
+		while (numSpans > 0 && (size_t)bytesOut >= pSpans->iov_len)
+		{
+			bytesOut -= pSpans->iov_len;
+			++pSpans;
+			--numSpans;
+		}
+
+		if (numSpans > 0)
+		{
+			pSpans->iov_base = (BYTE*)pSpans->iov_base + bytesOut;
+			pSpans->iov_len -= bytesOut;
+		}
+	}
+
+	return true;
+}
+
+CaptureWriter::CaptureWriter()
+: _enabled(false)
+, _ringMask(0)
+, _head(0)
+, _tail(0)
+, _pendingDroppedRecords(0)
+, _pendingDroppedBytes(0)
+, _recordsWritten(0)
+, _bytesWritten(0)
+, _recordsDropped(0)
+, _bytesDropped(0)
+, _startTime(0)
+, _started(false)
+, _fileHandle(-1)
+, _fileIndex(0)
+, _fileSize(0)
+, _stopEvent(false, false, L"")
+{
+	_producerFlag.clear();
+	memset(&_header, 0, sizeof(_header));
+}
+
+CaptureWriter::~CaptureWriter()
+{
+	Stop();
+}
+
+bool CaptureWriter::Start(const char *pBasePath, VID vendorId, PID productId, const CaptureSettings &settings)
+{
+	kmk::Lock lock(_criticalSection);
+
+	if (_started || pBasePath == NULL)
+		return false;
+
+	_basePath = pBasePath;
+	_settings = settings;
+
+	// Round the ring up to a power of 2 so positions can be masked
+	size_t ringSize = 4096;
+	while (ringSize < _settings.bufferSize)
+		ringSize <<= 1;
+
+	_ring.assign(ringSize, 0);
+	_ringMask = ringSize - 1;
+	_head = 0;
+	_tail = 0;
+	_pendingDroppedRecords = 0;
+	_pendingDroppedBytes = 0;
+	_recordsWritten = 0;
+	_bytesWritten = 0;
+	_recordsDropped = 0;
+	_bytesDropped = 0;
+
+	memcpy(_header.magic, CAPTURE_FILE_MAGIC, sizeof(_header.magic));
+	_header.version = CAPTURE_FILE_VERSION;
+	_header.headerSize = sizeof(CaptureFileHeader);
+	_header.vendorId = vendorId;
+	_header.productId = productId;
+	_header.startTime = kmk::Time::GetSystemTime();
+	_startTime = kmk::Time::GetTime();
+
+	_fileIndex = 0;
+	if (!OpenFile())
+		return false;
+
+	_stopEvent.Reset();
+	if (!_writerThread.Start(WriterThread, this, TR_OTHER, "kmk-capture"))
+	{
+		CloseFile();
+		return false;
+	}
+
+	_started = true;
+	_enabled.store(true, std::memory_order_release);
+	return true;
+}
+
+void CaptureWriter::Stop()
+{
+	kmk::Lock lock(_criticalSection);
+
+	if (!_started)
+		return;
+
+	// Wait for any record part way through being added, nothing new can start once disabled
+	_enabled.store(false);
+	while (_producerFlag.test_and_set(std::memory_order_acquire))
+		std::this_thread::yield();
+	_producerFlag.clear(std::memory_order_release);
+
+	// The writer flushes everything left before exiting
+	_stopEvent.Signal();
+	_writerThread.WaitForTermination();
+
+	CloseFile();
+	_started = false;
+}
+
+void CaptureWriter::GetStats(CaptureStats &statsOut)
+{
+	statsOut.recordsWritten = _recordsWritten.load(std::memory_order_relaxed);
+	statsOut.bytesWritten = _bytesWritten.load(std::memory_order_relaxed);
+	statsOut.recordsDropped = _recordsDropped.load(std::memory_order_relaxed);
+	statsOut.bytesDropped = _bytesDropped.load(std::memory_order_relaxed);
+}
+
+bool CaptureWriter::Write(CaptureRecordType type, const BYTE *pData, size_t dataSize, bool canWait /*= false*/)
+{
+	if (!_enabled.load(std::memory_order_acquire))
+		return false;
+
+	int64_t timestamp = kmk::Time::GetTime() - _startTime;
+
+	while (_producerFlag.test_and_set(std::memory_order_acquire))
+	{
+		// Another thread is adding a record. The read thread never waits for it
+		if (!canWait)
+		{
+			NoteDropped(dataSize);
+			return false;
+		}
+
+		std::this_thread::yield();
+	}
+
+	bool written = false;
+	if (_enabled.load(std::memory_order_relaxed))
+	{
+		uint64_t head = _head.load(std::memory_order_relaxed);
+		uint64_t tail = _tail.load(std::memory_order_acquire);
+		size_t freeSpace = _ring.size() - (size_t)(head - tail);
+
+		// Earlier drops are marked in front of the next record that fits
+		bool markDrops = _pendingDroppedRecords.load(std::memory_order_relaxed) != 0;
+		size_t needed = sizeof(CaptureRecordHeader) + dataSize;
+		if (markDrops)
+			needed += sizeof(CaptureRecordHeader) + sizeof(CaptureDropInfo);
+
+		if (needed > freeSpace)
+		{
+			NoteDropped(dataSize);
+		}
+		else
+		{
+			if (markDrops)
+			{
+				CaptureDropInfo info;
+				info.records = _pendingDroppedRecords.exchange(0, std::memory_order_relaxed);
+				info.bytes = _pendingDroppedBytes.exchange(0, std::memory_order_relaxed);
+				head = PushRecord(head, CRT_DROPPED, timestamp, &info, sizeof(info));
+			}
+
+			head = PushRecord(head, type, timestamp, pData, dataSize);
+			_head.store(head, std::memory_order_release);
+			written = true;
+		}
+	}
+
+	_producerFlag.clear(std::memory_order_release);
+	return written;
+}
+
+void CaptureWriter::NoteDropped(size_t dataSize)
+{
+	_pendingDroppedRecords.fetch_add(1, std::memory_order_relaxed);
+	_pendingDroppedBytes.fetch_add(dataSize, std::memory_order_relaxed);
+	_recordsDropped.fetch_add(1, std::memory_order_relaxed);
+	_bytesDropped.fetch_add(dataSize, std::memory_order_relaxed);
+}
+
+uint64_t CaptureWriter::PushRecord(uint64_t position, uint8_t type, int64_t timestamp, const void *pData, size_t dataSize)
+{
+	CaptureRecordHeader recordHeader;
+	recordHeader.timestamp = timestamp;
+	recordHeader.type = type;
+	recordHeader.dataSize = (uint32_t)dataSize;
+
+	CopyToRing(position, &recordHeader, sizeof(recordHeader));
+	position += sizeof(recordHeader);
+	CopyToRing(position, pData, dataSize);
+	return position + dataSize;
+}
+
+void CaptureWriter::CopyToRing(uint64_t position, const void *pData, size_t dataSize)
+{
+	size_t start = (size_t)position & _ringMask;
+	size_t first = (dataSize < _ring.size() - start) ? dataSize : _ring.size() - start;
+
+	memcpy(&_ring[start], pData, first);
+	if (dataSize > first)
+		memcpy(&_ring[0], (const BYTE*)pData + first, dataSize - first);
+}
+
+void CaptureWriter::CopyFromRing(uint64_t position, void *pDataOut, size_t dataSize)
+{
+	size_t start = (size_t)position & _ringMask;
+	size_t first = (dataSize < _ring.size() - start) ? dataSize : _ring.size() - start;
+
+	memcpy(pDataOut, &_ring[start], first);
+	if (dataSize > first)
+		memcpy((BYTE*)pDataOut + first, &_ring[0], dataSize - first);
+}
+
+std::string CaptureWriter::GetFileName(unsigned int index)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "_%04u.kcap", index);
+	return _basePath + suffix;
+}
+
+bool CaptureWriter::OpenFile()
+{
+	std::string fileName = GetFileName(_fileIndex);
+	_fileHandle = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (_fileHandle == -1)
+		return false;
+
+	iovec span;
+	span.iov_base = &_header;
+	span.iov_len = sizeof(_header);
+	if (!WriteAll(_fileHandle, &span, 1))
+	{
+		CloseFile();
+		return false;
+	}
+
+	_fileSize = sizeof(_header);
+
+	// Keep within the file limit by removing the oldest
+	if (_settings.maxFiles != 0 && _fileIndex >= _settings.maxFiles)
+		unlink(GetFileName(_fileIndex - _settings.maxFiles).c_str());
+
+	return true;
+}
+
+void CaptureWriter::CloseFile()
+{
+	if (_fileHandle != -1)
+	{
+		close(_fileHandle);
+		_fileHandle = -1;
+	}
+}
+
+bool CaptureWriter::Flush()
+{
+	uint64_t tail = _tail.load(std::memory_order_relaxed);
+	uint64_t head = _head.load(std::memory_order_acquire);
+
+	while (tail != head)
+	{
+		// Take as many whole records as fit in the current file. A new file always takes at least one record so an
+		// oversized record can not stall the capture
+		uint64_t batchEnd = tail;
+		uint64_t batchRecords = 0;
+		bool rotate = false;
+		while (batchEnd != head)
+		{
+			CaptureRecordHeader recordHeader;
+			CopyFromRing(batchEnd, &recordHeader, sizeof(recordHeader));
+			uint64_t recordSize = sizeof(recordHeader) + recordHeader.dataSize;
+			uint64_t fileSize = _fileSize + (batchEnd - tail);
+
+			if (_settings.maxFileSize != 0 && fileSize + recordSize > _settings.maxFileSize && fileSize > sizeof(CaptureFileHeader))
+			{
+				rotate = true;
+				break;
+			}
+
+			batchEnd += recordSize;
+			if (recordHeader.type != CRT_DROPPED)
+				++batchRecords;
+		}
+
+		if (batchEnd != tail)
+		{
+			// Written straight from the ring, at most two spans when the batch wraps around the end
+			size_t length = (size_t)(batchEnd - tail);
+			size_t start = (size_t)tail & _ringMask;
+			size_t first = (length < _ring.size() - start) ? length : _ring.size() - start;
+
+			iovec spans[2];
+			spans[0].iov_base = &_ring[start];
+			spans[0].iov_len = first;
+			spans[1].iov_base = &_ring[0];
+			spans[1].iov_len = length - first;
+
+			if (!WriteAll(_fileHandle, spans, (length > first) ? 2 : 1))
+				return false;
+
+			_fileSize += length;
+			_recordsWritten.fetch_add(batchRecords, std::memory_order_relaxed);
+			_bytesWritten.fetch_add(length, std::memory_order_relaxed);
+
+			tail = batchEnd;
+			_tail.store(tail, std::memory_order_release);
+		}
+
+		if (rotate)
+		{
+			CloseFile();
+			++_fileIndex;
+			if (!OpenFile())
+				return false;
+		}
+	}
+
+	return true;
+}
+
+// Thread function that periodically writes out the ring until stopped
+int CaptureWriter::WriterThread(void *pArg)
+{
+	CaptureWriter *pThis = (CaptureWriter*)pArg;
+
+	while (true)
+	{
+		bool stopping = pThis->_stopEvent.Wait(pThis->_settings.flushInterval);
+
+		if (!pThis->Flush())
+		{
+			// Disk full or similar, give up on the capture rather than buffering forever
+			pThis->_enabled.store(false);
+			break;
+		}
+
+		if (stopping)
+			break;
+	}
+
+	return 0;
+}
+
+}
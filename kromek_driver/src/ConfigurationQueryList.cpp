@@ -0,0 +1,105 @@
+#include "stdafx.h"
+#include "ConfigurationQueryList.h"
+#include "kmkTime.h"
+
+namespace kmk
+{
+
+bool ConfigurationQueryList::Add(Key key)
+{
+	kmk::Lock lock(_criticalSection);
+
+	QueryPtr &ptrQuery = _queries[key];
+	bool isNew = !ptrQuery;
+	if (isNew)
+	{
+		ptrQuery = std::make_shared<Query>();
+	}
+	else if (ptrQuery->complete)
+	{
+		// The response may predate this request (e.g. a get straight after a set) so send it again. Waiters that have not
+		// yet taken the old response get the new one instead, which is also after their request
+		ptrQuery->complete = false;
+		ptrQuery->data.clear();
+		ptrQuery->event.Reset();
+		isNew = true;
+	}
+
+	++ptrQuery->refCount;
+	return isNew;
+}
+
+bool ConfigurationQueryList::Complete(Key key, const BYTE *pData, size_t dataSize)
+{
+	kmk::Lock lock(_criticalSection);
+
+	QueryMap::iterator it = _queries.find(key);
+	if (it == _queries.end())
+		return false;
+
+	Query &query = *it->second;
+	query.data.assign(pData, pData + dataSize);
+	query.complete = true;
+	query.event.Signal();
+	return true;
+}
+
+bool ConfigurationQueryList::Wait(Key key, int64_t deadlineMs, std::vector<BYTE> &dataOut)
+{
+	QueryPtr ptrQuery;
+	{
+		kmk::Lock lock(_criticalSection);
+		QueryMap::iterator it = _queries.find(key);
+		if (it == _queries.end())
+			return false;
+
+		ptrQuery = it->second;
+	}
+
+	bool complete = false;
+	while (true)
+	{
+		{
+			kmk::Lock lock(_criticalSection);
+			complete = ptrQuery->complete;
+			if (complete)
+				dataOut = ptrQuery->data;
+		}
+
+		int64_t remainingMs = deadlineMs - kmk::Time::GetTimeMs();
+		if (complete || remainingMs <= 0)
+			break;
+
+		// The event stays signalled once complete so waiters sharing the query all wake
+		ptrQuery->event.Wait((uint32_t)remainingMs);
+	}
+
+	Release(key, ptrQuery);
+	return complete;
+}
+
+void ConfigurationQueryList::Remove(Key key)
+{
+	kmk::Lock lock(_criticalSection);
+	QueryMap::iterator it = _queries.find(key);
+	if (it != _queries.end())
+	{
+		QueryPtr ptrQuery = it->second;
+		Release(key, ptrQuery);
+	}
+}
+
+bool ConfigurationQueryList::IsEmpty()
+{
+	kmk::Lock lock(_criticalSection);
+	return _queries.empty();
+}
+
+void ConfigurationQueryList::Release(Key key, const QueryPtr &ptrQuery)
+{
+	kmk::Lock lock(_criticalSection);
+	if (--ptrQuery->refCount == 0)
+		_queries.erase(key);
+}
+
+}
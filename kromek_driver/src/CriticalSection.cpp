@@ -5,6 +5,27 @@ namespace kmk
 {
 
 	CriticalSection::CriticalSection ()
+#ifdef KMK_LOCK_PROFILING
+	: m_pCounters (NULL)
+	, m_depth (0)
+	, m_holdStartNs (0)
+#endif
+	{
+		Construct ();
+	}
+
+	CriticalSection::CriticalSection (const char *pName)
+#ifdef KMK_LOCK_PROFILING
+	: m_pCounters (LockProfiler::Register (pName))
+	, m_depth (0)
+	, m_holdStartNs (0)
+#endif
+	{
+		(void)pName;
+		Construct ();
+	}
+
+	void CriticalSection::Construct ()
 	{
 #ifdef _WINDOWS
 		InitializeCriticalSection (&m_cs);
@@ -60,6 +81,28 @@ namespace kmk
 		
 	void CriticalSection::Enter ()
 	{
+#ifdef KMK_LOCK_PROFILING
+		if (m_pCounters != NULL)
+		{
+			// Only a lock held by another thread is timed, the clock is not read for the uncontended case
+			if (TryEnterUnprofiled ())
+			{
+				Acquired (false, 0);
+				return;
+			}
+
+			uint64_t waitStartNs = LockProfiler::GetTimeNs ();
+			EnterUnprofiled ();
+			Acquired (true, LockProfiler::GetTimeNs () - waitStartNs);
+			return;
+		}
+#endif
+
+		EnterUnprofiled ();
+	}
+
+	void CriticalSection::EnterUnprofiled ()
+	{
 #ifdef _WINDOWS
 		EnterCriticalSection (&m_cs);
 #else
@@ -69,6 +112,11 @@ namespace kmk
 
 	void CriticalSection::Leave ()
 	{
+#ifdef KMK_LOCK_PROFILING
+		if (m_pCounters != NULL && --m_depth == 0)
+			LockProfiler::RecordHold (m_pCounters, LockProfiler::GetTimeNs () - m_holdStartNs);
+#endif
+
 #ifdef _WINDOWS
 		LeaveCriticalSection (&m_cs);
 #else
@@ -77,6 +125,18 @@ namespace kmk
 	}
 
 	bool CriticalSection::TryEnter ()
+	{
+		bool entered = TryEnterUnprofiled ();
+
+#ifdef KMK_LOCK_PROFILING
+		if (entered && m_pCounters != NULL)
+			Acquired (false, 0);
+#endif
+
+		return entered;
+	}
+
+	bool CriticalSection::TryEnterUnprofiled ()
 	{
 #ifdef _WINDOWS
 		return (TryEnterCriticalSection (&m_cs) == TRUE);
@@ -85,6 +145,15 @@ namespace kmk
 #endif
 	}
 
+#ifdef KMK_LOCK_PROFILING
+	void CriticalSection::Acquired (bool contended, uint64_t waitTimeNs)
+	{
+		LockProfiler::RecordAcquisition (m_pCounters, contended, waitTimeNs);
+		if (m_depth++ == 0)
+			m_holdStartNs = LockProfiler::GetTimeNs ();
+	}
+#endif
+
 
 } // namespace kmk
 
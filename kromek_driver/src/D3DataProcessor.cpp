@@ -2,6 +2,8 @@
 #include "D3DataProcessor.h"
 #include "D3Structs.h"
 #include "kmkTime.h"
+#include "Probes.h"
+#include "VirtualClock.h"
 #include <cstring>
 #include <stdlib.h>
 #include <algorithm>
@@ -13,6 +15,7 @@
 #include <thread>
 #include <chrono>
 #include "Heatshrink.hpp"
+#include "heatshrink_common.h"
 
 
 // The main reports max size is 8205 bytes and we only request it one at a time. 
@@ -22,39 +25,87 @@
 // Allocate enough space for (approx) a seconds worth of data
 #define MAX_BUFFER_SIZE (MAX_REPORT_SIZE * 20)
 
-// Number of milliseconds to wait between querying for a new spectrum
-#define QUERY_SPECTRUM_RATE 100
-
 // Timeout in ms for configuration querys
 #define CONFIGURATION_QUERY_TIMEOUT 3000
 
+// Time in ms the processing thread is kept alive after the last configuration query when no component is acquiring
+#define CONFIGURATION_SESSION_LINGER 500
+
+// Longest single wait (ms) in WaitForIdle before waking the thread again
+#define IDLE_CHECK_INTERVAL 1
+
+// Most reports processed in one turn on the shared executor before letting other devices have a go
+#define REPORTS_PER_TURN 16
+
 namespace kmk
 {
 
 D3DataProcessor::D3DataProcessor(IDataInterface* pDataInterface, bool supportsRadiometricsV1, IPacketStreamerPtr ptrPacketBuffer, bool neutronIsGamma)
 	: _pDataInterface(pDataInterface)
+	, _interfaceHash(pDataInterface->GetHash())
+	, _strand(Executor::GetInstance(), ProcessStrandProc, this)
+	, _onExecutor(false)
+	, _criticalSection("D3DataProcessor::_criticalSection")
+	, _eventSection("D3DataProcessor::_eventSection")
 	, _waitEvent(false, false, L"")
+	, _lastQueryTime(0)
+	, _newSession(false)
+	, _forcedStop(true)
+	, _idleCount(0)
+	, _idleEvent(true, false, L"")
 	, _currentState(ES_IDLE)
 	, _requiredState(RS_STOP)
 	, _ignoreFirstSpectrumDataPacket(true)
 	, _accumilatedRealTimeMs(0)
-	, _configurationQueryState(CQS_IDLE)
-	, _configurationQueryEvent(false, false, L"")
+	, _configurationSessionEndTime(0)
 	, _lastSpectrumRequestTime(0)
 	, _ptrPacketBuffer(ptrPacketBuffer)
 	, _startAcquisitionTimestamp(0)
+	, _lastReceivedTime(0)
+	, _sampledReceivedTime(0)
 	, _neutronIsGamma(neutronIsGamma)
+	, _compressionEnabled(false)
+	, _compressionWindowSize(D3CompressionRequest::HS_WINDOW_SIZE_DEFAULT)
+	, _compressionLookAheadSize(D3CompressionRequest::HS_LOOKAHEAD_SIZE_DEFAULT)
+	, _decodeWindowSize(D3CompressionRequest::HS_WINDOW_SIZE_DEFAULT)
+	, _decodeLookAheadSize(D3CompressionRequest::HS_LOOKAHEAD_SIZE_DEFAULT)
+	, _pollIntervalMs(0)
+	, _quietSpectrumCount(0)
+	, _alarmActive(false)
+	, _compressedPackets(0)
+	, _wireBytes(0)
+	, _decodedBytes(0)
 {
 	_reportType = supportsRadiometricsV1 ? SRT_RADIOMETRICS_V1 : SRT_UNKNOWN;
+	_pollIntervalMs = _pollSettings.intervalMs;
+	_spectrumBuffer.resize(D3Spectrum16ResponseHeader::SPECTRUM_SIZE);
+	_reportBuffer.resize(MAX_REPORT_SIZE);
 
+	_ptrPacketBuffer->SetPacketsReadyCallback(PacketsReadyCallbackProc, this);
 	_pDataInterface->SetDataReadyCallback(ReadDataCallbackProc, this);
 	_pDataInterface->SetErrorCallback(DataInterfaceErrorCallbackProc, this);
+	_pDataInterface->GetMetrics().SetCollector(CollectMetricsProc, this);
 }
 
 D3DataProcessor::~D3DataProcessor()
 {
+	// The thread may still be lingering after a configuration query
+	bool isRunning = false;
+	{
+		kmk::Lock lock(_criticalSection);
+		isRunning = _currentState != ES_IDLE;
+	}
+
+	if (isRunning)
+	{
+		RequestExecutionState(RS_STOP);
+		WakeProcessing();
+		WaitForProcessingThread();
+	}
+
 	_pDataInterface->SetDataReadyCallback(NULL, NULL);
 	_pDataInterface->SetErrorCallback(NULL, NULL);
+	_pDataInterface->GetMetrics().SetCollector(NULL, NULL);
 }
 
 void D3DataProcessor::AddComponent(uint8_t componentId, IDevice *pDevice, 
@@ -112,6 +163,19 @@ void D3DataProcessor::RemoveComponent(uint8_t componentId, IDevice *)
 	}
 }
 
+void D3DataProcessor::SetSpectrumEventCallback(uint8_t componentId, SpectrumEventCallbackFunc pSpectrumEventFunc, void *pSpectrumEventArg)
+{
+	kmk::Lock lock(_criticalSection);
+	kmk::Lock eventLock(_eventSection);
+
+	// Only the gamma component receives a spectrum
+	if (componentId == GammaComponentId)
+	{
+		_gammaComponent.spectrumEventCallback = pSpectrumEventFunc;
+		_gammaComponent.spectrumEventCallbackArg = pSpectrumEventArg;
+	}
+}
+
 float D3DataProcessor::GetComponentProperty(uint8_t componentId, ComponentProperty prop)
 {
 	kmk::Lock lock(_criticalSection);
@@ -206,34 +270,43 @@ void D3DataProcessor::SetStartTime(uint8_t componentId, int64_t value)
 // Returns false if no report is ready
 bool D3DataProcessor::GetNextReport(std::vector<BYTE> &dataBufferOut, size_t &reportSizeOut)
 {
-	try
+	// Corrupt data raises an error but the packet streamer resyncs on the data that follows it so keep reading. Every
+	// error consumes data so this can not loop forever
+	while (true)
 	{
-		if (!_ptrPacketBuffer->ReadPacket(dataBufferOut))
-			return false;
+		try
+		{
+			if (!_ptrPacketBuffer->ReadPacket(dataBufferOut))
+				return false;
 
-		// The first two bytes of a report give the size of the report
-		reportSizeOut = dataBufferOut.size();
-		return true;
-	}
-	catch (const std::exception& ex)
-	{
+			// The first two bytes of a report give the size of the report
+			reportSizeOut = dataBufferOut.size();
+			return true;
+		}
+		catch (const std::exception& ex)
+		{
 #ifdef _UNICODE
-		wchar_t buffer[D3InternalErrorMessage::BUFFER_SIZE];
+			wchar_t buffer[D3InternalErrorMessage::BUFFER_SIZE];
 #ifdef _WINDOWS
-		size_t charsToConvert = D3InternalErrorMessage::BUFFER_SIZE;
-		mbstowcs_s(&charsToConvert, buffer, ex.what(), D3InternalErrorMessage::BUFFER_SIZE);
+			size_t charsToConvert = D3InternalErrorMessage::BUFFER_SIZE;
+			mbstowcs_s(&charsToConvert, buffer, ex.what(), D3InternalErrorMessage::BUFFER_SIZE);
 #else
-		mbstowcs(buffer, ex.what(), D3InternalErrorMessage::BUFFER_SIZE);
+			mbstowcs(buffer, ex.what(), D3InternalErrorMessage::BUFFER_SIZE);
 #endif
-		String str(buffer);
+			String str(buffer);
 #else
-		String str(ex.what());
+			String str(ex.what());
 #endif
-		RaiseError(ERROR_INTERNAL_DEVICE, str);
-		return false;
+			RaiseError(ERROR_INTERNAL_DEVICE, str);
+		}
 	}
 }
 
+void D3DataProcessor::GetPacketStreamerStats(PacketStreamerStats &statsOut)
+{
+	_ptrPacketBuffer->GetStats(statsOut);
+}
+
 void D3DataProcessor::Reset()
 {
 	kmk::Lock lock(_criticalSection);
@@ -339,9 +412,9 @@ bool D3DataProcessor::SetExecutionState(ExecutionState state)
 bool D3DataProcessor::StartProcessingThread()
 {
 	// If a thread is running then it is still cleaning up a previous run. Let it finish
-	if (_thread.IsRunning())
+	if (_onExecutor || _thread.IsRunning())
 	{
-		_thread.WaitForTermination();
+		WaitForProcessingThread();
 	}
 
 	Reset();
@@ -356,12 +429,25 @@ bool D3DataProcessor::StartProcessingThread()
 	_ignoreFirstSpectrumDataPacket = true;
 	_accumilatedRealTimeMs = 0;
 
-	if (!_thread.Start(ProcessThreadProc, this))
+	// Loop state for the new session
+	_lastQueryTime = kmk::Time::GetTimeMs();
+	_newSession = true;
+	_forcedStop = true;
+
+	// Run on the shared executor if it is running, otherwise on a thread of our own
+	_onExecutor = _strand.Attach();
+	if (!_onExecutor && !_thread.Start(ProcessThreadProc, this, TR_PROCESSOR))
 	{
 		return false;
 	}
 
-	return SetExecutionState(ES_RUNNING);
+	bool result = SetExecutionState(ES_RUNNING);
+
+	// A turn taken before the state is set would find the processor idle and finish straight away
+	if (_onExecutor)
+		_strand.Post();
+
+	return result;
 }
 
 bool D3DataProcessor::StartProcessing(unsigned char componentId)
@@ -377,9 +463,9 @@ bool D3DataProcessor::StartProcessing(unsigned char componentId)
 	// If the thread if still exiting wait
 	if (threadIsExiting)
 	{
-		if (_thread.IsRunning())
+		if (_onExecutor || _thread.IsRunning())
 		{
-			_thread.WaitForTermination();
+			WaitForProcessingThread();
 		}
 	}
 
@@ -471,7 +557,7 @@ bool D3DataProcessor::StopProcessing(unsigned char componentId, bool force)
 		stopReading =	_gammaComponent.status != TS_RUNNING && 
 						_neutronComponent.status != TS_RUNNING &&
 						_doseComponent.status != TS_RUNNING &&
-						_configurationQueryState != CQS_WAITING;
+						_configurationQueries.IsEmpty();
 	}
 	
 	if (stopReading)
@@ -486,11 +572,11 @@ bool D3DataProcessor::StopProcessing(unsigned char componentId, bool force)
 		
 		RequestExecutionState(force ? RS_STOP : RS_FINISH);
 		
-		_waitEvent.Signal(); // Interrupt any wait on the thread	
+		WakeProcessing(); // Interrupt any wait on the thread	
 
 		// If we are not allowing the queue to be completed then wait for the thread to exit before continuing
 		if (force)
-            _thread.WaitForTermination();
+            WaitForProcessingThread();
 	}
 	
 	if (force)
@@ -519,7 +605,7 @@ bool D3DataProcessor::StopProcessing(unsigned char componentId, bool force)
 
 // Decompress the content (excluding header and crc) and ensure the returned data is in the same format as the original
 // packet including header and crc
-bool D3DataProcessor::Decompress(MessageHeader* pMessage, std::vector<BYTE>& dataOut)
+bool D3DataProcessor::Decompress(MessageHeader* pMessage, std::vector<BYTE>& dataOut, uint8_t windowSize, uint8_t lookAheadSize)
 {
 	const int HeaderAndCrcSize = 5;
 
@@ -531,7 +617,7 @@ bool D3DataProcessor::Decompress(MessageHeader* pMessage, std::vector<BYTE>& dat
 	BYTE* pDecodeData = (BYTE*)&pMessage->contentHeader;
 	uint32_t decompressedLength = 0;
 
-	Heatshrink heatshrink(D3CompressionRequest::HS_WINDOW_SIZE_DEFAULT, D3CompressionRequest::HS_LOOKAHEAD_SIZE_DEFAULT);
+	Heatshrink heatshrink(windowSize, lookAheadSize);
 	if (!heatshrink.Expand(pDecodeData, pMessage->messageSize - HeaderAndCrcSize, &decompressBuffer[0], bufferSize, &decompressedLength))
 		return false;
 	
@@ -554,21 +640,47 @@ void D3DataProcessor::ProcessReport(BYTE *pData)
 
 	// Determine the report type
 	MessageHeader *pMessageHeader = (MessageHeader*)pData;
+	bool compressed = (pMessageHeader->mode & 0x1) != 0;
 
 	// Determine if the payload needs decoding?
-	if ((pMessageHeader->mode & 0x1) != 0)
+	if (compressed)
 	{
+		uint8_t windowSize, lookAheadSize;
+		{
+			kmk::Lock lock(_criticalSection);
+			windowSize = _decodeWindowSize;
+			lookAheadSize = _decodeLookAheadSize;
+		}
+
 		// Decompress
-		if (!Decompress(pMessageHeader, decompressedData))
+		if (!Decompress(pMessageHeader, decompressedData, windowSize, lookAheadSize))
 		{
+			_pDataInterface->GetMetrics().Add(METRIC_DECOMPRESSION_FAILURES);
 			RaiseError(ERROR_DECOMPRESSION_FAILED, L"Decompression of packet failed");
 			return;
 		}
+	}
 
-		// Point to the new decompressed data
-		pMessageHeader = (MessageHeader*)&decompressedData[0];
+	{
+		kmk::Lock lock(_criticalSection);
+		_wireBytes += pMessageHeader->messageSize;
+		if (compressed)
+		{
+			++_compressedPackets;
+			_decodedBytes += ((MessageHeader*)&decompressedData[0])->messageSize;
+		}
+		else
+		{
+			_decodedBytes += pMessageHeader->messageSize;
+		}
 	}
 
+	_pDataInterface->GetMetrics().Add(METRIC_REPORTS_DECODED);
+
+	// Point to the new decompressed data
+	if (compressed)
+		pMessageHeader = (MessageHeader*)&decompressedData[0];
+
 	switch(pMessageHeader->contentHeader.reportID)
 	{
 	case D3StartResponseHeader::REPORT_ID:
@@ -616,6 +728,22 @@ void D3DataProcessor::ProcessReport(BYTE *pData)
 		}
 		break;
 
+	case REPORT_ID_SET_COMPRESSION:
+		// The device echoes a compression request once the packets after it are encoded with the settings it holds.
+		// Packets already in flight were encoded with the previous settings so they are only switched to here
+		if (pMessageHeader->messageSize >= sizeof(D3CompressionRequest))
+		{
+			D3CompressionRequest *pResponse = (D3CompressionRequest*)pMessageHeader;
+			if (pResponse->m_windowSize >= HEATSHRINK_MIN_WINDOW_BITS && pResponse->m_windowSize <= HEATSHRINK_MAX_WINDOW_BITS &&
+				pResponse->m_lookAheadSize >= HEATSHRINK_MIN_LOOKAHEAD_BITS && pResponse->m_lookAheadSize < pResponse->m_windowSize)
+			{
+				kmk::Lock lock(_criticalSection);
+				_decodeWindowSize = pResponse->m_windowSize;
+				_decodeLookAheadSize = pResponse->m_lookAheadSize;
+			}
+		}
+		break;
+
 	case D3Configuration16::REPORT_ID_GET_BIAS:
 	case D3Configuration16::REPORT_ID_GET_LLD:
 	case D3Configuration16::REPORT_ID_GET_SOFTWARE_LLD:
@@ -636,12 +764,51 @@ void D3DataProcessor::ProcessReport(BYTE *pData)
 
 }
 
+// Raise the events for a gamma spectrum (called on the process thread without any locks held)
+uint64_t D3DataProcessor::RaiseSpectrumEvents(int64_t timestamp, const void *pSpectrum, int numChannels,
+	SpectrumEventCallbackFunc spectrumEventFunc, void *pSpectrumEventArg, CountEventCallbackFunc countEventFunc, void *pCountEventArg)
+{
+	// The spectrum is at an odd offset within the packet, copy it out so the callbacks get an aligned array
+	if (_spectrumBuffer.size() < static_cast<size_t>(numChannels))
+		_spectrumBuffer.resize(numChannels);
+
+	std::memcpy(&_spectrumBuffer[0], pSpectrum, numChannels * sizeof(uint16_t));
+	kmk::LatencyTracer::Mark(LS_DECODED);
+
+	uint64_t totalCounts = 0;
+	if (spectrumEventFunc != NULL)
+	{
+		for (int i = 0; i < numChannels; ++i)
+			totalCounts += _spectrumBuffer[i];
+
+		// One event for the whole spectrum
+		(*spectrumEventFunc)(pSpectrumEventArg, timestamp, &_spectrumBuffer[0], numChannels);
+	}
+	else
+	{
+		// Raise an event for each channel containing counts
+		for (int i = 0; i < numChannels; ++i)
+		{
+			if (_spectrumBuffer[i] > 0)
+			{
+				totalCounts += _spectrumBuffer[i];
+				(*countEventFunc)(pCountEventArg, timestamp, i, _spectrumBuffer[i]);
+			}
+		}
+	}
+
+	_pDataInterface->GetMetrics().Add(METRIC_EVENTS_COUNTED, totalCounts);
+	return totalCounts;
+}
+
 void D3DataProcessor::ProcessSpectrum16Report(D3Spectrum16ResponseHeader *pMessage)
 {
 	CountEventCallbackFunc sigmaEventFunc = NULL;
+	SpectrumEventCallbackFunc sigmaSpectrumFunc = NULL;
 	CountEventCallbackFunc tn15EventFunc = NULL;
 	CountEventCallbackFunc doseEventFunc = NULL;
 	void *pSigmaEventArg = NULL;
+	void *pSigmaSpectrumArg = NULL;
 	void *ptn15EventArg = NULL;
 	void* pdoseEventArg = NULL;
 
@@ -652,7 +819,9 @@ void D3DataProcessor::ProcessSpectrum16Report(D3Spectrum16ResponseHeader *pMessa
 	void *ptn15FinishedArg = NULL;
 	void* pdoseFinishedArg = NULL;
 	int64_t timestamp = 0;
+	bool adaptivePolling = false;
 
+	KMK_PROBE2(report_begin, _interfaceHash, _lastReceivedTime.load(std::memory_order_relaxed));
 	_spectrumQueryEvent.Signal();
 
 	// Grab a local copy of the event functions (We dont want the critical section locked during the call to the actual event functions)
@@ -667,9 +836,12 @@ void D3DataProcessor::ProcessSpectrum16Report(D3Spectrum16ResponseHeader *pMessa
 
 			// Store the timestamp of the current time as a reference point
 			_startAcquisitionTimestamp = Time::GetTime();
+			KMK_PROBE2(report_end, _interfaceHash, 0);
 			return;
 		}
 
+		adaptivePolling = _pollSettings.adaptive;
+
 		// Calculate the timestamp for this data
 		_accumilatedRealTimeMs += pMessage->realTimeMS;
 
@@ -692,6 +864,8 @@ void D3DataProcessor::ProcessSpectrum16Report(D3Spectrum16ResponseHeader *pMessa
 			{
 				sigmaEventFunc = _gammaComponent.countEventCallback;
 				pSigmaEventArg = _gammaComponent.countEventCallbackArg;
+				sigmaSpectrumFunc = _gammaComponent.spectrumEventCallback;
+				pSigmaSpectrumArg = _gammaComponent.spectrumEventCallbackArg;
 				_gammaComponent.accumilatedRealTimeMs += pMessage->realTimeMS;
 			}
 			else if (_gammaComponent.status == TS_FINISH)
@@ -736,20 +910,29 @@ void D3DataProcessor::ProcessSpectrum16Report(D3Spectrum16ResponseHeader *pMessa
 	}
 
 	// Gamma spectrum / SIGMA
-	// Raise an event for each channel containing counts
-	if (sigmaEventFunc != NULL)
+	uint64_t totalCounts = pMessage->neutronCounts;
+	if (sigmaEventFunc != NULL || sigmaSpectrumFunc != NULL)
 	{
-		for (int i = 0; i < D3Spectrum16ResponseHeader::SPECTRUM_SIZE; ++i)
-		{
-			if (pMessage->gammaSpectrum[i] > 0)
-				(*sigmaEventFunc)(pSigmaEventArg, timestamp, i, pMessage->gammaSpectrum[i]);
-		}
+		totalCounts += RaiseSpectrumEvents(timestamp, pMessage->gammaSpectrum, D3Spectrum16ResponseHeader::SPECTRUM_SIZE,
+			sigmaSpectrumFunc, pSigmaSpectrumArg, sigmaEventFunc, pSigmaEventArg);
 	}
-	else if (sigmaFinishedFunc != NULL)
+	else
 	{
-		(*sigmaFinishedFunc)(pSigmaFinishedArg, false);
+		// Nothing has summed the spectrum, only needed for the poll interval
+		if (adaptivePolling)
+		{
+			for (int i = 0; i < D3Spectrum16ResponseHeader::SPECTRUM_SIZE; ++i)
+				totalCounts += pMessage->gammaSpectrum[i];
+		}
+
+		if (sigmaFinishedFunc != NULL)
+			(*sigmaFinishedFunc)(pSigmaFinishedArg, false);
 	}
 
+	// Adjust how often spectra are requested given the rate in this one
+	if (adaptivePolling)
+		UpdatePollInterval(totalCounts, pMessage->realTimeMS);
+
 	// Neutron / TN15
 	if (tn15EventFunc != NULL)
 	{
@@ -771,14 +954,17 @@ void D3DataProcessor::ProcessSpectrum16Report(D3Spectrum16ResponseHeader *pMessa
 		(*doseFinishedFunc)(pdoseFinishedArg, false);
 	}
 
+	KMK_PROBE2(report_end, _interfaceHash, totalCounts);
 }
 
 void D3DataProcessor::ProcessRadiometricsV1Report(D3RadiometricsV1ReponseHeader *pMessage)
 {
 	CountEventCallbackFunc sigmaEventFunc = NULL;
+	SpectrumEventCallbackFunc sigmaSpectrumFunc = NULL;
 	CountEventCallbackFunc tn15EventFunc = NULL;
 	DoseEventCallbackFunc doseEventFunc = NULL;
 	void *pSigmaEventArg = NULL;
+	void *pSigmaSpectrumArg = NULL;
 	void *ptn15EventArg = NULL;
 	void *pdoseEventArg = NULL;
 
@@ -789,7 +975,9 @@ void D3DataProcessor::ProcessRadiometricsV1Report(D3RadiometricsV1ReponseHeader
 	void *ptn15FinishedArg = NULL;
 	void *pdoseFinishedArg = NULL;
 	int64_t timestamp = 0;
+	bool adaptivePolling = false;
 
+	KMK_PROBE2(report_begin, _interfaceHash, _lastReceivedTime.load(std::memory_order_relaxed));
 	_spectrumQueryEvent.Signal();
 
 	// Grab a local copy of the event functions (We dont want the critical section locked during the call to the actual event functions)
@@ -804,9 +992,12 @@ void D3DataProcessor::ProcessRadiometricsV1Report(D3RadiometricsV1ReponseHeader
 
 			// Store the timestamp of the current time as a reference point
 			_startAcquisitionTimestamp = Time::GetTime();
+			KMK_PROBE2(report_end, _interfaceHash, 0);
 			return;
 		}
 
+		adaptivePolling = _pollSettings.adaptive;
+
 		// Calculate the timestamp for this data
 		_accumilatedRealTimeMs += pMessage->realTimeMS;
 
@@ -829,6 +1020,8 @@ void D3DataProcessor::ProcessRadiometricsV1Report(D3RadiometricsV1ReponseHeader
 			{
 				sigmaEventFunc = _gammaComponent.countEventCallback;
 				pSigmaEventArg = _gammaComponent.countEventCallbackArg;
+				sigmaSpectrumFunc = _gammaComponent.spectrumEventCallback;
+				pSigmaSpectrumArg = _gammaComponent.spectrumEventCallbackArg;
 				_gammaComponent.accumilatedRealTimeMs += pMessage->realTimeMS;
 				_gammaComponent.SetProperty(CP_Temperature, pMessage->gammaTemperature / 100.0f);
 				_gammaComponent.SetProperty(CP_LiveTime, _gammaComponent.GetProperty(CP_LiveTime) + ( pMessage->gammaLiveTime / 100.0f));
@@ -877,21 +1070,29 @@ void D3DataProcessor::ProcessRadiometricsV1Report(D3RadiometricsV1ReponseHeader
 	}
 
 	// Gamma spectrum / SIGMA
-	// Raise an event for each channel containing counts
-	if (sigmaEventFunc != NULL)
+	uint64_t totalCounts = pMessage->neutronCounts;
+	if (sigmaEventFunc != NULL || sigmaSpectrumFunc != NULL)
 	{
-		for (int i = 0; i < D3Spectrum16ResponseHeader::SPECTRUM_SIZE; ++i)
-		{
-			//assert(pMessage->gammaSpectrum[i] < 1000);
-			if (pMessage->gammaSpectrum[i] > 0)
-				(*sigmaEventFunc)(pSigmaEventArg, timestamp, i, pMessage->gammaSpectrum[i]);
-		}
+		totalCounts += RaiseSpectrumEvents(timestamp, pMessage->gammaSpectrum, D3RadiometricsV1ReponseHeader::SPECTRUM_SIZE,
+			sigmaSpectrumFunc, pSigmaSpectrumArg, sigmaEventFunc, pSigmaEventArg);
 	}
-	else if (sigmaFinishedFunc != NULL)
+	else
 	{
-		(*sigmaFinishedFunc)(pSigmaFinishedArg, false);
+		// Nothing has summed the spectrum, only needed for the poll interval
+		if (adaptivePolling)
+		{
+			for (int i = 0; i < D3RadiometricsV1ReponseHeader::SPECTRUM_SIZE; ++i)
+				totalCounts += pMessage->gammaSpectrum[i];
+		}
+
+		if (sigmaFinishedFunc != NULL)
+			(*sigmaFinishedFunc)(pSigmaFinishedArg, false);
 	}
 
+	// Adjust how often spectra are requested given the rate in this one
+	if (adaptivePolling)
+		UpdatePollInterval(totalCounts, pMessage->realTimeMS);
+
 	// Neutron / TN15
 	if (tn15EventFunc != NULL)
 	{
@@ -912,36 +1113,179 @@ void D3DataProcessor::ProcessRadiometricsV1Report(D3RadiometricsV1ReponseHeader
 	{
 		(*doseFinishedFunc)(pdoseFinishedArg, false);
 	}
+
+	KMK_PROBE2(report_end, _interfaceHash, totalCounts);
 }
 
-void D3DataProcessor::ProcessConfigurationReport(MessageHeader *pMessageHeader)
+// Called on the process thread for every spectrum received. The interval drops straight to the minimum as soon as the
+// rate reaches fastCountRate but only backs off (doubling) once the rate has stayed below slowCountRate for slowSpectrumCount spectra
+void D3DataProcessor::UpdatePollInterval(uint64_t counts, uint32_t realTimeMs)
 {
-	// A configuration report response has been received. If we are still waiting
-	// for the response then store the data and notify the original calling thread
-	Lock lock(_criticalSection);
-	if (_configurationQueryState != CQS_WAITING)
-	{
-		// We are not waiting for a response (probably timed out). Just ignore this report
+	kmk::Lock lock(_criticalSection);
+
+	if (!_pollSettings.adaptive || realTimeMs == 0)
 		return;
+
+	float countRate = (counts * 1000.0f) / realTimeMs;
+
+	if (_alarmActive || countRate >= _pollSettings.fastCountRate)
+	{
+		_pollIntervalMs = _pollSettings.minIntervalMs;
+		_quietSpectrumCount = 0;
+	}
+	else if (countRate < _pollSettings.slowCountRate)
+	{
+		if (++_quietSpectrumCount >= _pollSettings.slowSpectrumCount)
+		{
+			_pollIntervalMs = std::min(_pollIntervalMs * 2, _pollSettings.maxIntervalMs);
+			_quietSpectrumCount = 0;
+		}
 	}
+	else
+	{
+		// Between the two thresholds, hold the current interval
+		_quietSpectrumCount = 0;
+	}
+}
+
+uint32_t D3DataProcessor::GetPollInterval()
+{
+	kmk::Lock lock(_criticalSection);
+	return _pollIntervalMs;
+}
 
-	// Copy the full packet into the result buffer
-	if (_configurationQueryResultData.size() < pMessageHeader->messageSize)
-		_configurationQueryResultData.resize(pMessageHeader->messageSize);
+bool D3DataProcessor::SetSpectrumPollSettings(const SpectrumPollSettings &settings)
+{
+	if (settings.intervalMs == 0)
+		return false;
 
-    std::memcpy(&_configurationQueryResultData[0], pMessageHeader, pMessageHeader->messageSize);
-	_configurationQueryState = CQS_SUCCESS;
-	
-	// Signal the waiting thread that data is ready
-	_configurationQueryEvent.Signal();
+	if (settings.adaptive && (settings.minIntervalMs == 0 || settings.minIntervalMs > settings.maxIntervalMs || 
+		settings.slowCountRate > settings.fastCountRate))
+	{
+		return false;
+	}
+
+	{
+		kmk::Lock lock(_criticalSection);
+		_pollSettings = settings;
+		_quietSpectrumCount = 0;
+
+		// Adaptive mode starts at the fast end so the first spectra are as fresh as possible and backs off from there
+		_pollIntervalMs = settings.adaptive ? settings.minIntervalMs : settings.intervalMs;
+	}
+
+	// Wake the processing thread so the new interval is used straight away
+	WakeProcessing();
+	return true;
+}
+
+SpectrumPollSettings D3DataProcessor::GetSpectrumPollSettings()
+{
+	kmk::Lock lock(_criticalSection);
+	return _pollSettings;
+}
+
+bool D3DataProcessor::SetAlarmState(bool active)
+{
+	{
+		kmk::Lock lock(_criticalSection);
+		_alarmActive = active;
+
+		if (active && _pollSettings.adaptive)
+		{
+			_pollIntervalMs = _pollSettings.minIntervalMs;
+			_quietSpectrumCount = 0;
+		}
+	}
+
+	WakeProcessing();
+	return true;
+}
+
+void D3DataProcessor::ProcessConfigurationReport(MessageHeader *pMessageHeader)
+{
+	// A configuration report response has been received. If a request is still waiting for it then store the
+	// full packet and notify the calling thread. Otherwise it probably timed out, just ignore this report
+	ConfigurationQueryList::Key key = ConfigurationQueryList::MakeKey(pMessageHeader->contentHeader.componentID, pMessageHeader->contentHeader.reportID);
+	_configurationQueries.Complete(key, (const BYTE*)pMessageHeader, pMessageHeader->messageSize);
 }
 
 bool D3DataProcessor::GetConfigurationData(uint8_t componentId, uint16_t configurationIds, BYTE *pDataOut, size_t &dataLength)
 {
-	DSC_LOG(std::hex << "D3DataProcessor::GETCD Cmp 0x" << (int)componentId << " Cnf 0x" << (int)configurationIds << " Size 0x" << dataLength << " VID 0x" << _pDataInterface->GetVendorID() << " PID 0x" << _pDataInterface->GetProductID() << " #" << _pDataInterface->GetHash())
+	ConfigurationQuery query;
+	query.configurationId = configurationIds;
+	query.pDataOut = pDataOut;
+	query.dataLength = dataLength;
+	query.success = false;
+
+	GetConfigurationDataBatch(componentId, &query, 1);
+
+	dataLength = query.dataLength;
+	return query.success;
+}
+
+bool D3DataProcessor::GetConfigurationDataBatch(uint8_t componentId, ConfigurationQuery *pQueries, size_t numQueries)
+{
+	std::vector<ConfigurationQueryList::Key> keys(numQueries);
+	std::vector<bool> waiting(numQueries, false);
+	int64_t startTime = kmk::Time::GetTime();
+
+	// Send every request before waiting on any of them so the device can answer them back to back
+	for (size_t i = 0; i < numQueries; ++i)
+	{
+		ConfigurationQuery &query = pQueries[i];
+		query.success = false;
+
+		// Compression settings are held by the driver, the device has no report to read them back
+		if ((query.configurationId & 0xFF) == REPORT_ID_GET_COMPRESSION)
+		{
+			if (query.dataLength >= sizeof(D3CompressionStatus))
+			{
+				GetCompressionStatus(*(D3CompressionStatus*)query.pDataOut);
+				query.dataLength = sizeof(D3CompressionStatus);
+				query.success = true;
+			}
+			else
+				query.dataLength = 0;
+
+			continue;
+		}
+
+		waiting[i] = SendConfigurationQuery(componentId, query.configurationId, keys[i]);
+		if (!waiting[i])
+			query.dataLength = 0;
+	}
+
+	// All requests share the same deadline
+	int64_t deadlineMs = kmk::Time::GetTimeMs() + CONFIGURATION_QUERY_TIMEOUT;
+	bool result = true;
+	for (size_t i = 0; i < numQueries; ++i)
+	{
+		if (waiting[i])
+		{
+			pQueries[i].success = ReceiveConfigurationQuery(componentId, keys[i], deadlineMs, pQueries[i]);
+			_pDataInterface->GetMetrics().AddConfigurationQuery(startTime, pQueries[i].success);
+		}
+
+		result &= pQueries[i].success;
+	}
+
+	// Keep the processing thread alive for a while in case more queries follow
+	{
+		kmk::Lock lock(_criticalSection);
+		_configurationSessionEndTime = kmk::Time::GetTimeMs() + CONFIGURATION_SESSION_LINGER;
+	}
+
+	return result;
+}
+
+bool D3DataProcessor::SendConfigurationQuery(uint8_t componentId, uint16_t configurationIds, ConfigurationQueryList::Key &keyOut)
+{
+	DSC_LOG(std::hex << "D3DataProcessor::GETCD Cmp 0x" << (int)componentId << " Cnf 0x" << (int)configurationIds << " VID 0x" << _pDataInterface->GetVendorID() << " PID 0x" << _pDataInterface->GetProductID() << " #" << _pDataInterface->GetHash())
 
 	uint8_t configurationId = configurationIds & 0xFF;
 	uint8_t requestComponentId = componentId;
+
 	// For D3 force some commands to if board
 	if ((configurationIds & REPORT_MASK_USE_PARENT) || configurationId == REPORT_ID_GET_STATUS || configurationId == REPORT_ID_GET_DEVICE_INFO || configurationId == REPORT_ID_GET_SERIAL_NO)
 		requestComponentId = InterfaceBoardComponentId;
@@ -954,6 +1298,12 @@ bool D3DataProcessor::GetConfigurationData(uint8_t componentId, uint16_t configu
 	if (_neutronIsGamma && requestComponentId == NeutronComponentId)
 		requestComponentId = GammaComponentId;
 
+	// Register the request before sending it so the response can not arrive before we are waiting for it. If the same
+	// request is already in flight then share its response rather than sending it again
+	keyOut = ConfigurationQueryList::MakeKey(requestComponentId, configurationId);
+	if (!_configurationQueries.Add(keyOut))
+		return true;
+
 	std::vector<BYTE> requestBuffer;
 	requestBuffer.resize(sizeof(D3GetConfiguration));
 	D3GetConfiguration *pRequest = reinterpret_cast<D3GetConfiguration*>(&requestBuffer[0]);
@@ -963,98 +1313,89 @@ bool D3DataProcessor::GetConfigurationData(uint8_t componentId, uint16_t configu
 	std::vector<BYTE> preparedRequest;
 	_ptrPacketBuffer->PrepareForSend(requestBuffer, preparedRequest);
 
-	{
-		kmk::Lock lock(_criticalSection);
-
-		// Getting a configuration requires writing a report to the device and waiting for a response
-		if (_configurationQueryState != CQS_IDLE)
-			return false;
-
-		_configurationQueryEvent.Reset();
-		_configurationQueryState = CQS_WAITING;
-	}
-	
 	// Make sure the data processor is running to process the configuration response
 	StartProcessing(ConfigurationComponentId);
 
 	// Send the request
 	if (!_pDataInterface->GetConfigurationSetting(&preparedRequest[0], preparedRequest.size()))
 	{
-		{
-			kmk::Lock lock(_criticalSection);
-			_configurationQueryState = CQS_IDLE;
-		}
-
-		StopProcessing(ConfigurationComponentId, true);
+		_configurationQueries.Remove(keyOut);
 		return false;
 	}
 
+	return true;
+}
+
+bool D3DataProcessor::ReceiveConfigurationQuery(uint8_t componentId, ConfigurationQueryList::Key key, int64_t deadlineMs, ConfigurationQuery &query)
+{
+	uint8_t configurationId = query.configurationId & 0xFF;
+
 	// Wait for a response
-	bool result = _configurationQueryEvent.Wait(CONFIGURATION_QUERY_TIMEOUT);
+	std::vector<BYTE> response;
+	if (!_configurationQueries.Wait(key, deadlineMs, response))
 	{
-		DSC_LOG(std::hex << "D3DataProcessor::GETCD Wait Complete");
-		{
-			kmk::Lock lock(_criticalSection);
-			result &= _configurationQueryState == CQS_SUCCESS;
-			_configurationQueryState = CQS_IDLE;
-		}
+		query.dataLength = 0;
+		DSC_LOG(std::hex << "D3DataProcessor::GETCD Wait Timed Out")
+		return false;
+	}
 
-		// No longer waiting for configuration response, close the connection if its not being used
-		StopProcessing(ConfigurationComponentId, true);
-		
-		if (result)
-		{
-			kmk::Lock lock(_criticalSection);
+	// Grab the data out of the packet and copy into the output buffer
+	MessageHeader *pHeader = (MessageHeader*)&response[0];
 
-			// Grab the data out of the packet and copy into the output buffer
-			MessageHeader *pHeader = (MessageHeader*)&_configurationQueryResultData[0];
-			assert(pHeader->contentHeader.componentID == requestComponentId);
+	// Calculate the size of the data by removing the size of the header and crc
+	size_t sizeOfData = pHeader->messageSize - sizeof(MessageHeader) - sizeof(uint16_t);
+	if (sizeOfData > query.dataLength)
+	{
+		query.dataLength = 0; // Not enough space in the buffer!
+		return false;
+	}
 
-			// Calculate the size of the data by removing the size of the header and crc
-			size_t sizeOfData = pHeader->messageSize - sizeof(MessageHeader) - sizeof(uint16_t);
+	DSC_LOG(std::hex << "D3DataProcessor::GETCD Got " << sizeOfData << " Bytes" );
+	size_t stringLength = strnlen((char*)&response[sizeof(MessageHeader)], sizeOfData);
+	std::memcpy(query.pDataOut, &response[sizeof(MessageHeader)], sizeOfData);
+	query.dataLength = sizeOfData;
 
-			// Success, copy the result back into the buffer
-			if (sizeOfData > dataLength)
-			{
-				result = false; // Not enough space in the buffer!
-				dataLength = 0;
-			}
-			else
-			{
-				DSC_LOG(std::hex << "D3DataProcessor::GETCD Got " << dataLength << " Bytes" );
-				size_t stringLength = strlen((char*)&_configurationQueryResultData[sizeof(MessageHeader)]);
-                std::memcpy(pDataOut, &_configurationQueryResultData[sizeof(MessageHeader)], sizeOfData);
-				dataLength = sizeOfData;
-
-				if (componentId != InterfaceBoardComponentId && configurationId == REPORT_ID_GET_SERIAL_NO)
-				{
-					// Append a letter to the serial number for the component
-					switch (componentId)
-					{
-					case NeutronComponentId:
-						pDataOut[stringLength] = 'N';
-						++dataLength;
-						break;
-					case GammaComponentId:
-						pDataOut[stringLength] = 'G';
-						++dataLength;
-						break;
-
-					case DoseComponentId:
-						pDataOut[stringLength] = 'D';
-						++dataLength;
-						break;
-					}
-				}
-			}
-		}
-		else
+	if (componentId != InterfaceBoardComponentId && configurationId == REPORT_ID_GET_SERIAL_NO && stringLength < sizeOfData)
+	{
+		// Append a letter to the serial number for the component
+		switch (componentId)
 		{
-			dataLength = 0;
-			DSC_LOG(std::hex << "D3DataProcessor::GETCD Wait Timed Out")
+		case NeutronComponentId:
+			query.pDataOut[stringLength] = 'N';
+			++query.dataLength;
+			break;
+		case GammaComponentId:
+			query.pDataOut[stringLength] = 'G';
+			++query.dataLength;
+			break;
+
+		case DoseComponentId:
+			query.pDataOut[stringLength] = 'D';
+			++query.dataLength;
+			break;
 		}
 	}
-	return result;
+
+	return true;
+}
+
+bool D3DataProcessor::CheckConfigurationSessionExpired()
+{
+	{
+		kmk::Lock lock(_criticalSection);
+
+		bool configOnly = _gammaComponent.status != TS_RUNNING && _neutronComponent.status != TS_RUNNING && _doseComponent.status != TS_RUNNING;
+		if (!configOnly || _currentState != ES_RUNNING || _requiredState != RS_RUN || 
+			!_configurationQueries.IsEmpty() || kmk::Time::GetTimeMs() < _configurationSessionEndTime)
+			return false;
+
+		// Set the request under the lock so a query starting now either sees the thread finishing and restarts it, or 
+		// is seen above and keeps it running
+		_requiredState = RS_FINISH;
+	}
+
+	TransitionExecutionState();
+	return true;
 }
 
 bool D3DataProcessor::SetConfigurationData(uint8_t componentId, uint16_t configurationIds, BYTE *pDataIn, size_t dataLength)
@@ -1063,6 +1404,15 @@ bool D3DataProcessor::SetConfigurationData(uint8_t componentId, uint16_t configu
 	
 	uint8_t configurationId = configurationIds & 0xFF;
 
+	// Compression is requested by the processor at the start of every acquisition so store it rather than sending it direct
+	if (configurationId == REPORT_ID_SET_COMPRESSION)
+	{
+		if (dataLength < 3)
+			return false;
+
+		return SetCompression(pDataIn[0] != 0, pDataIn[1], pDataIn[2]);
+	}
+
 	// For D3 force some commands to if board
 	if ((configurationIds & REPORT_MASK_USE_PARENT) || configurationId == REPORT_ID_SET_DFU || configurationId == REPORT_ID_SET_SERIAL_NO || configurationId == REPORT_ID_SET_FACTORYSETUP)
 		componentId = InterfaceBoardComponentId;
@@ -1083,6 +1433,39 @@ bool D3DataProcessor::SetConfigurationData(uint8_t componentId, uint16_t configu
 	return _pDataInterface->SetConfigurationSetting(&preparedBuffer[0], preparedBuffer.size());
 }
 
+bool D3DataProcessor::SetExecutor(Executor &executor)
+{
+	return _strand.SetExecutor(executor);
+}
+
+bool D3DataProcessor::WaitForIdle(uint32_t timeoutMs)
+{
+	// The thread may have started its current pass before the data or time arrived, so wait for it to run out of data
+	// on the pass after that
+	uint64_t targetCount = _idleCount.load() + 2;
+
+	for (uint32_t waitedMs = 0; ; waitedMs += IDLE_CHECK_INTERVAL)
+	{
+		// Events are not auto reset on every platform, reset before checking so a signal from the thread is never lost
+		_idleEvent.Reset();
+		if (_idleCount.load() >= targetCount)
+			return true;
+
+		{
+			kmk::Lock lock(_criticalSection);
+			if (_currentState == ES_IDLE)
+				return true;
+		}
+
+		if (waitedMs >= timeoutMs)
+			return false;
+
+		// Wake the thread so it checks whether a spectrum request is due
+		WakeProcessing();
+		_idleEvent.Wait(IDLE_CHECK_INTERVAL);
+	}
+}
+
 void D3DataProcessor::SendSpectrumRequest()
 {
 	// Only send requests if we need them, connections serving only configuration requests need not apply
@@ -1143,8 +1526,53 @@ void D3DataProcessor::SendSpectrumRequest()
 	}
 }
 
-void D3DataProcessor::EnableCompression(bool enabled)
+bool D3DataProcessor::SetCompression(bool enabled, uint8_t windowSize, uint8_t lookAheadSize)
+{
+	// Validate the settings against what the decoder supports
+	if (windowSize < HEATSHRINK_MIN_WINDOW_BITS || windowSize > HEATSHRINK_MAX_WINDOW_BITS ||
+		lookAheadSize < HEATSHRINK_MIN_LOOKAHEAD_BITS || lookAheadSize >= windowSize)
+	{
+		return false;
+	}
+
+	bool isRunning = false;
+	{
+		kmk::Lock lock(_criticalSection);
+		_compressionEnabled = enabled;
+		_compressionWindowSize = windowSize;
+		_compressionLookAheadSize = lookAheadSize;
+		isRunning = _currentState == ES_RUNNING;
+	}
+
+	if (isRunning)
+		SendCompressionRequest();
+
+	return true;
+}
+
+void D3DataProcessor::GetCompressionStatus(D3CompressionStatus &statusOut)
+{
+	kmk::Lock lock(_criticalSection);
+	statusOut.m_enabled = _compressionEnabled ? 1 : 0;
+	statusOut.m_windowSize = _compressionWindowSize;
+	statusOut.m_lookAheadSize = _compressionLookAheadSize;
+	statusOut.m_reserved = 0;
+	statusOut.m_compressedPackets = _compressedPackets;
+	statusOut.m_wireBytes = _wireBytes;
+	statusOut.m_decodedBytes = _decodedBytes;
+}
+
+void D3DataProcessor::SendCompressionRequest()
 {
+	bool enabled;
+	uint8_t windowSize, lookAheadSize;
+	{
+		kmk::Lock lock(_criticalSection);
+		enabled = _compressionEnabled;
+		windowSize = _compressionWindowSize;
+		lookAheadSize = _compressionLookAheadSize;
+	}
+
 	std::vector<BYTE> requestBuffer;
 	requestBuffer.resize(sizeof(D3CompressionRequest));
 	D3CompressionRequest* pRequest = (D3CompressionRequest*)&requestBuffer[0];
@@ -1153,8 +1581,8 @@ void D3DataProcessor::EnableCompression(bool enabled)
 	pRequest->m_message.contentHeader.componentID = InterfaceBoardComponentId;
 	pRequest->m_message.contentHeader.reportID = REPORT_ID_SET_COMPRESSION;
 	pRequest->m_direction = 0;
-	pRequest->m_lookAheadSize = D3CompressionRequest::HS_LOOKAHEAD_SIZE_DEFAULT;
-	pRequest->m_windowSize = D3CompressionRequest::HS_WINDOW_SIZE_DEFAULT;
+	pRequest->m_lookAheadSize = lookAheadSize;
+	pRequest->m_windowSize = windowSize;
 	pRequest->m_enabled = enabled ? 1 : 0;
 
 	std::vector<BYTE> preparedBuffer;
@@ -1162,78 +1590,97 @@ void D3DataProcessor::EnableCompression(bool enabled)
 	_pDataInterface->SetConfigurationSetting(&preparedBuffer[0], preparedBuffer.size());
 }
 
-int D3DataProcessor::ProcessThreadProc(void *pArg)
+D3DataProcessor::ProcessResult D3DataProcessor::ProcessNext(uint32_t &waitTimeOut)
 {
-	DSC_TRACE(L"D3DataProcessor::ProcessThreadProc");
+	ProcessResult result = PR_CONTINUE;
 
-	D3DataProcessor *pThis = (D3DataProcessor*)pArg;
-	std::vector<BYTE> tempBuffer;
-	tempBuffer.resize(MAX_REPORT_SIZE);
-	size_t tempReportSize = 0;
-	int64_t nextQueryTime = kmk::Time::GetTimeMs() + QUERY_SPECTRUM_RATE;
+	// Apply the compression settings for this device
+	if (_newSession)
+	{
+		_newSession = false;
+		SendCompressionRequest();
+	}
 
-	bool forcedStop = true;
+	// Are we ready to query for a new spectrum? The interval can change with every spectrum received so recalculate it 
+	// each time round
+	if (kmk::Time::GetTimeMs() >= _lastQueryTime + GetPollInterval())
+	{
+		SendSpectrumRequest();
 
-        // Disable Compression
-        pThis->EnableCompression(false);
+		_lastSpectrumRequestTime = _lastQueryTime = kmk::Time::GetTimeMs();
+	}
 
-	ExecutionState keepRunning = ES_RUNNING;
-	do
+	// If something is in the queue then process it, otherwise wait for data		
+	size_t reportSize = 0;
+	if (GetNextReport(_reportBuffer, reportSize))
+	{
+		// The packet streamer does not keep track of which read completed a packet, so a sampled read is traced through the
+		// first packet processed after it
+		int64_t sampledTime = _sampledReceivedTime.exchange(0, std::memory_order_relaxed);
+		kmk::LatencyTraceScope trace(sampledTime != 0 ? &_pDataInterface->GetLatencyTracer() : NULL, sampledTime);
+		trace.Mark(LS_DEQUEUED);
+
+		// Process
+        ProcessReport(&_reportBuffer[0]);
+	}
+	else
 	{
-		// Are we ready to query for a new spectrum?
-		if (kmk::Time::GetTimeMs() >= nextQueryTime)
+		// No more data, check if we have been asked to finish once all data is processed
 		{
-			pThis->SendSpectrumRequest();
+			kmk::Lock lock(_criticalSection);
+			if (_currentState == ES_FINISHING)
+			{
+				// Mark as finished and leave the loop
+				_forcedStop = false;
+				return PR_EXIT;
+			}
 
-			pThis->_lastSpectrumRequestTime = kmk::Time::GetTimeMs();
-			nextQueryTime = pThis->_lastSpectrumRequestTime + QUERY_SPECTRUM_RATE;
+			_waitEvent.Reset();
 		}
 
-		// If something is in the queue then process it, otherwise wait for data		
-		if (pThis->GetNextReport(tempBuffer, tempReportSize))
+		_idleCount.fetch_add(1);
+		_idleEvent.Signal();
+		
+		// Wait for event signalling new data or the time to query the next spectrum data. Virtual time only moves on
+		// between calls to WaitForIdle, which wakes the thread, so do not wake up part way through a step
+        waitTimeOut = (uint32_t)std::max<int64_t>(_lastQueryTime + GetPollInterval() - kmk::Time::GetTimeMs(), 1);
+		if (VirtualClock::GetEnabled() != NULL)
+			waitTimeOut = INFINITE;
+
+		result = PR_WAIT;
+	}
+
+	{
+		kmk::Lock lock(_errorSection);
+
+		// Process any errors
+		for (ErrorList::iterator it = _pendingErrors.begin(); it != _pendingErrors.end(); ++it)
 		{
-			// Process
-            pThis->ProcessReport(&tempBuffer[0]);
+			ExecuteError(it->errorCode, it->message);
 		}
-		else
-		{
-			// No more data, check if we have been asked to finish once all data is processed
-			{
-				kmk::Lock lock(pThis->_criticalSection);
-				if (pThis->_currentState == ES_FINISHING)
-				{
-					// Mark as finished and break from the loop
-					forcedStop = false;
-					break;
-				}
 
-				pThis->_waitEvent.Reset();
-			}
-			
-			// Wait for event signalling new data or the time to query the next spectrum data
-            uint32_t waitTime = (uint32_t)std::max<int64_t>(nextQueryTime - kmk::Time::GetTimeMs(), 1);
-			pThis->_waitEvent.Wait(waitTime);
-		}
+		_pendingErrors.clear();
+	}
 
-		{
-			kmk::Lock lock(pThis->_errorSection);
+	// Finish once the thread is no longer needed for configuration queries
+	CheckConfigurationSessionExpired();
 
-			// Process any errors
-			for (ErrorList::iterator it = pThis->_pendingErrors.begin(); it != pThis->_pendingErrors.end(); ++it)
-			{
-				pThis->ExecuteError(it->errorCode, it->message);
-			}
+	// Check thread continue status
+	ExecutionState state;
+	{
+		kmk::Lock lock(_criticalSection);
+		state = _currentState;
+	}
 
-			pThis->_pendingErrors.clear();
-		}
+	if (state != ES_RUNNING && state != ES_FINISHING)
+		return PR_EXIT;
 
-		// Check thread continue status
-		{
-			kmk::Lock lock(pThis->_criticalSection);
-			keepRunning = pThis->_currentState;
-		}
-	} while (keepRunning == ES_RUNNING || keepRunning == ES_FINISHING);
+	// Asked to finish, go straight on to finishing off the data
+	return (state == ES_FINISHING) ? PR_CONTINUE : result;
+}
 
+void D3DataProcessor::FinishProcessing()
+{
 	{
 		// Raise finished callback (if not already raised)
 		FinishedProcessingCallbackFunc gammaCallback = NULL;
@@ -1244,48 +1691,119 @@ int D3DataProcessor::ProcessThreadProc(void *pArg)
 		void *pDoseArg = NULL;
 
 		{
-			kmk::Lock lock(pThis->_eventSection);
-			if (pThis->_gammaComponent.finishedCallback != NULL && pThis->_gammaComponent.status != TS_STOP)
+			kmk::Lock lock(_eventSection);
+			if (_gammaComponent.finishedCallback != NULL && _gammaComponent.status != TS_STOP)
 			{
-				pThis->_gammaComponent.status = TS_STOP;
-				gammaCallback = pThis->_gammaComponent.finishedCallback;
-				pGammaArg = pThis->_gammaComponent.finishedCallbackArg;
+				_gammaComponent.status = TS_STOP;
+				gammaCallback = _gammaComponent.finishedCallback;
+				pGammaArg = _gammaComponent.finishedCallbackArg;
 			}
 
-			if (pThis->_neutronComponent.finishedCallback != NULL && pThis->_neutronComponent.status != TS_STOP)
+			if (_neutronComponent.finishedCallback != NULL && _neutronComponent.status != TS_STOP)
 			{
-				pThis->_neutronComponent.status = TS_STOP;
-				neutronCallback = pThis->_neutronComponent.finishedCallback;
-				pNeutronArg = pThis->_neutronComponent.finishedCallbackArg;
+				_neutronComponent.status = TS_STOP;
+				neutronCallback = _neutronComponent.finishedCallback;
+				pNeutronArg = _neutronComponent.finishedCallbackArg;
 			}
 
-			if (pThis->_doseComponent.finishedCallback != NULL && pThis->_doseComponent.status != TS_STOP)
+			if (_doseComponent.finishedCallback != NULL && _doseComponent.status != TS_STOP)
 			{
-				pThis->_doseComponent.status = TS_STOP;
-				doseCallback = pThis->_doseComponent.finishedCallback;
-				pDoseArg = pThis->_doseComponent.finishedCallbackArg;
+				_doseComponent.status = TS_STOP;
+				doseCallback = _doseComponent.finishedCallback;
+				pDoseArg = _doseComponent.finishedCallbackArg;
 			}
 		}
 
 		if (gammaCallback != NULL)
-			(*gammaCallback)(pGammaArg, forcedStop);
+			(*gammaCallback)(pGammaArg, _forcedStop);
 
 		if (neutronCallback != NULL)
-			(*neutronCallback)(pNeutronArg, forcedStop);
+			(*neutronCallback)(pNeutronArg, _forcedStop);
 
 		if (doseCallback != NULL)
-			(*doseCallback)(pDoseArg, forcedStop);
+			(*doseCallback)(pDoseArg, _forcedStop);
 	}
 	
-	pThis->SetExecutionState(ES_IDLE);
+	SetExecutionState(ES_IDLE);
+}
+
+int D3DataProcessor::ProcessThreadProc(void *pArg)
+{
+	DSC_TRACE(L"D3DataProcessor::ProcessThreadProc");
+
+	D3DataProcessor *pThis = (D3DataProcessor*)pArg;
+	uint32_t waitTime = INFINITE;
+
+	ProcessResult result;
+	while ((result = pThis->ProcessNext(waitTime)) != PR_EXIT)
+	{
+		if (result == PR_WAIT)
+			pThis->_waitEvent.Wait(waitTime);
+	}
 
+	pThis->FinishProcessing();
 	return 0;
 }
 
+// Stands in for the processing thread on the shared executor. Each turn works through the data received, a limited 
+// number of reports at a time so other devices get a turn, and leaves the next turn to be posted by new data or the
+// time of the next spectrum request
+void D3DataProcessor::ProcessStrandProc(void *pArg)
+{
+	D3DataProcessor *pThis = (D3DataProcessor*)pArg;
+	uint32_t waitTime = INFINITE;
+
+	for (int i = 0; i < REPORTS_PER_TURN; ++i)
+	{
+		switch (pThis->ProcessNext(waitTime))
+		{
+		case PR_CONTINUE:
+			break;
+
+		case PR_WAIT:
+			if (waitTime != INFINITE)
+				pThis->_strand.PostAfter(waitTime);
+			return;
+
+		case PR_EXIT:
+			// Let go of the executor first, the finished callbacks may start processing again
+			pThis->_strand.Detach();
+			pThis->FinishProcessing();
+			return;
+		}
+	}
+
+	pThis->_strand.Post();
+}
+
+void D3DataProcessor::WakeProcessing()
+{
+	_waitEvent.Signal();
+	_strand.Post();
+}
+
+void D3DataProcessor::WaitForProcessingThread()
+{
+	if (_onExecutor)
+		_strand.WaitForDetach();
+	else
+		_thread.WaitForTermination();
+}
+
 // Callback raised everytime data is received from the data interface.
 void D3DataProcessor::ReadDataCallbackProc(void *pArg, unsigned char *pData, size_t dataSize)
 {
 	D3DataProcessor *pThis = (D3DataProcessor*)pArg;
+	int64_t receivedTime = kmk::Time::GetTime();
+	pThis->_lastReceivedTime.store(receivedTime, std::memory_order_relaxed);
+	pThis->_pDataInterface->GetMetrics().Add(METRIC_BYTES_READ, dataSize);
+
+	// Sampling is decided once here. The time is handed to the processing thread before the data so it is never traced
+	// through a packet from an earlier read
+	kmk::LatencyTracer &tracer = pThis->_pDataInterface->GetLatencyTracer();
+	bool traced = tracer.ShouldSample();
+	if (traced)
+		pThis->_sampledReceivedTime.store(receivedTime, std::memory_order_relaxed);
 
 	// Pass data onto the data processor
 	if (!pThis->_ptrPacketBuffer->AddIncomingData(pData, dataSize))
@@ -1293,7 +1811,31 @@ void D3DataProcessor::ReadDataCallbackProc(void *pArg, unsigned char *pData, siz
 		pThis->RaiseError(ERROR_INTERNAL_DEVICE, L"Failed to add data to buffer. Buffer is probably full");
 	}
 
-	pThis->_waitEvent.Signal();
+	if (traced)
+		tracer.Record(LS_ENQUEUED, receivedTime);
+
+	pThis->WakeProcessing();
+}
+
+void D3DataProcessor::PacketsReadyCallbackProc(void *pArg)
+{
+	D3DataProcessor *pThis = (D3DataProcessor*)pArg;
+	pThis->WakeProcessing();
+}
+
+// Fill in the packet streamer metrics when a snapshot of the interface metrics is taken
+void D3DataProcessor::CollectMetricsProc(void *pArg, MetricsSnapshot &snapshotInOut)
+{
+	D3DataProcessor *pThis = (D3DataProcessor*)pArg;
+
+	PacketStreamerStats stats;
+	pThis->_ptrPacketBuffer->GetStats(stats);
+
+	snapshotInOut.values[METRIC_QUEUE_DEPTH] = stats.packetsQueued;
+	snapshotInOut.values[METRIC_QUEUE_HIGH_WATER] = stats.queueHighWater;
+	snapshotInOut.values[METRIC_DROPPED_QUEUE] = stats.packetsDropped;
+	snapshotInOut.values[METRIC_DROPPED_STREAM] = stats.resyncEvents;
+	snapshotInOut.values[METRIC_CRC_FAILURES] = stats.crcFailures;
 }
 
 void D3DataProcessor::DataInterfaceErrorCallbackProc(void *pArg, int errorCode, String message)
@@ -3,6 +3,7 @@
 #include "Lock.h"
 #include <vector>
 #include "kmkTime.h"
+#include "DeviceInfoCache.h"
 
 #include "SIGMA_50.h"
 #include "SIGMA_25.h"
@@ -17,6 +18,8 @@ namespace kmk
 DeviceBase::DeviceBase(IDataInterface *pInterface, IDataProcessor *pDataProcessor, uint8_t componentId /*= 0*/)
 : _pInterface(pInterface)
 , _pDataProcessor(pDataProcessor)
+, _eventCS("DeviceBase::_eventCS")
+, _dataCS("DeviceBase::_dataCS")
 , _isAcquiring(false)
 , _componentId(componentId)
 , _deviceSerialCached(false)
@@ -24,6 +27,8 @@ DeviceBase::DeviceBase(IDataInterface *pInterface, IDataProcessor *pDataProcesso
 , _deviceVersion(0)
 , _countEventCallback(NULL)
 , _countEventCallbackArg(NULL)
+, _spectrumEventCallback(NULL)
+, _spectrumEventCallbackArg(NULL)
 , _doseEventCallback(NULL)
 , _doseEventCallbackArg(NULL)
 , _finishedAcquisitionCallbackFunc(NULL)
@@ -46,6 +51,7 @@ DeviceBase::DeviceBase(IDataInterface *pInterface, IDataProcessor *pDataProcesso
 			DoseEventCallbackProc, this,
 			FinishedProcessingCallbackProc, this,
 			ErrorCallbackProc, this);
+		_pDataProcessor->SetSpectrumEventCallback(_componentId, SpectrumEventCallbackProc, this);
 	}
 }
 
@@ -62,46 +68,124 @@ unsigned int DeviceBase::GetHash() const
 	return _hash;
 }
 
-String DeviceBase::GetSerialNumber()
+bool DeviceBase::ReadDeviceInformation(bool refresh)
 {
-	if (!_deviceSerialCached)
+	// 25 unicode chars
+	BYTE serialBuffer[DEVICE_SERIAL_LENGTH];
+	unsigned short versionBuffer = 0;
+
+	ConfigurationQuery queries[2];
+	size_t numQueries = 0;
+	ConfigurationQuery *pSerialQuery = NULL;
+	ConfigurationQuery *pVersionQuery = NULL;
+
+	if (refresh || !_deviceSerialCached)
+	{
+		pSerialQuery = &queries[numQueries++];
+		pSerialQuery->configurationId = CONFIGURATION_GETSERIAL;
+		pSerialQuery->pDataOut = serialBuffer;
+		pSerialQuery->dataLength = DEVICE_SERIAL_LENGTH;
+	}
+
+	if (refresh || !_deviceVersionCached)
+	{
+		pVersionQuery = &queries[numQueries++];
+		pVersionQuery->configurationId = CONFIGURATION_GETVERSION;
+		pVersionQuery->pDataOut = (BYTE*)&versionBuffer;
+		pVersionQuery->dataLength = sizeof(unsigned short);
+	}
+
+	if (numQueries == 0)
+		return true;
+
+	bool success = _pDataProcessor->GetConfigurationDataBatch(_componentId, queries, numQueries);
+
+	DeviceInfoCache::DeviceInfo info;
 	{
-		// 25 unicode chars
-		size_t bufferSize = DEVICE_SERIAL_LENGTH;
-		BYTE buffer[DEVICE_SERIAL_LENGTH];
-		if (_pDataProcessor->GetConfigurationData(_componentId, CONFIGURATION_GETSERIAL, buffer, bufferSize))
+		Lock lock(_dataCS);
+
+		if (pSerialQuery != NULL && pSerialQuery->success)
 		{
+			size_t bufferSize = pSerialQuery->dataLength;
+
 			// Convert mbs to wcs
 			wchar_t str[DEVICE_SERIAL_LENGTH / sizeof(wchar_t)];
 #if _WINDOWS
 			size_t numCharsToConvert = DEVICE_SERIAL_LENGTH / sizeof(wchar_t);
-			mbstowcs_s(&numCharsToConvert, str, (const char*)buffer, (bufferSize / sizeof(wchar_t))-1);
+			mbstowcs_s(&numCharsToConvert, str, (const char*)serialBuffer, (bufferSize / sizeof(wchar_t))-1);
 #else
-            mbstowcs(str, (const char*)buffer, bufferSize / sizeof(wchar_t));
+			mbstowcs(str, (const char*)serialBuffer, bufferSize / sizeof(wchar_t));
 #endif
 			_deviceSerial = str;
 			_deviceSerialCached = true;
 		}
+
+		if (pVersionQuery != NULL && pVersionQuery->success)
+		{
+			_deviceVersion = versionBuffer;
+			_deviceVersionCached = true;
+		}
+
+		info.serial = _deviceSerial;
+		info.version = _deviceVersion;
 	}
+
+	// Outside the lock, it is also taken on the data path
+	if (success)
+	{
+		DeviceInfoCache::GetInstance().Store(_hash, GetVendorID(), GetProductID(), GetInterfaceProperty(IFPROP_SERIAL), info);
+	}
+
+	return success;
+}
+
+String DeviceBase::GetSerialNumber()
+{
+	{
+		Lock lock(_dataCS);
+		if (_deviceSerialCached)
+			return _deviceSerial;
+	}
+
+	ReadDeviceInformation(false);
+
+	Lock lock(_dataCS);
 	return _deviceSerial;
 }
 
 unsigned short DeviceBase::GetVersion()
 {
-	if (!_deviceVersionCached)
 	{
-		// 25 unicode chars
-		size_t bufferSize = sizeof(unsigned short);
-		unsigned short buffer = 0;
-		if (_pDataProcessor->GetConfigurationData(_componentId, CONFIGURATION_GETVERSION, (BYTE*)&buffer, bufferSize))
-		{
-			_deviceVersion = buffer;
-			_deviceVersionCached = true;
-		}
+		Lock lock(_dataCS);
+		if (_deviceVersionCached)
+			return _deviceVersion;
 	}
+
+	ReadDeviceInformation(false);
+
+	Lock lock(_dataCS);
 	return _deviceVersion;
 }
 
+bool DeviceBase::LoadCachedInformation()
+{
+	DeviceInfoCache::DeviceInfo info;
+	if (!DeviceInfoCache::GetInstance().Lookup(_hash, GetVendorID(), GetProductID(), GetInterfaceProperty(IFPROP_SERIAL), info))
+		return false;
+
+	Lock lock(_dataCS);
+	_deviceSerial = info.serial;
+	_deviceSerialCached = true;
+	_deviceVersion = info.version;
+	_deviceVersionCached = true;
+	return true;
+}
+
+bool DeviceBase::RefreshInformation()
+{
+	return ReadDeviceInformation(true);
+}
+
 String DeviceBase::GetInterfaceProperty(const String& param)
 {
 	return _pInterface ? _pInterface->GetInterfaceProperty(param) : L"";
@@ -115,6 +199,13 @@ void DeviceBase::SetCountEventCallback(CountEventDeviceCallbackFunc func, void *
 }
 
 
+void DeviceBase::SetSpectrumEventCallback(SpectrumEventDeviceCallbackFunc func, void *pArg)
+{
+	Lock lock (_eventCS);
+	_spectrumEventCallback = func;
+	_spectrumEventCallbackArg = pArg;
+}
+
 void DeviceBase::SetDoseEventCallback(DoseEventDeviceCallbackFunc func, void *pArg)
 {
 	Lock lock(_eventCS);
@@ -199,6 +290,26 @@ void DeviceBase::SetStartTime(int64_t value)
 	_pDataProcessor->SetStartTime(_componentId, value);
 }
 
+bool DeviceBase::WaitForProcessing(uint32_t timeoutMs)
+{
+	return _pDataProcessor->WaitForIdle(timeoutMs);
+}
+
+bool DeviceBase::SetExecutor(Executor &executor)
+{
+	return _pDataProcessor->SetExecutor(executor);
+}
+
+bool DeviceBase::SetSpectrumPollSettings(const SpectrumPollSettings &settings)
+{
+	return _pDataProcessor->SetSpectrumPollSettings(settings);
+}
+
+bool DeviceBase::SetAlarmState(bool active)
+{
+	return _pDataProcessor->SetAlarmState(active);
+}
+
 // Return the temperature last reported from the device.
 float DeviceBase::GetTemperature() const
 {
@@ -218,6 +329,27 @@ void DeviceBase::CountEventCallbackProc(void *pArg, int64_t timestamp, int chann
 	}
 }
 
+// Callback raised from the data processor once per spectrum. If nobody wants the whole spectrum then fall back
+// to a count event per channel
+void DeviceBase::SpectrumEventCallbackProc(void *pArg, int64_t timestamp, const uint16_t *pCounts, int numChannels)
+{
+	DeviceBase *pThis = (DeviceBase*)pArg;
+	Lock lock (pThis->_eventCS);
+
+	if (pThis->_spectrumEventCallback != NULL)
+	{
+		(*pThis->_spectrumEventCallback)(pThis, timestamp, pCounts, numChannels, pThis->_spectrumEventCallbackArg);
+	}
+	else if (pThis->_countEventCallback != NULL)
+	{
+		for (int i = 0; i < numChannels; ++i)
+		{
+			if (pCounts[i] > 0)
+				(*pThis->_countEventCallback)(pThis, timestamp, i, pCounts[i], pThis->_countEventCallbackArg);
+		}
+	}
+}
+
 void DeviceBase::DoseEventCallbackProc(void *pArg, int64_t timestamp, float dose, float doseRate, float accumulatedDose)
 {
 	// Pass on to the registered callback
@@ -347,6 +479,11 @@ bool DeviceBase::GetConfigurationData(ConfigurationID command, BYTE* buffer, int
 	return _pDataProcessor->GetConfigurationData(_componentId, command, buffer, length = len);
 }
 
+bool DeviceBase::GetConfigurationDataBatch(ConfigurationQuery *pQueries, size_t numQueries)
+{
+	return _pDataProcessor->GetConfigurationDataBatch(_componentId, pQueries, numQueries);
+}
+
 bool DeviceBase::GetConfigurationSettingUInt8(ConfigurationID command, uint8_t &valOut)
 {
 	// Send the command
@@ -1,164 +1,267 @@
 #include "stdafx.h"
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include <libudev.h>
 #include "DeviceEnumeratorLinux.h"
 #include "USBKromekDataInterfaceLinux.h"
+#include "USBSerialDataInterfaceLinux.h"
 #include "Lock.h"
 
+// Time in ms to wait for the rest of a burst of udev events (a device raises several as its interfaces are bound) before
+// reporting the changes they make
+#define DEBOUNCE_TIME 5
+
+// Longest time in ms a continuous burst of events can hold back reporting
+#define MAX_DEBOUNCE_TIME 100
+
 namespace kmk
 {
+    static int64_t GetMonotonicTimeMs()
+    {
+        // Not kmk::Time, which may be running on a virtual clock
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+
+    static uint32_t DeviceKey(VID vendorId, PID productId)
+    {
+        return ((uint32_t)vendorId << 16) | productId;
+    }
+
+    static bool IsSerialPort(udev_device *pDevice)
+    {
+        const char *pSubsystem = udev_device_get_subsystem(pDevice);
+        return pSubsystem != NULL && strcmp(pSubsystem, "tty") == 0;
+    }
+
+    // Device nodes a supported device may be on, the nodes created by the kromek driver i.e '/dev/kromek0' and serial ports
+    // i.e '/dev/ttyACM0'. Which serial ports are supported depends on the usb device they are on
+    static bool IsDeviceNode(udev_device *pDevice)
+    {
+        const char *pSysfsPath = udev_device_get_syspath(pDevice);
+        if (udev_device_get_devnode(pDevice) == NULL || pSysfsPath == NULL)
+            return false;
+
+        return strstr(pSysfsPath, "kromek") != NULL || IsSerialPort(pDevice);
+    }
+
     DeviceEnumerator::DeviceEnumerator()
-        : _devicesChangedCallbackFunc(NULL)
-        , _devicesChangedCallbackArg(NULL)
-        , _finishThreadEvent(false, false, L"")
+        : _interfaceAttachedCallbackFunc(NULL)
+        , _interfaceRemovedCallbackFunc(NULL)
+        , _callbackArg(NULL)
+        , _shutdownFd(-1)
+        , _pUdev(NULL)
+        , _pMonitor(NULL)
     {
-        
+
     }
-    
+
     DeviceEnumerator::~DeviceEnumerator()
     {
-        
+        ReleaseUdev();
     }
-    
-    void DeviceEnumerator::EnumerateUSBHIDDevices(const ValidDeviceIdentifier &deviceIdentifier, std::vector<IDataInterface*> &listOut)
+
+    IDataInterface *DeviceEnumerator::CreateInterface(udev_device *pDevice)
     {
-        struct udev *udev;
-        struct udev_enumerate *enumerate;
-        struct udev_list_entry *devices, *dev_list_entry;
-        
-        // Create the udev object
-        udev = udev_new();
-        if (!udev) 
+        if (!IsDeviceNode(pDevice))
+            return NULL;
+
+        // The product and vendor id are on the usb device, which might mean walking up the parent nodes to find it. A
+        // serial port not on a usb device (i.e. '/dev/ttyS0') has none. Parents are owned by the child so need no unref
+        unsigned short vendorId = 0;
+        unsigned short productId = 0;
+        const char *pSerial = NULL;
+        bool found = false;
+        for (udev_device *pUsbDevice = pDevice; pUsbDevice != NULL;
+            pUsbDevice = udev_device_get_parent_with_subsystem_devtype(pUsbDevice, "usb", NULL))
         {
-            return;
+            const char *pVendor = udev_device_get_sysattr_value(pUsbDevice, "idVendor");
+            const char *pProduct = udev_device_get_sysattr_value(pUsbDevice, "idProduct");
+            if (pVendor != NULL && pProduct != NULL)
+            {
+                // Stop at the first device with ids whether or not they can be read
+                found = sscanf(pVendor, "%hx", &vendorId) == 1 && sscanf(pProduct, "%hx", &productId) == 1;
+                pSerial = udev_device_get_sysattr_value(pUsbDevice, "serial");
+                break;
+            }
         }
-    
+
+        if (!found || _supportedDevices.find(DeviceKey(vendorId, productId)) == _supportedDevices.end())
+            return NULL;
+
+        // The firmware version (bcdDevice) is not decoded, the devices report it over the data interface
+        const char *pDevicePath = udev_device_get_devnode(pDevice);
+        IDataInterface *pInterface;
+        if (IsSerialPort(pDevice))
+            pInterface = new USBSerialDataInterface(pDevicePath, productId, vendorId, pSerial);
+        else
+            pInterface = new USBKromekDataInterface(pDevicePath, productId, vendorId, (pSerial != NULL) ? pSerial : "", 0);
+
+        if (!pInterface->Initialize())
+        {
+            delete pInterface;
+            return NULL;
+        }
+
+        return pInterface;
+    }
+
+    void DeviceEnumerator::ScanDevices()
+    {
         // Find all usb devices
-        enumerate = udev_enumerate_new(udev);
-        udev_enumerate_add_match_subsystem(enumerate, "usb");
-        udev_enumerate_add_match_subsystem(enumerate, "usbmisc");
-        udev_enumerate_scan_devices(enumerate);
-        devices = udev_enumerate_get_list_entry(enumerate);
-        
-        // For each item, see if it matches the vid/pid, and if so
-        // create a udev_device record for it 
-        udev_list_entry_foreach(dev_list_entry, devices) 
+        udev_enumerate *pEnumerate = udev_enumerate_new(_pUdev);
+        if (pEnumerate == NULL)
+            return;
+
+        udev_enumerate_add_match_subsystem(pEnumerate, "usb");
+        udev_enumerate_add_match_subsystem(pEnumerate, "usbmisc");
+        udev_enumerate_add_match_subsystem(pEnumerate, "tty");
+        udev_enumerate_scan_devices(pEnumerate);
+
+        udev_list_entry *pEntry;
+        udev_list_entry_foreach(pEntry, udev_enumerate_get_list_entry(pEnumerate))
         {
-            const char *sysfs_path;
-            const char *dev_path;
-            struct udev_device *current_dev; // The device's hidraw udev node.
-            struct udev_device *usb_dev; // The device's USB udev node.
-    
-            unsigned short dev_vid;
-            unsigned short dev_pid;
-            std::string deviceSerial;
-            unsigned short firmware_version = 0;
-
-            // Get the system path and then the device path i.e '/dev/kromek0' 
-            sysfs_path = udev_list_entry_get_name(dev_list_entry);
-            current_dev = udev_device_new_from_syspath(udev, sysfs_path);
-            dev_path = udev_device_get_devnode(current_dev);
-    
-            if (!dev_path || strstr(sysfs_path, "kromek") == NULL)
-            {
-                // No dev node associated so ignore
-                udev_device_unref(current_dev);
+            udev_device *pDevice = udev_device_new_from_syspath(_pUdev, udev_list_entry_get_name(pEntry));
+            if (pDevice == NULL)
                 continue;
-            }
-    
-            // Try to get the product and vendor id. This might mean walking up the parent nodes to find it
-            usb_dev = current_dev;
-            udev_device_ref(usb_dev);
-            while (usb_dev)
+
+            IDataInterface *pInterface = CreateInterface(pDevice);
+            if (pInterface != NULL && _interfaceAttachedCallbackFunc != NULL)
+                (*_interfaceAttachedCallbackFunc)(_callbackArg, pInterface);
+            else
+                delete pInterface;
+
+            udev_device_unref(pDevice);
+        }
+
+        udev_enumerate_unref(pEnumerate);
+    }
+
+    void DeviceEnumerator::QueueDeviceEvent(udev_device *pDevice, PendingChanges &changes)
+    {
+        // Only the device nodes. On removal sysfs has already gone, but the event still carries the node. Any serial port
+        // removed is reported, the receiver ignores those it has no interface for
+        const char *pAction = udev_device_get_action(pDevice);
+        const char *pDevicePath = udev_device_get_devnode(pDevice);
+        if (pAction == NULL || !IsDeviceNode(pDevice))
+            return;
+
+        bool added = strcmp(pAction, "add") == 0;
+        if (!added && strcmp(pAction, "remove") != 0)
+            return;
+
+        PendingChanges::iterator it = changes.begin();
+        while (it != changes.end() && it->devicePath != pDevicePath)
+            ++it;
+
+        if (it == changes.end())
+        {
+            PendingChange change;
+            change.devicePath = pDevicePath;
+            change.removed = false;
+            change.pAdded = NULL;
+            it = changes.insert(changes.end(), change);
+        }
+
+        if (it->pAdded != NULL)
+        {
+            udev_device_unref(it->pAdded);
+            it->pAdded = NULL;
+        }
+
+        if (added)
+            it->pAdded = udev_device_ref(pDevice);
+        else
+            it->removed = true;
+    }
+
+    void DeviceEnumerator::ReportChanges(PendingChanges &changes)
+    {
+        for (PendingChanges::iterator it = changes.begin(); it != changes.end(); ++it)
+        {
+            if (it->removed && _interfaceRemovedCallbackFunc != NULL)
+                (*_interfaceRemovedCallbackFunc)(_callbackArg, USBKromekDataInterface::HashDevicePath(it->devicePath.c_str()));
+
+            if (it->pAdded != NULL)
             {
-                struct udev_device *next_device = NULL;
-                
-                // Grab the properties from the device
-                const char *pVendor = udev_device_get_sysattr_value(usb_dev, "idVendor");
-                const char *pProduct = udev_device_get_sysattr_value(usb_dev, "idProduct");
-                const char *pSerial = udev_device_get_sysattr_value(usb_dev, "serial");
-
-                if (pVendor != NULL && pProduct != NULL) 
-                {
-                    // Found it!
-                    int retVendor = sscanf(pVendor, "%hx", &dev_vid);
-                    int retProduct = sscanf(pProduct, "%hx", &dev_pid);
-                    if (retVendor != 1 || retProduct != 1) 
-                    {
-                        usb_dev = NULL;
-                    }
-
-                    if (pSerial)
-                    {
-                        deviceSerial = pSerial ? pSerial : "";
-                    }
-
-                    
-                    break;
-                }
-                
-                // Attempt to extract the firmware version
-                const char *firmware_number_utf8 = udev_device_get_sysattr_value(usb_dev, "bcdDevice");
-                if (firmware_number_utf8 != NULL)
-                {
-                    // TODO: Extract the value correctly
-                    //firmware_version = sscanf(firmware_number_utf8, "%d");
-                }
+                IDataInterface *pInterface = CreateInterface(it->pAdded);
+                if (pInterface != NULL && _interfaceAttachedCallbackFunc != NULL)
+                    (*_interfaceAttachedCallbackFunc)(_callbackArg, pInterface);
                 else
-                {
-                    firmware_version = 0;
-                }
+                    delete pInterface;
 
-                // Move up the hierarchy to the parent and try again 
-                next_device = udev_device_get_parent_with_subsystem_devtype(usb_dev, "usb", NULL);
-                udev_device_ref(next_device);
-                udev_device_unref(usb_dev);
-                usb_dev = next_device;
+                udev_device_unref(it->pAdded);
             }
-            
-            // Not found details 
-            if (!usb_dev)
-            {
-                udev_device_unref(current_dev);
-                continue;
-            }
-                
-            udev_device_unref(usb_dev);
-            usb_dev = NULL;
-                
-            // Check the VID/PID against the arguments  
-            if (deviceIdentifier.productId == dev_pid && deviceIdentifier.vendorId == dev_vid)
-            {
-                const char *pDevicePath = strdup(dev_path);
-                USBKromekDataInterface *pInterface = new USBKromekDataInterface(pDevicePath, dev_pid, dev_vid, deviceSerial.c_str(), firmware_version);
-                pInterface->Initialize();
-                listOut.push_back(pInterface);
-           }
-            
-            udev_device_unref(current_dev);
         }
-        
-        // Cleanup
-        udev_enumerate_unref(enumerate);
-        udev_unref(udev);
+
+        changes.clear();
     }
-    
-    void DeviceEnumerator::EnumerateDevices(const ValidDeviceIdentifier &deviceIdentifier, std::vector<IDataInterface*> &listOut)
+
+    void DeviceEnumerator::ReleaseUdev()
     {
-        EnumerateUSBHIDDevices(deviceIdentifier, listOut);
-        //EnumerateUSBSerialDevices(deviceIdentifier, listOut);
+        if (_shutdownFd >= 0)
+        {
+            close(_shutdownFd);
+            _shutdownFd = -1;
+        }
+
+        if (_pMonitor != NULL)
+        {
+            udev_monitor_unref(_pMonitor);
+            _pMonitor = NULL;
+        }
+
+        if (_pUdev != NULL)
+        {
+            udev_unref(_pUdev);
+            _pUdev = NULL;
+        }
     }
-    
-    bool DeviceEnumerator::Initialize(DevicesChangedCallbackFunc callbackFunc, void *pCallbackArg)
+
+    bool DeviceEnumerator::Initialize(const std::vector<ValidDeviceIdentifier> &supportedDevices,
+        InterfaceAttachedCallbackFunc attachedFunc, InterfaceRemovedCallbackFunc removedFunc, void *pCallbackArg)
     {
-        _devicesChangedCallbackFunc = callbackFunc;
-        _devicesChangedCallbackArg = pCallbackArg;
+        _interfaceAttachedCallbackFunc = attachedFunc;
+        _interfaceRemovedCallbackFunc = removedFunc;
+        _callbackArg = pCallbackArg;
+
+        _supportedDevices.clear();
+        for (size_t i = 0; i < supportedDevices.size(); ++i)
+            _supportedDevices.insert(DeviceKey(supportedDevices[i].vendorId, supportedDevices[i].productId));
+
+        // Without udev no usb devices are found, but simulated and replayed devices can still be used
+        _pUdev = udev_new();
+        if (_pUdev == NULL)
+            return true;
+
+        // Receive events before scanning so a device attached during the scan is not missed. Its add event is then
+        // reported again, which the receiver ignores for an interface it already has
+        _pMonitor = udev_monitor_new_from_netlink(_pUdev, "udev");
+        if (_pMonitor != NULL)
+        {
+            udev_monitor_filter_add_match_subsystem_devtype(_pMonitor, "usb", NULL);
+            udev_monitor_filter_add_match_subsystem_devtype(_pMonitor, "usbmisc", NULL);
+            udev_monitor_filter_add_match_subsystem_devtype(_pMonitor, "tty", NULL);
+            udev_monitor_enable_receiving(_pMonitor);
+        }
+
+        ScanDevices();
+
+        // No netlink socket (e.g. in a container), devices attached later are not found
+        if (_pMonitor == NULL)
+            return true;
 
         // Start a thread to monitor for changes to devices
-        _finishThreadEvent.Reset();
-        if (!_deviceChangeMonitorThread.Start(DeviceChangeMonitorThreadProc, this))
+        _shutdownFd = eventfd(0, EFD_CLOEXEC);
+        if (_shutdownFd < 0 || !_deviceChangeMonitorThread.Start(DeviceChangeMonitorThreadProc, this, TR_ENUMERATOR))
         {
+            ReleaseUdev();
             return false;
         }
 
@@ -167,81 +270,71 @@ namespace kmk
 
 	void DeviceEnumerator::Shutdown()
     {
-        // Signal the thread to end and wait for it to exit
-        _finishThreadEvent.Signal();
-        _deviceChangeMonitorThread.WaitForTermination();
+        // Signal the thread to end and wait for it to exit. It is only running while there is a monitor
+        if (_pMonitor != NULL)
+        {
+            uint64_t value = 1;
+            if (write(_shutdownFd, &value, sizeof(value)) == sizeof(value))
+                _deviceChangeMonitorThread.WaitForTermination();
+        }
+
+        ReleaseUdev();
     }
 
     int DeviceEnumerator::DeviceChangeMonitorThreadProc(void *pArg)
     {
         DeviceEnumerator *pThis = (DeviceEnumerator *)pArg;
 
-        // Setup for notifications from udev
+        pollfd pollFds[2];
+        pollFds[0].fd = udev_monitor_get_fd(pThis->_pMonitor);
+        pollFds[0].events = POLLIN;
+        pollFds[1].fd = pThis->_shutdownFd;
+        pollFds[1].events = POLLIN;
 
-        udev *pudev = udev_new();
-        udev_monitor *pudevMonitor = udev_monitor_new_from_netlink(pudev, "udev");
-        udev_monitor_filter_add_match_subsystem_devtype(pudevMonitor, "usb", NULL);
-        udev_monitor_enable_receiving(pudevMonitor);
-        /* Get the file descriptor (fd) for the monitor. This fd will get passed to select() */
-        int monitorFd = udev_monitor_get_fd(pudevMonitor);
+        PendingChanges changes;
+        int64_t burstStartTime = 0;
 
-        // Continue until the thread is notified of exiting
-        bool continueRunning = true;
-        while(continueRunning)
+        // Sleep until udev has something or the thread is told to exit, only waking on a timeout to end a burst
+        for (;;)
         {
-            // Setup the file descriptor for the select
-            fd_set fdSet;
-            FD_ZERO(&fdSet);
-            FD_SET(monitorFd, &fdSet);
+            int result = poll(pollFds, 2, changes.empty() ? -1 : DEBOUNCE_TIME);
+            if (result < 0)
+            {
+                if (errno == EINTR)
+                    continue;
 
-            // No timeout means immediate return from select
-            struct timeval tv;
-            tv.tv_sec = tv.tv_usec = 0;
+                break;
+            }
 
-            bool devicesChanged = false;
+            if ((pollFds[1].revents & POLLIN) != 0)
+                break;
 
-            // Retrieve all outstanding messages from udev
-            for (;;)
+            if ((pollFds[0].revents & POLLIN) != 0)
             {
-                int result = select(monitorFd + 1, &fdSet, NULL, NULL, &tv);
-                if (result > 0 && FD_ISSET(monitorFd, &fdSet))
-                {
-                    // Data is waiting...
-                    udev_device *pDev = udev_monitor_receive_device(pudevMonitor);
-                    if (pDev)
-                    {
-                        // All we needed to know was something changed and we have retrieved the message off the queue...
-                        udev_device_unref(pDev);
-                        devicesChanged = true;
-                    }
-                }
-                else
-                    break; // No more messages to process
-            }
+                if (changes.empty())
+                    burstStartTime = GetMonotonicTimeMs();
 
-            if (devicesChanged)
-            {
-                // Add a device changed message
-                // Raise the callback function
-                if (pThis->_devicesChangedCallbackFunc != NULL)
+                // The monitor socket does not block, take every message waiting
+                udev_device *pDev;
+                while ((pDev = udev_monitor_receive_device(pThis->_pMonitor)) != NULL)
                 {
-                    (*pThis->_devicesChangedCallbackFunc)(pThis->_devicesChangedCallbackArg);
+                    pThis->QueueDeviceEvent(pDev, changes);
+                    udev_device_unref(pDev);
                 }
-            }
 
-            // Add a delay until we are either informed of the thread exiting or a short time expires
-            continueRunning = !pThis->_finishThreadEvent.Wait(500);
-        }
+                if (changes.empty() || GetMonotonicTimeMs() - burstStartTime < MAX_DEBOUNCE_TIME)
+                    continue;
+            }
 
-        // Release udev objects
-        if (pudevMonitor)
-        {
-            udev_monitor_unref(pudevMonitor);
+            // Quiet for the debounce time, or the burst has gone on long enough
+            pThis->ReportChanges(changes);
         }
 
-        if (pudev)
+        // Changes left when stopped are dropped, the devices are about to be removed anyway
+        for (PendingChanges::iterator it = changes.begin(); it != changes.end(); ++it)
         {
-            udev_unref(pudev);
+            if (it->pAdded != NULL)
+                udev_device_unref(it->pAdded);
         }
 
         return 0;
@@ -39,7 +39,7 @@ bool DeviceEnumerator::Initialize(DevicesChangedCallbackFunc callbackFunc, void
 	_devicesChangedCallbackArg = pCallbackArg;
 
 	DSC_LOG("DeviceEnumerator::INIT _processingThread.Start");
-	if (!_processingThread.Start(ThreadProc, this))
+	if (!_processingThread.Start(ThreadProc, this, TR_ENUMERATOR))
 	{
 		return false;
 	}
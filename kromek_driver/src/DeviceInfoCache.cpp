@@ -0,0 +1,248 @@
+#include "stdafx.h"
+#include "DeviceInfoCache.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WINDOWS
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// First line of the cache file, changed if the format changes so an old file is ignored rather than misread
+#define CACHE_FILE_HEADER "# kromek device cache 1"
+
+// Longest line read from the cache file
+#define MAX_LINE_LENGTH 512
+
+namespace kmk
+{
+
+// Narrow a device string for the file. Only printable ASCII without spaces is kept, anything else can not be cached
+static bool ToCacheString(const String &value, std::string &valueOut)
+{
+	valueOut.clear();
+	for (size_t i = 0; i < value.size(); ++i)
+	{
+		if (value[i] <= L' ' || value[i] > L'~')
+			return false;
+
+		valueOut += (char)value[i];
+	}
+
+	return !valueOut.empty();
+}
+
+static String FromCacheString(const char *pValue)
+{
+	String value;
+	for (size_t i = 0; pValue[i] != 0; ++i)
+		value += (wchar_t)pValue[i];
+
+	return value;
+}
+
+// Add the devices in a cache file to devicesInOut, replacing any with the same key. A file in another format is skipped
+static void ReadDevices(FILE *pFile, std::map<std::string, DeviceInfoCache::DeviceInfo> &devicesInOut)
+{
+	char line[MAX_LINE_LENGTH];
+	if (fgets(line, sizeof(line), pFile) == NULL || strncmp(line, CACHE_FILE_HEADER, strlen(CACHE_FILE_HEADER)) != 0)
+		return;
+
+	while (fgets(line, sizeof(line), pFile) != NULL)
+	{
+		char key[MAX_LINE_LENGTH];
+		char serial[MAX_LINE_LENGTH];
+		unsigned short version = 0;
+		if (sscanf(line, "%511s %hu %511s", key, &version, serial) != 3)
+			continue;
+
+		DeviceInfoCache::DeviceInfo info;
+		info.serial = FromCacheString(serial);
+		info.version = version;
+		devicesInOut[key] = info;
+	}
+}
+
+// Write to a temporary file and move it into place so a process starting now never reads a partial file
+static bool ReplaceFile(const std::string &filePath, const std::string &text)
+{
+#ifdef _WINDOWS
+	std::string tempPath = filePath + ".tmp";
+	FILE *pFile = fopen(tempPath.c_str(), "wb");
+#else
+	// Unique to this save, so a process that saves without the lock can not write into the same temporary file
+	std::string tempPath = filePath + ".XXXXXX";
+	FILE *pFile = NULL;
+	int fd = mkstemp(&tempPath[0]);
+	if (fd >= 0)
+	{
+		// mkstemp only gives the owner access, the cache file is readable by everyone
+		fchmod(fd, 0644);
+		pFile = fdopen(fd, "wb");
+		if (pFile == NULL)
+		{
+			close(fd);
+			remove(tempPath.c_str());
+		}
+	}
+#endif
+	if (pFile == NULL)
+		return false;
+
+	bool written = fwrite(text.data(), 1, text.size(), pFile) == text.size();
+	written &= fclose(pFile) == 0;
+
+	if (written && rename(tempPath.c_str(), filePath.c_str()) != 0)
+	{
+		// Windows will not rename over an existing file
+		remove(filePath.c_str());
+		written = rename(tempPath.c_str(), filePath.c_str()) == 0;
+	}
+
+	if (!written)
+		remove(tempPath.c_str());
+
+	return written;
+}
+
+DeviceInfoCache::DeviceInfoCache()
+{
+}
+
+DeviceInfoCache &DeviceInfoCache::GetInstance()
+{
+	static DeviceInfoCache instance;
+	return instance;
+}
+
+std::string DeviceInfoCache::MakeKey(unsigned int deviceHash, VID vendorId, PID productId, const String &usbSerial)
+{
+	std::string serial;
+	if (!ToCacheString(usbSerial, serial))
+		return "";
+
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%08x-%04x-%04x-", deviceHash, vendorId, productId);
+	return buffer + serial;
+}
+
+bool DeviceInfoCache::Open(const char *pFilePath)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_filePath = pFilePath;
+	_devices.clear();
+
+	FILE *pFile = fopen(pFilePath, "rb");
+	if (pFile == NULL)
+	{
+		if (errno == ENOENT)
+			return true;
+
+		_filePath.clear();
+		return false;
+	}
+
+	// A file in another format is replaced on the next store
+	ReadDevices(pFile, _devices);
+	fclose(pFile);
+	return true;
+}
+
+void DeviceInfoCache::Close()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_filePath.clear();
+	_devices.clear();
+}
+
+bool DeviceInfoCache::IsOpen()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return !_filePath.empty();
+}
+
+bool DeviceInfoCache::Lookup(unsigned int deviceHash, VID vendorId, PID productId, const String &usbSerial, DeviceInfo &infoOut)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_filePath.empty())
+		return false;
+
+	std::map<std::string, DeviceInfo>::const_iterator it = _devices.find(MakeKey(deviceHash, vendorId, productId, usbSerial));
+	if (it == _devices.end())
+		return false;
+
+	infoOut = it->second;
+	return true;
+}
+
+void DeviceInfoCache::Store(unsigned int deviceHash, VID vendorId, PID productId, const String &usbSerial, const DeviceInfo &info)
+{
+	std::string serial;
+	if (!ToCacheString(info.serial, serial))
+		return;
+
+	std::string key = MakeKey(deviceHash, vendorId, productId, usbSerial);
+	if (key.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_filePath.empty())
+		return;
+
+	std::map<std::string, DeviceInfo>::iterator it = _devices.find(key);
+	if (it != _devices.end() && it->second.serial == info.serial && it->second.version == info.version)
+		return;
+
+	Save(key, info);
+}
+
+bool DeviceInfoCache::Save(const std::string &key, const DeviceInfo &info)
+{
+#ifndef _WINDOWS
+	// Processes sharing the file take turns to update it. The lock is on a file of its own as the cache file is replaced
+	// by every save
+	int lockFd = open((_filePath + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (lockFd >= 0)
+	{
+		while (flock(lockFd, LOCK_EX) != 0 && errno == EINTR)
+		{
+		}
+	}
+#endif
+
+	// Keep the devices other processes have stored since the file was loaded
+	FILE *pFile = fopen(_filePath.c_str(), "rb");
+	if (pFile != NULL)
+	{
+		ReadDevices(pFile, _devices);
+		fclose(pFile);
+	}
+
+	_devices[key] = info;
+
+	std::string text = CACHE_FILE_HEADER "\n";
+	for (std::map<std::string, DeviceInfo>::const_iterator it = _devices.begin(); it != _devices.end(); ++it)
+	{
+		std::string serial;
+		ToCacheString(it->second.serial, serial);
+
+		char buffer[16];
+		snprintf(buffer, sizeof(buffer), " %u ", it->second.version);
+		text += it->first + buffer + serial + "\n";
+	}
+
+	bool written = ReplaceFile(_filePath, text);
+
+#ifndef _WINDOWS
+	// Closing releases the lock
+	if (lockFd >= 0)
+		close(lockFd);
+#endif
+
+	return written;
+}
+
+}
@@ -11,15 +11,44 @@
 #include "DoseDevice.h"
 
 #include "D3DataProcessor.h"
+#include "Executor.h"
 
 #include "Lock.h"
+#include <mutex>
 
 namespace kmk
 {
 
+// Enumerated interfaces (by hash) and the manager reading each. Every driver context enumerates the same devices, a
+// device is only added by the first to claim it so two contexts never read it at once
+static std::mutex s_claimsMutex;
+static std::map<unsigned int, DeviceMgr*> s_claimedInterfaces;
+
+// Returns true if the interface is now (or was already) claimed by pOwner
+static bool ClaimInterface(unsigned int interfaceHash, DeviceMgr *pOwner)
+{
+	std::lock_guard<std::mutex> lock(s_claimsMutex);
+	std::map<unsigned int, DeviceMgr*>::iterator it = s_claimedInterfaces.find(interfaceHash);
+	if (it != s_claimedInterfaces.end())
+		return it->second == pOwner;
+
+	s_claimedInterfaces[interfaceHash] = pOwner;
+	return true;
+}
+
+static void ReleaseInterface(unsigned int interfaceHash, DeviceMgr *pOwner)
+{
+	std::lock_guard<std::mutex> lock(s_claimsMutex);
+	std::map<unsigned int, DeviceMgr*>::iterator it = s_claimedInterfaces.find(interfaceHash);
+	if (it != s_claimedInterfaces.end() && it->second == pOwner)
+		s_claimedInterfaces.erase(it);
+}
+
 DeviceMgr::DeviceMgr(void)
 : _deviceChangedCallbackFunc(NULL)
 , _deviceChangedCallbackArg(NULL)
+, _pExecutor(NULL)
+, _deviceListCS("DeviceMgr::_deviceListCS")
 {
 }
 
@@ -31,10 +60,16 @@ DeviceMgr::~DeviceMgr(void)
 bool DeviceMgr::Initialize(ValidDeviceIdentifierVector &supportedDevices)
 {
 	_supportedDeviceList = supportedDevices;
+#ifdef _WINDOWS
 	if(!_deviceEnumerator.Initialize(DevicesChangedCallbackFuncProc, this))
 		return false;
 
 	UpdateAttachedDevices();
+#else
+	// Devices already attached are added before this returns
+	if (!_deviceEnumerator.Initialize(_supportedDeviceList, InterfaceAttachedCallbackProc, InterfaceRemovedCallbackProc, this))
+		return false;
+#endif
 	return true;
 }
 
@@ -49,9 +84,92 @@ bool DeviceMgr::ShutDown()
 		RemoveDevice(_deviceList.begin()->second);
 	}
 
+	for (DataInterfaceMap::iterator it = _registeredInterfaces.begin(); it != _registeredInterfaces.end(); ++it)
+	{
+		delete it->second;
+	}
+	_registeredInterfaces.clear();
+
+	return true;
+}
+
+void DeviceMgr::StopEnumerating()
+{
+	_deviceEnumerator.Shutdown();
+}
+
+bool DeviceMgr::RegisterInterface(IDataInterface *pInterface)
+{
+	Lock lock(_deviceListCS);
+
+	if (pInterface == NULL || _registeredInterfaces.find(pInterface->GetHash()) != _registeredInterfaces.end())
+		return false;
+
+	if (!pInterface->Initialize())
+		return false;
+
+	std::vector<IDevice*> newDevices = AddInterface(pInterface);
+	if (newDevices.empty())
+		return false;
+
+	_registeredInterfaces[pInterface->GetHash()] = pInterface;
+
+	for (std::vector<IDevice*>::iterator it = newDevices.begin(); it != newDevices.end(); ++it)
+	{
+		if (_deviceChangedCallbackFunc != NULL)
+		{
+			(*_deviceChangedCallbackFunc)(*it, true, _deviceChangedCallbackArg);
+		}
+	}
+
 	return true;
 }
 
+void DeviceMgr::UnregisterInterface(IDataInterface *pInterface)
+{
+	Lock lock(_deviceListCS);
+
+	DataInterfaceMap::iterator itInterface = _registeredInterfaces.find(pInterface->GetHash());
+	if (itInterface == _registeredInterfaces.end())
+		return;
+
+	// Collect first, RemoveDevice modifies the list
+	std::vector<IDevice*> removedDevices;
+	for (DeviceMap::iterator it = _deviceList.begin(); it != _deviceList.end(); ++it)
+	{
+		if (it->second->GetInterface() == pInterface)
+			removedDevices.push_back(it->second);
+	}
+
+	for (std::vector<IDevice*>::iterator it = removedDevices.begin(); it != removedDevices.end(); ++it)
+	{
+		if (_deviceChangedCallbackFunc != NULL)
+		{
+			(*_deviceChangedCallbackFunc)(*it, false, _deviceChangedCallbackArg);
+		}
+
+		RemoveDevice(*it);
+	}
+
+	_registeredInterfaces.erase(itInterface);
+	delete pInterface;
+}
+
+bool DeviceMgr::IsRegisteredInterface(IDataInterface *pInterface)
+{
+	DataInterfaceMap::iterator it = _registeredInterfaces.find(pInterface->GetHash());
+	return it != _registeredInterfaces.end() && it->second == pInterface;
+}
+
+bool DeviceMgr::IsAllowed(IDataInterface *pInterface)
+{
+	if (_allowedDevices.empty())
+		return true;
+
+	return _allowedDevices.count(pInterface->GetInterfaceProperty(IFPROP_SERIAL)) != 0
+		|| _allowedDevices.count(pInterface->GetInterfaceProperty(IFPROP_DEVICEPATH)) != 0;
+}
+
 std::vector<IDevice*> DeviceMgr::CreateDevices(IDataInterface *pInterface)
 {
 	std::vector<IDevice*> devices;
@@ -157,7 +275,7 @@ std::vector<IDevice*> DeviceMgr::CreateDevices(IDataInterface *pInterface)
 			case SIGMA_25_D5RIID::M2R2ProductId:
 			{
 				// D3M contains both a sigma and a tn15
-				D3DataProcessor* pProc = new D3DataProcessor(pInterface, true, std::make_shared<FramedPacketStreamer>(), true);
+				D3DataProcessor* pProc = new D3DataProcessor(pInterface, true, CreateFramedPacketStreamer(), true);
 				SIGMA_25_D5RIID* pSigma = new SIGMA_25_D5RIID(pInterface, pProc, D3DataProcessor::GammaComponentId);
 				TN15_D5RIID* pTN15 = new TN15_D5RIID(pInterface, pProc, D3DataProcessor::NeutronComponentId);
 				HighDose_D5RIID* pDose = new HighDose_D5RIID(pInterface, pProc, D3DataProcessor::DoseComponentId);
@@ -195,8 +313,9 @@ std::vector<IDevice*> DeviceMgr::CreateDevices(IDataInterface *pInterface)
 			{
 				case SIGMA_25_D3S::D3SBTProductId: // D3S
 				{
-					// D3S contains both a sigma and a tn15
+					// D3S contains both a sigma and a tn15. Bluetooth links cannot keep up with uncompressed spectra
 					D3DataProcessor *pProc = new D3DataProcessor(pInterface, false, std::make_shared<SerialPacketStreamer>());
+					pProc->SetCompression(true);
 					SIGMA_25_D3S *pSigma = new SIGMA_25_D3S(pInterface, pProc, D3DataProcessor::GammaComponentId);
 					TN15_D3S *pTN15 = new TN15_D3S(pInterface, pProc, D3DataProcessor::NeutronComponentId);
 					devices.push_back(pSigma);
@@ -206,8 +325,9 @@ std::vector<IDevice*> DeviceMgr::CreateDevices(IDataInterface *pInterface)
 
 				case SIGMA_25_D3M::D3MBTProductId: // D3M
 				{
-					// D3M contains both a sigma and a tn15
+					// D3M contains both a sigma and a tn15. Bluetooth links cannot keep up with uncompressed spectra
 					D3DataProcessor *pProc = new D3DataProcessor(pInterface, true, std::make_shared<SerialPacketStreamer>());
+					pProc->SetCompression(true);
 					SIGMA_25_D3M *pSigma = new SIGMA_25_D3M(pInterface, pProc, D3DataProcessor::GammaComponentId);
 					TN15_D3M *pTN15 = new TN15_D3M(pInterface, pProc, D3DataProcessor::NeutronComponentId);
 					devices.push_back(pSigma);
@@ -222,6 +342,18 @@ std::vector<IDevice*> DeviceMgr::CreateDevices(IDataInterface *pInterface)
 	return devices;
 }
 
+// Framed packet streamer with the packet pool settings. Called with _deviceListCS held
+IPacketStreamerPtr DeviceMgr::CreateFramedPacketStreamer()
+{
+	std::shared_ptr<FramedPacketStreamer> ptrStreamer = std::make_shared<FramedPacketStreamer>(_packetPoolSettings.poolSize,
+		_packetPoolSettings.overflowPolicy, _packetPoolSettings.blockTimeoutMs);
+
+	if (_packetPoolSettings.droppedCallback != NULL)
+		ptrStreamer->SetPacketsDroppedCallback(_packetPoolSettings.droppedCallback, _packetPoolSettings.droppedCallbackArg);
+
+	return ptrStreamer;
+}
+
 // Create the relevant devices and add to the internal list, if the device is unsupported then return NULL
 std::vector<IDevice*> DeviceMgr::AddInterface(IDataInterface *pInterface)
 {
@@ -231,6 +363,9 @@ std::vector<IDevice*> DeviceMgr::AddInterface(IDataInterface *pInterface)
 	std::vector<IDevice*>::iterator it;
 	for (it = newDevices.begin(); it != newDevices.end(); ++it)
 	{
+		if (_pExecutor != NULL)
+			(*it)->SetExecutor(*_pExecutor);
+
 		_deviceList[(*it)->GetHash()] =  (*it);
 	}
 	return newDevices;
@@ -238,11 +373,16 @@ std::vector<IDevice*> DeviceMgr::AddInterface(IDataInterface *pInterface)
 
 void DeviceMgr::RemoveDevice(IDevice *pDevice)
 {
+	IDataInterface *pInterface = pDevice->GetInterface();
+	if (!IsRegisteredInterface(pInterface))
+		ReleaseInterface(pInterface->GetHash(), this);
+
 	pDevice->Stop(true);
 	_deviceList.erase(pDevice->GetHash());
 	delete pDevice;
 }
 
+#ifdef _WINDOWS
 // Update the list of attached devices
 void DeviceMgr::UpdateAttachedDevices()
 {
@@ -258,8 +398,13 @@ void DeviceMgr::UpdateAttachedDevices()
 		_deviceEnumerator.EnumerateDevices(*itIdentifier, interfacesFound);
 	}
 
-	// Create all new devices and determine removed devices
-	DeviceMap removedDevices(_deviceList);
+	// Create all new devices and determine removed devices. Registered interfaces are never enumerated so keep their devices
+	DeviceMap removedDevices;
+	for (DeviceMap::iterator itDevice = _deviceList.begin(); itDevice != _deviceList.end(); ++itDevice)
+	{
+		if (!IsRegisteredInterface(itDevice->second->GetInterface()))
+			removedDevices.insert(*itDevice);
+	}
 
 	std::vector<IDataInterface*>::const_iterator itInterface;
 	for (itInterface = interfacesFound.begin(); itInterface != interfacesFound.end(); ++itInterface)
@@ -278,10 +423,14 @@ void DeviceMgr::UpdateAttachedDevices()
 			}
 		}
 
-		if (!hasDevices)
+		// Left to the driver context the device is allowed in, or that has already claimed it
+		if (!hasDevices && IsAllowed(*itInterface) && ClaimInterface(interfaceHash, this))
 		{
 			// New device
 			std::vector<IDevice*> newDevices = AddInterface(*itInterface);
+			if (newDevices.empty())
+				ReleaseInterface(interfaceHash, this);
+
 			for (std::vector<IDevice*>::iterator it = newDevices.begin(); it != newDevices.end(); ++it)
 			{
 				if (_deviceChangedCallbackFunc != NULL)
@@ -311,6 +460,82 @@ void DeviceMgr::DevicesChangedCallbackFuncProc(void *pArg)
 
 	pThis->UpdateAttachedDevices();
 }
+#else
+void DeviceMgr::AddEnumeratedInterface(IDataInterface *pInterface)
+{
+	// The enumerator has already read everything it needs from sysfs, only the list update is made under the lock
+	Lock lock(_deviceListCS);
+
+	// Left to the driver context the device is allowed in, or that has already claimed it
+	if (!IsAllowed(pInterface) || !ClaimInterface(pInterface->GetHash(), this))
+	{
+		delete pInterface;
+		return;
+	}
+
+	// Reported again when attached while the enumerator was starting
+	unsigned int interfaceHash = pInterface->GetHash();
+	for (DeviceMap::iterator itDevice = _deviceList.begin(); itDevice != _deviceList.end(); ++itDevice)
+	{
+		if (itDevice->second->GetInterface()->GetHash() == interfaceHash)
+		{
+			delete pInterface;
+			return;
+		}
+	}
+
+	std::vector<IDevice*> newDevices = AddInterface(pInterface);
+	if (newDevices.empty())
+	{
+		ReleaseInterface(interfaceHash, this);
+		delete pInterface;
+		return;
+	}
+
+	for (std::vector<IDevice*>::iterator it = newDevices.begin(); it != newDevices.end(); ++it)
+	{
+		if (_deviceChangedCallbackFunc != NULL)
+		{
+			(*_deviceChangedCallbackFunc)(*it, true, _deviceChangedCallbackArg);
+		}
+	}
+}
+
+void DeviceMgr::RemoveEnumeratedInterface(unsigned int interfaceHash)
+{
+	Lock lock(_deviceListCS);
+
+	// Collect first, RemoveDevice modifies the list. Registered interfaces are never enumerated so keep their devices
+	std::vector<IDevice*> removedDevices;
+	for (DeviceMap::iterator itDevice = _deviceList.begin(); itDevice != _deviceList.end(); ++itDevice)
+	{
+		IDataInterface *pInterface = itDevice->second->GetInterface();
+		if (pInterface->GetHash() == interfaceHash && !IsRegisteredInterface(pInterface))
+			removedDevices.push_back(itDevice->second);
+	}
+
+	for (std::vector<IDevice*>::iterator it = removedDevices.begin(); it != removedDevices.end(); ++it)
+	{
+		// Raise callback event
+		if (_deviceChangedCallbackFunc != NULL)
+		{
+			(*_deviceChangedCallbackFunc)(*it, false, _deviceChangedCallbackArg);
+		}
+
+		RemoveDevice(*it);
+	}
+}
+
+void DeviceMgr::InterfaceAttachedCallbackProc(void *pArg, IDataInterface *pInterface)
+{
+	((DeviceMgr*)pArg)->AddEnumeratedInterface(pInterface);
+}
+
+void DeviceMgr::InterfaceRemovedCallbackProc(void *pArg, unsigned int interfaceHash)
+{
+	((DeviceMgr*)pArg)->RemoveEnumeratedInterface(interfaceHash);
+}
+#endif
 
 void DeviceMgr::SetDeviceChangedCallback(DeviceChangedCallbackFunc func, void *pArg)
 {
@@ -318,6 +543,29 @@ void DeviceMgr::SetDeviceChangedCallback(DeviceChangedCallbackFunc func, void *p
 	_deviceChangedCallbackArg = pArg;
 }
 
+void DeviceMgr::SetAllowedDevices(const std::vector<String> &allowedDevices)
+{
+	Lock lock(_deviceListCS);
+	_allowedDevices.clear();
+	for (size_t i = 0; i < allowedDevices.size(); ++i)
+	{
+		if (!allowedDevices[i].empty())
+			_allowedDevices.insert(allowedDevices[i]);
+	}
+}
+
+void DeviceMgr::SetExecutor(Executor *pExecutor)
+{
+	Lock lock(_deviceListCS);
+	_pExecutor = pExecutor;
+}
+
+void DeviceMgr::SetPacketPoolSettings(const PacketPoolSettings &settings)
+{
+	Lock lock(_deviceListCS);
+	_packetPoolSettings = settings;
+}
+
 IDevice *DeviceMgr::GetNextDevice(IDevice *pPrevious)
 {
 	Lock lock(_deviceListCS);
@@ -3,12 +3,42 @@
 #include <assert.h>
 
 #ifndef _WINDOWS
-#include <sys/time.h> // Linux header
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Linux event states. Waiting is only set while not signalled, so Signal knows when it has nobody to wake
+#define EVENT_RESET 0
+#define EVENT_SIGNALLED 1
+#define EVENT_WAITING 2
+
+#define NS_PER_SECOND 1000000000L
 #endif
 
 namespace kmk
 {
 
+#ifndef _WINDOWS
+	static_assert(sizeof(std::atomic<int>) == sizeof(int), "Event state must be usable as a futex");
+
+	// Sleep while the state is expected. FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC deadline, so stepping the
+	// wall clock does not stretch or cut short the wait. Returns false on timing out
+	static bool FutexWait(std::atomic<int> &state, int expected, const timespec *pDeadline)
+	{
+		long result = syscall(SYS_futex, (int*)&state, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG, expected, pDeadline, NULL,
+			FUTEX_BITSET_MATCH_ANY);
+		return result == 0 || errno != ETIMEDOUT;
+	}
+
+	static void FutexWakeAll(std::atomic<int> &state)
+	{
+		syscall(SYS_futex, (int*)&state, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, INT_MAX, NULL, NULL, 0);
+	}
+#endif
+
 	Event::Event ()
     {
 		Construct (true, false, L"");
@@ -23,9 +53,6 @@ namespace kmk
     {
 #ifdef _WINDOWS
         CloseHandle (m_event);
-#else
-        pthread_cond_destroy(&m_condition);
-        pthread_mutex_destroy(&m_mutex);
 #endif
     }
 
@@ -37,9 +64,7 @@ namespace kmk
 								signalled ? TRUE : FALSE, 
 								name.empty () ? 0 : name.c_str ());
 #else
-        pthread_mutex_init(&m_mutex, NULL);
-        pthread_cond_init(&m_condition, NULL);
-        m_signalled = signalled;
+        m_state.store(signalled ? EVENT_SIGNALLED : EVENT_RESET);
 #endif
 	}
 
@@ -50,10 +75,12 @@ namespace kmk
 #ifdef _WINDOWS
 		SetEvent (m_event); 
 #else
-        pthread_mutex_lock(&m_mutex);
-        m_signalled = true;
-        pthread_cond_broadcast(&m_condition);
-        pthread_mutex_unlock(&m_mutex);
+        // Data arriving faster than it is processed signals an event that is already signalled, which only needs a read
+        if (m_state.load() == EVENT_SIGNALLED)
+            return;
+
+        if (m_state.exchange(EVENT_SIGNALLED) == EVENT_WAITING)
+            FutexWakeAll(m_state);
 #endif
 	}
 
@@ -62,9 +89,9 @@ namespace kmk
 #ifdef _WINDOWS
 		ResetEvent (m_event);
 #else
-        pthread_mutex_lock(&m_mutex);
-        m_signalled = false;
-        pthread_mutex_unlock(&m_mutex);
+        // Leave a waiting state alone, the waiters are still waiting for a signal
+        int expected = EVENT_SIGNALLED;
+        m_state.compare_exchange_strong(expected, EVENT_RESET);
 #endif
 	}
 
@@ -77,42 +104,39 @@ namespace kmk
 
 		signalled = (result == WAIT_OBJECT_0);
 #else
-        pthread_mutex_lock(&m_mutex);
-
-        if (m_signalled)
+        timespec deadline;
+        if (timeOut != INFINITE)
         {
-            signalled = m_signalled;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += timeOut / 1000;
+            deadline.tv_nsec += (long)(timeOut % 1000) * 1000000L;
+            if (deadline.tv_nsec >= NS_PER_SECOND)
+            {
+                ++deadline.tv_sec;
+                deadline.tv_nsec -= NS_PER_SECOND;
+            }
         }
-        else
+
+        while (true)
         {
-            if (timeOut == INFINITE)
+            int state = m_state.load();
+            if (state == EVENT_SIGNALLED || timeOut == 0)
             {
-                while (!m_signalled)
-                    pthread_cond_wait(&m_condition, &m_mutex);
+                signalled = (state == EVENT_SIGNALLED);
+                break;
             }
-            else
+
+            // Tell Signal there is a waiter to wake. Lost to a Signal or Reset in between, look again
+            if (state == EVENT_RESET && !m_state.compare_exchange_weak(state, EVENT_WAITING))
+                continue;
+
+            // Woken, interrupted or signalled before the wait began, all of which look again
+            if (!FutexWait(m_state, EVENT_WAITING, (timeOut == INFINITE) ? NULL : &deadline))
             {
-                struct timeval now;
-                struct timespec timeout;
-
-                /*gettimeofday(&tv, NULL);
-                    ts.tv_sec = time(NULL) + timeInMs / 1000;
-                    ts.tv_nsec = tv.tv_usec * 1000 + 1000 * 1000 * (timeInMs % 1000);
-                    ts.tv_sec += ts.tv_nsec / (1000 * 1000 * 1000);
-                    ts.tv_nsec %= (1000 * 1000 * 1000);*/
-
-                // Calculate the time to expire the wait
-                gettimeofday(&now, NULL);
-                int64_t timeUSec = (now.tv_usec * 1000) + (timeOut * 1000000);
-                timeout.tv_sec = now.tv_sec + (timeUSec / 1000000000L);
-                timeout.tv_nsec = (timeUSec % 1000000000L);
-
-                pthread_cond_timedwait(&m_condition, &m_mutex, &timeout);
-                signalled = m_signalled;
+                signalled = (m_state.load() == EVENT_SIGNALLED);
+                break;
             }
         }
-
-        pthread_mutex_unlock(&m_mutex);
 #endif
 
 		return signalled;
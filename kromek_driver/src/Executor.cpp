@@ -0,0 +1,342 @@
+#include "stdafx.h"
+#include "Executor.h"
+#include <algorithm>
+
+namespace kmk
+{
+
+Executor::Executor()
+: _workStealing(false)
+, _running(false)
+, _stopping(false)
+, _numAttached(0)
+{
+}
+
+Executor::~Executor()
+{
+	Stop();
+}
+
+Executor &Executor::GetInstance()
+{
+	static Executor instance;
+	return instance;
+}
+
+bool Executor::Start(unsigned int numWorkers, bool workStealing)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	// Workers left from a Stop still in progress
+	if (_running || !_workers.empty())
+		return false;
+
+	_workStealing = workStealing;
+	_stopping = false;
+
+	for (unsigned int i = 0; i < numWorkers; ++i)
+	{
+		Worker *pWorker = new Worker();
+		pWorker->pExecutor = this;
+
+		// Carry on with the workers already started
+		if (!pWorker->thread.Start(WorkerThreadProc, pWorker, TR_PROCESSOR, "kmk-worker"))
+		{
+			delete pWorker;
+			break;
+		}
+
+		_workers.push_back(pWorker);
+	}
+
+	_running = !_workers.empty();
+	return _running;
+}
+
+void Executor::Stop()
+{
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		if (!_running)
+			return;
+
+		// Attached strands are part way through their work, e.g. a processor finishing its queue
+		_running = false;
+		_strandCondition.wait(lock, [this] { return _numAttached == 0; });
+
+		_stopping = true;
+		_workCondition.notify_all();
+	}
+
+	// Only this thread changes the workers while stopping
+	for (size_t i = 0; i < _workers.size(); ++i)
+		_workers[i]->thread.WaitForTermination();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	for (size_t i = 0; i < _workers.size(); ++i)
+		delete _workers[i];
+
+	_workers.clear();
+	_stopping = false;
+}
+
+bool Executor::IsRunning()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _running;
+}
+
+void Executor::Enqueue(Strand *pStrand, Worker *pWorker)
+{
+	pStrand->_queued = true;
+
+	if (_workStealing && pWorker != NULL)
+	{
+		// The worker takes it next unless it already has work waiting, in which case an idle worker can steal it
+		pWorker->queue.push_back(pStrand);
+		if (pWorker->queue.size() > 1)
+			_workCondition.notify_one();
+	}
+	else
+	{
+		_queue.push_back(pStrand);
+		_workCondition.notify_one();
+	}
+}
+
+Strand *Executor::TakeNext(Worker *pWorker)
+{
+	std::deque<Strand*> *pQueue = NULL;
+	if (_workStealing && !pWorker->queue.empty())
+		pQueue = &pWorker->queue;
+	else if (!_queue.empty())
+		pQueue = &_queue;
+	else if (_workStealing)
+	{
+		for (size_t i = 0; i < _workers.size() && pQueue == NULL; ++i)
+		{
+			if (!_workers[i]->queue.empty())
+				pQueue = &_workers[i]->queue;
+		}
+	}
+
+	if (pQueue == NULL)
+		return NULL;
+
+	Strand *pStrand = pQueue->front();
+	pQueue->pop_front();
+	pStrand->_queued = false;
+	return pStrand;
+}
+
+void Executor::RemoveFromQueues(Strand *pStrand)
+{
+	if (!pStrand->_queued)
+		return;
+
+	_queue.erase(std::remove(_queue.begin(), _queue.end(), pStrand), _queue.end());
+	for (size_t i = 0; i < _workers.size(); ++i)
+	{
+		std::deque<Strand*> &queue = _workers[i]->queue;
+		queue.erase(std::remove(queue.begin(), queue.end(), pStrand), queue.end());
+	}
+
+	pStrand->_queued = false;
+}
+
+void Executor::CancelTimer(Strand *pStrand)
+{
+	if (!pStrand->_hasTimer)
+		return;
+
+	_timers.erase(pStrand->_timer);
+	pStrand->_hasTimer = false;
+}
+
+void Executor::QueueExpiredTimers()
+{
+	Clock::time_point now = Clock::now();
+	while (!_timers.empty() && _timers.begin()->first <= now)
+	{
+		Strand *pStrand = _timers.begin()->second;
+		CancelTimer(pStrand);
+
+		if (pStrand->_running)
+			pStrand->_runAgain = true;
+		else if (!pStrand->_queued)
+			Enqueue(pStrand, NULL);
+	}
+}
+
+void Executor::DetachStrand(Strand *pStrand)
+{
+	RemoveFromQueues(pStrand);
+	CancelTimer(pStrand);
+	pStrand->_runAgain = false;
+	pStrand->_detachOnReturn = false;
+
+	if (pStrand->_attached.load(std::memory_order_relaxed))
+	{
+		pStrand->_attached.store(false, std::memory_order_release);
+		--_numAttached;
+	}
+
+	_strandCondition.notify_all();
+}
+
+int Executor::WorkerThreadProc(void *pArg)
+{
+	Worker *pWorker = (Worker*)pArg;
+	Executor *pThis = pWorker->pExecutor;
+
+	std::unique_lock<std::mutex> lock(pThis->_mutex);
+	while (!pThis->_stopping)
+	{
+		pThis->QueueExpiredTimers();
+
+		Strand *pStrand = pThis->TakeNext(pWorker);
+		if (pStrand == NULL)
+		{
+			if (pThis->_timers.empty())
+				pThis->_workCondition.wait(lock);
+			else
+				pThis->_workCondition.wait_until(lock, pThis->_timers.begin()->first);
+
+			continue;
+		}
+
+		// The turn does whatever the timer was waiting for, it sets another if it still needs one
+		pThis->CancelTimer(pStrand);
+		pStrand->_running = true;
+		pStrand->_runAgain = false;
+		pStrand->_runningThread = std::this_thread::get_id();
+
+		lock.unlock();
+		(*pStrand->_func)(pStrand->_pArg);
+		lock.lock();
+
+		pStrand->_running = false;
+		pStrand->_runningThread = std::thread::id();
+
+		if (pStrand->_detachOnReturn)
+			pThis->DetachStrand(pStrand);
+		else if (pStrand->_runAgain)
+			pThis->Enqueue(pStrand, pWorker);
+
+		pThis->_strandCondition.notify_all();
+	}
+
+	return 0;
+}
+
+Strand::Strand(Executor &executor, StrandFunc func, void *pArg)
+: _pExecutor(&executor)
+, _func(func)
+, _pArg(pArg)
+, _attached(false)
+, _queued(false)
+, _running(false)
+, _runAgain(false)
+, _detachOnReturn(false)
+, _hasTimer(false)
+{
+}
+
+Strand::~Strand()
+{
+	Detach();
+}
+
+bool Strand::Attach()
+{
+	std::lock_guard<std::mutex> lock(_pExecutor->_mutex);
+
+	// Attached again by the final turn before it returns, carry on rather than letting go
+	if (_attached.load(std::memory_order_relaxed))
+	{
+		_detachOnReturn = false;
+		return true;
+	}
+
+	if (!_pExecutor->_running)
+		return false;
+
+	++_pExecutor->_numAttached;
+	_attached.store(true, std::memory_order_release);
+	return true;
+}
+
+void Strand::Detach()
+{
+	std::unique_lock<std::mutex> lock(_pExecutor->_mutex);
+
+	if (IsRunningOnThisThread())
+	{
+		_detachOnReturn = true;
+		return;
+	}
+
+	_pExecutor->_strandCondition.wait(lock, [this] { return !_running; });
+	_pExecutor->DetachStrand(this);
+}
+
+void Strand::WaitForDetach()
+{
+	std::unique_lock<std::mutex> lock(_pExecutor->_mutex);
+
+	if (IsRunningOnThisThread())
+		return;
+
+	_pExecutor->_strandCondition.wait(lock, [this] { return !_attached.load(std::memory_order_relaxed) && !_running; });
+}
+
+bool Strand::SetExecutor(Executor &executor)
+{
+	std::lock_guard<std::mutex> lock(_pExecutor->_mutex);
+	if (_attached.load(std::memory_order_relaxed) || _running)
+		return false;
+
+	_pExecutor = &executor;
+	return true;
+}
+
+void Strand::Post()
+{
+	if (!IsAttached())
+		return;
+
+	std::lock_guard<std::mutex> lock(_pExecutor->_mutex);
+	if (!_attached.load(std::memory_order_relaxed))
+		return;
+
+	if (_running)
+		_runAgain = true;
+	else if (!_queued)
+		_pExecutor->Enqueue(this, NULL);
+}
+
+void Strand::PostAfter(uint32_t delayMs)
+{
+	std::lock_guard<std::mutex> lock(_pExecutor->_mutex);
+	if (!_attached.load(std::memory_order_relaxed))
+		return;
+
+	// Keep an earlier timer, the turn it runs can set the next one
+	Executor::Clock::time_point dueTime = Executor::Clock::now() + std::chrono::milliseconds(delayMs);
+	if (_hasTimer)
+	{
+		if (_timer->first <= dueTime)
+			return;
+
+		_pExecutor->CancelTimer(this);
+	}
+
+	_timer = _pExecutor->_timers.insert(std::make_pair(dueTime, this));
+	_hasTimer = true;
+
+	// A waiting worker may need to wake sooner than it planned to
+	_pExecutor->_workCondition.notify_one();
+}
+
+}
@@ -81,7 +81,10 @@ bool HIDDataInterface::Initialize()
 
 		// Devices that dont have supporting serial numbers return a dummy value, make sure we ignore it
 		if (wstr[0] != 0x409)
+		{
 			_serialNumber = wstr;
+			_ifProperties[IFPROP_SERIAL] = _serialNumber;
+		}
 	}
 
 	Close();
@@ -177,7 +180,7 @@ bool HIDDataInterface::BeginReading()
 	_cancelIOEvent.Reset();
 	_readThreadRunning = true;
 
-	if (!_readThread.Start(ReadDataThread, this))
+	if (!_readThread.Start(ReadDataThread, this, TR_READER))
 	{
 		_readThreadRunning = false;
 		Close();
@@ -3,6 +3,7 @@
 #include "kmkTime.h"
 #include <assert.h>
 #include "IDevice.h"
+#include "Probes.h"
 #include <cstring>
 #include <algorithm>
 
@@ -15,6 +16,15 @@
 // Timeout in ms for configuration querys
 #define CONFIGURATION_QUERY_TIMEOUT 2000
 
+// Time in ms the processing thread is kept alive after the last configuration query when the detector is not acquiring
+#define CONFIGURATION_SESSION_LINGER 500
+
+// Longest single wait (ms) in WaitForIdle between checks of the queue
+#define IDLE_CHECK_INTERVAL 1
+
+// Most reports processed in one turn on the shared executor before letting other devices have a go
+#define REPORTS_PER_TURN 64
+
 #define ComponentDetector 0
 #define ComponentConfiguration 1
 
@@ -23,13 +33,19 @@ namespace kmk
 
 IntervalCountProcessor::IntervalCountProcessor(IDataInterface *pDataInterface)
 : _pDataInterface(pDataInterface)
+, _interfaceHash(pDataInterface->GetHash())
 , _countEventCallback(NULL)
 , _countEventCallbackArg(NULL)
 , _finishedCallback(NULL)
 , _finishedCallbackArg(NULL)
 , _errorCallback(NULL)
 , _errorCallbackArg(NULL)
+, _strand(Executor::GetInstance(), ProcessStrandProc, this)
+, _onExecutor(false)
+, _criticalSection("IntervalCountProcessor::_criticalSection")
 , _waitEvent(true, false, L"")
+, _processingReport(false)
+, _idleEvent(true, false, L"")
 , _componentRunning(TS_STOP)
 , _currentState(ES_IDLE)
 , _requiredState(RS_STOP)
@@ -38,18 +54,34 @@ IntervalCountProcessor::IntervalCountProcessor(IDataInterface *pDataInterface)
 , _startAcquisitionTime(0)
 , _endAcquisitionTime(0)
 
-, _configurationQueryState(CQS_IDLE)
-, _configurationQueryEvent(false, false, L"")
+, _configurationSessionEndTime(0)
 {
 	_pDataInterface->SetDataReadyCallback(ReadDataCallbackProc, this);
 	_pDataInterface->SetErrorCallback(DataInterfaceErrorCallbackProc, this);
+	_pDataInterface->GetMetrics().SetCollector(CollectMetricsProc, this);
 	_inputPacketBuffer.resize(REPORT_SIZE); // Max packet size is the data report 
+	_reportBuffer.resize(REPORT_SIZE);
 }
 
 IntervalCountProcessor::~IntervalCountProcessor()
 {
+	// The thread may still be lingering after a configuration query
+	bool isRunning = false;
+	{
+		kmk::Lock lock(_criticalSection);
+		isRunning = _currentState != ES_IDLE;
+	}
+
+	if (isRunning)
+	{
+		RequestExecutionState(RS_STOP);
+		WakeProcessing();
+		WaitForProcessingThread();
+	}
+
 	_pDataInterface->SetDataReadyCallback(NULL, NULL);
 	_pDataInterface->SetErrorCallback(NULL, NULL);
+	_pDataInterface->GetMetrics().SetCollector(NULL, NULL);
 }
 
 int IntervalCountProcessor::DeterminePacketSize(BYTE reportId)
@@ -83,7 +115,7 @@ int IntervalCountProcessor::DeterminePacketSize(BYTE reportId)
 }
 
 // NOTE: This call is coming from the read thread of the DataInterface, make sure its fast!
-void IntervalCountProcessor::QueueData(int64_t timeStamp, BYTE *pData, size_t dataLength)
+void IntervalCountProcessor::QueueData(int64_t timeStamp, BYTE *pData, size_t dataLength, bool traced /*= false*/)
 {
 	kmk::Lock lock(_criticalSection);
 
@@ -129,7 +161,10 @@ void IntervalCountProcessor::QueueData(int64_t timeStamp, BYTE *pData, size_t da
 				pQueueData = tempPacket;
 			}
 
-			_dataQueue.Enqueue(timeStamp, pQueueData, packetSize);
+			int queueDepth = 0;
+			_dataQueue.Enqueue(timeStamp, pQueueData, packetSize, &queueDepth, traced);
+			traced = false;
+			KMK_PROBE3(report_enqueued, _interfaceHash, packetSize, queueDepth);
 			newPacketReceived = true;
 			readIndex += packetSize;
 		}
@@ -151,7 +186,7 @@ void IntervalCountProcessor::QueueData(int64_t timeStamp, BYTE *pData, size_t da
 	}
 	
 	if (newPacketReceived)
-		_waitEvent.Signal();
+		WakeProcessing();
 }
 
 void IntervalCountProcessor::Reset()
@@ -257,9 +292,9 @@ bool IntervalCountProcessor::SetExecutionState(ExecutionState state)
 bool IntervalCountProcessor::StartProcessingThread()
 {
 	// If a thread is running then it is still cleaning up a previous run. Let it finish
-	if (_thread.IsRunning())
+	if (_onExecutor || _thread.IsRunning())
 	{
-		_thread.WaitForTermination();
+		WaitForProcessingThread();
 	}
 
 	Reset();
@@ -272,12 +307,20 @@ bool IntervalCountProcessor::StartProcessingThread()
 		}
 	}
 
-	if (!_thread.Start(ProcessThreadProc, this))
+	// Run on the shared executor if it is running, otherwise on a thread of our own
+	_onExecutor = _strand.Attach();
+	if (!_onExecutor && !_thread.Start(ProcessThreadProc, this, TR_PROCESSOR))
 	{
 		return false;
 	}
 
-	return SetExecutionState(ES_RUNNING);
+	bool result = SetExecutionState(ES_RUNNING);
+
+	// A turn taken before the state is set would find the processor idle and finish straight away
+	if (_onExecutor)
+		_strand.Post();
+
+	return result;
 }
 
 bool IntervalCountProcessor::StartProcessing(uint8_t componentId)
@@ -325,7 +368,7 @@ bool IntervalCountProcessor::StopProcessing(uint8_t componentId, bool force)
 		case ComponentDetector:
 			_componentRunning = force ? TS_STOP : TS_FINISH;
 
-			stopProcessing = _configurationQueryState != CQS_WAITING;
+			stopProcessing = _configurationQueries.IsEmpty();
 			_endAcquisitionTime = kmk::Time::GetTimeMs();
 			break;
 
@@ -338,10 +381,10 @@ bool IntervalCountProcessor::StopProcessing(uint8_t componentId, bool force)
 	{
 		RequestExecutionState(force ? RS_STOP : RS_FINISH);
 
-		_waitEvent.Signal(); // Interrupt any wait on the thread
+		WakeProcessing(); // Interrupt any wait on the thread
 
 		if (force)
-			_thread.WaitForTermination();
+			WaitForProcessingThread();
 	}
 
 	// If we are not allowing the queue to be completed then wait for the thread to exit before continuing
@@ -400,8 +443,9 @@ int64_t IntervalCountProcessor::GetRealTime(uint8_t /*componentId*/)
 	kmk::Lock lock(_criticalSection);
 
 	// Determine if we are currently acquiring data. If so calculate the real time based on currentTime - startTime 
-	// else return the time of the previously completed acquisition
-	if (_currentState == ES_RUNNING)
+	// else return the time of the previously completed acquisition. The processor also runs for a while after a
+	// configuration query, e.g. reading the serial when the device is attached, which is not acquiring
+	if (_currentState == ES_RUNNING && _componentRunning == TS_RUNNING)
 	{
 		return kmk::Time::GetTimeMs() - _startAcquisitionTime;
 	}
@@ -475,52 +519,113 @@ void IntervalCountProcessor::ProcessDataReport(int64_t timestamp, BYTE *pData, s
 	if (dataSize != REPORT_SIZE)
 		return;
 
+	KMK_PROBE2(report_begin, _interfaceHash, timestamp);
+
 	// Read following bytes in pairs and determine if any channel data is included
 	// First byte is report id
+	unsigned int channels[REPORT_SIZE / 2];
+	int numEvents = 0;
 	for (int offset = 1; offset < REPORT_SIZE; offset += 2)
 	{
 		// Check the least sig bit of the 2 byte data. If its a 1 it has a valid value
 		if ((pData[offset + 1] & 0x1) == 1)
 		{
 			// Valid channel. Actual channel number is 12 bit (remove first 4 bits from the least sig byte)
-			unsigned int val = ((pData[offset] << 4) & 0xFF0) + ((pData[offset+1] >> 4) & 0xF);
-
-			// Raise callback for each event
-			(*_countEventCallback)(_countEventCallbackArg, timestamp, val, 1);
+			channels[numEvents++] = ((pData[offset] << 4) & 0xFF0) + ((pData[offset+1] >> 4) & 0xF);
 		}
 		else 
 		{
 			break; // No more data in this report
 		}
 	}
+
+	kmk::LatencyTracer::Mark(LS_DECODED);
+
+	kmk::Metrics &metrics = _pDataInterface->GetMetrics();
+	metrics.Add(METRIC_REPORTS_DECODED);
+	metrics.Add(METRIC_EVENTS_COUNTED, numEvents);
+
+	// Raise callback for each event
+	for (int i = 0; i < numEvents; ++i)
+		(*_countEventCallback)(_countEventCallbackArg, timestamp, channels[i], 1);
+
+	KMK_PROBE2(report_end, _interfaceHash, numEvents);
 }
 
 void IntervalCountProcessor::ProcessConfigurationReport(BYTE *pData, size_t dataSize)
 {
-	// A configuration report response has been received. If we are still waiting
-	// for the response then store the data and notify the original calling thread
-	kmk::Lock lock(_criticalSection);
-	if (_configurationQueryState != CQS_WAITING)
+	// A configuration report response has been received. If a request is still waiting for it then store the
+	// full packet and notify the calling thread. Otherwise it probably timed out, just ignore this report
+	_configurationQueries.Complete(ConfigurationQueryList::MakeKey(ComponentDetector, pData[0]), pData, dataSize);
+}
+
+bool IntervalCountProcessor::GetConfigurationData(uint8_t componentId, uint16_t configurationIds, BYTE *pDataOut, size_t &dataLength)
+{
+	ConfigurationQuery query;
+	query.configurationId = configurationIds;
+	query.pDataOut = pDataOut;
+	query.dataLength = dataLength;
+	query.success = false;
+
+	GetConfigurationDataBatch(componentId, &query, 1);
+
+	dataLength = query.dataLength;
+	return query.success;
+}
+
+bool IntervalCountProcessor::GetConfigurationDataBatch(uint8_t /*componentId*/, ConfigurationQuery *pQueries, size_t numQueries)
+{
+	std::vector<ConfigurationQueryList::Key> keys(numQueries);
+	std::vector<bool> waiting(numQueries, false);
+	int64_t startTime = kmk::Time::GetTime();
+
+	// Send every request before waiting on any of them so the device can answer them back to back
+	for (size_t i = 0; i < numQueries; ++i)
 	{
-		// We are not waiting for a response (probably timed out). Just ignore this report
-		return;
+		pQueries[i].success = false;
+		waiting[i] = SendConfigurationQuery(pQueries[i].configurationId, pQueries[i].dataLength, keys[i]);
 	}
 
-	// Copy the full packet into the result buffer
-	if (_configurationQueryResultData.size() < dataSize)
-		_configurationQueryResultData.resize(dataSize);
+	// All requests share the same deadline
+	int64_t deadlineMs = kmk::Time::GetTimeMs() + CONFIGURATION_QUERY_TIMEOUT;
+	bool result = true;
+	for (size_t i = 0; i < numQueries; ++i)
+	{
+		ConfigurationQuery &query = pQueries[i];
+		std::vector<BYTE> response;
 
-    memcpy(&_configurationQueryResultData[0], pData, dataSize);
-	_configurationQueryState = CQS_SUCCESS;
-	
-	// Signal the waiting thread that data is ready
-	_configurationQueryEvent.Signal();
+		// Grab the data out of the packet (after the report id) and copy into the output buffer
+		if (waiting[i] && _configurationQueries.Wait(keys[i], deadlineMs, response) && response.size() > query.dataLength)
+		{
+			memcpy(query.pDataOut, &response[1], query.dataLength);
+			query.success = true;
+		}
+		else
+			query.dataLength = 0;
+
+		_pDataInterface->GetMetrics().AddConfigurationQuery(startTime, query.success);
+		result &= query.success;
+	}
+
+	// Keep the processing thread alive for a while in case more queries follow
+	{
+		kmk::Lock lock(_criticalSection);
+		_configurationSessionEndTime = kmk::Time::GetTimeMs() + CONFIGURATION_SESSION_LINGER;
+	}
+
+	return result;
 }
 
-bool IntervalCountProcessor::GetConfigurationData(uint8_t /*componentId*/, uint16_t configurationIds, BYTE *pDataOut, size_t &dataLength)
+bool IntervalCountProcessor::SendConfigurationQuery(uint16_t configurationIds, size_t dataLength, ConfigurationQueryList::Key &keyOut)
 {
 	uint8_t configurationId = configurationIds & 0xFF;
 
+	// Register the request before sending it, some interfaces return the response before the send returns. If the same
+	// request is already in flight then share its response rather than sending it again
+	keyOut = ConfigurationQueryList::MakeKey(ComponentDetector, configurationId);
+	if (!_configurationQueries.Add(keyOut))
+		return true;
+
     size_t requestLength = dataLength + 1;
 	// Time for a little fix - Report 0x87 is shared between PULSEWIDTH (LCS - 1 byte) and BIAS 2 (SIGMA / TN15 - 2 bytes).
 	// Because the report id is used to determine the data packet size we need to pass this on with the same size. Pad the PULSEWIDTH with 1
@@ -535,55 +640,34 @@ bool IntervalCountProcessor::GetConfigurationData(uint8_t /*componentId*/, uint1
 	requestReport.resize(requestLength);
 	requestReport[0] = configurationId;
 
-	{
-		kmk::Lock lock(_criticalSection);
-
-		// Getting a configuration requires writing a report to the device and waiting for a response
-		if (_configurationQueryState != CQS_IDLE)
-			return false;
-
-		_configurationQueryEvent.Reset();
-		_configurationQueryState = CQS_WAITING;
-	}
-	
 	StartProcessing(ComponentConfiguration);
 
 	// Send the request
 	if (!_pDataInterface->GetConfigurationSetting((unsigned char*)&requestReport[0], requestReport.size()))
 	{
-		{
-			kmk::Lock lock(_criticalSection);
-			_configurationQueryState = CQS_IDLE;
-		}
-
-		// No longer waiting for configuration response, close the connection if its not being used
-		StopProcessing(ComponentConfiguration, true);
+		_configurationQueries.Remove(keyOut);
 		return false;
 	}
 
-	// Wait for a response
-	bool result = _configurationQueryEvent.Wait(CONFIGURATION_QUERY_TIMEOUT);
-	
-	{
-		kmk::Lock lock(_criticalSection);
-		result &= _configurationQueryState == CQS_SUCCESS;
-		_configurationQueryState = CQS_IDLE;
-	}
+	return true;
+}
 
-	// No longer waiting for configuration response, close the connection if its not being used
-	StopProcessing(ComponentConfiguration, true);
-		
-	if (result)
+bool IntervalCountProcessor::CheckConfigurationSessionExpired()
+{
 	{
 		kmk::Lock lock(_criticalSection);
 
-		// Grab the data out of the packet and copy into the output buffer
-        memcpy(pDataOut, &_configurationQueryResultData[1], dataLength);
+		if (_componentRunning == TS_RUNNING || _currentState != ES_RUNNING || _requiredState != RS_RUN || 
+			!_configurationQueries.IsEmpty() || kmk::Time::GetTimeMs() < _configurationSessionEndTime)
+			return false;
+
+		// Set the request under the lock so a query starting now either sees the thread finishing and restarts it, or 
+		// is seen above and keeps it running
+		_requiredState = RS_FINISH;
 	}
-	else
-		dataLength = 0;
 
-	return result;
+	TransitionExecutionState();
+	return true;
 }
 
 bool IntervalCountProcessor::SetConfigurationData(uint8_t /*componentId*/, uint16_t configurationIds, BYTE *pDataIn, size_t dataLength)
@@ -599,92 +683,214 @@ bool IntervalCountProcessor::SetConfigurationData(uint8_t /*componentId*/, uint1
 	return _pDataInterface->SetConfigurationSetting(&requestReport[0], requestReport.size());
 }
 
-int IntervalCountProcessor::ProcessThreadProc(void *pArg)
+bool IntervalCountProcessor::SetExecutor(Executor &executor)
 {
-	IntervalCountProcessor *pThis = (IntervalCountProcessor*)pArg;
-	unsigned char *pBuffer = new unsigned char [REPORT_SIZE];
-	int64_t timestamp;
+	return _strand.SetExecutor(executor);
+}
 
-	ExecutionState keepRunning = ES_RUNNING;
-	do
+bool IntervalCountProcessor::WaitForIdle(uint32_t timeoutMs)
+{
+	for (uint32_t waitedMs = 0; ; waitedMs += IDLE_CHECK_INTERVAL)
 	{
-		// If something is in the queue then process it, otherwise wait for data		
-		if (!pThis->_dataQueue.IsEmpty())
+		// Events are not auto reset on every platform, reset before checking so a signal from the thread is never lost
+		_idleEvent.Reset();
+
 		{
-			// Process
-			pThis->_dataQueue.Dequeue(pBuffer, REPORT_SIZE, timestamp);
-			pThis->ProcessReport(timestamp, pBuffer, REPORT_SIZE);
+			kmk::Lock lock(_criticalSection);
+			if (_currentState == ES_IDLE)
+				return true;
 		}
-		else
+
+		// Queue first, a report is marked as being processed before it leaves the queue
+		if (_dataQueue.IsEmpty() && !_processingReport.load())
+			return true;
+
+		if (waitedMs >= timeoutMs)
+			return false;
+
+		_idleEvent.Wait(IDLE_CHECK_INTERVAL);
+	}
+}
+
+IntervalCountProcessor::ProcessResult IntervalCountProcessor::ProcessNext(uint32_t &waitTimeOut)
+{
+	ProcessResult result = PR_CONTINUE;
+
+	// Marked before looking at the queue so WaitForIdle never sees an empty queue while a report is still outstanding
+	_processingReport.store(true);
+
+	// If something is in the queue then process it, otherwise wait for data		
+	if (!_dataQueue.IsEmpty())
+	{
+		// Process
+		int64_t timestamp;
+		bool traced = false;
+		_dataQueue.Dequeue(&_reportBuffer[0], REPORT_SIZE, timestamp, &traced);
+
+		// The queued timestamp is when the report was received so it starts the latency trace of sampled reports
+		kmk::LatencyTraceScope trace(traced ? &_pDataInterface->GetLatencyTracer() : NULL, timestamp);
+		trace.Mark(LS_DEQUEUED);
+
+		ProcessReport(timestamp, &_reportBuffer[0], REPORT_SIZE);
+		_processingReport.store(false);
+	}
+	else
+	{
+		_processingReport.store(false);
+		_idleEvent.Signal();
+
+		// No more data, check if we have been asked to finish once all data is processed
 		{
-			// No more data, check if we have been asked to finish once all data is processed
+			kmk::Lock lock(_criticalSection);
+			if (_currentState == ES_FINISHING ||
+				_currentState == ES_STOPPING)
 			{
-				kmk::Lock lock(pThis->_criticalSection);
-				if (pThis->_currentState == ES_FINISHING ||
-					pThis->_currentState == ES_STOPPING)
-				{
-					break;
-				}
-				
-                pThis->_waitEvent.Reset();
+				return PR_EXIT;
 			}
 			
-			// Wait for event signalling new data (or cancel)
-			pThis->_waitEvent.Wait(INFINITE);
+            _waitEvent.Reset();
+
+			// When only serving configuration queries wake up to check whether the session has expired
+			waitTimeOut = (_componentRunning == TS_RUNNING) ? INFINITE : CONFIGURATION_SESSION_LINGER;
 		}
+		
+		// Data queued after the check above but before the reset would otherwise leave the thread waiting with reports 
+		// in the queue
+		if (_dataQueue.IsEmpty())
+			result = PR_WAIT;
+	}
 
+	{
+		kmk::Lock lock(_errorSection);
+
+		// Process any errors
+		for (ErrorList::iterator it = _pendingErrors.begin(); it != _pendingErrors.end(); ++it)
 		{
-			kmk::Lock lock(pThis->_errorSection);
+			ExecuteError(it->errorCode, it->message);
+		}
 
-			// Process any errors
-			for (ErrorList::iterator it = pThis->_pendingErrors.begin(); it != pThis->_pendingErrors.end(); ++it)
-			{
-				pThis->ExecuteError(it->errorCode, it->message);
-			}
+		_pendingErrors.clear();
+	}
 
-			pThis->_pendingErrors.clear();
-		}
+	// Finish once the thread is no longer needed for configuration queries
+	CheckConfigurationSessionExpired();
 
-		// Check thread continue status
-		{
-			kmk::Lock lock(pThis->_criticalSection);
-			keepRunning = pThis->_currentState;
-		}
-	} while (keepRunning == ES_RUNNING || keepRunning == ES_FINISHING);
+	// Check thread continue status
+	ExecutionState state;
+	{
+		kmk::Lock lock(_criticalSection);
+		state = _currentState;
+	}
+
+	if (state != ES_RUNNING && state != ES_FINISHING)
+		return PR_EXIT;
 
+	// Asked to finish, go straight on to finishing off the queue
+	return (state == ES_FINISHING) ? PR_CONTINUE : result;
+}
+
+void IntervalCountProcessor::FinishProcessing()
+{
 	// Raise the finished callback for the detector only if finishing
-	if (pThis->_componentRunning == TS_FINISH)
+	if (_componentRunning == TS_FINISH)
 	{
 		FinishedProcessingCallbackFunc callFunc = NULL;
 		void *pCallArg = NULL;
 
 		{
-			kmk::Lock lock(pThis->_criticalSection);
-			pThis->_componentRunning = TS_STOP;
-			callFunc = pThis->_finishedCallback;
-			pCallArg = pThis->_finishedCallbackArg;
+			kmk::Lock lock(_criticalSection);
+			_componentRunning = TS_STOP;
+			callFunc = _finishedCallback;
+			pCallArg = _finishedCallbackArg;
 			
 		}
 
-		if (pThis->_finishedCallback != NULL)
+		if (_finishedCallback != NULL)
 		{
 			(*callFunc)(pCallArg, false);
 		}
 	}
 
-	pThis->SetExecutionState(ES_IDLE);
+	SetExecutionState(ES_IDLE);
+}
+
+int IntervalCountProcessor::ProcessThreadProc(void *pArg)
+{
+	IntervalCountProcessor *pThis = (IntervalCountProcessor*)pArg;
+	uint32_t waitTime = INFINITE;
 
-	delete[] pBuffer;
+	ProcessResult result;
+	while ((result = pThis->ProcessNext(waitTime)) != PR_EXIT)
+	{
+		// Wait for event signalling new data (or cancel)
+		if (result == PR_WAIT)
+			pThis->_waitEvent.Wait(waitTime);
+	}
+
+	pThis->FinishProcessing();
 	return 0;
 }
 
+// Stands in for the processing thread on the shared executor. Each turn works through the queue, a limited number of 
+// reports at a time so other devices get a turn, and leaves the next turn to be posted by new data or a timeout
+void IntervalCountProcessor::ProcessStrandProc(void *pArg)
+{
+	IntervalCountProcessor *pThis = (IntervalCountProcessor*)pArg;
+	uint32_t waitTime = INFINITE;
+
+	for (int i = 0; i < REPORTS_PER_TURN; ++i)
+	{
+		switch (pThis->ProcessNext(waitTime))
+		{
+		case PR_CONTINUE:
+			break;
+
+		case PR_WAIT:
+			if (waitTime != INFINITE)
+				pThis->_strand.PostAfter(waitTime);
+			return;
+
+		case PR_EXIT:
+			// Let go of the executor first, the finished callback may start processing again
+			pThis->_strand.Detach();
+			pThis->FinishProcessing();
+			return;
+		}
+	}
+
+	pThis->_strand.Post();
+}
+
+void IntervalCountProcessor::WakeProcessing()
+{
+	_waitEvent.Signal();
+	_strand.Post();
+}
+
+void IntervalCountProcessor::WaitForProcessingThread()
+{
+	if (_onExecutor)
+		_strand.WaitForDetach();
+	else
+		_thread.WaitForTermination();
+}
+
 // Callback raised everytime data is received from the data interface.
 void IntervalCountProcessor::ReadDataCallbackProc(void *pArg, unsigned char *pData, size_t dataSize)
 {
 	IntervalCountProcessor *pThis = (IntervalCountProcessor*)pArg;
+	int64_t receivedTime = kmk::Time::GetTime();
+
+	// Sampling is decided once here and carried through the queue with the report
+	kmk::LatencyTracer &tracer = pThis->_pDataInterface->GetLatencyTracer();
+	bool traced = tracer.ShouldSample();
 
 	// Pass data onto the data processor
-	pThis->QueueData(kmk::Time::GetTime(), pData, dataSize);
+	pThis->QueueData(receivedTime, pData, dataSize, traced);
+	pThis->_pDataInterface->GetMetrics().Add(METRIC_BYTES_READ, dataSize);
+
+	if (traced)
+		tracer.Record(LS_ENQUEUED, receivedTime);
 }
 
 void IntervalCountProcessor::DataInterfaceErrorCallbackProc(void *pArg, int errorCode, String message)
@@ -693,6 +899,21 @@ void IntervalCountProcessor::DataInterfaceErrorCallbackProc(void *pArg, int erro
 	pThis->RaiseError(errorCode, message);
 }
 
+// Fill in the queue metrics when a snapshot of the interface metrics is taken
+void IntervalCountProcessor::CollectMetricsProc(void *pArg, MetricsSnapshot &snapshotInOut)
+{
+	IntervalCountProcessor *pThis = (IntervalCountProcessor*)pArg;
+
+	int numEntries = 0;
+	int highWater = 0;
+	uint64_t numOverwritten = 0;
+	pThis->_dataQueue.GetStats(numEntries, highWater, numOverwritten);
+
+	snapshotInOut.values[METRIC_QUEUE_DEPTH] = numEntries;
+	snapshotInOut.values[METRIC_QUEUE_HIGH_WATER] = highWater;
+	snapshotInOut.values[METRIC_DROPPED_QUEUE] = numOverwritten;
+}
+
 // Execute the error callback routine. Do not call direct, Call Raise error instead
 void IntervalCountProcessor::ExecuteError(int errorCode, String message)
 {
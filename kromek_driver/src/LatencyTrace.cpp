@@ -0,0 +1,188 @@
+#include "stdafx.h"
+#include "LatencyTrace.h"
+#include "kmkTime.h"
+#include <stdint.h>
+#include <algorithm>
+
+// Ticks (100ns) in a microsecond
+#define TICKS_PER_US 10.0
+
+namespace kmk
+{
+
+// Trace currently being processed by this thread
+static thread_local LatencyTraceScope *t_pCurrentScope = NULL;
+
+static int HighestBit(uint64_t value)
+{
+#if defined(__GNUC__)
+	return 63 - __builtin_clzll(value);
+#else
+	int bit = 0;
+	while (value >>= 1)
+		++bit;
+	return bit;
+#endif
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+	Reset();
+}
+
+void LatencyHistogram::Reset()
+{
+	for (int i = 0; i < NUM_BUCKETS; ++i)
+		_buckets[i].store(0, std::memory_order_relaxed);
+
+	_count.store(0, std::memory_order_relaxed);
+	_sum.store(0, std::memory_order_relaxed);
+	_min.store(UINT64_MAX, std::memory_order_relaxed);
+	_max.store(0, std::memory_order_relaxed);
+}
+
+int LatencyHistogram::BucketIndex(uint64_t value)
+{
+	if (value < (uint64_t)SUB_BUCKET_COUNT)
+		return (int)value;
+
+	// Keep the top SUB_BUCKET_BITS bits, the shift picks the power of 2 range and the bits the bucket within it
+	int shift = HighestBit(value) - SUB_BUCKET_BITS + 1;
+	int subBucket = (int)(value >> shift);
+	return SUB_BUCKET_COUNT + (shift - 1) * SUB_BUCKET_HALF + (subBucket - SUB_BUCKET_HALF);
+}
+
+uint64_t LatencyHistogram::BucketValue(int index)
+{
+	if (index < SUB_BUCKET_COUNT)
+		return index;
+
+	int shift = (index - SUB_BUCKET_COUNT) / SUB_BUCKET_HALF + 1;
+	uint64_t subBucket = (index - SUB_BUCKET_COUNT) % SUB_BUCKET_HALF + SUB_BUCKET_HALF;
+	return (subBucket << shift) + ((1ull << shift) / 2);
+}
+
+void LatencyHistogram::Record(int64_t ticks)
+{
+	uint64_t value = (ticks > 0) ? (uint64_t)ticks : 0;
+	if (value >= (1ull << MAX_VALUE_BITS))
+		value = (1ull << MAX_VALUE_BITS) - 1;
+
+	_buckets[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+	_count.fetch_add(1, std::memory_order_relaxed);
+	_sum.fetch_add(value, std::memory_order_relaxed);
+
+	uint64_t current = _min.load(std::memory_order_relaxed);
+	while (value < current && !_min.compare_exchange_weak(current, value, std::memory_order_relaxed))
+		;
+
+	current = _max.load(std::memory_order_relaxed);
+	while (value > current && !_max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+		;
+}
+
+void LatencyHistogram::GetStatistics(LatencyStatistics &statsOut) const
+{
+	statsOut = LatencyStatistics();
+
+	// Take a copy of the buckets so the percentiles are consistent with each other while recording continues
+	uint64_t buckets[NUM_BUCKETS];
+	uint64_t count = 0;
+	for (int i = 0; i < NUM_BUCKETS; ++i)
+	{
+		buckets[i] = _buckets[i].load(std::memory_order_relaxed);
+		count += buckets[i];
+	}
+
+	if (count == 0)
+		return;
+
+	uint64_t minValue = _min.load(std::memory_order_relaxed);
+	uint64_t maxValue = _max.load(std::memory_order_relaxed);
+
+	statsOut.count = count;
+	statsOut.min = minValue / TICKS_PER_US;
+	statsOut.max = maxValue / TICKS_PER_US;
+	statsOut.mean = (double)_sum.load(std::memory_order_relaxed) / _count.load(std::memory_order_relaxed) / TICKS_PER_US;
+
+	const double percentiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	double *pResults[] = { &statsOut.p50, &statsOut.p90, &statsOut.p99, &statsOut.p999 };
+
+	uint64_t seen = 0;
+	int bucket = 0;
+	for (int i = 0; i < 4; ++i)
+	{
+		// Walk on to the bucket containing the percentile. Percentiles are increasing so carry on from the last one
+		uint64_t target = (uint64_t)(percentiles[i] * count + 0.5);
+		if (target < 1)
+			target = 1;
+
+		while (bucket < NUM_BUCKETS && seen + buckets[bucket] < target)
+			seen += buckets[bucket++];
+
+		uint64_t value = BucketValue(std::min(bucket, NUM_BUCKETS - 1));
+		value = std::max(minValue, std::min(maxValue, value));
+		*pResults[i] = value / TICKS_PER_US;
+	}
+}
+
+LatencyTracer::LatencyTracer()
+: _sampleInterval(0)
+, _sampleCounter(0)
+{
+}
+
+void LatencyTracer::SetSampleInterval(uint32_t sampleInterval)
+{
+	_sampleInterval.store(sampleInterval, std::memory_order_relaxed);
+	Reset();
+}
+
+void LatencyTracer::Record(LatencyStage stage, int64_t receivedTime)
+{
+	_histograms[stage].Record(kmk::Time::GetTime() - receivedTime);
+}
+
+void LatencyTracer::GetStatistics(LatencyStage stage, LatencyStatistics &statsOut) const
+{
+	_histograms[stage].GetStatistics(statsOut);
+}
+
+void LatencyTracer::Reset()
+{
+	for (int i = 0; i < LS_COUNT; ++i)
+		_histograms[i].Reset();
+}
+
+void LatencyTracer::Mark(LatencyStage stage)
+{
+	if (t_pCurrentScope != NULL)
+		t_pCurrentScope->Mark(stage);
+}
+
+LatencyTraceScope::LatencyTraceScope(LatencyTracer *pTracer, int64_t receivedTime)
+: _pTracer(pTracer)
+, _receivedTime(receivedTime)
+, _markedStages(0)
+, _pPreviousScope(t_pCurrentScope)
+{
+	if (_pTracer != NULL)
+		t_pCurrentScope = this;
+}
+
+LatencyTraceScope::~LatencyTraceScope()
+{
+	if (_pTracer != NULL)
+		t_pCurrentScope = _pPreviousScope;
+}
+
+void LatencyTraceScope::Mark(LatencyStage stage)
+{
+	if (_pTracer == NULL || (_markedStages & (1u << stage)) != 0)
+		return;
+
+	_markedStages |= (1u << stage);
+	_pTracer->Record(stage, _receivedTime);
+}
+
+}
@@ -15,6 +15,26 @@ namespace kmk
 		m_cs.Leave ();
 	}
 
+	TryLock::TryLock (CriticalSection &cs)
+    : m_cs (cs)
+	, m_locked (cs.TryEnter ())
+	{
+	}
+
+	TryLock::~TryLock ()
+	{
+		if (m_locked)
+			m_cs.Leave ();
+	}
+
+	bool TryLock::Retry ()
+	{
+		if (!m_locked)
+			m_locked = m_cs.TryEnter ();
+
+		return m_locked;
+	}
+
 
 } // namespace kmk
 
@@ -0,0 +1,206 @@
+#include "stdafx.h"
+#include "LockProfiler.h"
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <mutex>
+
+// Upper bound of the first histogram bucket (ns), each bucket after it is 4 times wider
+#define FIRST_BUCKET_BOUND 256
+
+namespace kmk
+{
+
+// Critical sections in static objects can still be used while the process exits, so the registry is never destroyed.
+// A std::mutex rather than a CriticalSection keeps the registry out of its own statistics
+struct LockRegistry
+{
+	std::mutex mutex;
+	std::vector<LockProfiler::Counters*> counters;
+};
+
+static LockRegistry &GetRegistry()
+{
+	static LockRegistry *pRegistry = new LockRegistry();
+	return *pRegistry;
+}
+
+static int GetBucket(uint64_t timeNs)
+{
+	int bucket = 0;
+	uint64_t bound = FIRST_BUCKET_BOUND;
+	while (bucket < LOCK_HISTOGRAM_BUCKETS - 1 && timeNs > bound)
+	{
+		++bucket;
+		bound *= 4;
+	}
+
+	return bucket;
+}
+
+static void ZeroCounters(LockProfiler::Counters &counters)
+{
+	counters.acquisitions.store(0, std::memory_order_relaxed);
+	counters.contended.store(0, std::memory_order_relaxed);
+	counters.waitTimeNs.store(0, std::memory_order_relaxed);
+	counters.holdTimeNs.store(0, std::memory_order_relaxed);
+	for (int i = 0; i < LOCK_HISTOGRAM_BUCKETS; ++i)
+	{
+		counters.waitHistogram[i].store(0, std::memory_order_relaxed);
+		counters.holdHistogram[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+// One OpenMetrics histogram family, a sample set per lock
+static void WriteHistogram(const std::vector<LockStatistics> &statistics, const char *pFamily, const char *pHelp, bool wait,
+	std::string &textOut)
+{
+	char buffer[256];
+	snprintf(buffer, sizeof(buffer), "# TYPE %s histogram\n# HELP %s %s\n", pFamily, pFamily, pHelp);
+	textOut += buffer;
+
+	for (size_t i = 0; i < statistics.size(); ++i)
+	{
+		const LockStatistics &lock = statistics[i];
+		const uint64_t *pHistogram = wait ? lock.waitHistogram : lock.holdHistogram;
+
+		uint64_t cumulative = 0;
+		for (int bucket = 0; bucket < LOCK_HISTOGRAM_BUCKETS; ++bucket)
+		{
+			cumulative += pHistogram[bucket];
+
+			uint64_t bound = LockProfiler::GetBucketBound(bucket);
+			if (bound != 0)
+				snprintf(buffer, sizeof(buffer), "%s_bucket{lock=\"%s\",le=\"%.9g\"} %llu\n", pFamily, lock.name.c_str(),
+					bound / 1e9, (unsigned long long)cumulative);
+			else
+				snprintf(buffer, sizeof(buffer), "%s_bucket{lock=\"%s\",le=\"+Inf\"} %llu\n", pFamily, lock.name.c_str(),
+					(unsigned long long)cumulative);
+			textOut += buffer;
+		}
+
+		snprintf(buffer, sizeof(buffer), "%s_count{lock=\"%s\"} %llu\n%s_sum{lock=\"%s\"} %.9f\n", pFamily, lock.name.c_str(),
+			(unsigned long long)cumulative, pFamily, lock.name.c_str(), (wait ? lock.waitTimeNs : lock.holdTimeNs) / 1e9);
+		textOut += buffer;
+	}
+}
+
+bool LockProfiler::IsEnabled()
+{
+#ifdef KMK_LOCK_PROFILING
+	return true;
+#else
+	return false;
+#endif
+}
+
+LockProfiler::Counters *LockProfiler::Register(const char *pName)
+{
+	LockRegistry &registry = GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	for (size_t i = 0; i < registry.counters.size(); ++i)
+	{
+		if (strcmp(registry.counters[i]->pName, pName) == 0)
+			return registry.counters[i];
+	}
+
+	Counters *pCounters = new Counters();
+	pCounters->pName = pName;
+	ZeroCounters(*pCounters);
+	registry.counters.push_back(pCounters);
+	return pCounters;
+}
+
+void LockProfiler::RecordAcquisition(Counters *pCounters, bool contended, uint64_t waitTimeNs)
+{
+	pCounters->acquisitions.fetch_add(1, std::memory_order_relaxed);
+	if (contended)
+	{
+		pCounters->contended.fetch_add(1, std::memory_order_relaxed);
+		pCounters->waitTimeNs.fetch_add(waitTimeNs, std::memory_order_relaxed);
+	}
+
+	pCounters->waitHistogram[GetBucket(waitTimeNs)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LockProfiler::RecordHold(Counters *pCounters, uint64_t holdTimeNs)
+{
+	pCounters->holdTimeNs.fetch_add(holdTimeNs, std::memory_order_relaxed);
+	pCounters->holdHistogram[GetBucket(holdTimeNs)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t LockProfiler::GetTimeNs()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t LockProfiler::GetBucketBound(int bucket)
+{
+	if (bucket < 0 || bucket >= LOCK_HISTOGRAM_BUCKETS - 1)
+		return 0;
+
+	return (uint64_t)FIRST_BUCKET_BOUND << (2 * bucket);
+}
+
+void LockProfiler::GetStatistics(std::vector<LockStatistics> &statisticsOut)
+{
+	LockRegistry &registry = GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	statisticsOut.clear();
+	for (size_t i = 0; i < registry.counters.size(); ++i)
+	{
+		const Counters &counters = *registry.counters[i];
+
+		LockStatistics statistics;
+		statistics.name = counters.pName;
+		statistics.acquisitions = counters.acquisitions.load(std::memory_order_relaxed);
+		statistics.contended = counters.contended.load(std::memory_order_relaxed);
+		statistics.waitTimeNs = counters.waitTimeNs.load(std::memory_order_relaxed);
+		statistics.holdTimeNs = counters.holdTimeNs.load(std::memory_order_relaxed);
+		for (int bucket = 0; bucket < LOCK_HISTOGRAM_BUCKETS; ++bucket)
+		{
+			statistics.waitHistogram[bucket] = counters.waitHistogram[bucket].load(std::memory_order_relaxed);
+			statistics.holdHistogram[bucket] = counters.holdHistogram[bucket].load(std::memory_order_relaxed);
+		}
+
+		statisticsOut.push_back(statistics);
+	}
+}
+
+void LockProfiler::Reset()
+{
+	LockRegistry &registry = GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	for (size_t i = 0; i < registry.counters.size(); ++i)
+		ZeroCounters(*registry.counters[i]);
+}
+
+void LockProfiler::WriteOpenMetrics(std::string &textOut)
+{
+	if (!IsEnabled())
+		return;
+
+	std::vector<LockStatistics> statistics;
+	GetStatistics(statistics);
+	if (statistics.empty())
+		return;
+
+	char buffer[256];
+	textOut += "# TYPE kromek_lock_contended counter\n# HELP kromek_lock_contended Acquisitions that had to wait for the lock\n";
+	for (size_t i = 0; i < statistics.size(); ++i)
+	{
+		snprintf(buffer, sizeof(buffer), "kromek_lock_contended_total{lock=\"%s\"} %llu\n", statistics[i].name.c_str(),
+			(unsigned long long)statistics[i].contended);
+		textOut += buffer;
+	}
+
+	// The acquisition count is the _count of the wait histogram
+	WriteHistogram(statistics, "kromek_lock_wait_seconds", "Time spent waiting to acquire the lock", true, textOut);
+	WriteHistogram(statistics, "kromek_lock_hold_seconds", "Time the lock was held for", false, textOut);
+}
+
+}
@@ -0,0 +1,133 @@
+#include "stdafx.h"
+#include "Metrics.h"
+#include "Lock.h"
+#include "LockProfiler.h"
+#include "kmkTime.h"
+#include <stdio.h>
+#include <string.h>
+
+// Ticks (100ns) in a microsecond
+#define TICKS_PER_US 10
+
+namespace kmk
+{
+
+// Descriptors in MetricId order
+static const MetricDescriptor s_descriptors[METRIC_COUNT] =
+{
+	{ "kromek_read_bytes", MT_COUNTER, "_total", NULL, 1.0, "Bytes read from the device" },
+	{ "kromek_reports_decoded", MT_COUNTER, "_total", NULL, 1.0, "Data reports decoded" },
+	{ "kromek_events_counted", MT_COUNTER, "_total", NULL, 1.0, "Counts decoded from the data reports" },
+	{ "kromek_queue_depth", MT_GAUGE, "", NULL, 1.0, "Reports waiting to be processed" },
+	{ "kromek_queue_high_water", MT_GAUGE, "", NULL, 1.0, "Most reports ever waiting to be processed" },
+	{ "kromek_dropped", MT_COUNTER, "_total", "stage=\"queue\"", 1.0, "Reports or corrupt data thrown away, by stage" },
+	{ "kromek_dropped", MT_COUNTER, "_total", "stage=\"stream\"", 1.0, NULL },
+	{ "kromek_crc_failures", MT_COUNTER, "_total", NULL, 1.0, "Packets that failed their crc check" },
+	{ "kromek_decompression_failures", MT_COUNTER, "_total", NULL, 1.0, "Packets that could not be decompressed" },
+	{ "kromek_config_query_seconds", MT_SUMMARY, "_count", NULL, 1.0, "Time taken to answer configuration queries" },
+	{ "kromek_config_query_seconds", MT_SUMMARY, "_sum", NULL, 0.000001, NULL },
+	{ "kromek_config_query_failures", MT_COUNTER, "_total", NULL, 1.0, "Configuration queries that failed or timed out" },
+	{ "kromek_acquisitions_started", MT_COUNTER, "_total", NULL, 1.0, "Acquisitions started" },
+};
+
+static const char *TypeName(MetricType type)
+{
+	switch (type)
+	{
+	case MT_GAUGE:
+		return "gauge";
+	case MT_SUMMARY:
+		return "summary";
+	default:
+		return "counter";
+	}
+}
+
+Metrics::Metrics()
+: _collector(NULL)
+, _collectorArg(NULL)
+{
+	for (int i = 0; i < METRIC_COUNT; ++i)
+		_values[i].store(0, std::memory_order_relaxed);
+}
+
+void Metrics::AddConfigurationQuery(int64_t startTime, bool success)
+{
+	int64_t elapsed = kmk::Time::GetTime() - startTime;
+
+	Add(METRIC_CONFIG_QUERIES);
+	Add(METRIC_CONFIG_QUERY_TIME, (elapsed > 0) ? (uint64_t)(elapsed / TICKS_PER_US) : 0);
+	if (!success)
+		Add(METRIC_CONFIG_QUERY_FAILURES);
+}
+
+void Metrics::SetCollector(CollectorFunc func, void *pArg)
+{
+	kmk::Lock lock(_collectorSection);
+	_collector = func;
+	_collectorArg = pArg;
+}
+
+void Metrics::GetSnapshot(MetricsSnapshot &snapshotOut)
+{
+	for (int i = 0; i < METRIC_COUNT; ++i)
+		snapshotOut.values[i] = _values[i].load(std::memory_order_relaxed);
+
+	// Held while collecting so the collector can not be removed (and its owner destroyed) part way through
+	kmk::Lock lock(_collectorSection);
+	if (_collector != NULL)
+		(*_collector)(_collectorArg, snapshotOut);
+}
+
+const MetricDescriptor &Metrics::GetDescriptor(MetricId id)
+{
+	return s_descriptors[id];
+}
+
+void Metrics::WriteOpenMetrics(const std::vector<LabelledMetricsSnapshot> &snapshots, std::string &textOut)
+{
+	char buffer[256];
+	const char *pPreviousFamily = NULL;
+
+	for (int id = 0; id < METRIC_COUNT; ++id)
+	{
+		const MetricDescriptor &descriptor = s_descriptors[id];
+
+		// Metadata once per family
+		if (pPreviousFamily == NULL || strcmp(pPreviousFamily, descriptor.pFamily) != 0)
+		{
+			snprintf(buffer, sizeof(buffer), "# TYPE %s %s\n# HELP %s %s\n", descriptor.pFamily, TypeName(descriptor.type),
+				descriptor.pFamily, descriptor.pHelp);
+			textOut += buffer;
+			pPreviousFamily = descriptor.pFamily;
+		}
+
+		for (size_t i = 0; i < snapshots.size(); ++i)
+		{
+			const LabelledMetricsSnapshot &device = snapshots[i];
+			std::string labels = device.labels;
+			if (descriptor.pLabel != NULL)
+				labels += (labels.empty() ? "" : ",") + std::string(descriptor.pLabel);
+
+			textOut += descriptor.pFamily;
+			textOut += descriptor.pSuffix;
+			if (!labels.empty())
+				textOut += "{" + labels + "}";
+			textOut += " ";
+
+			uint64_t value = device.snapshot.values[id];
+			if (descriptor.scale == 1.0)
+				snprintf(buffer, sizeof(buffer), "%llu\n", (unsigned long long)value);
+			else
+				snprintf(buffer, sizeof(buffer), "%.6f\n", value * descriptor.scale);
+			textOut += buffer;
+		}
+	}
+
+	// Lock statistics are kept for the whole process rather than per device
+	LockProfiler::WriteOpenMetrics(textOut);
+
+	textOut += "# EOF\n";
+}
+
+}
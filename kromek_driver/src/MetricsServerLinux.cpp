@@ -0,0 +1,152 @@
+#include "stdafx.h"
+#include "MetricsServer.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Time in ms between checks for the server being stopped
+#define ACCEPT_POLL_INTERVAL 250
+
+// Time in ms a client has to send a request before it is sent the plain text
+#define REQUEST_WAIT_TIME 100
+
+#define MAX_PENDING_CONNECTIONS 8
+
+namespace kmk
+{
+
+MetricsServer::MetricsServer()
+: _keepRunning(false)
+, _listenSocket(-1)
+, _textCallback(NULL)
+, _textCallbackArg(NULL)
+{
+}
+
+MetricsServer::~MetricsServer()
+{
+	Stop();
+}
+
+bool MetricsServer::Start(const char *pSocketPath, TextCallbackFunc func, void *pArg)
+{
+	if (_keepRunning.load() || pSocketPath == NULL || func == NULL)
+		return false;
+
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(pSocketPath) >= sizeof(address.sun_path))
+		return false;
+
+	strncpy(address.sun_path, pSocketPath, sizeof(address.sun_path) - 1);
+
+	int listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (listenSocket < 0)
+		return false;
+
+	// A socket file left by a previous run stops the bind
+	unlink(pSocketPath);
+
+	if (bind(listenSocket, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenSocket, MAX_PENDING_CONNECTIONS) != 0)
+	{
+		close(listenSocket);
+		return false;
+	}
+
+	_listenSocket = listenSocket;
+	_socketPath = pSocketPath;
+	_textCallback = func;
+	_textCallbackArg = pArg;
+	_keepRunning.store(true);
+
+	if (!_thread.Start(ServeThreadProc, this, TR_OTHER, "kmk-metrics"))
+	{
+		_keepRunning.store(false);
+		close(_listenSocket);
+		unlink(_socketPath.c_str());
+		_listenSocket = -1;
+		return false;
+	}
+
+	return true;
+}
+
+void MetricsServer::Stop()
+{
+	if (_listenSocket < 0)
+		return;
+
+	_keepRunning.store(false);
+	_thread.WaitForTermination();
+
+	close(_listenSocket);
+	unlink(_socketPath.c_str());
+	_listenSocket = -1;
+}
+
+void MetricsServer::ServeClient(int clientSocket)
+{
+	// Give an HTTP client a moment to send its request. The request itself is not needed, whatever is asked for gets
+	// the metrics
+	bool isHttp = false;
+	pollfd pollSocket = { clientSocket, POLLIN, 0 };
+	if (poll(&pollSocket, 1, REQUEST_WAIT_TIME) > 0 && (pollSocket.revents & POLLIN) != 0)
+	{
+		char request[512];
+		ssize_t received = recv(clientSocket, request, sizeof(request), 0);
+		isHttp = received >= 4 && memcmp(request, "GET ", 4) == 0;
+	}
+
+	std::string text;
+	(*_textCallback)(_textCallbackArg, text);
+
+	std::string response;
+	if (isHttp)
+	{
+		char header[256];
+		snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; version=1.0.0; "
+			"charset=utf-8\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", text.size());
+		response = header;
+	}
+	response += text;
+
+	size_t sent = 0;
+	while (sent < response.size())
+	{
+		ssize_t result = send(clientSocket, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0)
+			break;
+
+		sent += result;
+	}
+}
+
+int MetricsServer::ServeThreadProc(void *pArg)
+{
+	MetricsServer *pThis = (MetricsServer*)pArg;
+
+	while (pThis->_keepRunning.load())
+	{
+		pollfd pollSocket = { pThis->_listenSocket, POLLIN, 0 };
+		if (poll(&pollSocket, 1, ACCEPT_POLL_INTERVAL) <= 0)
+			continue;
+
+		int clientSocket = accept4(pThis->_listenSocket, NULL, NULL, SOCK_CLOEXEC);
+		if (clientSocket < 0)
+			continue;
+
+		pThis->ServeClient(clientSocket);
+		close(clientSocket);
+	}
+
+	return 0;
+}
+
+}
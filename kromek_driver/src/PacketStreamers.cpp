@@ -3,7 +3,9 @@
 #include <array>
 #include <mutex>
 #include <cstring>
+#include <algorithm>
 #include "crc.h"
+#include "D3Structs.h"
 
 namespace kmk
 {
@@ -11,16 +13,68 @@ namespace kmk
 	// Add some more space for configuration setting reports that might also be returned
 	constexpr uint16_t MAX_REPORT_SIZE = 8500;
 
+	// Smallest valid packet is a message header followed by the crc
+	constexpr uint16_t MIN_REPORT_SIZE = sizeof(MessageHeader) + sizeof(uint16_t);
+
 	constexpr uint8_t  FRAME_BYTE = 0xC0;
 	constexpr uint8_t  ESC_BYTE = 0xDB;
 	constexpr uint8_t  ESC_FRAME_BYTE = 0xDC;
 	constexpr uint8_t  ESC_ESC_BYTE = 0xDD;
 
+	// Packet pool slots start on a cache line so neighbouring slots never share one
+	constexpr size_t POOL_SLOT_ALIGNMENT = 64;
+	constexpr size_t POOL_SLOT_SIZE = (MAX_REPORT_SIZE + POOL_SLOT_ALIGNMENT - 1) & ~(POOL_SLOT_ALIGNMENT - 1);
+
+	// Components that send reports on D3 family devices (gamma, neutron, dose and interface board)
+	static bool IsKnownComponent(uint8_t componentId)
+	{
+		return componentId == 0x01 || componentId == 0x02 || componentId == 0x03 || componentId == 0x07;
+	}
+
+	// Reports that can be received from D3 family devices
+	static bool IsKnownReport(uint8_t reportId)
+	{
+		switch (reportId)
+		{
+		case REPORT_ID_INTERNAL_ERROR:
+		case REPORT_ID_GET_16BIT_SPECTRUM:
+		case REPORT_ID_GET_RADIOMETRICSV1_SPECTRUM:
+		case REPORT_ID_D3_START:
+		case REPORT_ID_GET_STATUS:
+		case REPORT_ID_GET_DEVICE_INFO:
+		case REPORT_ID_GET_SERIAL_NO:
+		case D3Configuration16::REPORT_ID_GET_BIAS:
+		case D3Configuration16::REPORT_ID_GET_LLD:
+		case D3Configuration16::REPORT_ID_GET_SOFTWARE_LLD:
+		case D3Configuration16::REPORT_ID_GET_VERSION:
+		case D3Configuration16::REPORT_ID_GET_ACTUAL_BIAS:
+		case D3Configuration8::REPORT_ID_GET_GAIN:
+		case D3Configuration8::REPORT_ID_GET_OTG:
+		case D3Configuration8::REPORT_ID_GET_ENABLE_LLD:
+			return true;
+
+		default:
+			return false;
+		}
+	}
+
+	// Whether the header could start a valid packet. The content header of a compressed packet is compressed
+	// along with the rest of the content so only its size can be checked
+	static bool IsPlausibleHeader(const MessageHeader* pHeader)
+	{
+		if (pHeader->messageSize < MIN_REPORT_SIZE || pHeader->messageSize > MAX_REPORT_SIZE)
+			return false;
+
+		if ((pHeader->mode & 0x1) != 0)
+			return true;
+
+		return IsKnownComponent(pHeader->contentHeader.componentID) && IsKnownReport(pHeader->contentHeader.reportID);
+	}
+
 
 	SerialPacketStreamer::SerialPacketStreamer(size_t bufferSize)
 		: _writeIndex(0)
-		, _enableDataRecovery(false)
-		, _lastDataTime()
+		, _resyncing(false)
 	{
 		_buffer.resize(bufferSize);
 	}
@@ -29,89 +83,127 @@ namespace kmk
 	{
 		std::lock_guard<std::mutex> lock(_bufferMutex);
 		_writeIndex = 0;
+		_resyncing = false;
 	}
 
 
 	bool SerialPacketStreamer::AddIncomingData(const BYTE* pData, size_t dataSize)
 	{
 		std::lock_guard<std::mutex> lock(_bufferMutex);
-		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
 
-		if (UpdateDataRecoveryStatus(now))
+		// Append data to the buffer if there is space
+		if (_writeIndex + dataSize > _buffer.size())
 		{
-			// Append data to the buffer if there is space
-			if (_writeIndex + dataSize > _buffer.size())
-			{
-				return false;
-			}
-
-			std::memcpy(&_buffer[_writeIndex], pData, dataSize);
-			_writeIndex += dataSize;
+			_stats.bytesDropped += dataSize;
+			return false;
 		}
-		_lastDataTime = now;
+
+		std::memcpy(&_buffer[_writeIndex], pData, dataSize);
+		_writeIndex += dataSize;
 		return true;
 	}
 
-	bool SerialPacketStreamer::UpdateDataRecoveryStatus(std::chrono::steady_clock::time_point now)
+	bool SerialPacketStreamer::ReadPacket(std::vector<BYTE>& dataOut)
 	{
-		if (_enableDataRecovery)
+		std::lock_guard<std::mutex> lock(_bufferMutex);
+
+		size_t readIndex = 0;
+		size_t firstIncompleteIndex = _writeIndex;
+		bool packetFound = false;
+		const char* pCorruptionError = NULL;
+
+		// Normally the packet starts at the beginning of the buffer. While resyncing step through the buffer a byte
+		// at a time until a plausible packet is found
+		while (_writeIndex - readIndex >= sizeof(MessageHeader))
 		{
-			// We now want to wait for an idle time of > 100ms before we start accepting data again
-			if (now > _lastDataTime + std::chrono::milliseconds(100))
+			const MessageHeader* pHeader = reinterpret_cast<const MessageHeader*>(&_buffer[readIndex]);
+			uint16_t packetSize = pHeader->messageSize;
+			const char* pError = NULL;
+
+			if (packetSize < MIN_REPORT_SIZE || packetSize > MAX_REPORT_SIZE || (_resyncing && !IsPlausibleHeader(pHeader)))
 			{
-				// Recovered
-				_enableDataRecovery = false;
+				pError = "Corrupt data detected - Invalid Packet Size";
 			}
-		}
-		return !_enableDataRecovery;
-	}
+			else if (_writeIndex - readIndex < packetSize)
+			{
+				if (!_resyncing)
+					break; // Not enough data yet
 
-	bool SerialPacketStreamer::ReadPacket(std::vector<BYTE>& dataOut)
-	{
-		std::lock_guard<std::mutex> lock(_bufferMutex);
+				// This could be the start of a packet that has not fully arrived. Keep it but look further on for a 
+				// complete packet in case it is just noise that looks like a header
+				firstIncompleteIndex = std::min(firstIncompleteIndex, readIndex);
+				++readIndex;
+				continue;
+			}
+			else
+			{
+				// Verify the crc which will be the last two bytes. A crc of 0 means the device did not calculate one, 
+				// only trust that while resyncing if the content header could be checked. Zeros are common in spectra,
+				// so the header of a cut short packet can pick up a 0 from the packet after it. Only trust an unchecked
+				// packet if whatever has arrived after it could start the next packet
+				uint16_t packetCrc;
+				std::memcpy(&packetCrc, &_buffer[readIndex + packetSize - 2], sizeof(uint16_t));
+				size_t nextIndex = readIndex + packetSize;
+				bool crcSkipped = packetCrc == 0 && (!_resyncing || (pHeader->mode & 0x1) == 0) &&
+					(_writeIndex - nextIndex < sizeof(MessageHeader) || IsPlausibleHeader(reinterpret_cast<const MessageHeader*>(&_buffer[nextIndex])));
+				if (crcSkipped || packetCrc == kmk::crc::CalculateCrc(&_buffer[readIndex], packetSize - 2))
+				{
+					packetFound = true;
+					break;
+				}
 
-		// We need at least 2 bytes for the packet length
-		if (_writeIndex < 2)
-		{
-			return false; // Not enough data
-		}
+				pError = "Corrupt data detected - Crc failed";
 
-		uint16_t* pPacketSize = reinterpret_cast<uint16_t*>(&_buffer[0]);
-		if (*pPacketSize == 0 || *pPacketSize > MAX_REPORT_SIZE)
-		{
-			// Packet size is invalid - critical error!
-			// Attempt a recovery and clear all data currently in the buffer
-			_enableDataRecovery = true;
-			_writeIndex = 0;
-			throw std::runtime_error("Corrupt data detected - Invalid Packet Size");
-		}
+				// While resyncing most positions fail, only count the packet that started the resync
+				if (!_resyncing)
+					++_stats.crcFailures;
+			}
 
-		// Ok we have a size but do we have enough data for the packet?
-		if (_writeIndex < *pPacketSize)
-		{
-			return false; // Not enough data yet
+			// This is not the start of a packet, skip a byte and try again
+			++readIndex;
+
+			if (!_resyncing)
+			{
+				// Report the corruption once then resync on the following calls
+				_resyncing = true;
+				++_stats.resyncEvents;
+				pCorruptionError = pError;
+				break;
+			}
 		}
 
-		// Verify the crc which will be the last two bytes
-		uint16_t* pPacketCrc = reinterpret_cast<uint16_t*>(&_buffer[*pPacketSize - 2]);
-		if (*pPacketCrc == 0 || *pPacketCrc == kmk::crc::CalculateCrc(&_buffer[0], *pPacketSize - 2))
+		// Nothing found while resyncing, keep any data that may still become a packet
+		if (!packetFound && _resyncing)
+			readIndex = std::min(readIndex, firstIncompleteIndex);
+
+		size_t packetSize = packetFound ? reinterpret_cast<const MessageHeader*>(&_buffer[readIndex])->messageSize : 0;
+		if (packetFound)
 		{
 			// Take the data out
-			dataOut.resize(*pPacketSize);
-			std::copy(_buffer.begin(), std::next(_buffer.begin(), *pPacketSize), dataOut.begin());
+			dataOut.resize(packetSize);
+			std::copy(std::next(_buffer.begin(), readIndex), std::next(_buffer.begin(), readIndex + packetSize), dataOut.begin());
+			++_stats.packetsRead;
 
-			// Move remaining data to start of buffer
-			std::copy(std::next(_buffer.begin(), *pPacketSize), std::next(_buffer.begin(), _writeIndex), _buffer.begin());
-			_writeIndex -= *pPacketSize;
-			return true;
+			if (_resyncing)
+			{
+				_resyncing = false;
+				++_stats.packetsRecovered;
+			}
 		}
-		else
+
+		// Move remaining data to start of buffer, throwing away anything skipped
+		size_t consumed = readIndex + packetSize;
+		if (consumed != 0)
 		{
-			// Invalid crc is a critical error as the data has become corrupted and we can not trust any of it
-			_enableDataRecovery = true;
-			_writeIndex = 0;
-			throw std::runtime_error("Corrupt data detected - Crc failed");
-		}		
+			std::copy(std::next(_buffer.begin(), consumed), std::next(_buffer.begin(), _writeIndex), _buffer.begin());
+			_writeIndex -= consumed;
+			_stats.bytesSkipped += readIndex;
+		}
+
+		if (pCorruptionError != NULL)
+			throw std::runtime_error(pCorruptionError);
+
+		return packetFound;
 	}
 
 	void SerialPacketStreamer::PrepareForSend(const std::vector<BYTE>& dataToSend, std::vector<BYTE>& preparedDataOut)
@@ -120,17 +212,35 @@ namespace kmk
 		preparedDataOut = dataToSend;
 	}
 
-	FramedPacketStreamer::FramedPacketStreamer()
+	void SerialPacketStreamer::GetStats(PacketStreamerStats& statsOut)
+	{
+		std::lock_guard<std::mutex> lock(_bufferMutex);
+		statsOut = _stats;
+	}
+
+	FramedPacketStreamer::FramedPacketStreamer(size_t poolSize, OverflowPolicy overflowPolicy, uint32_t blockTimeoutMs)
 		: _writeIndex(0)
 		, _firstByteEscaped(false)
+		, _recovering(false)
+		, _overflowPolicy(overflowPolicy)
+		, _blockTimeoutMs(blockTimeoutMs)
+		, _droppedCallback(NULL)
+		, _droppedCallbackArg(NULL)
+		, _readyCallback(NULL)
+		, _readyCallbackArg(NULL)
 	{
 		_buffer.resize(MAX_REPORT_SIZE);
 
-		// Create buffers for complete packets and add to the pool
-		_poolBuffer.resize(MAX_REPORT_SIZE * PacketPoolSize);
-		for (size_t i = 0; i < PacketPoolSize; ++i)
+		if (poolSize == 0)
+			poolSize = 1;
+
+		// Create buffers for complete packets and add to the pool. Allocate an extra slot alignment so the first slot can 
+		// be moved onto a cache line
+		_poolBuffer.resize(POOL_SLOT_SIZE * poolSize + POOL_SLOT_ALIGNMENT);
+		uintptr_t poolStart = (reinterpret_cast<uintptr_t>(&_poolBuffer[0]) + POOL_SLOT_ALIGNMENT - 1) & ~(uintptr_t)(POOL_SLOT_ALIGNMENT - 1);
+		for (size_t i = 0; i < poolSize; ++i)
 		{
-			_packetPool.push_back(&_poolBuffer[PacketPoolSize * i]);
+			_packetPool.push_back(reinterpret_cast<BYTE*>(poolStart + POOL_SLOT_SIZE * i));
 		}
 	}
 
@@ -145,6 +255,7 @@ namespace kmk
 		std::lock_guard<std::mutex> lock(_bufferMutex);
 		_writeIndex = 0;
 		_firstByteEscaped = false;
+		_recovering = false;
 
 		// Move all packets back to the pool
 		std::lock_guard<std::mutex> poolLock(_poolMutex);
@@ -153,13 +264,77 @@ namespace kmk
 			_packetPool.push_back(i);
 		}
 		_packetsReady.clear();
+		_slotFreedCondition.notify_all();
+	}
+
+	void FramedPacketStreamer::SetPacketsDroppedCallback(PacketsDroppedCallbackFunc func, void* pArg)
+	{
+		std::lock_guard<std::mutex> lock(_bufferMutex);
+		_droppedCallback = func;
+		_droppedCallbackArg = pArg;
+	}
+
+	void FramedPacketStreamer::SetPacketsReadyCallback(PacketsReadyCallbackFunc func, void* pArg)
+	{
+		std::lock_guard<std::mutex> lock(_bufferMutex);
+		_readyCallback = func;
+		_readyCallbackArg = pArg;
+	}
+
+	bool FramedPacketStreamer::QueuePacket(std::unique_lock<std::mutex> &bufferLock, size_t packetSize, uint64_t &totalDroppedOut)
+	{
+		std::unique_lock<std::mutex> poolLock(_poolMutex);
+		const BYTE *pPacket = &_buffer[0];
+		std::vector<BYTE> blockedPacket;
+
+		// Give the consumer a chance to free a slot rather than losing the packet
+		if (_packetPool.empty() && _overflowPolicy == OP_BLOCK)
+		{
+			// Wait without the buffer mutex so the stats can still be read and the streamer cleared. The packet is copied
+			// out first as the buffer may be cleared meanwhile
+			blockedPacket.assign(_buffer.begin(), _buffer.begin() + packetSize);
+			pPacket = &blockedPacket[0];
+			PacketsReadyCallbackFunc readyCallback = _readyCallback;
+			void *readyCallbackArg = _readyCallbackArg;
+			poolLock.unlock();
+			bufferLock.unlock();
+
+			// The consumer is usually only woken once AddIncomingData returns, so it may not know the pool is full
+			if (readyCallback != NULL)
+				(*readyCallback)(readyCallbackArg);
+
+			poolLock.lock();
+			_slotFreedCondition.wait_for(poolLock, std::chrono::milliseconds(_blockTimeoutMs), [this] { return !_packetPool.empty(); });
+
+			// Locks are always taken buffer then pool
+			poolLock.unlock();
+			bufferLock.lock();
+			poolLock.lock();
+		}
+
+		if (!_packetPool.empty())
+		{
+			BYTE* pPoolBuf = _packetPool.front();
+			std::memcpy(pPoolBuf, pPacket, packetSize);
+			_packetPool.pop_front();
+			_packetsReady.push_back(pPoolBuf);
+			_stats.queueHighWater = std::max(_stats.queueHighWater, (uint64_t)_packetsReady.size());
+			return true;
+		}
+
+		++_stats.packetsDropped;
+		_stats.bytesDropped += packetSize;
+		totalDroppedOut = _stats.packetsDropped;
+		return false;
 	}
 
 	bool FramedPacketStreamer::AddIncomingData(const BYTE* pData, size_t dataSize)
 	{
 		// Framed data contains escaped characters. When we find an escaped character sequence replace with the correct character
-		std::lock_guard<std::mutex> lock(_bufferMutex);
+		std::unique_lock<std::mutex> lock(_bufferMutex);
 		size_t readIndex = 0;
+		size_t bytesDropped = 0;
+		uint64_t totalDropped = 0;
 
 		if (_firstByteEscaped)
 		{
@@ -176,6 +351,7 @@ namespace kmk
 				// First check that the length of the packet is sufficient for a size. 
 				// If it is then compare the size with the number of bytes we have read.
 				// If they match then we have a valid packet. If not then remove the corrupt data from the buffer
+				bool validPacket = false;
 				if (_writeIndex >= 2)
 				{
 					uint16_t* pSize = reinterpret_cast<uint16_t*>( &_buffer[0]);
@@ -185,19 +361,33 @@ namespace kmk
 						uint16_t* pPacketCrc = reinterpret_cast<uint16_t*>(&_buffer[_writeIndex - 2]);
 						if (*pPacketCrc == 0 || *pPacketCrc == kmk::crc::CalculateCrc(&_buffer[0], _writeIndex - 2))
 						{
+							validPacket = true;
+
 							// We have a full packet. Add to recieved queue
-							std::lock_guard<std::mutex> poolLock(_poolMutex);
-							if (_packetPool.size() > 0)
-							{
-								BYTE* pPoolBuf = _packetPool.front();
-								std::memcpy(pPoolBuf, &_buffer[0], *pSize);
-								_packetPool.pop_front();
-								_packetsReady.push_back(pPoolBuf);
-							}
+							size_t packetSize = *pSize;
+							if (!QueuePacket(lock, packetSize, totalDropped))
+								bytesDropped += packetSize;
+						}
+						else
+						{
+							++_stats.crcFailures;
 						}
 					}
 				}
 
+				if (validPacket && _recovering)
+				{
+					_recovering = false;
+					++_stats.packetsRecovered;
+				}
+				else if (!validPacket && _writeIndex != 0)
+				{
+					// The next frame byte resyncs the stream, only the corrupt frame is lost
+					_recovering = true;
+					++_stats.resyncEvents;
+					_stats.bytesSkipped += _writeIndex;
+				}
+
 				_writeIndex = 0;
 				++readIndex;
 			}
@@ -205,6 +395,9 @@ namespace kmk
 			{
 				// We have run out of space in the packet buffer. No packet should be bigger than the buffer so something has gone wrong (missing frame byte in corrupted data?)
 				// Discard the buffer as we will have to wait for another frame byte, fail the crc and discard
+				_recovering = true;
+				++_stats.resyncEvents;
+				_stats.bytesSkipped += _writeIndex;
 				_writeIndex = 0;
 			}
 			else if (pData[readIndex] == ESC_BYTE)
@@ -228,7 +421,20 @@ namespace kmk
 				_buffer[_writeIndex++] = pData[readIndex++];
 			}
 		}
-		return true;
+
+		if (bytesDropped == 0)
+			return true;
+
+		// Report the loss with the buffer mutex released so the callback is free to use the streamer
+		PacketsDroppedCallbackFunc droppedCallback = _droppedCallback;
+		void *droppedCallbackArg = _droppedCallbackArg;
+		lock.unlock();
+
+		if (droppedCallback != NULL)
+			(*droppedCallback)(droppedCallbackArg, bytesDropped, totalDropped);
+
+		// Let the caller know that data has been lost
+		return false;
 	}
 
 	bool FramedPacketStreamer::ReadPacket(std::vector<BYTE>& dataOut)
@@ -239,11 +445,14 @@ namespace kmk
 		{
 			BYTE* pPacketData = *_packetsReady.begin();
 			uint16_t* pPacketSize = reinterpret_cast<uint16_t*>(pPacketData);
+			dataOut.resize(*pPacketSize);
 			std::memcpy(&dataOut[0], pPacketData, *pPacketSize);
 
 			// Return to pool
 			_packetsReady.pop_front();
 			_packetPool.push_back(pPacketData);
+			++_stats.packetsRead;
+			_slotFreedCondition.notify_one();
 			return true;
 		}
 		
@@ -294,4 +503,12 @@ namespace kmk
 		preparedDataOut[preparedDataOut.size() - 1] = FRAME_BYTE;
 	}
 
+	void FramedPacketStreamer::GetStats(PacketStreamerStats& statsOut)
+	{
+		std::lock_guard<std::mutex> lock(_bufferMutex);
+		std::lock_guard<std::mutex> poolLock(_poolMutex);
+		statsOut = _stats;
+		statsOut.packetsQueued = _packetsReady.size();
+	}
+
 }
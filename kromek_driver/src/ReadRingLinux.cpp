@@ -0,0 +1,646 @@
+#include "stdafx.h"
+#include "ReadRing.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#ifdef KMK_HAVE_IO_URING
+	#include <linux/io_uring.h>
+#endif
+
+// Entries in the submission queue, enough for a run and a cancel of every file at once. The completion queue is twice this
+#define RING_ENTRIES 512
+
+// Files the ring can read at once, further files are read by their own thread
+#define MAX_RING_FILES 32
+
+// Reads made for each wake up of a file before polling again
+#define RING_READS_PER_POLL 8
+
+// Longest read, the kromek driver nodes return 63 byte reports
+#define RING_BUFFER_LENGTH 64
+
+// User data of the entries that are not part of a run. Runs use ((slot + 1) << 16) | read index
+#define WAKE_USER_DATA 0
+#define CANCEL_USER_DATA 1
+#define POLL_INDEX 0xFFFF
+
+// Slot whose file is being removed, not yet free for another
+#define REMOVING_SLOT -2
+
+namespace kmk
+{
+
+ReadRing::ReadRing()
+: _setUp(false)
+, _available(false)
+, _stopping(false)
+, _ringFd(-1)
+, _wakeFd(-1)
+, _wakeValue(0)
+, _systemCalls(0)
+, _pSqRing(NULL)
+, _sqRingSize(0)
+, _pCqRing(NULL)
+, _cqRingSize(0)
+, _pSqes(NULL)
+, _sqesSize(0)
+, _pSqHead(NULL)
+, _pSqTail(NULL)
+, _pSqArray(NULL)
+, _sqMask(0)
+, _sqEntries(0)
+, _pCqHead(NULL)
+, _pCqTail(NULL)
+, _pCqes(NULL)
+, _cqMask(0)
+, _toSubmit(0)
+, _pBuffers(NULL)
+{
+}
+
+ReadRing::~ReadRing()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_available)
+		{
+			TearDown();
+			return;
+		}
+
+		_stopping = true;
+	}
+
+	// Reads still in flight are cancelled when the ring is closed
+	uint64_t value = 1;
+	if (write(_wakeFd, &value, sizeof(value)) == sizeof(value))
+		_thread.WaitForTermination();
+
+	TearDown();
+}
+
+ReadRing &ReadRing::GetInstance()
+{
+	static ReadRing instance;
+	return instance;
+}
+
+uint64_t ReadRing::GetSystemCalls()
+{
+	return _systemCalls.load(std::memory_order_relaxed);
+}
+
+bool ReadRing::IsAvailable()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (!_setUp)
+	{
+		_setUp = true;
+		_available = SetUp();
+	}
+
+	return _available;
+}
+
+#ifdef KMK_HAVE_IO_URING
+
+static int RingEnter(int ringFd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+bool ReadRing::SetUp()
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = RING_ENTRIES * 2;
+
+	_ringFd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (_ringFd < 0)
+		return false;
+
+	// Kernel 5.9 or later. Reads from the current position are needed for the devices that can not seek
+	const unsigned requiredFeatures = IORING_FEAT_NODROP | IORING_FEAT_RW_CUR_POS | IORING_FEAT_POLL_32BITS;
+	if ((params.features & requiredFeatures) != requiredFeatures)
+	{
+		TearDown();
+		return false;
+	}
+
+	// Every operation used must be supported, they may be disabled even on a new kernel
+	const int probeOps = IORING_OP_LAST;
+	std::vector<unsigned char> probeBuffer(sizeof(io_uring_probe) + probeOps * sizeof(io_uring_probe_op), 0);
+	io_uring_probe *pProbe = (io_uring_probe*)&probeBuffer[0];
+	if (syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_PROBE, pProbe, probeOps) < 0)
+	{
+		TearDown();
+		return false;
+	}
+
+	const int requiredOps[] = { IORING_OP_POLL_ADD, IORING_OP_READ_FIXED, IORING_OP_READ, IORING_OP_ASYNC_CANCEL };
+	for (size_t i = 0; i < sizeof(requiredOps) / sizeof(requiredOps[0]); ++i)
+	{
+		if (requiredOps[i] > pProbe->last_op || (pProbe->ops[requiredOps[i]].flags & IO_URING_OP_SUPPORTED) == 0)
+		{
+			TearDown();
+			return false;
+		}
+	}
+
+	// Map the rings, a single mapping holds both where the kernel allows
+	_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool singleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMapping)
+		_sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+
+	void *pSqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+	_pSqRing = (pSqRing != MAP_FAILED) ? pSqRing : NULL;
+	if (_pSqRing == NULL)
+	{
+		TearDown();
+		return false;
+	}
+
+	if (singleMapping)
+	{
+		_pCqRing = _pSqRing;
+	}
+	else
+	{
+		void *pCqRing = mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_CQ_RING);
+		_pCqRing = (pCqRing != MAP_FAILED) ? pCqRing : NULL;
+	}
+
+	_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	void *pSqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+	_pSqes = (pSqes != MAP_FAILED) ? (io_uring_sqe*)pSqes : NULL;
+	if (_pCqRing == NULL || _pSqes == NULL)
+	{
+		TearDown();
+		return false;
+	}
+
+	unsigned char *pSq = (unsigned char*)_pSqRing;
+	_pSqHead = (unsigned*)(pSq + params.sq_off.head);
+	_pSqTail = (unsigned*)(pSq + params.sq_off.tail);
+	_pSqArray = (unsigned*)(pSq + params.sq_off.array);
+	_sqMask = *(unsigned*)(pSq + params.sq_off.ring_mask);
+	_sqEntries = *(unsigned*)(pSq + params.sq_off.ring_entries);
+
+	unsigned char *pCq = (unsigned char*)_pCqRing;
+	_pCqHead = (unsigned*)(pCq + params.cq_off.head);
+	_pCqTail = (unsigned*)(pCq + params.cq_off.tail);
+	_pCqes = (io_uring_cqe*)(pCq + params.cq_off.cqes);
+	_cqMask = *(unsigned*)(pCq + params.cq_off.ring_mask);
+
+	// One registered region split between the files, so reads need no page pinning or lookup of the buffer each time
+	size_t buffersSize = MAX_RING_FILES * RING_READS_PER_POLL * RING_BUFFER_LENGTH;
+	void *pBuffers = mmap(NULL, buffersSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	_pBuffers = (pBuffers != MAP_FAILED) ? (unsigned char*)pBuffers : NULL;
+	if (_pBuffers == NULL)
+	{
+		TearDown();
+		return false;
+	}
+
+	iovec bufferRegion;
+	bufferRegion.iov_base = _pBuffers;
+	bufferRegion.iov_len = buffersSize;
+	if (syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_BUFFERS, &bufferRegion, 1) < 0)
+	{
+		TearDown();
+		return false;
+	}
+
+	_wakeFd = eventfd(0, EFD_CLOEXEC);
+	if (_wakeFd < 0)
+	{
+		TearDown();
+		return false;
+	}
+
+	_slotFiles.assign(MAX_RING_FILES, -1);
+	_files.resize(MAX_RING_FILES);
+
+	if (!_thread.Start(RingThreadProc, this, TR_READER, "kmk-ring"))
+	{
+		TearDown();
+		return false;
+	}
+
+	return true;
+}
+
+void ReadRing::TearDown()
+{
+	if (_pBuffers != NULL)
+		munmap(_pBuffers, MAX_RING_FILES * RING_READS_PER_POLL * RING_BUFFER_LENGTH);
+
+	if (_pSqes != NULL)
+		munmap(_pSqes, _sqesSize);
+
+	if (_pCqRing != NULL && _pCqRing != _pSqRing)
+		munmap(_pCqRing, _cqRingSize);
+
+	if (_pSqRing != NULL)
+		munmap(_pSqRing, _sqRingSize);
+
+	if (_wakeFd >= 0)
+		close(_wakeFd);
+
+	if (_ringFd >= 0)
+		close(_ringFd);
+
+	_pBuffers = NULL;
+	_pSqes = NULL;
+	_pCqRing = NULL;
+	_pSqRing = NULL;
+	_wakeFd = -1;
+	_ringFd = -1;
+}
+
+bool ReadRing::Add(int fileHandle, size_t readLength, RingReadCallbackFunc func, void *pArg)
+{
+	if (readLength == 0 || readLength > RING_BUFFER_LENGTH)
+		return false;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (!_setUp)
+	{
+		_setUp = true;
+		_available = SetUp();
+	}
+
+	if (!_available)
+		return false;
+
+	std::vector<int>::iterator itSlot = std::find(_slotFiles.begin(), _slotFiles.end(), -1);
+	if (itSlot == _slotFiles.end())
+		return false;
+
+	// The slot is not used by the ring thread until it takes it from the pending adds
+	int slot = (int)(itSlot - _slotFiles.begin());
+	_slotFiles[slot] = fileHandle;
+
+	File &file = _files[slot];
+	file.fileHandle = fileHandle;
+	file.readLength = readLength;
+	file.func = func;
+	file.pArg = pArg;
+	file.completionsDue = 0;
+	file.hungUp = false;
+	file.failed = false;
+	file.removing = false;
+
+	_pendingAdds.push_back(slot);
+
+	uint64_t value = 1;
+	return write(_wakeFd, &value, sizeof(value)) == sizeof(value);
+}
+
+void ReadRing::Remove(int fileHandle)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	std::vector<int>::iterator itSlot = std::find(_slotFiles.begin(), _slotFiles.end(), fileHandle);
+	if (fileHandle < 0 || itSlot == _slotFiles.end())
+		return;
+
+	// The handle may be closed and reused while the reads of the slot are being cancelled
+	int slot = (int)(itSlot - _slotFiles.begin());
+	_slotFiles[slot] = REMOVING_SLOT;
+
+	// From a callback, the thread can not wait for itself. Nothing more is passed on for the file once marked
+	if (std::this_thread::get_id() == _threadId)
+	{
+		lock.unlock();
+		StopFile(slot);
+		return;
+	}
+
+	// The thread has stopped, nothing is in flight
+	if (!_available)
+	{
+		_slotFiles[slot] = -1;
+		return;
+	}
+
+	_pendingRemoves.push_back(slot);
+
+	uint64_t value = 1;
+	if (write(_wakeFd, &value, sizeof(value)) != sizeof(value))
+		return;
+
+	while (_slotFiles[slot] == REMOVING_SLOT)
+		_removedCondition.wait(lock);
+}
+
+io_uring_sqe *ReadRing::GetSqe()
+{
+	unsigned tail = *_pSqTail;
+	if (tail - __atomic_load_n(_pSqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+	{
+		// Never expected, the ring is sized for everything the thread queues between waits
+		int submitted = RingEnter(_ringFd, _toSubmit, 0, 0);
+		_systemCalls.fetch_add(1, std::memory_order_relaxed);
+		if (submitted > 0)
+			_toSubmit -= submitted;
+
+		if (tail - __atomic_load_n(_pSqHead, __ATOMIC_ACQUIRE) >= _sqEntries)
+			return NULL;
+	}
+
+	unsigned index = tail & _sqMask;
+	io_uring_sqe *pSqe = &_pSqes[index];
+	memset(pSqe, 0, sizeof(*pSqe));
+	_pSqArray[index] = index;
+
+	__atomic_store_n(_pSqTail, tail + 1, __ATOMIC_RELEASE);
+	++_toSubmit;
+	return pSqe;
+}
+
+void ReadRing::QueueWakeRead()
+{
+	io_uring_sqe *pSqe = GetSqe();
+	if (pSqe == NULL)
+		return;
+
+	pSqe->opcode = IORING_OP_READ;
+	pSqe->fd = _wakeFd;
+	pSqe->addr = (uint64_t)(uintptr_t)&_wakeValue;
+	pSqe->len = sizeof(_wakeValue);
+	pSqe->user_data = WAKE_USER_DATA;
+}
+
+void ReadRing::SubmitRun(int slot)
+{
+	File &file = _files[slot];
+	uint64_t runUserData = (uint64_t)(slot + 1) << 16;
+
+	// The whole run has to go into the ring together, the last entry of a submission can not link to the next
+	unsigned tail = *_pSqTail;
+	if (tail - __atomic_load_n(_pSqHead, __ATOMIC_ACQUIRE) + RING_READS_PER_POLL + 1 > _sqEntries)
+	{
+		int submitted = RingEnter(_ringFd, _toSubmit, 0, 0);
+		_systemCalls.fetch_add(1, std::memory_order_relaxed);
+		if (submitted > 0)
+			_toSubmit -= submitted;
+
+		// The kernel may take none of them, e.g. while the completion queue is backed up
+		if (tail - __atomic_load_n(_pSqHead, __ATOMIC_ACQUIRE) + RING_READS_PER_POLL + 1 > _sqEntries)
+		{
+			file.failed = true;
+			(*file.func)(file.pArg, NULL, -EBUSY);
+			return;
+		}
+	}
+
+	// Wait for the file to have data, then read until it has no more. A failed or short read cancels the rest of the run.
+	// There is room for the whole run, so none of these fail
+	io_uring_sqe *pSqe = GetSqe();
+
+	pSqe->opcode = IORING_OP_POLL_ADD;
+	pSqe->fd = file.fileHandle;
+	pSqe->poll32_events = POLLIN;
+	pSqe->flags = IOSQE_IO_LINK;
+	pSqe->user_data = runUserData | POLL_INDEX;
+
+	for (int i = 0; i < RING_READS_PER_POLL; ++i)
+	{
+		pSqe = GetSqe();
+
+		// The file is non blocking, so an empty device ends the run. RWF_NOWAIT would say the same but the driver nodes
+		// do not support it
+		pSqe->opcode = IORING_OP_READ_FIXED;
+		pSqe->fd = file.fileHandle;
+		pSqe->off = (uint64_t)-1;
+		pSqe->addr = (uint64_t)(uintptr_t)&_pBuffers[(slot * RING_READS_PER_POLL + i) * RING_BUFFER_LENGTH];
+		pSqe->len = (unsigned)file.readLength;
+		pSqe->buf_index = 0;
+		pSqe->flags = (i + 1 < RING_READS_PER_POLL) ? IOSQE_IO_LINK : 0;
+		pSqe->user_data = runUserData | i;
+	}
+
+	file.completionsDue = RING_READS_PER_POLL + 1;
+	file.hungUp = false;
+}
+
+void ReadRing::StopFile(int slot)
+{
+	File &file = _files[slot];
+	if (file.removing)
+		return;
+
+	// The slot is released once nothing is in flight for it, after the completion being handled if called from a callback
+	file.removing = true;
+	_removingSlots.push_back(slot);
+
+	if (file.completionsDue == 0)
+		return;
+
+	// Which entry of the run is waiting is not known, cancel them all. Those already complete are not found
+	uint64_t runUserData = (uint64_t)(slot + 1) << 16;
+	for (int i = -1; i < RING_READS_PER_POLL; ++i)
+	{
+		io_uring_sqe *pSqe = GetSqe();
+		if (pSqe == NULL)
+			return;
+
+		pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+		pSqe->fd = -1;
+		pSqe->addr = runUserData | ((i < 0) ? POLL_INDEX : i);
+		pSqe->user_data = CANCEL_USER_DATA;
+	}
+}
+
+void ReadRing::ReleaseSlot(int slot)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_slotFiles[slot] = -1;
+	_removedCondition.notify_all();
+}
+
+bool ReadRing::ProcessPendingChanges()
+{
+	std::vector<int> adds;
+	std::vector<int> removes;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_stopping)
+			return false;
+
+		adds.swap(_pendingAdds);
+		removes.swap(_pendingRemoves);
+	}
+
+	// A file may have been removed from a callback before its first run
+	for (size_t i = 0; i < adds.size(); ++i)
+	{
+		if (!_files[adds[i]].removing)
+			SubmitRun(adds[i]);
+	}
+
+	for (size_t i = 0; i < removes.size(); ++i)
+		StopFile(removes[i]);
+
+	// Only now is nothing on the thread still using the files, a released slot may be taken by Add straight away
+	std::vector<int>::iterator itSlot = _removingSlots.begin();
+	while (itSlot != _removingSlots.end())
+	{
+		if (_files[*itSlot].completionsDue == 0)
+		{
+			ReleaseSlot(*itSlot);
+			itSlot = _removingSlots.erase(itSlot);
+		}
+		else
+		{
+			++itSlot;
+		}
+	}
+
+	return true;
+}
+
+void ReadRing::HandleCompletion(uint64_t userData, int result)
+{
+	if (userData == WAKE_USER_DATA)
+	{
+		QueueWakeRead();
+		return;
+	}
+
+	if (userData == CANCEL_USER_DATA)
+		return;
+
+	int slot = (int)(userData >> 16) - 1;
+	unsigned index = (unsigned)(userData & 0xFFFF);
+	File &file = _files[slot];
+	--file.completionsDue;
+
+	if (index == POLL_INDEX)
+	{
+		if (result > 0 && (result & (POLLHUP | POLLERR)) != 0)
+			file.hungUp = true;
+	}
+	else if (!file.removing && !file.failed)
+	{
+		if (result > 0)
+		{
+			(*file.func)(file.pArg, &_pBuffers[(slot * RING_READS_PER_POLL + index) * RING_BUFFER_LENGTH], result);
+		}
+		else if ((result == 0 && file.hungUp) || (result < 0 && result != -EAGAIN && result != -ECANCELED))
+		{
+			// An empty read is only the end of the file once the poll has seen it hang up
+			file.failed = true;
+			(*file.func)(file.pArg, NULL, result);
+		}
+	}
+
+	// Run finished. A removed file is released by ProcessPendingChanges
+	if (file.completionsDue == 0 && !file.removing && !file.failed)
+		SubmitRun(slot);
+}
+
+int ReadRing::RingThreadProc(void *pArg)
+{
+	ReadRing *pThis = (ReadRing*)pArg;
+	{
+		std::lock_guard<std::mutex> lock(pThis->_mutex);
+		pThis->_threadId = std::this_thread::get_id();
+	}
+
+	pThis->QueueWakeRead();
+
+	while (pThis->ProcessPendingChanges())
+	{
+		// Submit everything queued and sleep until something completes
+		int submitted = RingEnter(pThis->_ringFd, pThis->_toSubmit, 1, IORING_ENTER_GETEVENTS);
+		pThis->_systemCalls.fetch_add(1, std::memory_order_relaxed);
+		if (submitted > 0)
+		{
+			pThis->_toSubmit -= submitted;
+		}
+		else if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			// Not expected once set up. Fail every file so their devices report it, later files are read by threads
+			int error = -errno;
+			std::vector<int> failedSlots;
+			{
+				std::lock_guard<std::mutex> lock(pThis->_mutex);
+				pThis->_available = false;
+
+				// Free the slots being removed, nothing more will complete for them
+				pThis->_removingSlots.clear();
+				for (int slot = 0; slot < MAX_RING_FILES; ++slot)
+				{
+					if (pThis->_slotFiles[slot] == REMOVING_SLOT)
+						pThis->_slotFiles[slot] = -1;
+					else if (pThis->_slotFiles[slot] >= 0 && !pThis->_files[slot].failed)
+						failedSlots.push_back(slot);
+				}
+
+				pThis->_pendingAdds.clear();
+				pThis->_pendingRemoves.clear();
+				pThis->_removedCondition.notify_all();
+			}
+
+			for (size_t i = 0; i < failedSlots.size(); ++i)
+			{
+				File &file = pThis->_files[failedSlots[i]];
+				file.failed = true;
+				(*file.func)(file.pArg, NULL, error);
+			}
+
+			break;
+		}
+
+		// Take every completion, freeing each entry before its callback so the kernel has room for more
+		unsigned head = *pThis->_pCqHead;
+		while (head != __atomic_load_n(pThis->_pCqTail, __ATOMIC_ACQUIRE))
+		{
+			io_uring_cqe *pCqe = &pThis->_pCqes[head & pThis->_cqMask];
+			uint64_t userData = pCqe->user_data;
+			int result = pCqe->res;
+			__atomic_store_n(pThis->_pCqHead, ++head, __ATOMIC_RELEASE);
+
+			pThis->HandleCompletion(userData, result);
+		}
+	}
+
+	return 0;
+}
+
+#else
+
+bool ReadRing::SetUp()
+{
+	return false;
+}
+
+void ReadRing::TearDown()
+{
+}
+
+bool ReadRing::Add(int /*fileHandle*/, size_t /*readLength*/, RingReadCallbackFunc /*func*/, void * /*pArg*/)
+{
+	return false;
+}
+
+void ReadRing::Remove(int /*fileHandle*/)
+{
+}
+
+#endif
+
+}
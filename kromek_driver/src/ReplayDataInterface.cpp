@@ -0,0 +1,399 @@
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+
+#include "ReplayDataInterface.h"
+#include "kmkTime.h"
+#include "Lock.h"
+
+// A response is only matched to a configuration request if it was captured within this time (ms)
+#define CONFIGURATION_RESPONSE_WINDOW 1000
+
+// Oldest capture version that can be played. Version 1 recorded responses as plain data records
+#define CAPTURE_FILE_MIN_VERSION 1
+
+// Bytes before the end of a D3 message header: uint16 messageSize, uint8 mode, uint8 componentId, uint8 reportId
+#define D3_HEADER_SIZE 5
+
+// Longest single wait (ms) between checks for StopReading
+#define MAX_PLAYBACK_WAIT 200
+
+namespace kmk
+{
+
+// Identifies what a configuration request asks for or a response answers. For a D3 message (starts with its own size)
+// this is the component and report id, otherwise it is the HID report id in the first byte. Returns -1 if empty
+static int GetConfigurationKey(const BYTE *pData, size_t size)
+{
+	if (size == 0)
+		return -1;
+
+	if (size >= D3_HEADER_SIZE && (size_t)(pData[0] | (pData[1] << 8)) == size)
+		return 0x10000 | (pData[3] << 8) | pData[4];
+
+	return pData[0];
+}
+
+ReplayDataInterface::ReplayDataInterface(const char *pCaptureFilePath, PlaybackMode mode /*= PM_ORIGINAL_TIMING*/, double speed /*= 1.0*/, bool loop /*= false*/)
+: _captureFilePath(pCaptureFilePath)
+, _playbackMode(mode)
+, _speed(speed > 0 ? speed : 1.0)
+, _loop(loop)
+, _position(0)
+, _timelineOrigin(0)
+, _playbackStartTime(0)
+, _reading(false)
+, _stopEvent(false, false, L"")
+, _pClock(NULL)
+, _dataReadyCallback(NULL)
+, _dataReadyCallbackArg(NULL)
+, _errorCallback(NULL)
+, _errorCallbackArg(NULL)
+{
+	memset(&_header, 0, sizeof(_header));
+
+	if (_playbackMode == PM_ORIGINAL_TIMING)
+		_speed = 1.0;
+
+	_ifProperties[L"CaptureFile"] = String(_captureFilePath.begin(), _captureFilePath.end());
+}
+
+ReplayDataInterface::~ReplayDataInterface()
+{
+	StopReading();
+}
+
+unsigned int ReplayDataInterface::GetHash()
+{
+	unsigned int hash = 0;
+	for (size_t i = 0; i < _captureFilePath.length(); ++i)
+		hash = 65599 * hash + _captureFilePath.c_str()[i];
+	return hash ^ (hash >> 16);
+}
+
+bool ReplayDataInterface::Initialize()
+{
+	kmk::Lock lock(_readCriticalSection);
+
+	if (!_captureData.empty())
+		return true;
+
+	return LoadCaptureFile();
+}
+
+VID ReplayDataInterface::GetVendorID()
+{
+	return _header.vendorId;
+}
+
+PID ReplayDataInterface::GetProductID()
+{
+	return _header.productId;
+}
+
+String ReplayDataInterface::GetInterfaceProperty(const String& name)
+{
+	InterfaceProperties::iterator i = _ifProperties.find(name);
+	return (i != _ifProperties.end()) ? i->second : L"";
+}
+
+void ReplayDataInterface::SetDataReadyCallback(DataReadyCallbackFunc pFunc, void *pArg)
+{
+	kmk::Lock lock(_callbackCriticalSection);
+	_dataReadyCallback = pFunc;
+	_dataReadyCallbackArg = pArg;
+}
+
+void ReplayDataInterface::SetErrorCallback(ErrorCallbackFunc func, void *pArg)
+{
+	kmk::Lock lock(_readCriticalSection);
+	_errorCallback = func;
+	_errorCallbackArg = pArg;
+}
+
+// Read the whole capture into memory and split it into the playback timeline and the configuration responses
+bool ReplayDataInterface::LoadCaptureFile()
+{
+	FILE *pFile = fopen(_captureFilePath.c_str(), "rb");
+	if (pFile == NULL)
+		return false;
+
+	std::vector<BYTE> fileData;
+	BYTE buffer[4096];
+	size_t bytesRead;
+	while ((bytesRead = fread(buffer, 1, sizeof(buffer), pFile)) > 0)
+		fileData.insert(fileData.end(), buffer, buffer + bytesRead);
+
+	fclose(pFile);
+
+	if (fileData.size() < sizeof(CaptureFileHeader))
+		return false;
+
+	CaptureFileHeader header;
+	memcpy(&header, &fileData[0], sizeof(header));
+	if (memcmp(header.magic, CAPTURE_FILE_MAGIC, sizeof(header.magic)) != 0 || header.version < CAPTURE_FILE_MIN_VERSION ||
+		header.version > CAPTURE_FILE_VERSION ||
+		header.headerSize < sizeof(CaptureFileHeader) || header.headerSize > fileData.size())
+		return false;
+
+	// Requests waiting for a response, oldest first. Pipelined requests are answered in the order they were sent
+	std::deque<std::pair<std::vector<BYTE>, int64_t> > pendingRequests;
+	std::deque<std::pair<std::vector<BYTE>, int64_t> >::iterator request;
+	int64_t windowTicks = MS_TO_TICKS(CONFIGURATION_RESPONSE_WINDOW);
+
+	std::vector<Record> timeline;
+	ResponseMap responses;
+
+	size_t offset = header.headerSize;
+	while (fileData.size() - offset >= sizeof(CaptureRecordHeader))
+	{
+		CaptureRecordHeader recordHeader;
+		memcpy(&recordHeader, &fileData[offset], sizeof(recordHeader));
+		offset += sizeof(recordHeader);
+
+		// A truncated last record (capture was interrupted) is ignored
+		if (recordHeader.dataSize > fileData.size() - offset)
+			break;
+
+		Record record;
+		record.timestamp = recordHeader.timestamp;
+		record.offset = offset;
+		record.size = recordHeader.dataSize;
+		offset += recordHeader.dataSize;
+
+		// Forget requests that were never answered
+		while (!pendingRequests.empty() && record.timestamp - pendingRequests.front().second > windowTicks)
+			pendingRequests.pop_front();
+
+		// The oldest pending request asking for what this record answers
+		int key = GetConfigurationKey(&fileData[0] + record.offset, record.size);
+		for (request = pendingRequests.begin(); request != pendingRequests.end(); ++request)
+		{
+			if (GetConfigurationKey(&request->first[0], request->first.size()) == key)
+				break;
+		}
+
+		switch (recordHeader.type)
+		{
+		case CRT_DATA:
+			// Version 1 captures recorded responses as data. Later versions never answer a request with a data record,
+			// so anything read from the device (spectra, interleaved packets) stays in the timeline
+			if (header.version < 2 && request != pendingRequests.end())
+			{
+				responses[request->first].responses.push_back(record);
+				pendingRequests.erase(request);
+			}
+			else
+			{
+				timeline.push_back(record);
+			}
+			break;
+
+		case CRT_CONFIGURATION_RESPONSE:
+			if (request != pendingRequests.end())
+			{
+				responses[request->first].responses.push_back(record);
+				pendingRequests.erase(request);
+			}
+			break;
+
+		case CRT_GET_CONFIGURATION:
+			if (record.size > 0)
+				pendingRequests.push_back(std::make_pair(std::vector<BYTE>(&fileData[0] + record.offset, &fileData[0] + record.offset + record.size), record.timestamp));
+			break;
+
+		default:
+			// Settings and anything newer than this version are not needed for playback
+			break;
+		}
+	}
+
+	_header = header;
+	_captureData.swap(fileData);
+	_timeline.swap(timeline);
+	_responses.swap(responses);
+	_position = 0;
+
+	return true;
+}
+
+void ReplayDataInterface::RestartTimeline()
+{
+	if (_position < _timeline.size())
+		_timelineOrigin = _timeline[_position].timestamp;
+
+	_playbackStartTime = kmk::Time::GetTimeMs();
+}
+
+bool ReplayDataInterface::BeginReading()
+{
+	kmk::Lock lock(_readCriticalSection);
+
+	if (_reading || _captureData.empty())
+		return false;
+
+	_reading = true;
+	_stopEvent.Reset();
+	RestartTimeline();
+
+	_pClock = VirtualClock::GetEnabled();
+	if (_pClock != NULL)
+	{
+		_pClock->AddListener(AdvanceProc, this);
+		return true;
+	}
+
+	if (!_readThread.Start(ReadDataThread, this, TR_READER, "kmk-replay"))
+	{
+		_reading = false;
+		return false;
+	}
+
+	return true;
+}
+
+bool ReplayDataInterface::StopReading()
+{
+	VirtualClock *pClock = NULL;
+	{
+		kmk::Lock lock(_readCriticalSection);
+
+		if (!_reading)
+			return false;
+
+		_reading = false;
+		_stopEvent.Signal();
+
+		pClock = _pClock;
+		_pClock = NULL;
+	}
+
+	// The clock calls back into the interface holding its own lock, so remove the listener without holding ours
+	if (pClock != NULL)
+		pClock->RemoveListener(AdvanceProc, this);
+	else
+		_readThread.WaitForTermination();
+
+	return true;
+}
+
+bool ReplayDataInterface::IsPlaybackComplete()
+{
+	kmk::Lock lock(_readCriticalSection);
+	return !_loop && _position >= _timeline.size();
+}
+
+bool ReplayDataInterface::GetConfigurationSetting(unsigned char *pReportdata, size_t dataLength)
+{
+	Record response;
+	{
+		kmk::Lock lock(_readCriticalSection);
+
+		ResponseMap::iterator it = _responses.find(std::vector<BYTE>(pReportdata, pReportdata + dataLength));
+		if (it == _responses.end() || it->second.responses.empty())
+			return false;
+
+		ResponseList &list = it->second;
+		response = list.responses[list.next];
+		if (list.next + 1 < list.responses.size())
+			++list.next;
+	}
+
+	// Returned through the data callback the same as a real device
+	Deliver(response);
+	return true;
+}
+
+bool ReplayDataInterface::SetConfigurationSetting(unsigned char * /*pData*/, size_t /*dataLength*/)
+{
+	return true;
+}
+
+void ReplayDataInterface::Deliver(const Record &record)
+{
+	kmk::Lock lock(_callbackCriticalSection);
+
+	if (_dataReadyCallback != NULL && record.size > 0)
+	{
+		(*_dataReadyCallback)(_dataReadyCallbackArg, &_captureData[record.offset], record.size);
+	}
+}
+
+int64_t ReplayDataInterface::TakeNextRecord(int64_t nowMs, Record &recordOut)
+{
+	if (_position >= _timeline.size())
+	{
+		// Nothing left to play, idle until stopped
+		if (!_loop || _timeline.empty())
+			return MAX_PLAYBACK_WAIT;
+
+		_position = 0;
+		RestartTimeline();
+	}
+
+	recordOut = _timeline[_position];
+
+	if (_playbackMode != PM_AS_FAST_AS_POSSIBLE)
+	{
+		int64_t dueMs = _playbackStartTime + (int64_t)(kmk::Time::TicksToMs(recordOut.timestamp - _timelineOrigin) / _speed);
+		if (dueMs > nowMs)
+			return dueMs - nowMs;
+	}
+
+	++_position;
+	return 0;
+}
+
+// Thread function for playing the timeline until stopped. Pass all data up via the DataReadyCallback
+int ReplayDataInterface::ReadDataThread(void *pArg)
+{
+	ReplayDataInterface *pThis = (ReplayDataInterface*)pArg;
+
+	while (true)
+	{
+		Record record;
+		int64_t waitMs = 0;
+		{
+			kmk::Lock lock(pThis->_readCriticalSection);
+
+			if (!pThis->_reading)
+				break;
+
+			waitMs = pThis->TakeNextRecord(kmk::Time::GetTimeMs(), record);
+		}
+
+		if (waitMs > 0)
+		{
+			pThis->_stopEvent.Wait((uint32_t)((waitMs < MAX_PLAYBACK_WAIT) ? waitMs : MAX_PLAYBACK_WAIT));
+			continue;
+		}
+
+		pThis->Deliver(record);
+	}
+
+	return 0;
+}
+
+// Called each time the virtual clock is advanced. Plays every record due by the new time, a looping capture goes round
+// at most once per step
+void ReplayDataInterface::AdvanceProc(void *pArg, int64_t timeMs)
+{
+	ReplayDataInterface *pThis = (ReplayDataInterface*)pArg;
+
+	for (size_t played = 0; played <= pThis->_timeline.size(); ++played)
+	{
+		Record record;
+		{
+			kmk::Lock lock(pThis->_readCriticalSection);
+
+			if (!pThis->_reading || pThis->TakeNextRecord(timeMs, record) > 0)
+				break;
+		}
+
+		pThis->Deliver(record);
+	}
+}
+
+}
@@ -11,9 +11,13 @@ RollingQueue::RollingQueue(int bufferSize, int numBuffers)
 , _readIndex(0)
 , _writeIndex(0)
 , _numEntries(0)
+, _highWater(0)
+, _numOverwritten(0)
+, _criticalSection("RollingQueue::_criticalSection")
 {
 	_data.resize(bufferSize * numBuffers);
 	_timestamps.resize(numBuffers);
+	_traced.resize(numBuffers);
 }
 
 RollingQueue::~RollingQueue()
@@ -27,7 +31,7 @@ int RollingQueue::IncrementCounter(int currentVal)
 	return (currentVal >= _totalBuffers) ? 0 : currentVal;
 }
 
-bool RollingQueue::Enqueue(int64_t timeStamp, unsigned char *pData, size_t dataSize)
+bool RollingQueue::Enqueue(int64_t timeStamp, unsigned char *pData, size_t dataSize, int *pNumEntriesOut, bool traced)
 {
 	if (dataSize > (size_t)_bufferSize)
 		return false;
@@ -35,22 +39,29 @@ bool RollingQueue::Enqueue(int64_t timeStamp, unsigned char *pData, size_t dataS
 	kmk::Lock lock (_criticalSection);
     memcpy(&_data[_writeIndex * _bufferSize], pData, dataSize);
 	_timestamps[_writeIndex] = timeStamp;
+	_traced[_writeIndex] = traced;
 	_writeIndex = IncrementCounter(_writeIndex);
 
 	if (_numEntries == _totalBuffers)
 	{
 		// Queue is full so we just replaced the oldest entry, move the read pointer
 		_readIndex = IncrementCounter(_readIndex);
+		++_numOverwritten;
 	}
 	else
 	{
 		++_numEntries;
+		if (_numEntries > _highWater)
+			_highWater = _numEntries;
 	}
 
+	if (pNumEntriesOut != NULL)
+		*pNumEntriesOut = _numEntries;
+
 	return true;
 }
 
-bool RollingQueue::Dequeue(unsigned char *pDataOut, size_t dataSize, int64_t &timeStampOut)
+bool RollingQueue::Dequeue(unsigned char *pDataOut, size_t dataSize, int64_t &timeStampOut, bool *pTracedOut)
 {
     if (dataSize != (size_t)_bufferSize)
 		return false;
@@ -62,6 +73,8 @@ bool RollingQueue::Dequeue(unsigned char *pDataOut, size_t dataSize, int64_t &ti
 
 	memcpy(pDataOut, &_data[_readIndex * _bufferSize], _bufferSize);
 	timeStampOut = _timestamps[_readIndex];
+	if (pTracedOut != NULL)
+		*pTracedOut = _traced[_readIndex] != 0;
 	_readIndex = IncrementCounter(_readIndex);
 	--_numEntries;
 	return true;
@@ -83,4 +96,12 @@ bool RollingQueue::IsEmpty()
 	return _numEntries == 0;
 }
 
+void RollingQueue::GetStats(int &numEntriesOut, int &highWaterOut, uint64_t &numOverwrittenOut)
+{
+	kmk::Lock lock (_criticalSection);
+	numEntriesOut = _numEntries;
+	highWaterOut = _highWater;
+	numOverwrittenOut = _numOverwritten;
+}
+
 }
@@ -0,0 +1,746 @@
+#include "stdafx.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+
+#include "SimulatedDataInterface.h"
+#include "IDevice.h"
+#include "SIGMA_25.h"
+#include "UNIBASE.h"
+#include "Thread.h"
+#include "Event.h"
+#include "kmkTime.h"
+#include "crc.h"
+#include "Lock.h"
+#include "VirtualClock.h"
+
+// Time (ms) between ticks of the simulation thread
+#define SIMULATION_TICK_INTERVAL 10
+
+// Longest period (ms) generated in one tick. If the process stalls for longer the missing time is not caught up
+#define MAX_SIMULATION_PERIOD 1000
+
+// Interval count report, as read by IntervalCountProcessor. Each report holds up to 31 events
+#define INTERVAL_COUNT_REPORT_ID 4
+#define INTERVAL_COUNT_REPORT_SIZE 63
+
+// Firmware version reported by all simulated devices
+#define SIMULATED_FIRMWARE_VERSION 0x0100
+
+namespace kmk
+{
+
+// Runs every reading simulated interface in the process from a single thread. The thread is started with the first
+// interface and stopped once the last one has gone. If the first interface starts while the virtual clock is enabled the
+// interfaces are ticked each time the clock is advanced instead
+class SimulationHub
+{
+public:
+	static SimulationHub &GetInstance()
+	{
+		static SimulationHub instance;
+		return instance;
+	}
+
+	void Add(SimulatedDataInterface *pInterface)
+	{
+		kmk::Lock controlLock(_controlCriticalSection);
+		{
+			kmk::Lock lock(_criticalSection);
+			_interfaces.push_back(pInterface);
+		}
+
+		if (!_running && _pClock == NULL)
+		{
+			_pClock = VirtualClock::GetEnabled();
+			if (_pClock != NULL)
+			{
+				_pClock->AddListener(AdvanceProc, this);
+			}
+			else
+			{
+				_stopEvent.Reset();
+				_running = _thread.Start(TickThread, this, TR_READER, "kmk-simulator");
+			}
+		}
+	}
+
+	void Remove(SimulatedDataInterface *pInterface)
+	{
+		kmk::Lock controlLock(_controlCriticalSection);
+		bool empty;
+		{
+			// Once removed the interface is never ticked again, any tick in progress holds this lock
+			kmk::Lock lock(_criticalSection);
+			_interfaces.erase(std::remove(_interfaces.begin(), _interfaces.end(), pInterface), _interfaces.end());
+			empty = _interfaces.empty();
+		}
+
+		if (empty && _pClock != NULL)
+		{
+			_pClock->RemoveListener(AdvanceProc, this);
+			_pClock = NULL;
+		}
+		else if (empty && _running)
+		{
+			_stopEvent.Signal();
+			_thread.WaitForTermination();
+			_running = false;
+		}
+	}
+
+private:
+	std::vector<SimulatedDataInterface*> _interfaces;
+	bool _running;
+	kmk::Thread _thread;
+	kmk::Event _stopEvent;
+
+	// Clock ticking the interfaces in place of the thread
+	VirtualClock *_pClock;
+
+	// Serialises starting and stopping the thread
+	kmk::CriticalSection _controlCriticalSection;
+
+	// Held while ticking
+	kmk::CriticalSection _criticalSection;
+
+	SimulationHub()
+		: _running(false)
+		, _stopEvent(false, false, L"")
+		, _pClock(NULL)
+	{
+	}
+
+	void TickAll(int64_t timeMs)
+	{
+		kmk::Lock lock(_criticalSection);
+
+		for (size_t i = 0; i < _interfaces.size(); ++i)
+			_interfaces[i]->Tick(timeMs);
+	}
+
+	static int TickThread(void *pArg)
+	{
+		SimulationHub *pThis = (SimulationHub*)pArg;
+
+		while (!pThis->_stopEvent.Wait(SIMULATION_TICK_INTERVAL))
+			pThis->TickAll(kmk::Time::GetTimeMs());
+
+		return 0;
+	}
+
+	static void AdvanceProc(void *pArg, int64_t timeMs)
+	{
+		SimulationHub *pThis = (SimulationHub*)pArg;
+		pThis->TickAll(timeMs);
+	}
+};
+
+SimulatedDataInterface::SimulatedDataInterface(VID vendorId, PID productId, const SimulationSettings &settings)
+: _settings(settings)
+, _vendorId(vendorId)
+, _productId(productId)
+, _reading(false)
+, _lastTickTime(kmk::Time::GetTimeMs())
+, _dataReadyCallback(NULL)
+, _dataReadyCallbackArg(NULL)
+, _errorCallback(NULL)
+, _errorCallbackArg(NULL)
+{
+	static std::atomic<unsigned int> instanceCount(0);
+	unsigned int instance = ++instanceCount;
+
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "Simulated/%04X:%04X/%u", vendorId, productId, instance);
+	_name = buffer;
+
+	snprintf(buffer, sizeof(buffer), "SIM%06u", instance);
+	_serialNumber = buffer;
+
+	// Devices are seeded differently unless a seed is given so a fleet does not report identical data. Under the virtual
+	// clock the time is left out so every run repeats
+	unsigned int timeSeed = (VirtualClock::GetEnabled() != NULL) ? 0 : (unsigned int)kmk::Time::GetTime();
+	_random.seed(_settings.seed != 0 ? _settings.seed : timeSeed + instance);
+
+	_ifProperties[L"Simulated"] = String(_name.begin(), _name.end());
+
+	BuildChannelDistribution();
+}
+
+SimulatedDataInterface::~SimulatedDataInterface()
+{
+}
+
+SimulatedDataInterface *SimulatedDataInterface::Create(VID vendorId, PID productId, const SimulationSettings &settings)
+{
+	// The same VID / PID split as DeviceMgr::CreateDevices
+	switch (vendorId)
+	{
+	case OLD_KROMEK_VENDOR_ID:
+	case KROMEK_VENDOR_ID:
+		switch (productId)
+		{
+		case SIGMA_25_D3S::D3SProductId:
+		case UNIBASE_PMT::ProductId:
+		case UNIBASE_SiPM::ProductId:
+		case SIGMA_25_D3M::D3MProductId:
+		case SIGMA_25_D3M::D3M_BUB_ProductId:
+		case SIGMA_25_D3PRD::D3MProductId:
+		case SIGMA_25_D4::D4ProductId:
+			return new D3Simulator(vendorId, productId, false, settings);
+
+		case SIGMA_25_D5RIID::M2R2ProductId:
+			return new D3Simulator(vendorId, productId, true, settings);
+
+		default:
+			return new IntervalCountSimulator(vendorId, productId, settings);
+		}
+
+	case STM_VENDOR_ID:
+		if (productId == SIGMA_25_D3::D3ProductId)
+			return new D3Simulator(vendorId, productId, false, settings);
+		break;
+
+	case TOSHIBA_BT_VENDOR_ID:
+		if (productId == SIGMA_25_D3S::D3SBTProductId || productId == SIGMA_25_D3M::D3MBTProductId)
+			return new D3Simulator(vendorId, productId, false, settings);
+		break;
+	}
+
+	return NULL;
+}
+
+unsigned int SimulatedDataInterface::GetHash()
+{
+	unsigned int hash = 0;
+	for (size_t i = 0; i < _name.length(); ++i)
+		hash = 65599 * hash + _name.c_str()[i];
+	return hash ^ (hash >> 16);
+}
+
+bool SimulatedDataInterface::Initialize()
+{
+	return true;
+}
+
+VID SimulatedDataInterface::GetVendorID()
+{
+	return _vendorId;
+}
+
+PID SimulatedDataInterface::GetProductID()
+{
+	return _productId;
+}
+
+String SimulatedDataInterface::GetInterfaceProperty(const String& name)
+{
+	InterfaceProperties::iterator i = _ifProperties.find(name);
+	return (i != _ifProperties.end()) ? i->second : L"";
+}
+
+void SimulatedDataInterface::SetDataReadyCallback(DataReadyCallbackFunc pFunc, void *pArg)
+{
+	kmk::Lock lock(_callbackCriticalSection);
+	_dataReadyCallback = pFunc;
+	_dataReadyCallbackArg = pArg;
+}
+
+void SimulatedDataInterface::SetErrorCallback(ErrorCallbackFunc func, void *pArg)
+{
+	kmk::Lock lock(_criticalSection);
+	_errorCallback = func;
+	_errorCallbackArg = pArg;
+}
+
+bool SimulatedDataInterface::BeginReading()
+{
+	{
+		kmk::Lock lock(_criticalSection);
+
+		if (_reading)
+			return false;
+
+		// Nothing is generated for the time spent stopped
+		_reading = true;
+		_lastTickTime = kmk::Time::GetTimeMs();
+	}
+
+	SimulationHub::GetInstance().Add(this);
+	return true;
+}
+
+bool SimulatedDataInterface::StopReading()
+{
+	{
+		kmk::Lock lock(_criticalSection);
+
+		if (!_reading)
+			return false;
+	}
+
+	// No tick is in progress once removed, so nothing is delivered after this returns
+	SimulationHub::GetInstance().Remove(this);
+
+	kmk::Lock lock(_criticalSection);
+	_reading = false;
+	_pendingOutput.clear();
+	return true;
+}
+
+void SimulatedDataInterface::QueueOutput(const BYTE *pData, size_t dataSize)
+{
+	// Responses to requests made while stopped are lost, the same as a device that is not being read
+	if (_reading)
+		_pendingOutput.insert(_pendingOutput.end(), pData, pData + dataSize);
+}
+
+unsigned int SimulatedDataInterface::SampleCounts(double rate, int64_t periodMs)
+{
+	double mean = rate * periodMs / 1000.0;
+	if (mean <= 0)
+		return 0;
+
+	std::poisson_distribution<unsigned int> distribution(mean);
+	return distribution(_random);
+}
+
+unsigned int SimulatedDataInterface::SampleChannel()
+{
+	std::uniform_real_distribution<double> distribution(0.0, _channelDistribution.back());
+	size_t channel = std::upper_bound(_channelDistribution.begin(), _channelDistribution.end(), distribution(_random)) - _channelDistribution.begin();
+	return (unsigned int)std::min(channel, (size_t)NUM_CHANNELS - 1);
+}
+
+// Build the cumulative distribution of the continuum plus peaks once so each event is a single binary search
+void SimulatedDataInterface::BuildChannelDistribution()
+{
+	std::vector<double> continuum(NUM_CHANNELS);
+	double continuumTotal = 0;
+	for (int channel = 0; channel < NUM_CHANNELS; ++channel)
+	{
+		continuum[channel] = (_settings.continuumScale > 0) ? exp(-channel / _settings.continuumScale) : 1.0;
+		continuumTotal += continuum[channel];
+	}
+
+	std::vector<double> density(NUM_CHANNELS, 0.0);
+	double peakWeight = 0;
+	for (size_t i = 0; i < _settings.peaks.size(); ++i)
+	{
+		const SimulationPeak &peak = _settings.peaks[i];
+		if (peak.weight <= 0 || peak.sigma <= 0)
+			continue;
+
+		std::vector<double> shape(NUM_CHANNELS);
+		double shapeTotal = 0;
+		for (int channel = 0; channel < NUM_CHANNELS; ++channel)
+		{
+			double offset = (channel - peak.channel) / peak.sigma;
+			shape[channel] = exp(-0.5 * offset * offset);
+			shapeTotal += shape[channel];
+		}
+
+		// Peaks that fall entirely outside the channels add nothing
+		if (shapeTotal <= 0)
+			continue;
+
+		for (int channel = 0; channel < NUM_CHANNELS; ++channel)
+			density[channel] += peak.weight * shape[channel] / shapeTotal;
+
+		peakWeight += peak.weight;
+	}
+
+	double continuumWeight = (peakWeight < 1.0) ? 1.0 - peakWeight : 0.0;
+	_channelDistribution.resize(NUM_CHANNELS);
+
+	double total = 0;
+	for (int channel = 0; channel < NUM_CHANNELS; ++channel)
+	{
+		total += density[channel] + continuumWeight * continuum[channel] / continuumTotal;
+		_channelDistribution[channel] = total;
+	}
+}
+
+void SimulatedDataInterface::Tick(int64_t timeMs)
+{
+	kmk::Lock callbackLock(_callbackCriticalSection);
+	{
+		kmk::Lock lock(_criticalSection);
+
+		int64_t periodMs = timeMs - _lastTickTime;
+		_lastTickTime = timeMs;
+
+		if (periodMs > 0)
+			Generate(std::min(periodMs, (int64_t)MAX_SIMULATION_PERIOD));
+
+		_deliveryBuffer.swap(_pendingOutput);
+		_pendingOutput.clear();
+	}
+
+	if (!_deliveryBuffer.empty() && _dataReadyCallback != NULL)
+		(*_dataReadyCallback)(_dataReadyCallbackArg, &_deliveryBuffer[0], _deliveryBuffer.size());
+
+	_deliveryBuffer.clear();
+}
+
+IntervalCountSimulator::IntervalCountSimulator(VID vendorId, PID productId, const SimulationSettings &settings)
+: SimulatedDataInterface(vendorId, productId, settings)
+{
+}
+
+IntervalCountSimulator::~IntervalCountSimulator()
+{
+	// Stop ticking before this part of the object has gone
+	StopReading();
+}
+
+void IntervalCountSimulator::Generate(int64_t periodMs)
+{
+	unsigned int counts = SampleCounts(_settings.countRate, periodMs);
+
+	BYTE report[INTERVAL_COUNT_REPORT_SIZE];
+	while (counts > 0)
+	{
+		// Each event is a 12 bit channel in 2 bytes with the low bit set. Unused pairs are left zero
+		memset(report, 0, sizeof(report));
+		report[0] = INTERVAL_COUNT_REPORT_ID;
+
+		for (int offset = 1; offset < INTERVAL_COUNT_REPORT_SIZE && counts > 0; offset += 2, --counts)
+		{
+			unsigned int channel = SampleChannel();
+			report[offset] = (BYTE)(channel >> 4);
+			report[offset + 1] = (BYTE)(((channel & 0xF) << 4) | 0x1);
+		}
+
+		QueueOutput(report, sizeof(report));
+	}
+}
+
+bool IntervalCountSimulator::GetConfigurationSetting(unsigned char *pReportdata, size_t dataLength)
+{
+	if (dataLength == 0)
+		return false;
+
+	kmk::Lock lock(_criticalSection);
+
+	// The response size is fixed by the report id, see IntervalCountProcessor::DeterminePacketSize
+	BYTE reportId = pReportdata[0];
+	size_t responseSize;
+	switch (reportId)
+	{
+	case CONFIGURATION_GETGAIN:
+	case CONFIGURATION_GETDIFFGAIN:
+	case CONFIGURATION_GETBIAS:
+		responseSize = 2;
+		break;
+
+	case CONFIGURATION_GETLLD_CHANNEL:
+	case CONFIGURATION_GETPULSEWIDTH:
+	case CONFIGURATION_GETVERSION:
+		responseSize = 3;
+		break;
+
+	case CONFIGURATION_GETSETTINGS:
+		responseSize = 5;
+		break;
+
+	case CONFIGURATION_GETSERIAL:
+		responseSize = DEVICE_SERIAL_LENGTH + 1;
+		break;
+
+	default:
+		return false;
+	}
+
+	std::vector<BYTE> response(responseSize, 0);
+	response[0] = reportId;
+
+	if (reportId == CONFIGURATION_GETSERIAL)
+	{
+		strncpy((char*)&response[1], _serialNumber.c_str(), DEVICE_SERIAL_LENGTH - 1);
+	}
+	else if (reportId == CONFIGURATION_GETVERSION)
+	{
+		unsigned short version = SIMULATED_FIRMWARE_VERSION;
+		memcpy(&response[1], &version, sizeof(version));
+	}
+	else
+	{
+		ConfigurationMap::iterator it = _configuration.find(reportId);
+		if (it != _configuration.end())
+			memcpy(&response[1], &it->second[0], std::min(it->second.size(), responseSize - 1));
+	}
+
+	QueueOutput(&response[0], response.size());
+	return true;
+}
+
+bool IntervalCountSimulator::SetConfigurationSetting(unsigned char *pData, size_t dataLength)
+{
+	if (dataLength < 2)
+		return false;
+
+	kmk::Lock lock(_criticalSection);
+
+	// Stored against the matching get report so it can be read back
+	_configuration[pData[0] | 0x80].assign(pData + 1, pData + dataLength);
+	return true;
+}
+
+D3Simulator::D3Simulator(VID vendorId, PID productId, bool framed, const SimulationSettings &settings)
+: SimulatedDataInterface(vendorId, productId, settings)
+, _framed(framed)
+, _gammaSpectrum(D3Spectrum16ResponseHeader::SPECTRUM_SIZE, 0)
+, _gammaCounts(0)
+, _neutronCounts(0)
+, _spectrumTimeMs(0)
+, _dose(0)
+{
+	if (_framed)
+		_packetStreamer = std::make_shared<FramedPacketStreamer>(1);
+	else
+		_packetStreamer = std::make_shared<SerialPacketStreamer>(0);
+}
+
+D3Simulator::~D3Simulator()
+{
+	// Stop ticking before this part of the object has gone
+	StopReading();
+}
+
+void D3Simulator::Generate(int64_t periodMs)
+{
+	unsigned int counts = SampleCounts(_settings.countRate, periodMs);
+	for (unsigned int i = 0; i < counts; ++i)
+	{
+		uint16_t &channel = _gammaSpectrum[SampleChannel()];
+		if (channel < 0xFFFF)
+			++channel;
+	}
+
+	_gammaCounts += counts;
+	_neutronCounts += SampleCounts(_settings.neutronRate, periodMs);
+	_spectrumTimeMs += (uint32_t)periodMs;
+
+	// Dose is accumulated in Sv from the dose rate in uSv/h
+	_dose += _settings.doseRate * 1e-6 * periodMs / (3600.0 * 1000.0);
+}
+
+bool D3Simulator::DecodeRequest(const BYTE *pData, size_t dataLength, std::vector<BYTE> &requestOut)
+{
+	requestOut.clear();
+
+	if (!_framed)
+	{
+		requestOut.assign(pData, pData + dataLength);
+	}
+	else
+	{
+		// Frames end with 0xC0, 0xC0 and 0xDB inside the frame are escaped with 0xDB
+		for (size_t i = 0; i < dataLength && pData[i] != 0xC0; ++i)
+		{
+			if (pData[i] == 0xDB && i + 1 < dataLength)
+				requestOut.push_back(pData[++i] == 0xDC ? 0xC0 : 0xDB);
+			else
+				requestOut.push_back(pData[i]);
+		}
+	}
+
+	return requestOut.size() >= sizeof(MessageHeader);
+}
+
+void D3Simulator::QueueResponse(std::vector<BYTE> &response)
+{
+	MessageHeader *pHeader = (MessageHeader*)&response[0];
+	pHeader->messageSize = (uint16_t)response.size();
+
+	// Responses are never compressed
+	pHeader->mode = 0;
+
+	uint16_t crc = kmk::crc::CalculateCrc(&response[0], response.size() - sizeof(uint16_t));
+	memcpy(&response[response.size() - sizeof(uint16_t)], &crc, sizeof(crc));
+
+	std::vector<BYTE> prepared;
+	_packetStreamer->PrepareForSend(response, prepared);
+	QueueOutput(&prepared[0], prepared.size());
+}
+
+void D3Simulator::SendError(const MessageHeader &request, uint8_t errorId)
+{
+	std::vector<BYTE> response(sizeof(D3InternalErrorMessage), 0);
+	D3InternalErrorMessage *pError = (D3InternalErrorMessage*)&response[0];
+	pError->m_message.contentHeader.componentID = request.contentHeader.componentID;
+	pError->m_message.contentHeader.reportID = D3InternalErrorMessage::REPORT_ID;
+	pError->m_errorId = errorId;
+	snprintf(pError->m_errorText, sizeof(pError->m_errorText), "Report 0x%02x not implemented", request.contentHeader.reportID);
+	QueueResponse(response);
+}
+
+void D3Simulator::SendSpectrum(const MessageHeader &request)
+{
+	std::vector<BYTE> response;
+
+	if (request.contentHeader.reportID == D3RadiometricsV1ReponseHeader::REPORT_ID)
+	{
+		response.resize(sizeof(D3RadiometricsV1ReponseHeader), 0);
+		D3RadiometricsV1ReponseHeader *pSpectrum = (D3RadiometricsV1ReponseHeader*)&response[0];
+		pSpectrum->realTimeMS = _spectrumTimeMs;
+		pSpectrum->dose = (float)_dose;
+		pSpectrum->doseRate = (float)(_settings.doseRate * 1e-6);
+		pSpectrum->neutronLiveTime = _spectrumTimeMs / 10;
+		pSpectrum->neutronCounts = _neutronCounts;
+		pSpectrum->neutronTemperature = 2500;
+		pSpectrum->gammaLiveTime = _spectrumTimeMs / 10;
+		pSpectrum->gammaCounts = _gammaCounts;
+		pSpectrum->gammaTemperature = 2500;
+		pSpectrum->spectrumBitsSize = 12;
+		memcpy(pSpectrum->gammaSpectrum, &_gammaSpectrum[0], sizeof(pSpectrum->gammaSpectrum));
+	}
+	else
+	{
+		response.resize(sizeof(D3Spectrum16ResponseHeader), 0);
+		D3Spectrum16ResponseHeader *pSpectrum = (D3Spectrum16ResponseHeader*)&response[0];
+		pSpectrum->realTimeMS = _spectrumTimeMs;
+		pSpectrum->neutronCounts = (uint16_t)std::min(_neutronCounts, (uint32_t)0xFFFF);
+		memcpy(pSpectrum->gammaSpectrum, &_gammaSpectrum[0], sizeof(pSpectrum->gammaSpectrum));
+	}
+
+	((MessageHeader*)&response[0])->contentHeader = request.contentHeader;
+	QueueResponse(response);
+
+	// Each spectrum holds the counts since the previous request
+	std::fill(_gammaSpectrum.begin(), _gammaSpectrum.end(), 0);
+	_gammaCounts = 0;
+	_neutronCounts = 0;
+	_spectrumTimeMs = 0;
+}
+
+void D3Simulator::SendConfiguration(const MessageHeader &request)
+{
+	std::vector<BYTE> response;
+	const std::vector<BYTE> *pValue = NULL;
+
+	ConfigurationMap::iterator it = _configuration.find((request.contentHeader.componentID << 8) | request.contentHeader.reportID);
+	if (it != _configuration.end())
+		pValue = &it->second;
+
+	switch (request.contentHeader.reportID)
+	{
+	case D3Configuration16::REPORT_ID_GET_BIAS:
+	case D3Configuration16::REPORT_ID_GET_LLD:
+	case D3Configuration16::REPORT_ID_GET_SOFTWARE_LLD:
+	case D3Configuration16::REPORT_ID_GET_VERSION:
+	case D3Configuration16::REPORT_ID_GET_ACTUAL_BIAS:
+	{
+		response.resize(sizeof(D3Configuration16), 0);
+		D3Configuration16 *pConfiguration = (D3Configuration16*)&response[0];
+		if (request.contentHeader.reportID == D3Configuration16::REPORT_ID_GET_VERSION)
+			pConfiguration->data = SIMULATED_FIRMWARE_VERSION;
+		else if (pValue != NULL)
+			memcpy(&pConfiguration->data, &(*pValue)[0], std::min(pValue->size(), sizeof(pConfiguration->data)));
+		break;
+	}
+
+	case D3Configuration8::REPORT_ID_GET_GAIN:
+	case D3Configuration8::REPORT_ID_GET_OTG:
+	case D3Configuration8::REPORT_ID_GET_ENABLE_LLD:
+	{
+		response.resize(sizeof(D3Configuration8), 0);
+		D3Configuration8 *pConfiguration = (D3Configuration8*)&response[0];
+		if (pValue != NULL && !pValue->empty())
+			pConfiguration->data = (*pValue)[0];
+		break;
+	}
+
+	case D3ConfigurationSerial::REPORT_ID_GET_SERIAL:
+	{
+		response.resize(sizeof(D3ConfigurationSerial), 0);
+		D3ConfigurationSerial *pSerial = (D3ConfigurationSerial*)&response[0];
+		strncpy(pSerial->data, _serialNumber.c_str(), sizeof(pSerial->data) - 1);
+		break;
+	}
+
+	case D3ConfigurationStatus::REPORT_ID_GET_STATUS:
+	{
+		response.resize(sizeof(D3ConfigurationStatus), 0);
+		D3ConfigurationStatus *pStatus = (D3ConfigurationStatus*)&response[0];
+		pStatus->m_d3Temperature = 25;
+		pStatus->m_batteryLevel = 100;
+		pStatus->m_batteryTemperature = 25;
+		break;
+	}
+
+	case D3DeviceInfo::REPORT_ID_GET_DEVICE_INFO:
+		response.resize(sizeof(D3DeviceInfo), 0);
+		break;
+
+	default:
+		SendError(request, D3InternalErrorMessage::ERROR_ID_NOT_IMPLEMENTED);
+		return;
+	}
+
+	((MessageHeader*)&response[0])->contentHeader = request.contentHeader;
+	QueueResponse(response);
+}
+
+bool D3Simulator::GetConfigurationSetting(unsigned char *pReportdata, size_t dataLength)
+{
+	std::vector<BYTE> request;
+	if (!DecodeRequest(pReportdata, dataLength, request))
+		return false;
+
+	kmk::Lock lock(_criticalSection);
+	SendConfiguration(*(MessageHeader*)&request[0]);
+	return true;
+}
+
+bool D3Simulator::SetConfigurationSetting(unsigned char *pData, size_t dataLength)
+{
+	std::vector<BYTE> request;
+	if (!DecodeRequest(pData, dataLength, request))
+		return false;
+
+	kmk::Lock lock(_criticalSection);
+
+	MessageHeader header = *(MessageHeader*)&request[0];
+	switch (header.contentHeader.reportID)
+	{
+	case REPORT_ID_GET_16BIT_SPECTRUM:
+		SendSpectrum(header);
+		break;
+
+	case REPORT_ID_GET_RADIOMETRICSV1_SPECTRUM:
+		// Older devices only have 16 bit spectra, the data processor falls back to them on this error
+		if (_settings.radiometricsV1)
+			SendSpectrum(header);
+		else
+			SendError(header, D3InternalErrorMessage::ERROR_ID_NOT_IMPLEMENTED);
+		break;
+
+	case REPORT_ID_SET_COMPRESSION:
+		// Acknowledged by echoing the request. Responses are always sent uncompressed which the data processor accepts
+		// whatever it asked for
+		if (request.size() >= sizeof(D3CompressionRequest))
+		{
+			request.resize(sizeof(D3CompressionRequest));
+			QueueResponse(request);
+		}
+		break;
+
+	default:
+		// Store settings (header, data, crc) against the matching get report so they can be read back
+		if (request.size() > sizeof(MessageHeader) + sizeof(uint16_t))
+		{
+			_configuration[(header.contentHeader.componentID << 8) | (header.contentHeader.reportID | 0x80)].assign(
+				request.begin() + sizeof(MessageHeader), request.end() - sizeof(uint16_t));
+		}
+		break;
+	}
+
+	return true;
+}
+
+}
@@ -0,0 +1,150 @@
+#include "stdafx.h"
+#include "SpectrumAccumulate.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define KMK_ACCUMULATE_X86
+	#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#define KMK_ACCUMULATE_NEON
+	#include <arm_neon.h>
+#endif
+
+// Number of channels summed in vector lanes before the lane totals are added into the 64 bit result. Keeps each
+// 32 bit lane clear of overflow (at most 65535 * 16384 per lane)
+#define TOTAL_BLOCK_SIZE 65536
+
+namespace kmk
+{
+
+static uint64_t AccumulateScalar(uint32_t *pHistogram, const uint16_t *pCounts, size_t numChannels)
+{
+	uint64_t total = 0;
+	for (size_t i = 0; i < numChannels; ++i)
+	{
+		pHistogram[i] += pCounts[i];
+		total += pCounts[i];
+	}
+	return total;
+}
+
+#ifdef KMK_ACCUMULATE_X86
+
+// 8 channels per iteration, SSE2 is always available on x86-64
+__attribute__((target("sse2")))
+static uint64_t AccumulateSSE2(uint32_t *pHistogram, const uint16_t *pCounts, size_t numChannels)
+{
+	uint64_t total = 0;
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+
+	while (numChannels - i >= 8)
+	{
+		size_t blockEnd = i + ((numChannels - i < TOTAL_BLOCK_SIZE) ? numChannels - i : TOTAL_BLOCK_SIZE);
+		__m128i sum = _mm_setzero_si128();
+
+		for (; i + 8 <= blockEnd; i += 8)
+		{
+			__m128i counts = _mm_loadu_si128((const __m128i*)&pCounts[i]);
+			__m128i lo = _mm_unpacklo_epi16(counts, zero);
+			__m128i hi = _mm_unpackhi_epi16(counts, zero);
+
+			__m128i *pDest = (__m128i*)&pHistogram[i];
+			_mm_storeu_si128(pDest, _mm_add_epi32(_mm_loadu_si128(pDest), lo));
+			_mm_storeu_si128(pDest + 1, _mm_add_epi32(_mm_loadu_si128(pDest + 1), hi));
+
+			sum = _mm_add_epi32(sum, _mm_add_epi32(lo, hi));
+		}
+
+		uint32_t lanes[4];
+		_mm_storeu_si128((__m128i*)lanes, sum);
+		total += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	}
+
+	return total + AccumulateScalar(pHistogram + i, pCounts + i, numChannels - i);
+}
+
+// 16 channels per iteration
+__attribute__((target("avx2")))
+static uint64_t AccumulateAVX2(uint32_t *pHistogram, const uint16_t *pCounts, size_t numChannels)
+{
+	uint64_t total = 0;
+	size_t i = 0;
+
+	while (numChannels - i >= 16)
+	{
+		size_t blockEnd = i + ((numChannels - i < TOTAL_BLOCK_SIZE) ? numChannels - i : TOTAL_BLOCK_SIZE);
+		__m256i sum = _mm256_setzero_si256();
+
+		for (; i + 16 <= blockEnd; i += 16)
+		{
+			__m256i lo = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&pCounts[i]));
+			__m256i hi = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)&pCounts[i + 8]));
+
+			__m256i *pDest = (__m256i*)&pHistogram[i];
+			_mm256_storeu_si256(pDest, _mm256_add_epi32(_mm256_loadu_si256(pDest), lo));
+			_mm256_storeu_si256(pDest + 1, _mm256_add_epi32(_mm256_loadu_si256(pDest + 1), hi));
+
+			sum = _mm256_add_epi32(sum, _mm256_add_epi32(lo, hi));
+		}
+
+		uint32_t lanes[8];
+		_mm256_storeu_si256((__m256i*)lanes, sum);
+		for (int lane = 0; lane < 8; ++lane)
+			total += lanes[lane];
+	}
+
+	return total + AccumulateScalar(pHistogram + i, pCounts + i, numChannels - i);
+}
+
+#endif
+
+#ifdef KMK_ACCUMULATE_NEON
+
+// 8 channels per iteration
+static uint64_t AccumulateNEON(uint32_t *pHistogram, const uint16_t *pCounts, size_t numChannels)
+{
+	uint64_t total = 0;
+	size_t i = 0;
+
+	while (numChannels - i >= 8)
+	{
+		size_t blockEnd = i + ((numChannels - i < TOTAL_BLOCK_SIZE) ? numChannels - i : TOTAL_BLOCK_SIZE);
+		uint32x4_t sum = vdupq_n_u32(0);
+
+		for (; i + 8 <= blockEnd; i += 8)
+		{
+			uint16x8_t counts = vld1q_u16(&pCounts[i]);
+			uint32x4_t lo = vmovl_u16(vget_low_u16(counts));
+			uint32x4_t hi = vmovl_u16(vget_high_u16(counts));
+
+			vst1q_u32(&pHistogram[i], vaddq_u32(vld1q_u32(&pHistogram[i]), lo));
+			vst1q_u32(&pHistogram[i + 4], vaddq_u32(vld1q_u32(&pHistogram[i + 4]), hi));
+
+			sum = vaddq_u32(sum, vaddq_u32(lo, hi));
+		}
+
+		total += (uint64_t)vgetq_lane_u32(sum, 0) + vgetq_lane_u32(sum, 1) + vgetq_lane_u32(sum, 2) + vgetq_lane_u32(sum, 3);
+	}
+
+	return total + AccumulateScalar(pHistogram + i, pCounts + i, numChannels - i);
+}
+
+#endif
+
+uint64_t AccumulateSpectrum(uint32_t *pHistogram, const uint16_t *pCounts, size_t numChannels)
+{
+#if defined(KMK_ACCUMULATE_X86)
+	// Checked once, the cpu will not change under us
+	static const bool hasAVX2 = __builtin_cpu_supports("avx2") != 0;
+	if (hasAVX2)
+		return AccumulateAVX2(pHistogram, pCounts, numChannels);
+
+	return AccumulateSSE2(pHistogram, pCounts, numChannels);
+#elif defined(KMK_ACCUMULATE_NEON)
+	return AccumulateNEON(pHistogram, pCounts, numChannels);
+#else
+	return AccumulateScalar(pHistogram, pCounts, numChannels);
+#endif
+}
+
+}
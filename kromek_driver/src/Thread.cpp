@@ -1,13 +1,28 @@
 #include "stdafx.h"
 #include "Thread.h"
 #include <memory.h>
+#include <string.h>
+#include <algorithm>
 #include "Lock.h"
 #ifndef _WINDOWS
     #include <time.h>
+    #include <errno.h>
+    #include <limits.h>
+    #include <sched.h>
 #endif
 
+// Most cpus a policy cpu mask can name
+#define MAX_POLICY_CPUS 64
+
 namespace kmk
 {
+
+	// Policies and their status by role, shared by every thread
+	static CriticalSection s_policySection;
+	static ThreadPolicy s_policies[TR_COUNT];
+	static ThreadPolicyStatus s_policyStatus[TR_COUNT];
+
+	static const char *s_roleNames[TR_COUNT] = { "kmk-reader", "kmk-processor", "kmk-updater", "kmk-enumerator", "kmk-thread" };
 	
 
 	Thread::Thread()
@@ -20,25 +35,48 @@ namespace kmk
 		, m_isRunning(false)
 #endif
 	{
-		memset(&_callbackArgs, 0, sizeof(CallbackArgs));
+		_callbackArgs.pThread = NULL;
+		_callbackArgs.callbackProc = NULL;
+		_callbackArgs.pArg = NULL;
+		_callbackArgs.role = TR_OTHER;
+		_callbackArgs.name[0] = 0;
+		_callbackArgs.failedSettings = 0;
+		_callbackArgs.error = 0;
 	}
 
-	bool Thread::Start(ThreadProcFunc pFunction, void *pArg)
+	bool Thread::Start(ThreadProcFunc pFunction, void *pArg, ThreadRole role, const char *pName)
 	{
 		_callbackArgs.pThread = this;
 		_callbackArgs.callbackProc = pFunction;
 		_callbackArgs.pArg = pArg;
 
+		ThreadPolicy policy = GetPolicy(role);
+		if (pName == NULL)
+			pName = s_roleNames[role];
+
+		// Linux limits names to 15 characters
+		_callbackArgs.role = role;
+		_callbackArgs.policy = policy;
+		strncpy(_callbackArgs.name, pName, sizeof(_callbackArgs.name) - 1);
+		_callbackArgs.name[sizeof(_callbackArgs.name) - 1] = 0;
+
+		unsigned int failedSettings = 0;
+		int error = 0;
+
 #ifdef _WINDOWS
+		_callbackArgs.failedSettings = failedSettings;
+		_callbackArgs.error = error;
+
 		if (m_handle)
 			CloseHandle(m_handle);
 		m_handle = CreateThread(0,
-			0,
+			policy.stackSize,
 			CallbackProc,
 			&_callbackArgs,
 			0,
 			&m_id);
-		return (m_handle != NULL);
+		if (m_handle == NULL)
+			return false;
 #else
 		if (m_thread)
 		{
@@ -46,8 +84,161 @@ namespace kmk
 			m_thread = 0;
 		}
 
-        return (pthread_create(&m_thread, NULL, CallbackProc, &_callbackArgs) == 0);
+		// Stack size and scheduling have to be set before the thread is created
+		pthread_attr_t attributes;
+		pthread_attr_init(&attributes);
+
+		if (policy.stackSize != 0)
+		{
+			int result = pthread_attr_setstacksize(&attributes, std::max<size_t>(policy.stackSize, PTHREAD_STACK_MIN));
+			if (result != 0)
+			{
+				failedSettings |= TPF_STACK_SIZE;
+				error = result;
+			}
+		}
+
+		bool realTime = policy.scheduling != SP_DEFAULT;
+		if (realTime)
+		{
+			sched_param parameters;
+			parameters.sched_priority = policy.priority;
+
+			int result = pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+			if (result == 0)
+				result = pthread_attr_setschedpolicy(&attributes, (policy.scheduling == SP_FIFO) ? SCHED_FIFO : SCHED_RR);
+			if (result == 0)
+				result = pthread_attr_setschedparam(&attributes, &parameters);
+
+			if (result != 0)
+			{
+				failedSettings |= TPF_SCHEDULING;
+				error = result;
+				pthread_attr_setinheritsched(&attributes, PTHREAD_INHERIT_SCHED);
+				realTime = false;
+			}
+		}
+
+		_callbackArgs.failedSettings = failedSettings;
+		_callbackArgs.error = error;
+		int result = pthread_create(&m_thread, &attributes, CallbackProc, &_callbackArgs);
+
+		// Real time scheduling needs CAP_SYS_NICE or an rtprio limit. Rather than lose the thread run it normally
+		if (result == EPERM && realTime)
+		{
+			failedSettings |= TPF_SCHEDULING;
+			error = result;
+			pthread_attr_setinheritsched(&attributes, PTHREAD_INHERIT_SCHED);
+			_callbackArgs.failedSettings = failedSettings;
+			_callbackArgs.error = error;
+			result = pthread_create(&m_thread, &attributes, CallbackProc, &_callbackArgs);
+		}
+
+		pthread_attr_destroy(&attributes);
+
+		if (result != 0)
+		{
+			m_thread = 0;
+			return false;
+		}
+#endif
+
+		return true;
+	}
+
+	void Thread::ApplyPolicy(CallbackArgs &args)
+	{
+		const ThreadPolicy &policy = args.policy;
+		unsigned int failedSettings = args.failedSettings;
+		int error = args.error;
+
+#ifdef _WINDOWS
+		// Windows has no per thread real time policy, the nearest is the highest priority in the process class
+		if (policy.scheduling != SP_DEFAULT && !SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+		{
+			failedSettings |= TPF_SCHEDULING;
+			error = GetLastError();
+		}
+
+		if (policy.cpuMask != 0 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)policy.cpuMask) == 0)
+		{
+			failedSettings |= TPF_AFFINITY;
+			error = GetLastError();
+		}
+#else
+		if (policy.cpuMask != 0)
+		{
+			cpu_set_t cpus;
+			CPU_ZERO(&cpus);
+			for (int cpu = 0; cpu < MAX_POLICY_CPUS; ++cpu)
+			{
+				if ((policy.cpuMask >> cpu) & 1)
+					CPU_SET(cpu, &cpus);
+			}
+
+			int result = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+			if (result != 0)
+			{
+				failedSettings |= TPF_AFFINITY;
+				error = result;
+			}
+		}
+
+		int result = pthread_setname_np(pthread_self(), args.name);
+		if (result != 0)
+		{
+			failedSettings |= TPF_NAME;
+			error = result;
+		}
 #endif
+
+		RecordPolicyResult(args.role, failedSettings, error);
+	}
+
+	void Thread::RecordPolicyResult(ThreadRole role, unsigned int failedSettings, int error)
+	{
+		Lock lock(s_policySection);
+
+		ThreadPolicyStatus &status = s_policyStatus[role];
+		++status.threadsStarted;
+		if (failedSettings != 0)
+		{
+			++status.threadsFailed;
+			status.failedSettings |= failedSettings;
+			status.lastError = error;
+		}
+	}
+
+	bool Thread::SetPolicy(ThreadRole role, const ThreadPolicy &policy)
+	{
+		if (role < 0 || role >= TR_COUNT)
+			return false;
+
+#ifndef _WINDOWS
+		if (policy.scheduling != SP_DEFAULT)
+		{
+			int schedulingPolicy = (policy.scheduling == SP_FIFO) ? SCHED_FIFO : SCHED_RR;
+			if (policy.priority < sched_get_priority_min(schedulingPolicy) || policy.priority > sched_get_priority_max(schedulingPolicy))
+				return false;
+		}
+#endif
+
+		Lock lock(s_policySection);
+		s_policies[role] = policy;
+		s_policyStatus[role] = ThreadPolicyStatus();
+		return true;
+	}
+
+	ThreadPolicy Thread::GetPolicy(ThreadRole role)
+	{
+		Lock lock(s_policySection);
+		return s_policies[role];
+	}
+
+	ThreadPolicyStatus Thread::GetPolicyStatus(ThreadRole role)
+	{
+		Lock lock(s_policySection);
+		return s_policyStatus[role];
 	}
 
 
@@ -99,6 +290,7 @@ namespace kmk
 	DWORD WINAPI Thread::CallbackProc(void *pArg)
 	{
 		CallbackArgs *pArgs = (CallbackArgs*)pArg;
+		ApplyPolicy(*pArgs);
 
 		{
 			Lock lock(pArgs->pThread->m_critical);
@@ -121,6 +313,7 @@ namespace kmk
 	void *Thread::CallbackProc(void *pArg)
 	{
 		CallbackArgs *pArgs = (CallbackArgs*)pArg;
+		ApplyPolicy(*pArgs);
 		
 		{
 			Lock lock(pArgs->pThread->m_critical);
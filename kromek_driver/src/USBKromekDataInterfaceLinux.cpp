@@ -10,25 +10,38 @@
 #include <errno.h>
 
 #include <memory.h>
+#include <atomic>
 #include <vector>
 
 #include "IDevice.h"
 #include "USBKromekDataInterfaceLinux.h"
 #include "Lock.h"
+#include "Probes.h"
+#include "ReadRing.h"
 
 #define INPUT_BUFFER_LENGTH 1024
+
+// Each read of the kromek driver returns a single report of this length (INPUT_BUFFER_SIZE in kromekusb), it fails
+// reads for less. The ring reads exactly this so each of its buffers holds one report
+#define REPORT_LENGTH 63
 #define MAX_SERIAL_RX_BUFFER 16
 #define MAX_SERIAL_TX_BUFFER 16
 
 namespace kmk
 {
 
+// Backend used by devices when they start reading
+static std::atomic<int> s_readBackend(RB_EPOLL);
 
+// System calls made by the read threads of every device
+static std::atomic<uint64_t> s_readThreadSystemCalls(0);
 
 USBKromekDataInterface::USBKromekDataInterface(const char *pDevicePath, PID productID, VID vendorID, const char *pSerial, unsigned short firmwareVersion)
 : _devicePath(pDevicePath)
+, _hash(HashDevicePath(pDevicePath))
 , _fileHandle(0)
 , _readThreadRunning(false)
+, _readingOnRing(false)
 , _dataReadyCallback(NULL)
 , _dataReadyCallbackArg(NULL)
 , _errorCallback(NULL)
@@ -45,6 +58,10 @@ USBKromekDataInterface::USBKromekDataInterface(const char *pDevicePath, PID prod
 
     if (pSerial != NULL)
         _serialNumber = pSerial;
+
+    // The usb serial from sysfs is ASCII
+    _ifProperties[IFPROP_SERIAL] = String(_serialNumber.begin(), _serialNumber.end());
+    _ifProperties[IFPROP_DEVICEPATH] = String(_devicePath.begin(), _devicePath.end());
 }
 
 USBKromekDataInterface::~USBKromekDataInterface(void)
@@ -56,6 +73,8 @@ USBKromekDataInterface::~USBKromekDataInterface(void)
     {
         StopReading();
     }
+
+    StopCapture();
 }
 
 bool USBKromekDataInterface::Initialize()
@@ -64,10 +83,15 @@ bool USBKromekDataInterface::Initialize()
 }
 
 unsigned int USBKromekDataInterface::GetHash()
+{
+    return _hash;
+}
+
+unsigned int USBKromekDataInterface::HashDevicePath(const char *pDevicePath)
 {
     unsigned int hash = 0;
-    for(size_t i = 0; i < _devicePath.length(); ++i)
-        hash = 65599 * hash + _devicePath.c_str()[i];
+    for(size_t i = 0; pDevicePath[i] != 0; ++i)
+        hash = 65599 * hash + pDevicePath[i];
     return hash ^ (hash >> 16);
 }
 
@@ -81,12 +105,44 @@ PID USBKromekDataInterface::GetProductID()
     return _productID;
 }
 
+bool USBKromekDataInterface::SetReadBackend(ReadBackend backend)
+{
+    if (backend == RB_IO_URING && !ReadRing::GetInstance().IsAvailable())
+    {
+        s_readBackend = RB_EPOLL;
+        return false;
+    }
+
+    s_readBackend = backend;
+    return true;
+}
+
+ReadBackend USBKromekDataInterface::GetReadBackend()
+{
+    return (ReadBackend)s_readBackend.load();
+}
+
+uint64_t USBKromekDataInterface::GetReadSystemCalls()
+{
+    return s_readThreadSystemCalls.load(std::memory_order_relaxed) + ReadRing::GetInstance().GetSystemCalls();
+}
+
 String USBKromekDataInterface::GetInterfaceProperty(const String& name)
 {
     InterfaceProperties::iterator i = _ifProperties.find(name);
     return (i != _ifProperties.end()) ? i->second : L"";
 }
 
+bool USBKromekDataInterface::StartCapture(const char *pBasePath, const CaptureSettings &settings)
+{
+    return _captureWriter.Start(pBasePath, _vendorID, _productID, settings);
+}
+
+void USBKromekDataInterface::StopCapture()
+{
+    _captureWriter.Stop();
+}
+
 void USBKromekDataInterface::SetDataReadyCallback(DataReadyCallbackFunc pFunc, void *pArg)
 {
     kmk::Lock lock(_readCriticalSection);
@@ -153,7 +209,14 @@ bool USBKromekDataInterface::BeginReading()
 
     _readThreadRunning = true;
 
-    if (!_readThread.Start(ReadDataThread, this))
+    // Read by a thread of its own if the ring can not take the device
+    if (s_readBackend == RB_IO_URING && ReadRing::GetInstance().Add(_fileHandle, REPORT_LENGTH, RingReadProc, this))
+    {
+        _readingOnRing = true;
+        return true;
+    }
+
+    if (!_readThread.Start(ReadDataThread, this, TR_READER))
     {
         _readThreadRunning = false;
         Close();
@@ -175,6 +238,15 @@ bool USBKromekDataInterface::StopReading()
         _readThreadRunning = false;
     }
 
+    // Nothing more is passed on once removed from the ring, the device is then closed here rather than by the thread
+    if (_readingOnRing)
+    {
+        ReadRing::GetInstance().Remove(_fileHandle);
+        _readingOnRing = false;
+        Close();
+        return true;
+    }
+
     // Wait for the thread to end before continuing
     _readThread.WaitForTermination();
     return true;
@@ -187,6 +259,9 @@ bool USBKromekDataInterface::GetConfigurationSetting(unsigned char *pReportdata,
     // works the same as other interfaces by passing the configuration result back through the data queue so that the data processor
     // can process it
 
+    // The response is written over the request, so keep a copy for the capture
+    std::vector<unsigned char> request(pReportdata, pReportdata + dataLength);
+
     if (pReportdata[0] == CONFIGURATION_GETSERIAL)
     {
         // If the report id of the request is for the serial number then return the serial number from the usb header rather
@@ -208,7 +283,10 @@ bool USBKromekDataInterface::GetConfigurationSetting(unsigned char *pReportdata,
         return false;
     }
 
-    // Post the returned data
+    // Post the returned data. The request is only captured once it has been answered so an unanswered request is never
+    // replayed
+    _captureWriter.Write(CRT_GET_CONFIGURATION, &request[0], dataLength, true);
+    _captureWriter.Write(CRT_CONFIGURATION_RESPONSE, pReportdata, dataLength, true);
     if (_dataReadyCallback != NULL)
     {
         (*_dataReadyCallback)(_dataReadyCallbackArg, pReportdata, dataLength);
@@ -223,6 +301,8 @@ bool USBKromekDataInterface::SetConfigurationSetting(unsigned char *pData, size_
 
     kmk::Lock lock(_readCriticalSection);
 
+    _captureWriter.Write(CRT_SET_CONFIGURATION, pData, dataLength, true);
+
     int fd = open(_devicePath.c_str(), O_WRONLY);
     if (fd == 0)
     {
@@ -245,6 +325,7 @@ int USBKromekDataInterface::ReadDataThread(void *pArg)
     const int TIMEOUT = 200;
 
     USBKromekDataInterface *pThis = (USBKromekDataInterface*)pArg;
+    unsigned int hash = pThis->GetHash();
 
     try
     {
@@ -293,6 +374,7 @@ int USBKromekDataInterface::ReadDataThread(void *pArg)
 
             // Check for pending data but dont block indefinitely
             int ready = epoll_wait(epollFile, eventList, MAX_EPOLL_DEVICES, TIMEOUT);
+            s_readThreadSystemCalls.fetch_add(1, std::memory_order_relaxed);
             if (ready == -1)
             {
                 // If interrupted by a signal then restart the wait
@@ -312,8 +394,14 @@ int USBKromekDataInterface::ReadDataThread(void *pArg)
                 {
                     // Read data
                     int bytesRead = read(pThis->_fileHandle, &dataBuffer[0], dataBuffer.size());
+                    s_readThreadSystemCalls.fetch_add(1, std::memory_order_relaxed);
                     if (bytesRead > 0)
                     {
+                        KMK_PROBE2(read_complete, hash, bytesRead);
+
+                        // Never blocks, drops the record if the capture writer has fallen behind
+                        pThis->_captureWriter.Write(CRT_DATA, &dataBuffer[0], bytesRead);
+
                         // Raise the data callback
                         if (pThis->_dataReadyCallback != NULL)
                         {
@@ -342,6 +430,26 @@ int USBKromekDataInterface::ReadDataThread(void *pArg)
     return 0;
 }
 
+// Pass on each read made by the ring, straight from the buffer of the ring
+void USBKromekDataInterface::RingReadProc(void *pArg, unsigned char *pData, int bytesRead)
+{
+    USBKromekDataInterface *pThis = (USBKromekDataInterface*)pArg;
+    if (bytesRead <= 0)
+    {
+        pThis->RaiseError(ERROR_READ_FAILED, L"Unexpected error. Reading from device has been stopped!");
+        return;
+    }
+
+    KMK_PROBE2(read_complete, pThis->_hash, bytesRead);
+
+    pThis->_captureWriter.Write(CRT_DATA, pData, bytesRead);
+
+    if (pThis->_dataReadyCallback != NULL)
+    {
+        (*pThis->_dataReadyCallback)(pThis->_dataReadyCallbackArg, pData, bytesRead);
+    }
+}
+
 void USBKromekDataInterface::RaiseError(int errorCode, String message)
 {
     if (_errorCallback != NULL)
@@ -0,0 +1,442 @@
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+
+#include <vector>
+
+#include "IDevice.h"
+#include "USBSerialDataInterfaceLinux.h"
+#include "USBKromekDataInterfaceLinux.h"
+#include "Lock.h"
+#include "Probes.h"
+
+// Largest single read from the port. The tty layer hands over everything buffered in one read, so a burst of packets
+// arriving while the thread was busy is taken in one go rather than a packet at a time
+#define INPUT_BUFFER_LENGTH 16384
+
+// Longest time in ms to wait for the port to accept more data when writing
+#define WRITE_TIMEOUT 1000
+
+namespace kmk
+{
+
+USBSerialDataInterface::USBSerialDataInterface(const char *pDevicePath, PID productID, VID vendorID, const char *pSerial)
+: _devicePath(pDevicePath)
+, _fileHandle(-1)
+, _stopFd(-1)
+, _readThreadRunning(false)
+, _dataReadyCallback(NULL)
+, _dataReadyCallbackArg(NULL)
+, _errorCallback(NULL)
+, _errorCallbackArg(NULL)
+, _vendorID(vendorID)
+, _productID(productID)
+{
+    std::string serial = (pSerial != NULL) ? pSerial : "";
+
+    // The usb serial from sysfs and the device path are ASCII
+    _ifProperties[IFPROP_SERIAL] = String(serial.begin(), serial.end());
+    _ifProperties[IFPROP_DEVICEPATH] = String(_devicePath.begin(), _devicePath.end());
+    _ifProperties[IFPROP_CONNECTION] = L"USB";
+}
+
+USBSerialDataInterface::~USBSerialDataInterface(void)
+{
+    kmk::Lock lock(_readCriticalSection);
+
+    // Stop reading if the device is open
+    if (_readThreadRunning)
+    {
+        StopReading();
+    }
+
+    StopCapture();
+
+    if (_stopFd >= 0)
+        close(_stopFd);
+}
+
+bool USBSerialDataInterface::Initialize()
+{
+    if (_stopFd < 0)
+        _stopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    return _stopFd >= 0;
+}
+
+unsigned int USBSerialDataInterface::GetHash()
+{
+    // Same as the kromek driver nodes so the enumerator can find the interface of any device node that is removed
+    return USBKromekDataInterface::HashDevicePath(_devicePath.c_str());
+}
+
+VID USBSerialDataInterface::GetVendorID()
+{
+    return _vendorID;
+}
+
+PID USBSerialDataInterface::GetProductID()
+{
+    return _productID;
+}
+
+String USBSerialDataInterface::GetInterfaceProperty(const String& name)
+{
+    InterfaceProperties::iterator i = _ifProperties.find(name);
+    return (i != _ifProperties.end()) ? i->second : L"";
+}
+
+bool USBSerialDataInterface::StartCapture(const char *pBasePath, const CaptureSettings &settings)
+{
+    return _captureWriter.Start(pBasePath, _vendorID, _productID, settings);
+}
+
+void USBSerialDataInterface::StopCapture()
+{
+    _captureWriter.Stop();
+}
+
+void USBSerialDataInterface::SetDataReadyCallback(DataReadyCallbackFunc pFunc, void *pArg)
+{
+    kmk::Lock lock(_readCriticalSection);
+    _dataReadyCallback = pFunc;
+    _dataReadyCallbackArg = pArg;
+}
+
+void USBSerialDataInterface::SetErrorCallback(ErrorCallbackFunc func, void *pArg)
+{
+    kmk::Lock lock(_readCriticalSection);
+    _errorCallback = func;
+    _errorCallbackArg = pArg;
+}
+
+// Return if the port is open
+bool USBSerialDataInterface::IsOpen()
+{
+    kmk::Lock lock(_readCriticalSection);
+
+    return _fileHandle >= 0;
+}
+
+// Open the port ready for reading
+bool USBSerialDataInterface::OpenDevice()
+{
+    if (IsOpen())
+        return true;
+
+    // Non blocking, the read thread waits in epoll. Never let the port become the controlling terminal of the process
+    int fd = open(_devicePath.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    // Raw mode, no echo, line editing, flow control or translation of any byte. The baud rate means nothing to a CDC-ACM
+    // device but is set to what the devices expect in case the port is a real uart
+    termios settings;
+    if (tcgetattr(fd, &settings) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    cfmakeraw(&settings);
+    settings.c_cflag |= CLOCAL | CREAD;
+    settings.c_cflag &= ~(CSTOPB | CRTSCTS);
+    settings.c_cc[VMIN] = 0;
+    settings.c_cc[VTIME] = 0;
+    cfsetispeed(&settings, B115200);
+    cfsetospeed(&settings, B115200);
+
+    if (tcsetattr(fd, TCSANOW, &settings) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    // Pass data up as soon as it arrives rather than batching it (e.g. the 16ms latency timer of ftdi adapters). Not
+    // every driver supports it and it is not needed for the data to be read, so failure is ignored
+    serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0 && (serial.flags & ASYNC_LOW_LATENCY) == 0)
+    {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+
+    // Clear any data already on the port or waiting to be sent
+    tcflush(fd, TCIOFLUSH);
+
+    kmk::Lock lock(_readCriticalSection);
+    _fileHandle = fd;
+    return true;
+}
+
+// Close the port if open
+bool USBSerialDataInterface::Close()
+{
+    kmk::Lock lock(_readCriticalSection);
+
+    if (_fileHandle >= 0)
+    {
+        close(_fileHandle);
+        _fileHandle = -1;
+        return true;
+    }
+
+    return false;
+}
+
+// Start reading data on a seperate thread and pass all data through into the data processor
+bool USBSerialDataInterface::BeginReading()
+{
+    kmk::Lock lock(_readCriticalSection);
+
+    if (_readThreadRunning)
+        return false;
+
+    if (_stopFd < 0 || !OpenDevice())
+        return false;
+
+    // Clear a stop left from the last time the thread ran
+    uint64_t value;
+    while (read(_stopFd, &value, sizeof(value)) > 0)
+        ;
+
+    _readThreadRunning = true;
+
+    if (!_readThread.Start(ReadDataThread, this, TR_READER))
+    {
+        _readThreadRunning = false;
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+// Stop reading data from the device and kill the thread
+bool USBSerialDataInterface::StopReading()
+{
+    {
+        kmk::Lock lock(_readCriticalSection);
+
+        if (!_readThreadRunning)
+            return false;
+
+        _readThreadRunning = false;
+    }
+
+    // Wake the thread from epoll and wait for it to end before continuing
+    uint64_t value = 1;
+    if (write(_stopFd, &value, sizeof(value)) != sizeof(value))
+        return false;
+
+    _readThread.WaitForTermination();
+    return true;
+}
+
+// Get a configuration setting. The actual configuration response will be returned across the serial port
+bool USBSerialDataInterface::GetConfigurationSetting(unsigned char *pReportdata, size_t dataLength)
+{
+    return SetConfigurationSetting(pReportdata, dataLength);
+}
+
+// Send a configuration setting / report data
+bool USBSerialDataInterface::SetConfigurationSetting(unsigned char *pData, size_t dataLength)
+{
+    // Held for the whole write so the read thread can not close the port part way through, it only takes the lock once
+    // it is stopping
+    kmk::Lock lock(_readCriticalSection);
+
+    _captureWriter.Write(CRT_SET_CONFIGURATION, pData, dataLength, true);
+
+    // Written directly when the read thread has the port open, a tty can be read and written at the same time
+    if (_fileHandle >= 0)
+        return SendDataToDevice(pData, dataLength);
+
+    // Otherwise open the port, send the data and close it again
+    if (!OpenDevice())
+        return false;
+
+    bool result = SendDataToDevice(pData, dataLength);
+    Close();
+    return result;
+}
+
+// Write a data buffer to the open port
+bool USBSerialDataInterface::SendDataToDevice(const unsigned char *pData, size_t dataLength)
+{
+    size_t bytesSent = 0;
+    while (bytesSent < dataLength)
+    {
+        ssize_t bytesWritten = write(_fileHandle, &pData[bytesSent], dataLength - bytesSent);
+        if (bytesWritten > 0)
+        {
+            bytesSent += bytesWritten;
+            continue;
+        }
+
+        if (bytesWritten < 0 && errno == EINTR)
+            continue;
+
+        // The output buffer is full, wait for the device to take some of it
+        if (bytesWritten < 0 && errno == EAGAIN)
+        {
+            pollfd pollFd;
+            pollFd.fd = _fileHandle;
+            pollFd.events = POLLOUT;
+            if (poll(&pollFd, 1, WRITE_TIMEOUT) > 0 && (pollFd.revents & POLLOUT) != 0)
+                continue;
+        }
+
+        wchar_t msgBuffer[200];
+        swprintf(msgBuffer, 200, L"Write Data Error - ErrorCode = %d. Written = %zu, Expected %zu", errno, bytesSent, dataLength);
+        RaiseError(ERROR_WRITE_FAILED, msgBuffer);
+        return false;
+    }
+
+    return true;
+}
+
+// Thread function for reading data from the device until stopped. Pass all data up via the DataReadyCallback
+int USBSerialDataInterface::ReadDataThread(void *pArg)
+{
+    const int MAX_EPOLL_EVENTS = 2;
+
+    USBSerialDataInterface *pThis = (USBSerialDataInterface*)pArg;
+    unsigned int hash = pThis->GetHash();
+
+    try
+    {
+        // Device should already be open before the thread is started
+        if (!pThis->IsOpen())
+        {
+            pThis->RaiseError(ERROR_DEVICE_OPEN_FAILED, L"Can not open device");
+            return false;
+        }
+
+        // Allocate a memory buffer
+        std::vector<BYTE> dataBuffer;
+        dataBuffer.resize(INPUT_BUFFER_LENGTH);
+
+        // Sleep until the port has data or the thread is told to stop, there is no timeout to wake for
+        epoll_event eventList[MAX_EPOLL_EVENTS];
+        int epollFile = epoll_create1(EPOLL_CLOEXEC);
+        if (epollFile == -1)
+        {
+            pThis->RaiseError(ERROR_DEVICE_OPEN_FAILED, L"epoll error");
+            pThis->Close();
+            return false;
+        }
+
+        epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = pThis->_fileHandle;
+        bool registered = epoll_ctl(epollFile, EPOLL_CTL_ADD, pThis->_fileHandle, &ev) == 0;
+        ev.data.fd = pThis->_stopFd;
+        registered = registered && epoll_ctl(epollFile, EPOLL_CTL_ADD, pThis->_stopFd, &ev) == 0;
+        if (!registered)
+        {
+            pThis->RaiseError(ERROR_DEVICE_OPEN_FAILED, L"Failed to register epoll device");
+            close(epollFile);
+            pThis->Close();
+            return false;
+        }
+
+        bool keepRunning = true;
+        while (keepRunning)
+        {
+            int ready = epoll_wait(epollFile, eventList, MAX_EPOLL_EVENTS, -1);
+            if (ready == -1)
+            {
+                // If interrupted by a signal then restart the wait
+                if (errno == EINTR)
+                    continue;
+
+                pThis->RaiseError(ERROR_READ_FAILED, L"Unexpected error. Reading from device has been stopped!");
+                break;
+            }
+
+            for (int i = 0; i < ready && keepRunning; ++i)
+            {
+                if (eventList[i].data.fd == pThis->_stopFd)
+                {
+                    keepRunning = false;
+                    break;
+                }
+
+                // Take everything buffered, a short read means the port is empty
+                while (keepRunning)
+                {
+                    ssize_t bytesRead = read(pThis->_fileHandle, &dataBuffer[0], dataBuffer.size());
+                    if (bytesRead > 0)
+                    {
+                        KMK_PROBE2(read_complete, hash, bytesRead);
+
+                        // Never blocks, drops the record if the capture writer has fallen behind
+                        pThis->_captureWriter.Write(CRT_DATA, &dataBuffer[0], bytesRead);
+
+                        // Raise the data callback
+                        if (pThis->_dataReadyCallback != NULL)
+                        {
+                            (*pThis->_dataReadyCallback)(pThis->_dataReadyCallbackArg, &dataBuffer[0], bytesRead);
+                        }
+
+                        if ((size_t)bytesRead < dataBuffer.size())
+                            break;
+                    }
+                    else if (bytesRead < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    else if (bytesRead < 0 && errno == EAGAIN)
+                    {
+                        // Woken by a hang up or error rather than data
+                        if ((eventList[i].events & (EPOLLHUP | EPOLLERR)) != 0)
+                        {
+                            pThis->RaiseError(ERROR_READ_FAILED, L"Unexpected error. Reading from device has been stopped!");
+                            keepRunning = false;
+                        }
+                        break;
+                    }
+                    else
+                    {
+                        // End of file or an error, the device has been unplugged
+                        pThis->RaiseError(ERROR_READ_FAILED, L"Unexpected error. Reading from device has been stopped!");
+                        keepRunning = false;
+                    }
+                }
+            }
+        }
+
+        close(epollFile);
+
+        // Close the device once we have finished
+        pThis->Close();
+    }
+    catch(const std::exception&)
+    {
+        pThis->RaiseError(ERROR_READ_FAILED, L"Unexpected error. Reading from device has been stopped!");
+    }
+
+    return 0;
+}
+
+void USBSerialDataInterface::RaiseError(int errorCode, String message)
+{
+    if (_errorCallback != NULL)
+    {
+        (*_errorCallback)(_errorCallbackArg, errorCode, message);
+    }
+}
+
+}
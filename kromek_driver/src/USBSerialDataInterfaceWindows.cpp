@@ -210,7 +210,7 @@ bool SerialDataInterface::BeginReading()
 	_readThreadRunning = true;
 
 	//DSC_LOG("SerialDataInterface::BeginReading _readThread.Start");
-	if (!_readThread.Start(ReadDataThread, this))
+	if (!_readThread.Start(ReadDataThread, this, TR_READER))
 	{
 		_readThreadRunning = false;
 		Close();
@@ -0,0 +1,90 @@
+#include "stdafx.h"
+#include "VirtualClock.h"
+#include "Lock.h"
+
+namespace kmk
+{
+
+VirtualClock::VirtualClock()
+: _time(0)
+{
+}
+
+VirtualClock &VirtualClock::GetInstance()
+{
+	static VirtualClock instance;
+	return instance;
+}
+
+VirtualClock *VirtualClock::GetEnabled()
+{
+	VirtualClock &clock = GetInstance();
+	return clock.IsEnabled() ? &clock : NULL;
+}
+
+void VirtualClock::Enable()
+{
+	if (IsEnabled())
+		return;
+
+	// Never go back on a previous period of virtual time
+	int64_t now = kmk::Time::GetTime();
+	if (now > _time.load(std::memory_order_relaxed))
+		_time.store(now, std::memory_order_release);
+
+	kmk::Time::SetTimeSource(this);
+}
+
+void VirtualClock::Disable()
+{
+	if (IsEnabled())
+		kmk::Time::SetTimeSource(NULL);
+}
+
+bool VirtualClock::IsEnabled()
+{
+	return kmk::Time::GetTimeSource() == this;
+}
+
+void VirtualClock::Advance(int64_t timeMs)
+{
+	kmk::Lock lock(_listenerSection);
+
+	int64_t now = _time.fetch_add(MS_TO_TICKS(timeMs), std::memory_order_acq_rel) + MS_TO_TICKS(timeMs);
+	int64_t nowMs = kmk::Time::TicksToMs(now);
+
+	// By index as a listener may remove itself while it is being called
+	size_t i = 0;
+	while (i < _listeners.size())
+	{
+		Listener listener = _listeners[i];
+		(*listener.func)(listener.pArg, nowMs);
+
+		if (i < _listeners.size() && _listeners[i].func == listener.func && _listeners[i].pArg == listener.pArg)
+			++i;
+	}
+}
+
+void VirtualClock::AddListener(AdvanceCallbackFunc func, void *pArg)
+{
+	kmk::Lock lock(_listenerSection);
+
+	Listener listener = { func, pArg };
+	_listeners.push_back(listener);
+}
+
+void VirtualClock::RemoveListener(AdvanceCallbackFunc func, void *pArg)
+{
+	kmk::Lock lock(_listenerSection);
+
+	for (std::vector<Listener>::iterator it = _listeners.begin(); it != _listeners.end(); ++it)
+	{
+		if (it->func == func && it->pArg == pArg)
+		{
+			_listeners.erase(it);
+			return;
+		}
+	}
+}
+
+}
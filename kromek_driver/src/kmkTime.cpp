@@ -0,0 +1,9 @@
+#include "stdafx.h"
+#include "kmkTime.h"
+
+namespace kmk
+{
+
+std::atomic<ITimeSource*> Time::s_pTimeSource(NULL);
+
+}
@@ -31,6 +31,8 @@ public:
         info_pub = nh_.advertise<std_msgs::UInt32MultiArray>("kromek/info", 1);
         raw_pub = nh_.advertise<std_msgs::UInt32MultiArray>("kromek/raw", 1);
         pn_.param("integration_seconds", integrationSeconds, 1);
+        pn_.param<std::string>("device_cache_file", deviceCacheFile, "");
+        pn_.param<std::string>("read_backend", readBackend, "epoll");
     }
 
     ~KromekRosNode()
@@ -46,6 +48,14 @@ public:
 private:
     void _process()
     {
+        // Detectors seen before are ready without waiting for them to answer
+        if (!deviceCacheFile.empty())
+            kr_SetDeviceCacheFile(deviceCacheFile.c_str());
+
+        // Falls back to epoll if the kernel does not support io_uring
+        if (readBackend == "io_uring" && kr_SetReadBackend(READ_BACKEND_IO_URING) != ERROR_OK)
+            printf("io_uring not available, reading with epoll\n");
+
         kr_Initialise(errorCallback, NULL);
         
         int integrationMilliseconds = integrationSeconds * 1000;
@@ -156,6 +166,8 @@ private:
     unsigned int realtime;
     unsigned int livetime;
     int integrationSeconds;
+    std::string deviceCacheFile;
+    std::string readBackend;
     std::map<int, int> detMap;
 };
 
@@ -0,0 +1,416 @@
+// Microbenchmarks for the per event and per spectrum work done by Detector as data arrives and is read back through
+// GetAcquiredData, and for a whole serial device read through a pseudo terminal (Linux). Results are written as JSON, see
+// Benchmark.h in kromek_driver.
+//
+// spectrometer_benchmark [--filter <text>] [--min-time <ms>] [--repetitions <n>] [--output <file>]
+
+#include "stdafx.h"
+#include "Benchmark.h"
+#include "Detector.h"
+#include "IDevice.h"
+
+#ifndef _WINDOWS
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <termios.h>
+	#include <unistd.h>
+	#include "SpectrometerDriver.h"
+	#include "SimulatedDataInterface.h"
+	#include "PacketStreamers.h"
+	#include "D3Structs.h"
+#endif
+#include <atomic>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Count events raised in each operation, about one interval count report's worth for a busy detector
+#define EVENTS_PER_BATCH 1024
+
+// D3S, simulated on the far side of a pseudo terminal
+#define PTY_VENDOR_ID 0x2A5A
+#define PTY_PRODUCT_ID 0x01D3
+
+// Longest time (ms) to wait for a spectrum to come back through the pseudo terminal before giving up
+#define PTY_SPECTRUM_TIMEOUT 5000
+
+// Device that never acquires, the benchmark raises its data callbacks directly
+class BenchmarkDevice : public kmk::IDevice
+{
+public:
+	BenchmarkDevice()
+		: _countEventCallback(NULL)
+		, _countEventCallbackArg(NULL)
+		, _spectrumEventCallback(NULL)
+		, _spectrumEventCallbackArg(NULL)
+	{
+	}
+
+	unsigned int GetHash() const { return 0; }
+	kmk::IDataInterface *GetInterface() { return NULL; }
+	VID GetVendorID() const { return 0; }
+	PID GetProductID() const { return 0; }
+	String GetSerialNumber() { return L"BENCHMARK"; }
+	String GetManufacturer() const { return L"Kromek"; }
+	String GetProductName() const { return L"Benchmark"; }
+	unsigned short GetVersion() { return 0; }
+	bool LoadCachedInformation() { return false; }
+	bool RefreshInformation() { return true; }
+	String GetInterfaceProperty(const String& /*param*/) { return String(); }
+
+	kmk::DetectorType GetDetectorType() const { return kmk::DT_Gamma; }
+	int64_t GetRealTime() const { return 1000; }
+	void ResetRealTime() {}
+	int64_t GetStartTime() const { return 0; }
+	void SetStartTime(int64_t /*value*/) {}
+	float GetTemperature() const { return 0; }
+
+	void SetCountEventCallback(kmk::CountEventDeviceCallbackFunc func, void *pArg)
+	{
+		_countEventCallback = func;
+		_countEventCallbackArg = pArg;
+	}
+
+	void SetSpectrumEventCallback(kmk::SpectrumEventDeviceCallbackFunc func, void *pArg)
+	{
+		_spectrumEventCallback = func;
+		_spectrumEventCallbackArg = pArg;
+	}
+
+	void SetDoseEventCallback(kmk::DoseEventDeviceCallbackFunc /*func*/, void * /*pArg*/) {}
+	void SetFinishedAcquisitionCallback(kmk::FinishedAcquisitionCallbackFunc /*func*/, void * /*pArg*/) {}
+	void SetErrorCallback(kmk::DeviceErrorCallbackFunc /*func*/, void * /*pArg*/) {}
+
+	bool Start() { return true; }
+	bool Stop(bool /*force*/) { return true; }
+
+	bool SetConfigurationSettingUInt8(kmk::ConfigurationID /*command*/, uint8_t /*val*/) { return false; }
+	bool SetConfigurationSettingUInt16(kmk::ConfigurationID /*command*/, uint16_t /*val*/) { return false; }
+	bool GetConfigurationSettingUInt8(kmk::ConfigurationID /*command*/, uint8_t & /*valOut*/) { return false; }
+	bool GetConfigurationSettingUInt16(kmk::ConfigurationID /*command*/, uint16_t & /*valOut*/) { return false; }
+	bool SetConfigurationData(kmk::ConfigurationID /*command*/, BYTE* /*buffer*/, int /*len*/) { return false; }
+	bool GetConfigurationData(kmk::ConfigurationID /*command*/, BYTE* /*buffer*/, int /*len*/) { return false; }
+	bool GetConfigurationDataBatch(kmk::ConfigurationQuery * /*pQueries*/, size_t /*numQueries*/) { return false; }
+	bool WaitForProcessing(uint32_t /*timeoutMs*/) { return true; }
+	bool SetExecutor(kmk::Executor & /*executor*/) { return true; }
+	bool SetSpectrumPollSettings(const kmk::SpectrumPollSettings & /*settings*/) { return false; }
+	bool SetAlarmState(bool /*active*/) { return false; }
+
+	void RaiseCountEvent(int channel)
+	{
+		(*_countEventCallback)(this, 0, channel, 1, _countEventCallbackArg);
+	}
+
+	void RaiseSpectrumEvent(const uint16_t *pCounts, int numChannels)
+	{
+		(*_spectrumEventCallback)(this, 0, pCounts, numChannels, _spectrumEventCallbackArg);
+	}
+
+private:
+	kmk::CountEventDeviceCallbackFunc _countEventCallback;
+	void *_countEventCallbackArg;
+
+	kmk::SpectrumEventDeviceCallbackFunc _spectrumEventCallback;
+	void *_spectrumEventCallbackArg;
+};
+
+static kmk::DetectorProperties MakeDetectorProperties()
+{
+	kmk::DetectorProperties properties;
+	memset(&properties, 0, sizeof(properties));
+	properties.detectorType = kmk::DT_Gamma;
+	properties.defaultDeadTime = 0.000005;
+	return properties;
+}
+
+static void OnDataReceived(Detector * /*pDetector*/, int64_t /*timestamp*/, int /*channel*/, uint32_t numCounts, void *pArg)
+{
+	*(uint64_t*)pArg += numCounts;
+}
+
+static void BenchmarkCountEvents(kmk::BenchmarkRunner &runner, const char *name, bool withCallback)
+{
+	BenchmarkDevice device;
+	uint64_t forwarded = 0;
+	Detector detector(&device, withCallback ? OnDataReceived : NULL, &forwarded, MakeDetectorProperties());
+
+	std::mt19937 random(1);
+	std::vector<int> channels(EVENTS_PER_BATCH);
+	for (size_t i = 0; i < channels.size(); ++i)
+		channels[i] = random() % TOTAL_RESULT_CHANNELS;
+
+	runner.Run(name, 0, [&](uint64_t iterations)
+	{
+		for (uint64_t i = 0; i < iterations; ++i)
+		{
+			for (size_t event = 0; event < channels.size(); ++event)
+				device.RaiseCountEvent(channels[event]);
+		}
+	});
+
+	kmk::DoNotOptimize(forwarded);
+	detector.ClearAcquiredData();
+}
+
+static void BenchmarkSpectrumEvents(kmk::BenchmarkRunner &runner)
+{
+	BenchmarkDevice device;
+	Detector detector(&device, NULL, NULL, MakeDetectorProperties());
+
+	std::mt19937 random(2);
+	std::vector<uint16_t> spectrum(TOTAL_RESULT_CHANNELS);
+	for (size_t i = 0; i < spectrum.size(); ++i)
+		spectrum[i] = random() % 16;
+
+	runner.Run("Detector/SpectrumEvent", spectrum.size() * sizeof(uint16_t), [&](uint64_t iterations)
+	{
+		for (uint64_t i = 0; i < iterations; ++i)
+			device.RaiseSpectrumEvent(&spectrum[0], (int)spectrum.size());
+
+		// Keep the totals from overflowing over long runs
+		detector.ClearAcquiredData();
+	});
+}
+
+static void BenchmarkGetAcquiredData(kmk::BenchmarkRunner &runner, const char *name, unsigned int flags)
+{
+	BenchmarkDevice device;
+	Detector detector(&device, NULL, NULL, MakeDetectorProperties());
+
+	std::vector<unsigned int> buffer(TOTAL_RESULT_CHANNELS);
+	unsigned int totalCounts = 0;
+	unsigned int realTime = 0;
+	unsigned int liveTime = 0;
+
+	runner.Run(name, buffer.size() * sizeof(unsigned int), [&](uint64_t iterations)
+	{
+		for (uint64_t i = 0; i < iterations; ++i)
+		{
+			detector.GetAcquiredData(&buffer[0], &totalCounts, &realTime, &liveTime, flags);
+			kmk::DoNotOptimize(buffer[0]);
+		}
+	});
+}
+
+#ifndef _WINDOWS
+// A simulated D3S behind the master side of a pseudo terminal. The driver opens the slave with kr_AddSerialDevice, so every
+// request and spectrum goes through the same tty reads and writes as a device on a usb serial adapter
+struct PtyDevice
+{
+	int master;
+	kmk::D3Simulator simulator;
+	std::atomic<bool> serving;
+	std::atomic<uint64_t> bytesWritten;
+
+	PtyDevice(const kmk::SimulationSettings &settings)
+		: master(-1)
+		, simulator(PTY_VENDOR_ID, PTY_PRODUCT_ID, false, settings)
+		, serving(true)
+		, bytesWritten(0)
+	{
+	}
+};
+
+// Simulator output is written to the master for the driver to read
+static void WritePtyProc(void *pArg, unsigned char *pData, size_t dataSize)
+{
+	PtyDevice *pDevice = (PtyDevice*)pArg;
+
+	size_t written = 0;
+	while (written < dataSize)
+	{
+		ssize_t result = write(pDevice->master, pData + written, dataSize - written);
+		if (result > 0)
+		{
+			written += result;
+			continue;
+		}
+
+		pollfd pollInfo = { pDevice->master, POLLOUT, 0 };
+		if (poll(&pollInfo, 1, 100) < 0 || !pDevice->serving.load())
+			break;
+	}
+
+	pDevice->bytesWritten.fetch_add(written);
+}
+
+// Read the requests the driver writes to the slave and pass them to the simulator
+static void ServePtyRequests(PtyDevice *pDevice)
+{
+	kmk::SerialPacketStreamer streamer;
+	std::vector<BYTE> packet;
+	BYTE buffer[1024];
+
+	while (pDevice->serving.load())
+	{
+		pollfd pollInfo = { pDevice->master, POLLIN, 0 };
+		if (poll(&pollInfo, 1, 50) <= 0 || (pollInfo.revents & POLLIN) == 0)
+			continue;
+
+		ssize_t bytesRead = read(pDevice->master, buffer, sizeof(buffer));
+		if (bytesRead <= 0)
+			continue;
+
+		streamer.AddIncomingData(buffer, bytesRead);
+		while (true)
+		{
+			try
+			{
+				if (!streamer.ReadPacket(packet))
+					break;
+			}
+			catch (const std::runtime_error &)
+			{
+				// The streamer skips the corrupt data on the next read
+				continue;
+			}
+
+			// Spectra and settings are sent as set reports, every other get report is a configuration query
+			uint8_t reportId = ((kmk::MessageHeader*)&packet[0])->contentHeader.reportID;
+			if ((reportId & 0x80) == 0 || reportId == kmk::REPORT_ID_GET_16BIT_SPECTRUM || reportId == kmk::REPORT_ID_GET_RADIOMETRICSV1_SPECTRUM)
+				pDevice->simulator.SetConfigurationSetting(&packet[0], packet.size());
+			else
+				pDevice->simulator.GetConfigurationSetting(&packet[0], packet.size());
+		}
+	}
+}
+
+static void stdcall OnDriverError(void * /*pUserData*/, unsigned int /*deviceID*/, int /*errorCode*/, const char * /*pMessage*/)
+{
+}
+
+// Spectra polled from a simulated D3S through a pseudo terminal, read back through kr_AddSerialDevice. The time is mostly
+// the poll interval. The counters give the bytes through the terminal and the time from a read to the counts being
+// decoded, and the counts are checked against the simulated photopeak
+static void BenchmarkSerialPty(kmk::BenchmarkRunner &runner)
+{
+	const char *name = "SerialDevice/Pty/D3S/Spectrum";
+
+	kmk::SimulationSettings settings;
+	settings.countRate = 2000;
+	settings.neutronRate = 2;
+	settings.seed = 1;
+	settings.peaks.push_back(kmk::SimulationPeak(662, 20, 0.5));
+
+	PtyDevice device(settings);
+	device.master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (device.master < 0 || grantpt(device.master) != 0 || unlockpt(device.master) != 0 || ptsname(device.master) == NULL)
+	{
+		fprintf(stderr, "%-48s unable to open a pseudo terminal\n", name);
+		if (device.master >= 0)
+			close(device.master);
+		return;
+	}
+
+	std::string slavePath = ptsname(device.master);
+
+	// Keep a slave open so the master does not see a hangup before the driver opens it
+	int slave = open(slavePath.c_str(), O_RDWR | O_NOCTTY);
+
+	termios settingsMaster;
+	tcgetattr(device.master, &settingsMaster);
+	cfmakeraw(&settingsMaster);
+	tcsetattr(device.master, TCSANOW, &settingsMaster);
+
+	device.simulator.Initialize();
+	device.simulator.SetDataReadyCallback(WritePtyProc, &device);
+	device.simulator.BeginReading();
+	std::thread requestThread(ServePtyRequests, &device);
+
+	unsigned int deviceId = 0;
+	if (kr_Initialise(OnDriverError, NULL) == ERROR_OK && kr_AddSerialDevice(slavePath.c_str(), PTY_VENDOR_ID, PTY_PRODUCT_ID) == ERROR_OK)
+		deviceId = kr_GetNextDetector(0);
+
+	if (deviceId != 0 && kr_SetLatencyTracing(deviceId, 1) == ERROR_OK && kr_BeginDataAcquisition(deviceId, 0, 0) == ERROR_OK)
+	{
+		std::vector<unsigned int> spectrum(TOTAL_RESULT_CHANNELS);
+		unsigned int totalCounts = 0;
+		unsigned int realTime = 0;
+		unsigned int liveTime = 0;
+		uint64_t operations = 0;
+		bool timedOut = false;
+		uint64_t bytesStart = device.bytesWritten.load();
+
+		bool ran = runner.Run(name, 0, [&](uint64_t iterations)
+		{
+			for (uint64_t i = 0; i < iterations && !timedOut; ++i)
+			{
+				// Wait for the counts of the next spectrum
+				unsigned int previousCounts = totalCounts;
+				int64_t timeoutTime = kmk::Time::GetTimeMs() + PTY_SPECTRUM_TIMEOUT;
+				while (kr_GetAcquiredData(deviceId, &spectrum[0], &totalCounts, &realTime, &liveTime) == ERROR_OK && totalCounts == previousCounts)
+				{
+					if (kmk::Time::GetTimeMs() >= timeoutTime)
+					{
+						timedOut = true;
+						break;
+					}
+
+					usleep(1000);
+				}
+			}
+
+			operations += iterations;
+		});
+
+		kr_StopDataAcquisition(deviceId);
+
+		if (ran && timedOut)
+		{
+			fprintf(stderr, "%-48s no spectrum within %d ms\n", name, PTY_SPECTRUM_TIMEOUT);
+		}
+		else if (ran && operations > 0)
+		{
+			kr_GetAcquiredData(deviceId, &spectrum[0], &totalCounts, &realTime, &liveTime);
+
+			// About half the gamma counts are in the peak, the rest are spread over the continuum
+			unsigned int peakCounts = 0;
+			for (int channel = 662 - 60; channel <= 662 + 60; ++channel)
+				peakCounts += spectrum[channel];
+
+			SLatencyStatistics decoded;
+			memset(&decoded, 0, sizeof(decoded));
+			kr_GetLatencyStatistics(deviceId, LATENCY_STAGE_DECODED, &decoded);
+
+			runner.AddCounter("pty_bytes_per_op", (double)(device.bytesWritten.load() - bytesStart) / operations);
+			runner.AddCounter("decoded_latency_us_p50", decoded.p50);
+			runner.AddCounter("counts_per_op", (double)totalCounts / operations);
+
+			if (totalCounts == 0 || peakCounts < totalCounts / 4)
+				fprintf(stderr, "%-48s spectrum does not match the simulation (%u counts, %u in the peak)\n", name, totalCounts, peakCounts);
+		}
+	}
+	else
+	{
+		fprintf(stderr, "%-48s unable to add the serial device\n", name);
+	}
+
+	kr_Destruct();
+
+	device.serving.store(false);
+	requestThread.join();
+	device.simulator.StopReading();
+
+	if (slave >= 0)
+		close(slave);
+
+	close(device.master);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	kmk::BenchmarkRunner runner(argc, argv);
+
+	BenchmarkCountEvents(runner, "Detector/CountEvent", false);
+	BenchmarkCountEvents(runner, "Detector/CountEvent/Callback", true);
+	BenchmarkSpectrumEvents(runner);
+	BenchmarkGetAcquiredData(runner, "Detector/GetAcquiredData", 0);
+	BenchmarkGetAcquiredData(runner, "Detector/GetAcquiredData/Clear", GAD_CLEAR_COUNTS);
+#ifndef _WINDOWS
+	BenchmarkSerialPty(runner);
+#endif
+
+	return runner.Finish("spectrometer_benchmark");
+}
@@ -24,6 +24,7 @@ private:
 protected:
 
 	kmk::IDevice *m_pDevice;
+	unsigned int m_hash;			// Device hash, cached for the trace probes
 	bool m_acquiringData;
 
 	int64_t m_clearedTime;			// Time the data was last cleared by GetAcquiredData
@@ -46,6 +47,7 @@ protected:
 	bool SendLLDConfigurationCommand(int channelLLD);
 
 	static void OnDataRecievedProc(kmk::IDevice *pDetector, int64_t timestamp, int channel, uint32_t numCounts, void *pThis);
+	static void OnSpectrumRecievedProc(kmk::IDevice *pDetector, int64_t timestamp, const uint16_t *pCounts, int numChannels, void *pThis);
 public:
 
 	Detector(kmk::IDevice *pDevice, DataReceivedCallbackFunc dataReceivedCallback, void *pCallbackArg, const kmk::DetectorProperties &detectorProps);
@@ -60,6 +62,10 @@ public:
 	unsigned short GetDeviceProductID() const {return m_pDevice->GetProductID();}
 
 	unsigned int Hash() const {return m_pDevice->GetHash();}
+	kmk::IDevice *GetDevice() const {return m_pDevice;}
+
+	// Interface the device reads from, shared by all detectors in the same unit
+	kmk::IDataInterface *GetDataInterface() const {return m_pDevice->GetInterface();}
 
     virtual bool BeginDataAcquisition(unsigned int realTime, unsigned int liveTime);
 	virtual void EndDataAcquisition();
@@ -68,9 +74,23 @@ public:
     bool GetAcquiredData(unsigned int *pBuffer, unsigned int *pTotalCounts, unsigned int *pRealTime, unsigned int *pLiveTime, unsigned int flags = 0);
 	bool IsAcquiringData() const {return m_acquiringData;}
 
+	// Set the callback raised for each channel as counts arrive. Pass NULL when nobody is listening so whole spectra
+	// can be added without splitting them back into channels
+	void SetDataReceivedCallback(DataReceivedCallbackFunc dataReceivedCallback, void *pCallbackArg);
+
 	bool SendInt16ConfigurationCommand(kmk::ConfigurationID configurationID, unsigned short command);
 	bool SendInt8ConfigurationCommand(kmk::ConfigurationID configurationID, unsigned char command);
 
+	// Wait (up to timeoutMs real time) until the counts received so far have been added to the acquired data
+	bool WaitForDataProcessing(uint32_t timeoutMs) {return m_pDevice->WaitForProcessing(timeoutMs);}
+
+	// Read the properties that need a round trip to the device, so later calls return them straight away. Can take a
+	// few seconds for a device that is slow to respond
+	void Probe();
+
+	// Read them again even if they are cached, e.g. loaded from the device information cache when attached
+	void Refresh();
+
 	// Update the device state - called once every few milliseconds
 	void Update();
 };
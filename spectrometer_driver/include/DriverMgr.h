@@ -4,9 +4,21 @@
 #include "Detector.h"
 #include <string>
 #include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
 #include "CriticalSection.h"
 #include "Thread.h"
 #include "DeviceMgr.h"
+#include "SimulatedDataInterface.h"
+#include "Metrics.h"
+#include "LockProfiler.h"
+
+#ifndef _WINDOWS
+	#include "MetricsServer.h"
+#endif
 
 
 class DriverMgr
@@ -16,19 +28,28 @@ class DriverMgr
 	private:
 		DriverMgr();
 		DriverMgr(const DriverMgr &rhs); // Private to prevent calling (Singleton)
-		~DriverMgr();
 
 	public:
-		// Basic Singleton
+		// Basic Singleton, the default context used by the kr_ functions without a context
 		static DriverMgr *m_pInstance;
 		static DriverMgr *GetInstance();
 		static void DeleteInstance();
 
+		// Independent context with its own processing threads that only adds the enumerated devices with one of the
+		// usb serials or device paths given (every device if empty)
+		DriverMgr(const std::vector<std::wstring> &allowedDevices);
+		~DriverMgr();
+
 	////////////////////////////////
 
 	private:
 		
 		bool m_initialised;
+
+		// Processing threads of the devices, the shared executor for the default context
+		kmk::Executor *m_pExecutor;
+		kmk::Executor *m_pOwnedExecutor;
+
 		kmk::DeviceMgr m_deviceMgr;
         kmk::CriticalSection m_propSection;
 		kmk::CriticalSection m_deviceSection;
@@ -40,6 +61,25 @@ class DriverMgr
 
 		HIDSpectrometerDeviceVector m_attachedDevices;
 
+		// Detectors still being probed, not yet listed or announced. Guarded by m_deviceSection
+		HIDSpectrometerDeviceVector m_probingDevices;
+
+		// Detector to probe, or to refresh if it was listed from the device information cache
+		struct ProbeRequest
+		{
+			unsigned int hash;
+			bool listed;
+		};
+
+		// Detectors waiting for a probe thread and those (by hash) being probed
+		std::mutex m_probeMutex;
+		std::condition_variable m_probeCondition;
+		std::deque<ProbeRequest> m_probeQueue;
+		std::set<unsigned int> m_probesRunning;
+		unsigned int m_numUnlistedProbes;	// Queued or running for detectors not listed yet
+		std::vector<kmk::Thread*> m_probeThreads;
+		bool m_stopProbing;
+
 		// Callback on error
 		ErrorCallback m_pErrorCallbackFunc;
 		void *m_pErrorCallbackUserData;
@@ -52,11 +92,37 @@ class DriverMgr
 		DataReceivedCallback m_pDataReceivedCallbackFunc;
 		void *m_pDataReceivedCallbackUserData;
 
+#ifndef _WINDOWS
+		kmk::MetricsServer m_metricsServer;
+		kmk::CriticalSection m_metricsServerSection;
+#endif
+
 		static void OnDeviceChangedProc(kmk::IDevice *pDevice, bool added, void *pArg);
 		static void USBDetectorDataChangedCallbackProc(Detector *pDetector, int64_t timestamp, int channel, uint32_t counts, void *pArg);
         static void DeviceFinishedAcquisitionCallbackProc(kmk::IDevice *pDevice, bool forced, void *pArg);
         static void DeviceErrorCallbackProc(kmk::IDevice *pDevice, int errorCode, const String &message, void *pArg);
         static int UpdateThreadProc(void *pThis);
+        static int ProbeThreadProc(void *pThis);
+
+		// Add a probed detector to the list and raise the device changed callback. Called with m_deviceSection held
+		void ListDetector(Detector *pDetector);
+
+		// Probe a new detector on the probe threads, then list it unless it already is
+		void QueueProbe(Detector *pDetector, bool listed);
+
+		// Probe threads are started before the device manager so devices attached at startup are probed in parallel
+		bool StartProbeThreads();
+		void StopProbeThreads();
+
+		// Wait for every detector queued so far to be listed
+		void WaitForProbes();
+
+		// Take a removed detector off the probe queue, or wait for its probe to finish
+		void CancelProbe(unsigned int hash);
+
+		// Update every detector. Called with m_deviceSection held
+		void UpdateDetectors(bool waitForProcessing);
+        static void MetricsTextCallbackProc(void *pArg, std::string &textOut);
 
 	public:
 
@@ -104,6 +170,57 @@ class DriverMgr
         int SendInt8ConfigurationCommand(unsigned int deviceID, kmk::ConfigurationID configurationID, BYTE command);
         int SendInt16ConfigurationCommand(unsigned int deviceID, kmk::ConfigurationID configurationID, unsigned short command);
 
+		// Spectrum polling of D3 family detectors, shared by the detectors of the same device
+		int SetSpectrumPollSettings(unsigned int deviceID, const kmk::SpectrumPollSettings &settings);
+		int SetAlarmState(unsigned int deviceID, bool active);
+
+		// Add the devices recorded in a capture file. speed <= 0 plays as fast as possible
+		int AddReplayDevice(const char *pCaptureFilePath, double speed, bool loop);
+
+		// Add a simulated device that generates data for the VID / PID
+		int AddSimulatedDevice(int vendorID, int productID, const kmk::SimulationSettings &settings);
+
+		// Add the device on a serial port that is not found by enumeration, taking the VID / PID it would have over usb
+		int AddSerialDevice(const char *pDevicePath, int vendorID, int productID);
+
+		// Record the raw data read from a device into capture files
+		int StartCapture(unsigned int deviceID, const char *pBasePath, const kmk::CaptureSettings &settings);
+		int StopCapture(unsigned int deviceID);
+
+		// Trace 1 in sampleInterval reports read from a device (0 to stop tracing) and read back the latency of each stage
+		int SetLatencyTracing(unsigned int deviceID, unsigned int sampleInterval);
+		int GetLatencyStatistics(unsigned int deviceID, kmk::LatencyStage stage, kmk::LatencyStatistics &statsOut);
+
+		// Metrics of a device, and of all devices as OpenMetrics text written to a file or served on a Unix socket
+		int GetMetrics(unsigned int deviceID, kmk::MetricsSnapshot &snapshotOut);
+		void GetMetricsText(std::string &textOut);
+		int WriteMetrics(const char *pFilePath);
+		int StartMetricsServer(const char *pSocketPath);
+		int StopMetricsServer();
+
+		// Contention statistics of the named locks, only kept when built with KMK_LOCK_PROFILING
+		int GetLockProfile(std::vector<kmk::LockStatistics> &statisticsOut);
+		int ResetLockProfile();
+
+		// Run the whole driver on the virtual clock, stepped by the update thread as fast as the devices keep up
+		int SetVirtualTime(bool enabled);
+
+		// Process the data of all devices on numThreads shared threads, or a thread per device if 0
+		int SetProcessingThreads(unsigned int numThreads, bool workStealing);
+
+		// Packets each framed device added from now on holds, and whether reading waits for room. Can be set before initialising
+		int SetPacketPool(unsigned int poolSize, bool blockWhenFull, unsigned int blockTimeoutMs);
+
+		// Placement of the threads of a role started from now on. Can be set before initialising
+		int SetThreadPolicy(kmk::ThreadRole role, const kmk::ThreadPolicy &policy);
+		int GetThreadPolicyStatus(kmk::ThreadRole role, kmk::ThreadPolicyStatus &statusOut);
+
+		// Cache the serial and version of usb devices in a file, NULL to stop. Can be set before initialising
+		int SetDeviceCacheFile(const char *pFilePath);
+
+		// Read devices through io_uring rather than a thread each, from the next acquisition. Can be set before initialising
+		int SetReadBackend(bool ioUring);
+
 		// Call the error callback
 		void RaiseError(unsigned int deviceID, int errorCode);
 
@@ -43,10 +43,133 @@ typedef enum
 	HIDREPORTDATA_SETPOLARITY_NEGATIVE = 0x1
 } PolarityEnum;
 
+// Stages of the data path timed by kr_SetLatencyTracing. Each is measured from when the data was read from the device
+typedef enum
+{
+	LATENCY_STAGE_ENQUEUED = 0,		// Queued for processing by the read thread
+	LATENCY_STAGE_DEQUEUED,			// Taken from the queue by the processing thread
+	LATENCY_STAGE_DECODED,			// Counts decoded from the report
+	LATENCY_STAGE_ACCUMULATED,		// Added to the acquired data returned by kr_GetAcquiredData
+	LATENCY_STAGE_CALLBACK,			// Returned from the data received callback
+	LATENCY_STAGE_COUNT
+} LatencyStageEnum;
+
+// Latency statistics returned by kr_GetLatencyStatistics. Times are in microseconds
+struct SLatencyStatistics
+{
+	unsigned long long count;		// Number of traced reports that reached the stage
+	double min;
+	double mean;
+	double p50;
+	double p90;
+	double p99;
+	double p999;
+	double max;
+};
+
+// Counters and gauges returned by kr_GetMetrics. Counters are totals since the device was attached
+struct SMetrics
+{
+	unsigned long long bytesRead;				// Bytes read from the device
+	unsigned long long reportsDecoded;			// Data reports / packets decoded
+	unsigned long long eventsCounted;			// Counts decoded from the data reports
+	unsigned long long queueDepth;				// Reports / packets currently waiting to be processed
+	unsigned long long queueHighWater;			// Most reports / packets ever waiting to be processed
+	unsigned long long droppedQueue;			// Reports / packets lost because processing was not keeping up
+	unsigned long long droppedStream;			// Runs of corrupt data thrown away
+	unsigned long long crcFailures;				// Packets that failed their crc check
+	unsigned long long decompressionFailures;	// Compressed packets that could not be decompressed
+	unsigned long long configQueries;			// Configuration queries made
+	unsigned long long configQueryTimeUs;		// Total time spent waiting for configuration queries (microseconds)
+	unsigned long long configQueryFailures;		// Configuration queries that failed or timed out
+	unsigned long long acquisitionsStarted;		// Acquisitions started
+};
+
+// Histogram buckets of SLockProfile. Bucket i counts times up to 256ns * 4^i, the last bucket everything longer
+#define LOCK_PROFILE_BUCKETS 12
+#define LOCK_PROFILE_NAME_SIZE 64
+
+// Contention statistics of a lock returned by kr_GetLockProfile. Totals since the driver was loaded or last reset
+struct SLockProfile
+{
+	char name[LOCK_PROFILE_NAME_SIZE];			// e.g. Detector::m_dataCS, shared by every instance of the lock
+	unsigned long long acquisitions;
+	unsigned long long contended;				// Acquisitions that had to wait for another thread
+	unsigned long long waitTimeNs;				// Total time spent waiting for the lock
+	unsigned long long holdTimeNs;				// Total time the lock was held
+	unsigned long long waitHistogram[LOCK_PROFILE_BUCKETS];		// Acquisitions by time waited
+	unsigned long long holdHistogram[LOCK_PROFILE_BUCKETS];		// Holds by time held
+};
+
+// How often a D3 family detector is asked for its spectrum, set by kr_SetSpectrumPolling. In adaptive mode the interval
+// moves between minIntervalMs and maxIntervalMs with the count rate
+struct SSpectrumPollSettings
+{
+	unsigned int intervalMs;		// Interval when not adaptive (default 100)
+	BOOL adaptive;
+	unsigned int minIntervalMs;		// Fastest interval in adaptive mode, also used while an alarm is set (default 20)
+	unsigned int maxIntervalMs;		// Slowest interval in adaptive mode (default 1000)
+	float fastCountRate;			// Count rate (cps) at or above which the fastest interval is used (default 1000)
+	float slowCountRate;			// Count rate (cps) below which the interval backs off, at most fastCountRate (default 200)
+	unsigned int slowSpectrumCount;	// Consecutive spectra below slowCountRate before the interval is doubled (default 10)
+};
+
+// Threads placed by kr_SetThreadPolicy
+typedef enum
+{
+	THREAD_ROLE_READER = 0,			// Read data from the devices
+	THREAD_ROLE_PROCESSOR,			// Process the data read, including the threads of kr_SetProcessingThreads
+	THREAD_ROLE_UPDATER,			// Update the acquired data and check the acquisition limits
+	THREAD_ROLE_ENUMERATOR,			// Watch for devices being attached and removed
+	THREAD_ROLE_OTHER,				// Helpers off the data path (capture, metrics server)
+	THREAD_ROLE_COUNT
+} ThreadRoleEnum;
+
+typedef enum
+{
+	THREAD_SCHEDULING_DEFAULT = 0,	// Normal time shared scheduling
+	THREAD_SCHEDULING_FIFO,			// Real time first in first out (SCHED_FIFO)
+	THREAD_SCHEDULING_RR			// Real time round robin (SCHED_RR)
+} ThreadSchedulingEnum;
+
+// How the devices are read, set by kr_SetReadBackend
+typedef enum
+{
+	READ_BACKEND_EPOLL = 0,			// A thread for each device (default)
+	READ_BACKEND_IO_URING			// One io_uring shared by every device (Linux 5.9 or later)
+} ReadBackendEnum;
+
+// Settings of a thread policy that could not be applied, see SThreadPolicyStatus
+#define THREAD_POLICY_FAILED_AFFINITY	0x01
+#define THREAD_POLICY_FAILED_SCHEDULING	0x02
+#define THREAD_POLICY_FAILED_STACK_SIZE	0x04
+#define THREAD_POLICY_FAILED_NAME		0x08
+
+// Placement of the threads of a role set by kr_SetThreadPolicy
+struct SThreadPolicy
+{
+	unsigned long long cpuMask;		// Bit n set to allow cpu n, 0 for any cpu
+	int scheduling;					// ThreadSchedulingEnum
+	int priority;					// Real time priority (1 - 99 on Linux) for FIFO / RR scheduling
+	unsigned int stackSize;			// Bytes, 0 for the default
+};
+
+// Returned by kr_GetThreadPolicyStatus
+struct SThreadPolicyStatus
+{
+	unsigned int threadsStarted;	// Threads of the role started since its policy was set
+	unsigned int threadsFailed;		// Threads that did not get the whole policy (they still run)
+	unsigned int failedSettings;	// THREAD_POLICY_FAILED_ flags of every setting that could not be applied
+	int lastError;					// System error code of the last failure, e.g. EPERM without permission for real time
+};
+
 typedef void (stdcall *ErrorCallback)(void *pCallbackObject, unsigned int deviceID, int errorCode, const char *pMessage);
 typedef void (stdcall *DataReceivedCallback)(void *pCallbackObject, unsigned int deviceID, long long timestamp, int channelNumber, unsigned int numCounts);
 typedef  void (stdcall *DeviceChangedCallback)(unsigned int deviceID, BOOL added, void *pObject);
 
+// Handle of a driver context created by kr_CreateContext. NULL is the default context used by the functions without one
+typedef struct SDriverContext *DriverContext;
+
 /////////////////////////////////////////////////////////////////////////
 // Error codes. Also see ErrorCodes in ErrorCodes.h
 typedef enum
@@ -64,7 +64,8 @@ extern "C" {
 	*	Args:		errorCallbackFunc: Ptr to a function that will get called when an error occurs
 	*				pUserData: User defined data that will be passed into the callback function
 	*	Desc:		Initialise the detector library. Must be called before calling any
-	*				other detector function (With the exception of kr_GetVersionInformation)
+	*				other detector function (With the exception of kr_GetVersionInformation). Detectors already
+	*				attached are probed in parallel and listed by the time this returns
     *   Returns:    ERROR_OK on success or error code on failure
 	==========================================================================*/
     USBSPECTROMETER_API int stdcall kr_Initialise(ErrorCallback errorCallbackFunc, void *pUserData);
@@ -91,7 +92,9 @@ extern "C" {
 	*	Name:		kr_SetDeviceChangedCallback
 	*	Args:		callback: Ptr to function that will be called
 	*				pUserData: User defined data that will be passed into the callback function
-	*	Desc:		Register a callback function that is called when a new device is connected / disconnected
+	*	Desc:		Register a callback function that is called when a new device is connected / disconnected. A new
+	*				device is probed (serial, firmware version) in the background first and only listed and reported
+	*				once ready, so one slow to respond does not hold up the others
 	==========================================================================*/
     USBSPECTROMETER_API void stdcall kr_SetDeviceChangedCallback(DeviceChangedCallback callbackFunc, void *pUserData);
 
@@ -231,6 +234,317 @@ extern "C" {
 	==========================================================================*/
     USBSPECTROMETER_API int stdcall kr_SendInt16ConfigurationCommand(unsigned int deviceID, ConfigurationCommandsEnum configurationID, unsigned short command);
 
+	/*==========================================================================
+    *   Name:		kr_SetSpectrumPolling
+    *   Args:		deviceID: id of device
+    *               pSettings: Ptr to the polling settings, NULL for the defaults
+    *   Returns:    ERROR_OK on success or error code on failure (not a D3 family detector, invalid settings)
+    *   Desc:		Set how often a D3 family detector is asked for its spectrum. Faster polling gives fresher data at
+    *               the cost of more traffic on the link. In adaptive mode polling speeds up as soon as the count rate
+    *               rises and backs off while it stays low. Applies to every detector of the same device (e.g. the
+    *               gamma and neutron detectors of a D3M) and takes effect straight away
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetSpectrumPolling(unsigned int deviceID, const SSpectrumPollSettings *pSettings);
+
+	/*==========================================================================
+    *   Name:		kr_SetAlarmState
+    *   Args:		deviceID: id of device
+    *               active: TRUE while an alarm is raised on the detector, FALSE once it is cleared
+    *   Returns:    ERROR_OK on success or error code on failure (not a D3 family detector)
+    *   Desc:		In adaptive polling mode hold a D3 family detector at the fastest polling interval while an alarm
+    *               is active, so the spectra that confirm or clear it arrive as quickly as possible
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetAlarmState(unsigned int deviceID, BOOL active);
+
+	/*==========================================================================
+    *   Name:		kr_AddReplayDevice
+    *   Args:		pCaptureFilePath: Path of a raw data capture
+    *               speed: Playback speed, 1.0 for the original timing or <= 0 for as fast as possible
+    *               loop: Restart from the beginning once the end of the capture is reached
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Add the detectors recorded in a capture file as if they had been connected. They are reported
+    *               through the device changed callback and behave like real detectors
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_AddReplayDevice(const char *pCaptureFilePath, double speed, BOOL loop);
+
+	/*==========================================================================
+    *   Name:		kr_AddSimulatedDevice
+    *   Args:		vendorID: Vendor id of the device to simulate
+    *               productID: Product id of the device to simulate
+    *               countRate: Mean gamma count rate (counts per second)
+    *               neutronRate: Mean neutron count rate (counts per second) of devices with a neutron detector
+    *               peakChannel: Channel of a photopeak on top of the background continuum
+    *               peakFraction: Fraction (0 - 1) of the gamma counts in the photopeak, 0 for no peak
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Add a simulated detector that produces random data in the same format as the real device. It is
+    *               reported through the device changed callback and behaves like a real detector. Call repeatedly to
+    *               simulate many detectors
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_AddSimulatedDevice(int vendorID, int productID, double countRate, double neutronRate, double peakChannel, double peakFraction);
+
+	/*==========================================================================
+    *   Name:		kr_AddSerialDevice
+    *   Args:		pDevicePath: Path of the serial port, i.e. "/dev/ttyUSB0" or "COM3"
+    *               vendorID: Vendor id of the device on the port
+    *               productID: Product id of the device on the port
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Add the detectors of a device connected through a serial port that is not found when enumerating usb
+    *               devices, e.g. through a usb serial adapter or a pseudo terminal. Devices with their own usb serial
+    *               port are found without this. They are reported through the device changed callback and behave
+    *               like any other detector
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_AddSerialDevice(const char *pDevicePath, int vendorID, int productID);
+
+	/*==========================================================================
+    *   Name:		kr_StartCapture
+    *   Args:		deviceID: id of device
+    *               pBasePath: Path and file name prefix, files are named <pBasePath>_NNNN.kcap
+    *               maxFileSize: Start a new file once this many bytes have been written, 0 for no limit
+    *               maxFiles: Delete the oldest file once there are more than this, 0 to keep them all
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Record the raw data read from a device for use with kr_AddReplayDevice. Detectors in the same
+    *               unit (i.e. the gamma and neutron of a D3S) share a single capture
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_StartCapture(unsigned int deviceID, const char *pBasePath, unsigned int maxFileSize, unsigned int maxFiles);
+
+	/*==========================================================================
+    *   Name:		kr_StopCapture
+    *   Args:		deviceID: id of device
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Stop recording the device and close the capture file
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_StopCapture(unsigned int deviceID);
+
+	/*==========================================================================
+    *   Name:		kr_SetLatencyTracing
+    *   Args:		deviceID: id of device
+    *               sampleInterval: Trace 1 in every sampleInterval reports, 0 to turn tracing off
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Time reports from a device at each stage of the data path (see LatencyStageEnum) and collect the
+    *               results into latency histograms. Tracing is cheap enough to leave on in production with a sample
+    *               interval of 100 or more. Any previous statistics are cleared. Detectors in the same unit share
+    *               their statistics
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetLatencyTracing(unsigned int deviceID, unsigned int sampleInterval);
+
+	/*==========================================================================
+    *   Name:		kr_GetLatencyStatistics
+    *   Args:		deviceID: id of device
+    *               stage: Stage of the data path
+    *               pStatsOut: Ptr to the structure to receive the statistics
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Get the time taken (microseconds) for traced reports to reach a stage since being read from the
+    *               device. The count is 0 if no reports have been traced
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_GetLatencyStatistics(unsigned int deviceID, LatencyStageEnum stage, SLatencyStatistics *pStatsOut);
+
+	/*==========================================================================
+    *   Name:		kr_GetMetrics
+    *   Args:		deviceID: id of device
+    *               pMetricsOut: Ptr to the structure to receive the metrics
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Get a snapshot of the counters kept for a device (bytes read, reports decoded, drops etc). The
+    *               counters are always kept. Detectors in the same unit share their metrics
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_GetMetrics(unsigned int deviceID, SMetrics *pMetricsOut);
+
+	/*==========================================================================
+    *   Name:		kr_WriteMetrics
+    *   Args:		pFilePath: Path of the file to write
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Write the metrics of every device to a file in the OpenMetrics text format, labelled with the
+    *               device id, name and serial. The file is replaced in one step so it can be read (e.g. by the
+    *               node exporter textfile collector) while being rewritten
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_WriteMetrics(const char *pFilePath);
+
+	/*==========================================================================
+    *   Name:		kr_StartMetricsServer
+    *   Args:		pSocketPath: Path of the Unix domain socket to create
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Serve the metrics of every device in the OpenMetrics text format on a Unix domain socket, each
+    *               connection gets the current values. Linux only
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_StartMetricsServer(const char *pSocketPath);
+
+	/*==========================================================================
+    *   Name:		kr_StopMetricsServer
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Stop serving metrics and remove the socket
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_StopMetricsServer();
+
+	/*==========================================================================
+    *   Name:		kr_GetLockProfile
+    *   Args:		pProfilesOut: Array to receive the statistics of each lock
+    *               pNumProfilesInOut: In the size of the array, out the number of locks profiled
+    *   Returns:    ERROR_OK on success or error code on failure (the driver was not built with lock profiling)
+    *   Desc:		Get how often the driver's internal locks were taken, how often a thread had to wait for one and
+    *               how long locks were waited for and held. Only kept when the driver is built with
+    *               KROMEK_LOCK_PROFILING, when they are also included in the OpenMetrics text. If the array is
+    *               too small the first locks are returned
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_GetLockProfile(SLockProfile *pProfilesOut, unsigned int *pNumProfilesInOut);
+
+	/*==========================================================================
+    *   Name:		kr_ResetLockProfile
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Zero the lock statistics, e.g. to profile a single acquisition
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_ResetLockProfile();
+
+	/*==========================================================================
+    *   Name:		kr_SetVirtualTime
+    *   Args:		enabled: TRUE to run on virtual time, FALSE to go back to real time
+    *   Returns:    ERROR_OK on success or error code on failure (not initialised, any device acquiring)
+    *   Desc:		Replace real time throughout the driver with a virtual clock that moves on in 10ms steps as fast
+    *               as the devices can process the data for each step. Simulated and replay devices generate / play
+    *               their data for each step, so a time limited acquisition of hours completes in seconds and gives
+    *               the same result every run. Real hardware is not slowed down to match
+    *               and should not be used. Enable before adding simulated or replay devices. Other kr_ functions
+    *               must not be called from the callbacks while enabled
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetVirtualTime(BOOL enabled);
+
+	/*==========================================================================
+    *   Name:		kr_SetProcessingThreads
+    *   Args:		numThreads: Number of threads shared by all devices, 0 for a thread per device (default)
+    *               workStealing: TRUE to give each thread its own queue, keeping a busy device on the same thread
+    *                             while idle threads take work queued on busy ones
+    *   Returns:    ERROR_OK on success or error code on failure (not initialised, any device acquiring)
+    *   Desc:		Process the data of every device on a shared pool of threads rather than a thread per device. The
+    *               data of each device is still processed in order, one report at a time. Waits for devices still
+    *               finishing off a configuration query on the previous threads
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetProcessingThreads(unsigned int numThreads, BOOL workStealing);
+
+	/*==========================================================================
+    *   Name:		kr_SetPacketPool
+    *   Args:		poolSize: Number of complete packets each detector can hold until they are processed (default 20)
+    *               blockWhenFull: TRUE to hold up reading while the pool is full rather than drop the packet
+    *               blockTimeoutMs: Longest time to hold up reading for a packet before it is dropped (default 500)
+    *   Returns:    ERROR_OK on success or error code on failure (poolSize is 0)
+    *   Desc:		Set how many packets the D5 detectors (M2R2) added from now on hold between reading and processing,
+    *               and whether reading waits for room or drops packets once they are all held. A read that drops
+    *               packets raises ERROR_INTERNAL_DEVICE on the error callback. Call before kr_Initialise for the detectors
+    *               attached at startup
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetPacketPool(unsigned int poolSize, BOOL blockWhenFull, unsigned int blockTimeoutMs);
+
+	/*==========================================================================
+    *   Name:		kr_SetThreadPolicy
+    *   Args:		role: Threads to place
+    *               pPolicy: cpus, scheduling and stack size of the threads. NULL to go back to the defaults
+    *   Returns:    ERROR_OK on success or error code on failure (invalid role or priority)
+    *   Desc:		Set where and how the threads of a role run, e.g. to keep the read threads on a cpu of their own
+    *               with real time priority so they are not starved by other processes. Applies to threads started
+    *               afterwards: read and processing threads start with each acquisition, the update and enumerator
+    *               threads with kr_Initialise. Threads are named by role (Linux). A thread is still started if its
+    *               policy can not be fully applied (real time scheduling needs CAP_SYS_NICE or an rtprio limit),
+    *               check kr_GetThreadPolicyStatus
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetThreadPolicy(ThreadRoleEnum role, const SThreadPolicy *pPolicy);
+
+	/*==========================================================================
+    *   Name:		kr_GetThreadPolicyStatus
+    *   Args:		role: Threads to report on
+    *               pStatusOut: Ptr to the structure to receive the status
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Get how many threads of the role have been started since its policy was set, and which settings
+    *               of the policy could not be applied to them
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_GetThreadPolicyStatus(ThreadRoleEnum role, SThreadPolicyStatus *pStatusOut);
+
+	/*==========================================================================
+    *   Name:		kr_SetDeviceCacheFile
+    *   Args:		pFilePath: Path of the cache file, NULL to stop caching
+    *   Returns:    ERROR_OK on success or error code on failure (the file exists but can not be read)
+    *   Desc:		Keep the serial and firmware version of each usb detector in a file, keyed by its device path and
+    *               usb serial. Detectors found in it are listed as soon as they are attached rather than once they
+    *               have answered a configuration query, then read again in the background to keep the file up to
+    *               date. Call before kr_Initialise for the detectors attached at startup. The file is created when
+    *               the first detector is stored
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetDeviceCacheFile(const char *pFilePath);
+
+	/*==========================================================================
+    *   Name:		kr_SetReadBackend
+    *   Args:		backend: How to read the devices
+    *   Returns:    ERROR_OK on success or error code on failure (io_uring not supported by the kernel or build)
+    *   Desc:		Choose between a read thread for each device and a single io_uring reading every device, which
+    *               keeps several reads in flight for each device and needs far fewer system calls at high count
+    *               rates. Applies to devices that start acquiring afterwards. If io_uring is not supported the
+    *               devices stay on read threads, as do any the ring has no room for. Only devices using the
+    *               kromek driver (Linux) are affected
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_SetReadBackend(ReadBackendEnum backend);
+
+	/*==========================================================================
+    *   Name:		kr_CreateContext
+    *   Args:		ppAllowedDevices: Usb serials or device paths (i.e. "/dev/kromek0") of the detectors to add
+    *               numAllowedDevices: Number of entries in ppAllowedDevices, 0 to add every detector found
+    *               pContextOut: Ptr to receive the new context
+    *   Returns:    ERROR_OK on success or error code on failure
+    *   Desc:		Create a driver context independent of the default context used by the functions above. Each
+    *               context has its own detectors, callbacks, update thread and processing threads, so detectors
+    *               can be split between contexts (or processes) that do not hold each other up. Only detectors
+    *               found by enumeration are checked against the allowed list, ones added to a context with
+    *               kr_AddReplayDeviceCtx etc always are. A detector is only ever opened by one context, the first
+    *               initialised that allows it (the default context allows every detector), and is left to the
+    *               others until it is detached. Use the kr_ functions ending in Ctx with the context,
+    *               starting with kr_InitialiseCtx. The process wide settings (virtual time, thread policy, device
+    *               cache file, read backend and lock profile) apply to every context
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_CreateContext(const char **ppAllowedDevices, unsigned int numAllowedDevices, DriverContext *pContextOut);
+
+	/*==========================================================================
+    *   Name:		kr_DestroyContext
+    *   Args:		context: Context from kr_CreateContext, NULL for the default context
+    *   Desc:		Shut the context down as kr_Destruct does and free it. The context must not be used afterwards
+	==========================================================================*/
+    USBSPECTROMETER_API void stdcall kr_DestroyContext(DriverContext context);
+
+	/*==========================================================================
+    *   Name:		kr_InitialiseCtx ... kr_SetPacketPoolCtx
+    *   Args:		context: Context from kr_CreateContext, NULL for the default context
+    *               The rest as for the function of the same name without Ctx
+    *   Returns:    As for the function of the same name without Ctx
+    *   Desc:		The functions above that act on the detectors, for a given context. Detector ids are only
+    *               valid in the context that listed them. kr_GetAcquiredDataCtx takes the flags of
+    *               kr_GetAcquiredDataEx
+	==========================================================================*/
+    USBSPECTROMETER_API int stdcall kr_InitialiseCtx(DriverContext context, ErrorCallback errorCallbackFunc, void *pUserData);
+    USBSPECTROMETER_API unsigned int stdcall kr_GetNextDetectorCtx(DriverContext context, unsigned int currentDetectorID);
+    USBSPECTROMETER_API void stdcall kr_SetDeviceChangedCallbackCtx(DriverContext context, DeviceChangedCallback callbackFunc, void *pUserData);
+    USBSPECTROMETER_API void stdcall kr_SetDataReceivedCallbackCtx(DriverContext context, DataReceivedCallback callbackFunc, void *pUserData);
+    USBSPECTROMETER_API int stdcall kr_GetAcquiredDataCtx(DriverContext context, unsigned int deviceID, unsigned int *pBuffer, unsigned int *pTotalCounts, unsigned int *pRealTime, unsigned int *pLiveTime, unsigned int flags);
+    USBSPECTROMETER_API int stdcall kr_ClearAcquiredDataCtx(DriverContext context, unsigned int deviceID);
+    USBSPECTROMETER_API int stdcall kr_IsAcquiringDataCtx(DriverContext context, unsigned int deviceID);
+    USBSPECTROMETER_API int stdcall kr_BeginDataAcquisitionCtx(DriverContext context, unsigned int deviceID, unsigned int realTime, unsigned int liveTime);
+    USBSPECTROMETER_API int stdcall kr_StopDataAcquisitionCtx(DriverContext context, unsigned int deviceID);
+    USBSPECTROMETER_API int stdcall kr_GetDeviceNameCtx(DriverContext context, unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut);
+    USBSPECTROMETER_API int stdcall kr_GetDeviceManufacturerCtx(DriverContext context, unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut);
+    USBSPECTROMETER_API int stdcall kr_GetDeviceSerialCtx(DriverContext context, unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut);
+    USBSPECTROMETER_API int stdcall kr_GetDeviceVendorIDCtx(DriverContext context, unsigned int deviceID, int *pVendorIDOut);
+    USBSPECTROMETER_API int stdcall kr_GetDeviceProductIDCtx(DriverContext context, unsigned int deviceID, int *pProductIDOut);
+    USBSPECTROMETER_API int stdcall kr_SendInt8ConfigurationCommandCtx(DriverContext context, unsigned int deviceID, ConfigurationCommandsEnum configurationID, unsigned char command);
+    USBSPECTROMETER_API int stdcall kr_SendInt16ConfigurationCommandCtx(DriverContext context, unsigned int deviceID, ConfigurationCommandsEnum configurationID, unsigned short command);
+    USBSPECTROMETER_API int stdcall kr_SetSpectrumPollingCtx(DriverContext context, unsigned int deviceID, const SSpectrumPollSettings *pSettings);
+    USBSPECTROMETER_API int stdcall kr_SetAlarmStateCtx(DriverContext context, unsigned int deviceID, BOOL active);
+    USBSPECTROMETER_API int stdcall kr_AddReplayDeviceCtx(DriverContext context, const char *pCaptureFilePath, double speed, BOOL loop);
+    USBSPECTROMETER_API int stdcall kr_AddSimulatedDeviceCtx(DriverContext context, int vendorID, int productID, double countRate, double neutronRate, double peakChannel, double peakFraction);
+    USBSPECTROMETER_API int stdcall kr_AddSerialDeviceCtx(DriverContext context, const char *pDevicePath, int vendorID, int productID);
+    USBSPECTROMETER_API int stdcall kr_StartCaptureCtx(DriverContext context, unsigned int deviceID, const char *pBasePath, unsigned int maxFileSize, unsigned int maxFiles);
+    USBSPECTROMETER_API int stdcall kr_StopCaptureCtx(DriverContext context, unsigned int deviceID);
+    USBSPECTROMETER_API int stdcall kr_SetLatencyTracingCtx(DriverContext context, unsigned int deviceID, unsigned int sampleInterval);
+    USBSPECTROMETER_API int stdcall kr_GetLatencyStatisticsCtx(DriverContext context, unsigned int deviceID, LatencyStageEnum stage, SLatencyStatistics *pStatsOut);
+    USBSPECTROMETER_API int stdcall kr_GetMetricsCtx(DriverContext context, unsigned int deviceID, SMetrics *pMetricsOut);
+    USBSPECTROMETER_API int stdcall kr_WriteMetricsCtx(DriverContext context, const char *pFilePath);
+    USBSPECTROMETER_API int stdcall kr_StartMetricsServerCtx(DriverContext context, const char *pSocketPath);
+    USBSPECTROMETER_API int stdcall kr_StopMetricsServerCtx(DriverContext context);
+    USBSPECTROMETER_API int stdcall kr_SetProcessingThreadsCtx(DriverContext context, unsigned int numThreads, BOOL workStealing);
+    USBSPECTROMETER_API int stdcall kr_SetPacketPoolCtx(DriverContext context, unsigned int poolSize, BOOL blockWhenFull, unsigned int blockTimeoutMs);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,10 @@
 #include "CriticalSection.h"
 #include "Lock.h"
 #include "kmkTime.h"
+#include "SpectrumAccumulate.h"
+#include "LatencyTrace.h"
+#include "IDataInterface.h"
+#include "Probes.h"
 
 #include <memory.h>
 
@@ -17,13 +21,16 @@ Detector::Detector(kmk::IDevice *pDevice, DataReceivedCallbackFunc dataReceivedC
 , m_accumilatedRealTime(0)
 , m_totalCounts(0)
 , m_detectorProperties(detectorProperties)
+, m_dataCS("Detector::m_dataCS")
 , m_dataReceivedCallbackFunc(dataReceivedCallback)
 , m_dataReceivedCallbackArg(pCallbackArg)
 {
 	m_pDevice = pDevice;
+	m_hash = pDevice->GetHash();
 
 	// Set a callback raised everytime data is received and processed
 	m_pDevice->SetCountEventCallback(OnDataRecievedProc, this);
+	m_pDevice->SetSpectrumEventCallback(OnSpectrumRecievedProc, this);
 
 	// Allocate space for a full Spectrum counts array
 	m_pData.resize(TOTAL_RESULT_CHANNELS);
@@ -65,6 +72,10 @@ bool Detector::BeginDataAcquisition(unsigned int realTime, unsigned int liveTime
 	
 	if (!m_pDevice->Start())
 		return false;
+
+	kmk::IDataInterface *pInterface = m_pDevice->GetInterface();
+	if (pInterface != NULL)
+		pInterface->GetMetrics().Add(kmk::METRIC_ACQUISITIONS_STARTED);
 	
 	m_acquiringData = true;
 	return true;
@@ -87,14 +98,52 @@ void Detector::OnDataRecievedProc(kmk::IDevice * /*pDetector*/, int64_t timestam
 	// Add the the spectrum array and counts
 	pThis->m_pData[channel] += numCounts;
 	pThis->m_totalCounts += numCounts;
+	kmk::LatencyTracer::Mark(kmk::LS_ACCUMULATED);
+	KMK_PROBE3(count_event, pThis->m_hash, channel, numCounts);
 
 	// Pass on the callback
 	if (pThis->m_dataReceivedCallbackFunc != NULL)
 	{
 		pThis->m_dataReceivedCallbackFunc(pThis, timestamp, channel, numCounts, pThis->m_dataReceivedCallbackArg);
+		kmk::LatencyTracer::Mark(kmk::LS_CALLBACK);
+	}
+}
+
+// Callback routine called once per spectrum for devices that return whole spectra
+void Detector::OnSpectrumRecievedProc(kmk::IDevice * /*pDetector*/, int64_t timestamp, const uint16_t *pCounts, int numChannels, void *pArg)
+{
+	Detector *pThis = (Detector*)pArg;
+
+	if (numChannels > TOTAL_RESULT_CHANNELS)
+		numChannels = TOTAL_RESULT_CHANNELS;
+
+	kmk::Lock lock(pThis->m_dataCS);
+
+	// Add the whole spectrum in one pass
+	unsigned int numCounts = (unsigned int)kmk::AccumulateSpectrum(&pThis->m_pData[0], pCounts, numChannels);
+	pThis->m_totalCounts += numCounts;
+	kmk::LatencyTracer::Mark(kmk::LS_ACCUMULATED);
+	KMK_PROBE3(count_event, pThis->m_hash, -1, numCounts);
+
+	// Pass on the callback for each channel that changed
+	if (pThis->m_dataReceivedCallbackFunc != NULL)
+	{
+		for (int i = 0; i < numChannels; ++i)
+		{
+			if (pCounts[i] > 0)
+				pThis->m_dataReceivedCallbackFunc(pThis, timestamp, i, pCounts[i], pThis->m_dataReceivedCallbackArg);
+		}
+		kmk::LatencyTracer::Mark(kmk::LS_CALLBACK);
 	}
 }
 
+void Detector::SetDataReceivedCallback(DataReceivedCallbackFunc dataReceivedCallback, void *pCallbackArg)
+{
+	kmk::Lock lock(m_dataCS);
+	m_dataReceivedCallbackFunc = dataReceivedCallback;
+	m_dataReceivedCallbackArg = pCallbackArg;
+}
+
 void Detector::ClearAcquiredData()
 {
     kmk::Lock lock (m_dataCS);
@@ -109,6 +158,7 @@ void Detector::ClearAcquiredData()
 // acquisition of the acquisition has already ended
 bool Detector::GetAcquiredData(unsigned int *pBuffer, unsigned int *pTotalCounts, unsigned int *pRealTime, unsigned int *pLiveTime, unsigned int flags)
 {
+	KMK_PROBE1(get_acquired_data_begin, m_hash);
 	kmk::Lock lock (m_dataCS);
 	
     int64_t realTime = m_accumilatedRealTime + m_pDevice->GetRealTime();
@@ -127,14 +177,30 @@ bool Detector::GetAcquiredData(unsigned int *pBuffer, unsigned int *pTotalCounts
 	if (pLiveTime)
 		*pLiveTime = (unsigned int)CalculateLiveTime((double)realTime, m_totalCounts);
 
+	// Counts of the data returned, clearing below resets them
+	unsigned int totalCounts = m_totalCounts;
+
 	if (flags & GAD_CLEAR_COUNTS)
 	{
        ClearAcquiredData();
 	}
 
+	KMK_PROBE2(get_acquired_data_end, m_hash, totalCounts);
 	return true;
 }
 
+void Detector::Probe()
+{
+	// Both are read in the same round trip and cached by the device
+	m_pDevice->GetSerialNumber();
+	m_pDevice->GetVersion();
+}
+
+void Detector::Refresh()
+{
+	m_pDevice->RefreshInformation();
+}
+
 // Send the LLD value to the detector
 bool Detector::SendLLDConfigurationCommand(int channelLLD)
 {	
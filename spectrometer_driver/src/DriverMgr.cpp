@@ -2,10 +2,52 @@
 #include "stdafx.h"
 #include "DriverMgr.h"
 #include "Lock.h"
+#include "ReplayDataInterface.h"
+#ifdef _WINDOWS
+	#include "USBSerialDataInterfaceWindows.h"
+#else
+	#include "USBKromekDataInterfaceLinux.h"
+	#include "USBSerialDataInterfaceLinux.h"
+#endif
+#include "Probes.h"
+#include "VirtualClock.h"
+#include "Executor.h"
+#include "DeviceInfoCache.h"
 #include <assert.h>
+#include <stdio.h>
+#include <set>
 
 #define PRODUCT_ID_RADANGEL		0x100
 
+// Virtual time (ms) moved on by each pass of the update thread, the same as the simulation tick
+#define VIRTUAL_TIME_STEP 10
+
+// Longest real time (ms) a pass of the update thread waits for a detector to process the last step
+#define VIRTUAL_TIME_PROCESSING_TIMEOUT 1000
+
+// Longest real time (ms) a pass of the update thread waits for the devices when they are held elsewhere, e.g. by a
+// configuration query that needs time to move on before it can be answered
+#define VIRTUAL_TIME_DEVICE_WAIT 50
+
+// Most devices probed at once when they are attached. Probing mostly waits on configuration round trips, so several run
+// side by side, while keeping a burst of devices from starting a thread each
+#define MAX_PROBE_THREADS 4
+
+// Convert a device string to an OpenMetrics label value. Device strings are ASCII, anything else is replaced
+static std::string ToLabelValue(const std::wstring &value)
+{
+	std::string result;
+	for (size_t i = 0; i < value.size(); ++i)
+	{
+		wchar_t ch = value[i];
+		if (ch == L'\\' || ch == L'"')
+			result += '\\';
+
+		result += (ch >= 0x20 && ch < 0x7F) ? (char)ch : '?';
+	}
+	return result;
+}
+
 // Singleton
 DriverMgr *DriverMgr::m_pInstance = NULL;
 DriverMgr *DriverMgr::GetInstance()
@@ -26,7 +68,14 @@ void DriverMgr::DeleteInstance()
 
 DriverMgr::DriverMgr()
 : m_initialised(false)
+, m_pExecutor(&kmk::Executor::GetInstance())
+, m_pOwnedExecutor(NULL)
+, m_propSection("DriverMgr::m_propSection")
+, m_deviceSection("DriverMgr::m_deviceSection")
+, m_updateThreadSection("DriverMgr::m_updateThreadSection")
 , m_keepUpdateThreadRunning(false)
+, m_numUnlistedProbes(0)
+, m_stopProbing(false)
 , m_pErrorCallbackFunc(NULL)
 , m_pErrorCallbackUserData(NULL)
 , m_pDeviceChangedCallbackFunc(NULL)
@@ -37,6 +86,29 @@ DriverMgr::DriverMgr()
 	m_deviceMgr.SetDeviceChangedCallback(OnDeviceChangedProc, this);
 }
 
+DriverMgr::DriverMgr(const std::vector<std::wstring> &allowedDevices)
+: m_initialised(false)
+, m_pExecutor(NULL)
+, m_pOwnedExecutor(new kmk::Executor())
+, m_propSection("DriverMgr::m_propSection")
+, m_deviceSection("DriverMgr::m_deviceSection")
+, m_updateThreadSection("DriverMgr::m_updateThreadSection")
+, m_keepUpdateThreadRunning(false)
+, m_numUnlistedProbes(0)
+, m_stopProbing(false)
+, m_pErrorCallbackFunc(NULL)
+, m_pErrorCallbackUserData(NULL)
+, m_pDeviceChangedCallbackFunc(NULL)
+, m_pDeviceChangedCallbackUserData(NULL)
+, m_pDataReceivedCallbackFunc(NULL)
+, m_pDataReceivedCallbackUserData(NULL)
+{
+	m_pExecutor = m_pOwnedExecutor;
+	m_deviceMgr.SetDeviceChangedCallback(OnDeviceChangedProc, this);
+	m_deviceMgr.SetAllowedDevices(allowedDevices);
+	m_deviceMgr.SetExecutor(m_pExecutor);
+}
+
 // Private: Should never be called!
 DriverMgr::DriverMgr(const DriverMgr &)
 {
@@ -45,6 +117,7 @@ DriverMgr::DriverMgr(const DriverMgr &)
 DriverMgr::~DriverMgr()
 {
 	Destruct();
+	delete m_pOwnedExecutor;
 }
 
 bool DriverMgr::IsInitialised()
@@ -56,19 +129,29 @@ bool DriverMgr::IsInitialised()
 // Initialise the mgr including starting an update thread that will update devices regularly
 int DriverMgr::Initialise(kmk::ValidDeviceIdentifierVector& validDevices)
 {
-    kmk::Lock lock(m_propSection);
-    if (m_initialised)
-        return ERROR_OK;
+    {
+        kmk::Lock lock(m_propSection);
+        if (m_initialised)
+            return ERROR_OK;
 
-	m_deviceMgr.Initialize(validDevices);
-	m_keepUpdateThreadRunning = true;
+        if (!StartProbeThreads())
+            return ERROR_UNKNOWN;
 
-	if (!m_updateThread.Start(UpdateThreadProc, this))
-	{
-        return ERROR_UNKNOWN;
-	}
+        m_deviceMgr.Initialize(validDevices);
+        m_keepUpdateThreadRunning = true;
 
-    m_initialised = true;
+        if (!m_updateThread.Start(UpdateThreadProc, this, kmk::TR_UPDATER))
+        {
+            StopProbeThreads();
+            return ERROR_UNKNOWN;
+        }
+
+        m_initialised = true;
+    }
+
+    // The devices already attached are listed once initialised. Waited for outside the lock as the device changed
+    // callback raised for each may call back in
+    WaitForProbes();
     return ERROR_OK;
 }
 
@@ -78,6 +161,15 @@ void DriverMgr::Destruct()
     if (!IsInitialised())
         return;
 
+	// The server reads the devices so stop it before they go
+	StopMetricsServer();
+
+	// A device attached from here on would be left probing with nothing to service or delete it
+	m_deviceMgr.StopEnumerating();
+
+	// Waits for the probes already running, the rest are dropped
+	StopProbeThreads();
+
 	// Delete devices
     {
         kmk::Lock lock(m_deviceSection);
@@ -88,6 +180,11 @@ void DriverMgr::Destruct()
             delete it->second;
         }
         m_attachedDevices.clear();
+
+        for (it = m_probingDevices.begin(); it != m_probingDevices.end(); ++it)
+            delete it->second;
+
+        m_probingDevices.clear();
     }
 	// Stop the update thread and wait for it to exit
 	{
@@ -97,43 +194,73 @@ void DriverMgr::Destruct()
     m_updateThread.WaitForTermination();
 
 	m_deviceMgr.ShutDown();
+
+	// Only stops once the devices have gone
+	m_pExecutor->Stop();
 }
 
 // Event callback raised everytime a device is connected / disconnected. Called from a seperate thread.
 void DriverMgr::OnDeviceChangedProc(kmk::IDevice *pDevice, bool added, void *pArg)
 {
 	DriverMgr *pThis = (DriverMgr*)pArg;
+	unsigned int hash = pDevice->GetHash();
+
+	// The device is deleted once this returns, so its probe has to be finished first. The probe needs the device
+	// section to list the detector, so wait before taking it
+	if (!added)
+		pThis->CancelProbe(hash);
+
 	kmk::Lock lock(pThis->m_deviceSection);
 
 	if (added)
 	{
+		VID vendorId = pDevice->GetVendorID();
+		PID productId = pDevice->GetProductID();
+		KMK_PROBE4(device_changed, hash, true, vendorId, productId);
+
 		kmk::DetectorProperties props;
-		if (pThis->m_deviceMgr.GetDetectorProperties(pDevice->GetVendorID(), pDevice->GetProductID(), props))
+		if (pThis->m_deviceMgr.GetDetectorProperties(vendorId, productId, props))
 		{
-			// Create the new device
-			Detector *pDetector = new Detector(pDevice, USBDetectorDataChangedCallbackProc, pThis, props);
-
-			pThis->m_attachedDevices[pDetector->Hash()] = pDetector;
-			pDevice->SetFinishedAcquisitionCallback(DeviceFinishedAcquisitionCallbackProc, pThis);
-			pDevice->SetErrorCallback(DeviceErrorCallbackProc, pThis);
-
-			// Raise callback
-			if (pThis->m_pDeviceChangedCallbackFunc != NULL)
+			// Only ask for per channel data if someone is listening for it
+			DataReceivedCallbackFunc dataReceivedFunc = NULL;
 			{
-				(*pThis->m_pDeviceChangedCallbackFunc)(pDevice->GetHash(), TRUE, pThis->m_pDeviceChangedCallbackUserData);
+				kmk::Lock propLock(pThis->m_propSection);
+				if (pThis->m_pDataReceivedCallbackFunc != NULL)
+					dataReceivedFunc = USBDetectorDataChangedCallbackProc;
 			}
+
+			// Create the new device. It is listed and announced once probed, straight away if the device information
+			// cache already knows it, in which case the probe only checks the cache is still right
+			Detector *pDetector = new Detector(pDevice, dataReceivedFunc, pThis, props);
+			bool listed = pDevice->LoadCachedInformation();
+			if (listed)
+				pThis->ListDetector(pDetector);
+			else
+				pThis->m_probingDevices[pDetector->Hash()] = pDetector;
+
+			pThis->QueueProbe(pDetector, listed);
 		}
 	}
 	else
 	{
+		KMK_PROBE4(device_changed, hash, false, 0, 0);
+
+		// Never announced, so removed without a callback
+		HIDSpectrometerDeviceVector::iterator itProbing = pThis->m_probingDevices.find(hash);
+		if (itProbing != pThis->m_probingDevices.end())
+		{
+			delete itProbing->second;
+			pThis->m_probingDevices.erase(itProbing);
+		}
+
 		// Remove the device
-		HIDSpectrometerDeviceVector::iterator it = pThis->m_attachedDevices.find(pDevice->GetHash());
+		HIDSpectrometerDeviceVector::iterator it = pThis->m_attachedDevices.find(hash);
 		if (it != pThis->m_attachedDevices.end())
 		{
 			// Raise callback
 			if (pThis->m_pDeviceChangedCallbackFunc != NULL)
 			{
-                (*pThis->m_pDeviceChangedCallbackFunc)(pDevice->GetHash(), FALSE, pThis->m_pDeviceChangedCallbackUserData);
+                (*pThis->m_pDeviceChangedCallbackFunc)(hash, FALSE, pThis->m_pDeviceChangedCallbackUserData);
 			}
 
 			delete it->second;
@@ -142,6 +269,156 @@ void DriverMgr::OnDeviceChangedProc(kmk::IDevice *pDevice, bool added, void *pAr
 	}
 }
 
+void DriverMgr::ListDetector(Detector *pDetector)
+{
+	m_attachedDevices[pDetector->Hash()] = pDetector;
+
+	kmk::IDevice *pDevice = pDetector->GetDevice();
+	pDevice->SetFinishedAcquisitionCallback(DeviceFinishedAcquisitionCallbackProc, this);
+	pDevice->SetErrorCallback(DeviceErrorCallbackProc, this);
+
+	// Raise callback
+	if (m_pDeviceChangedCallbackFunc != NULL)
+	{
+		(*m_pDeviceChangedCallbackFunc)(pDetector->Hash(), TRUE, m_pDeviceChangedCallbackUserData);
+	}
+}
+
+void DriverMgr::QueueProbe(Detector *pDetector, bool listed)
+{
+	ProbeRequest request;
+	request.hash = pDetector->Hash();
+	request.listed = listed;
+
+	std::lock_guard<std::mutex> lock(m_probeMutex);
+	m_probeQueue.push_back(request);
+	if (!listed)
+		++m_numUnlistedProbes;
+
+	m_probeCondition.notify_all();
+}
+
+bool DriverMgr::StartProbeThreads()
+{
+	std::lock_guard<std::mutex> lock(m_probeMutex);
+	m_stopProbing = false;
+
+	for (int i = 0; i < MAX_PROBE_THREADS; ++i)
+	{
+		kmk::Thread *pThread = new kmk::Thread();
+		if (!pThread->Start(ProbeThreadProc, this, kmk::TR_ENUMERATOR, "kmk-probe"))
+		{
+			delete pThread;
+			break;
+		}
+
+		m_probeThreads.push_back(pThread);
+	}
+
+	return !m_probeThreads.empty();
+}
+
+void DriverMgr::StopProbeThreads()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_probeMutex);
+		m_stopProbing = true;
+		m_probeQueue.clear();
+		m_numUnlistedProbes = 0;
+		m_probeCondition.notify_all();
+	}
+
+	// Only this thread changes the probe threads while stopping
+	for (size_t i = 0; i < m_probeThreads.size(); ++i)
+	{
+		m_probeThreads[i]->WaitForTermination();
+		delete m_probeThreads[i];
+	}
+
+	m_probeThreads.clear();
+}
+
+void DriverMgr::WaitForProbes()
+{
+	std::unique_lock<std::mutex> lock(m_probeMutex);
+	m_probeCondition.wait(lock, [this] { return m_numUnlistedProbes == 0; });
+}
+
+void DriverMgr::CancelProbe(unsigned int hash)
+{
+	std::unique_lock<std::mutex> lock(m_probeMutex);
+
+	for (std::deque<ProbeRequest>::iterator it = m_probeQueue.begin(); it != m_probeQueue.end(); ++it)
+	{
+		if (it->hash == hash)
+		{
+			if (!it->listed)
+				--m_numUnlistedProbes;
+
+			m_probeQueue.erase(it);
+			m_probeCondition.notify_all();
+			break;
+		}
+	}
+
+	m_probeCondition.wait(lock, [this, hash] { return m_probesRunning.count(hash) == 0; });
+}
+
+// Probe detectors off the thread that found them, so a device slow to answer only holds up itself
+int DriverMgr::ProbeThreadProc(void *pArg)
+{
+	DriverMgr *pThis = (DriverMgr*)pArg;
+
+	std::unique_lock<std::mutex> probeLock(pThis->m_probeMutex);
+	for (;;)
+	{
+		pThis->m_probeCondition.wait(probeLock, [pThis] { return pThis->m_stopProbing || !pThis->m_probeQueue.empty(); });
+		if (pThis->m_stopProbing)
+			break;
+
+		ProbeRequest request = pThis->m_probeQueue.front();
+		pThis->m_probeQueue.pop_front();
+		pThis->m_probesRunning.insert(request.hash);
+		probeLock.unlock();
+
+		// Not deleted until this finishes, a removal waits for it
+		Detector *pDetector = NULL;
+		{
+			kmk::Lock lock(pThis->m_deviceSection);
+			HIDSpectrometerDeviceVector &devices = request.listed ? pThis->m_attachedDevices : pThis->m_probingDevices;
+			HIDSpectrometerDeviceVector::iterator it = devices.find(request.hash);
+			if (it != devices.end())
+				pDetector = it->second;
+		}
+
+		// A configuration query keeps some devices reading for a while after, so under the virtual clock an
+		// acquisition started straight after would begin part way through. Leave it to the first call that needs it
+		if (pDetector != NULL && kmk::VirtualClock::GetEnabled() == NULL)
+		{
+			if (request.listed)
+				pDetector->Refresh();
+			else
+				pDetector->Probe();
+		}
+
+		if (pDetector != NULL && !request.listed)
+		{
+			kmk::Lock lock(pThis->m_deviceSection);
+			pThis->m_probingDevices.erase(request.hash);
+			pThis->ListDetector(pDetector);
+		}
+
+		probeLock.lock();
+		pThis->m_probesRunning.erase(request.hash);
+		if (!request.listed)
+			--pThis->m_numUnlistedProbes;
+
+		pThis->m_probeCondition.notify_all();
+	}
+
+	return 0;
+}
+
 // Event callback from each detector raised whenever data is received from the device. Called from a seperate thread for each detector 
 // (as part of the data processor thread)
 void DriverMgr::USBDetectorDataChangedCallbackProc(Detector *pDetector, int64_t timestamp, int channel, uint32_t counts, void *pArg)
@@ -379,9 +656,23 @@ void DriverMgr::SetDeviceChangedCallback(DeviceChangedCallback pFunc, void *pUse
 // Set a callback function for when new data arrives on any device
 void DriverMgr::SetDataReceivedCallback(DataReceivedCallback pFunc, void *pUserData)
 {
-    kmk::Lock lock(m_propSection);
-	m_pDataReceivedCallbackFunc = pFunc;
-	m_pDataReceivedCallbackUserData = pUserData;
+	{
+		kmk::Lock lock(m_propSection);
+		m_pDataReceivedCallbackFunc = pFunc;
+		m_pDataReceivedCallbackUserData = pUserData;
+	}
+
+	// Detectors only split spectra into per channel events when there is a callback to receive them
+	kmk::Lock lock(m_deviceSection);
+	for (HIDSpectrometerDeviceVector::iterator it = m_attachedDevices.begin(); it != m_attachedDevices.end(); ++it)
+	{
+		it->second->SetDataReceivedCallback(pFunc != NULL ? USBDetectorDataChangedCallbackProc : NULL, this);
+	}
+
+	for (HIDSpectrometerDeviceVector::iterator it = m_probingDevices.begin(); it != m_probingDevices.end(); ++it)
+	{
+		it->second->SetDataReceivedCallback(pFunc != NULL ? USBDetectorDataChangedCallbackProc : NULL, this);
+	}
 }
 
 int DriverMgr::GetDeviceName(unsigned int deviceID, std::wstring &strOut)
@@ -466,6 +757,375 @@ int DriverMgr::SendInt16ConfigurationCommand(unsigned int deviceID, kmk::Configu
     return itDevice->second->SendInt16ConfigurationCommand(configurationID, command) ? ERROR_OK : ERROR_UNKNOWN;
 }
 
+int DriverMgr::SetSpectrumPollSettings(unsigned int deviceID, const kmk::SpectrumPollSettings &settings)
+{
+	kmk::Lock lock(m_deviceSection);
+
+	HIDSpectrometerDeviceVector::const_iterator itDevice = m_attachedDevices.find(deviceID);
+	if (itDevice == m_attachedDevices.end())
+        return ERROR_INVALID_DEVICE_ID;
+
+    return itDevice->second->GetDevice()->SetSpectrumPollSettings(settings) ? ERROR_OK : ERROR_UNKNOWN;
+}
+
+int DriverMgr::SetAlarmState(unsigned int deviceID, bool active)
+{
+	kmk::Lock lock(m_deviceSection);
+
+	HIDSpectrometerDeviceVector::const_iterator itDevice = m_attachedDevices.find(deviceID);
+	if (itDevice == m_attachedDevices.end())
+        return ERROR_INVALID_DEVICE_ID;
+
+    return itDevice->second->GetDevice()->SetAlarmState(active) ? ERROR_OK : ERROR_UNKNOWN;
+}
+
+int DriverMgr::AddReplayDevice(const char *pCaptureFilePath, double speed, bool loop)
+{
+	if (!IsInitialised())
+		return ERROR_NOT_INITIALISED;
+
+	kmk::ReplayDataInterface::PlaybackMode mode = kmk::ReplayDataInterface::PM_SCALED_TIMING;
+	if (speed <= 0)
+		mode = kmk::ReplayDataInterface::PM_AS_FAST_AS_POSSIBLE;
+	else if (speed == 1.0)
+		mode = kmk::ReplayDataInterface::PM_ORIGINAL_TIMING;
+
+	// Devices are added through OnDeviceChangedProc the same as when they are plugged in
+	kmk::ReplayDataInterface *pInterface = new kmk::ReplayDataInterface(pCaptureFilePath, mode, speed, loop);
+	if (!m_deviceMgr.RegisterInterface(pInterface))
+	{
+		delete pInterface;
+		return ERROR_DEVICE_OPEN_FAILED;
+	}
+
+	// Listed by the time this returns
+	WaitForProbes();
+	return ERROR_OK;
+}
+
+int DriverMgr::AddSimulatedDevice(int vendorID, int productID, const kmk::SimulationSettings &settings)
+{
+	if (!IsInitialised())
+		return ERROR_NOT_INITIALISED;
+
+	kmk::SimulatedDataInterface *pInterface = kmk::SimulatedDataInterface::Create(vendorID, productID, settings);
+	if (pInterface == NULL)
+		return ERROR_INVALID_DEVICE_ID;
+
+	// Devices are added through OnDeviceChangedProc the same as when they are plugged in
+	if (!m_deviceMgr.RegisterInterface(pInterface))
+	{
+		delete pInterface;
+		return ERROR_DEVICE_OPEN_FAILED;
+	}
+
+	// Listed by the time this returns
+	WaitForProbes();
+	return ERROR_OK;
+}
+
+int DriverMgr::AddSerialDevice(const char *pDevicePath, int vendorID, int productID)
+{
+	if (!IsInitialised())
+		return ERROR_NOT_INITIALISED;
+
+#ifdef _WINDOWS
+	std::string devicePath = pDevicePath;
+	kmk::USBSerialDataInterface *pInterface = new kmk::USBSerialDataInterface(kmk::String(devicePath.begin(), devicePath.end()),
+		productID, vendorID, L"");
+#else
+	kmk::USBSerialDataInterface *pInterface = new kmk::USBSerialDataInterface(pDevicePath, productID, vendorID, NULL);
+#endif
+
+	// Devices are added through OnDeviceChangedProc the same as when they are plugged in
+	if (!m_deviceMgr.RegisterInterface(pInterface))
+	{
+		delete pInterface;
+		return ERROR_DEVICE_OPEN_FAILED;
+	}
+
+	// Listed by the time this returns
+	WaitForProbes();
+	return ERROR_OK;
+}
+
+int DriverMgr::StartCapture(unsigned int deviceID, const char *pBasePath, const kmk::CaptureSettings &settings)
+{
+	kmk::Lock lock(m_deviceSection);
+
+	HIDSpectrometerDeviceVector::const_iterator itDevice = m_attachedDevices.find(deviceID);
+	if (itDevice == m_attachedDevices.end())
+        return ERROR_INVALID_DEVICE_ID;
+
+    return itDevice->second->GetDataInterface()->StartCapture(pBasePath, settings) ? ERROR_OK : ERROR_WRITE_FAILED;
+}
+
+int DriverMgr::StopCapture(unsigned int deviceID)
+{
+	kmk::Lock lock(m_deviceSection);
+
+	HIDSpectrometerDeviceVector::const_iterator itDevice = m_attachedDevices.find(deviceID);
+	if (itDevice == m_attachedDevices.end())
+        return ERROR_INVALID_DEVICE_ID;
+
+    itDevice->second->GetDataInterface()->StopCapture();
+    return ERROR_OK;
+}
+
+int DriverMgr::SetLatencyTracing(unsigned int deviceID, unsigned int sampleInterval)
+{
+	kmk::Lock lock(m_deviceSection);
+
+	HIDSpectrometerDeviceVector::const_iterator itDevice = m_attachedDevices.find(deviceID);
+	if (itDevice == m_attachedDevices.end())
+        return ERROR_INVALID_DEVICE_ID;
+
+    itDevice->second->GetDataInterface()->GetLatencyTracer().SetSampleInterval(sampleInterval);
+    return ERROR_OK;
+}
+
+int DriverMgr::GetLatencyStatistics(unsigned int deviceID, kmk::LatencyStage stage, kmk::LatencyStatistics &statsOut)
+{
+	kmk::Lock lock(m_deviceSection);
+
+	HIDSpectrometerDeviceVector::const_iterator itDevice = m_attachedDevices.find(deviceID);
+	if (itDevice == m_attachedDevices.end())
+        return ERROR_INVALID_DEVICE_ID;
+
+    if (stage < 0 || stage >= kmk::LS_COUNT)
+        return ERROR_UNKNOWN;
+
+    itDevice->second->GetDataInterface()->GetLatencyTracer().GetStatistics(stage, statsOut);
+    return ERROR_OK;
+}
+
+int DriverMgr::GetMetrics(unsigned int deviceID, kmk::MetricsSnapshot &snapshotOut)
+{
+	kmk::Lock lock(m_deviceSection);
+
+	HIDSpectrometerDeviceVector::const_iterator itDevice = m_attachedDevices.find(deviceID);
+	if (itDevice == m_attachedDevices.end())
+        return ERROR_INVALID_DEVICE_ID;
+
+    itDevice->second->GetDataInterface()->GetMetrics().GetSnapshot(snapshotOut);
+    return ERROR_OK;
+}
+
+void DriverMgr::GetMetricsText(std::string &textOut)
+{
+    std::vector<kmk::LabelledMetricsSnapshot> snapshots;
+    {
+        kmk::Lock lock(m_deviceSection);
+
+        // Detectors in the same unit share an interface, only report it once under the first detector
+        std::set<kmk::IDataInterface*> interfacesDone;
+        for (HIDSpectrometerDeviceVector::iterator it = m_attachedDevices.begin(); it != m_attachedDevices.end(); ++it)
+        {
+            kmk::IDataInterface *pInterface = it->second->GetDataInterface();
+            if (!interfacesDone.insert(pInterface).second)
+                continue;
+
+            char deviceLabel[32];
+            snprintf(deviceLabel, sizeof(deviceLabel), "device=\"%u\"", it->first);
+
+            kmk::LabelledMetricsSnapshot snapshot;
+            snapshot.labels = std::string(deviceLabel) + ",product=\"" + ToLabelValue(it->second->GetDeviceName()) + 
+                "\",serial=\"" + ToLabelValue(it->second->GetDeviceSerial()) + "\"";
+            pInterface->GetMetrics().GetSnapshot(snapshot.snapshot);
+            snapshots.push_back(snapshot);
+        }
+    }
+
+    kmk::Metrics::WriteOpenMetrics(snapshots, textOut);
+}
+
+int DriverMgr::WriteMetrics(const char *pFilePath)
+{
+    std::string text;
+    GetMetricsText(text);
+
+    // Write to a temporary file and move it into place so readers never see a partial file
+    std::string tempPath = std::string(pFilePath) + ".tmp";
+    FILE *pFile = fopen(tempPath.c_str(), "wb");
+    if (pFile == NULL)
+        return ERROR_UNKNOWN;
+
+    bool written = fwrite(text.data(), 1, text.size(), pFile) == text.size();
+    written &= fclose(pFile) == 0;
+
+    if (written && rename(tempPath.c_str(), pFilePath) != 0)
+    {
+        // Windows will not rename over an existing file
+        remove(pFilePath);
+        written = rename(tempPath.c_str(), pFilePath) == 0;
+    }
+
+    if (!written)
+    {
+        remove(tempPath.c_str());
+        return ERROR_UNKNOWN;
+    }
+
+    return ERROR_OK;
+}
+
+int DriverMgr::StartMetricsServer(const char *pSocketPath)
+{
+#ifndef _WINDOWS
+    kmk::Lock lock(m_metricsServerSection);
+    return m_metricsServer.Start(pSocketPath, MetricsTextCallbackProc, this) ? ERROR_OK : ERROR_UNKNOWN;
+#else
+    return ERROR_UNKNOWN;
+#endif
+}
+
+int DriverMgr::StopMetricsServer()
+{
+#ifndef _WINDOWS
+    kmk::Lock lock(m_metricsServerSection);
+    m_metricsServer.Stop();
+#endif
+    return ERROR_OK;
+}
+
+int DriverMgr::GetLockProfile(std::vector<kmk::LockStatistics> &statisticsOut)
+{
+    if (!kmk::LockProfiler::IsEnabled())
+        return ERROR_UNKNOWN;
+
+    kmk::LockProfiler::GetStatistics(statisticsOut);
+    return ERROR_OK;
+}
+
+int DriverMgr::ResetLockProfile()
+{
+    if (!kmk::LockProfiler::IsEnabled())
+        return ERROR_UNKNOWN;
+
+    kmk::LockProfiler::Reset();
+    return ERROR_OK;
+}
+
+int DriverMgr::SetVirtualTime(bool enabled)
+{
+    // The update thread steps the clock
+    if (!IsInitialised())
+        return ERROR_NOT_INITIALISED;
+
+    kmk::Lock lock(m_deviceSection);
+
+    // Acquisitions already running would jump in time
+    HIDSpectrometerDeviceVector::iterator it;
+    for (it = m_attachedDevices.begin(); it != m_attachedDevices.end(); ++it)
+    {
+        if (it->second->IsAcquiringData())
+            return ERROR_UNKNOWN;
+    }
+
+    if (enabled)
+        kmk::VirtualClock::GetInstance().Enable();
+    else
+        kmk::VirtualClock::GetInstance().Disable();
+
+    return ERROR_OK;
+}
+
+int DriverMgr::SetProcessingThreads(unsigned int numThreads, bool workStealing)
+{
+    if (!IsInitialised())
+        return ERROR_NOT_INITIALISED;
+
+    kmk::Lock lock(m_deviceSection);
+
+    // Processing stays where it started until it finishes, so only change over between acquisitions
+    HIDSpectrometerDeviceVector::iterator it;
+    for (it = m_attachedDevices.begin(); it != m_attachedDevices.end(); ++it)
+    {
+        if (it->second->IsAcquiringData())
+            return ERROR_UNKNOWN;
+    }
+
+    // Waits for any device finishing off a configuration query on the old threads
+    kmk::Executor &executor = *m_pExecutor;
+    executor.Stop();
+
+    if (numThreads > 0 && !executor.Start(numThreads, workStealing))
+        return ERROR_UNKNOWN;
+
+    return ERROR_OK;
+}
+
+int DriverMgr::SetPacketPool(unsigned int poolSize, bool blockWhenFull, unsigned int blockTimeoutMs)
+{
+    if (poolSize == 0)
+        return ERROR_UNKNOWN;
+
+    // Drops are already raised on the error callback by the processor reading the device
+    kmk::PacketPoolSettings settings;
+    settings.poolSize = poolSize;
+    settings.overflowPolicy = blockWhenFull ? kmk::FramedPacketStreamer::OP_BLOCK : kmk::FramedPacketStreamer::OP_DROP;
+    settings.blockTimeoutMs = blockTimeoutMs;
+    m_deviceMgr.SetPacketPoolSettings(settings);
+
+    return ERROR_OK;
+}
+
+int DriverMgr::SetThreadPolicy(kmk::ThreadRole role, const kmk::ThreadPolicy &policy)
+{
+    return kmk::Thread::SetPolicy(role, policy) ? ERROR_OK : ERROR_UNKNOWN;
+}
+
+int DriverMgr::GetThreadPolicyStatus(kmk::ThreadRole role, kmk::ThreadPolicyStatus &statusOut)
+{
+    if (role < 0 || role >= kmk::TR_COUNT)
+        return ERROR_UNKNOWN;
+
+    statusOut = kmk::Thread::GetPolicyStatus(role);
+    return ERROR_OK;
+}
+
+int DriverMgr::SetDeviceCacheFile(const char *pFilePath)
+{
+    kmk::DeviceInfoCache &cache = kmk::DeviceInfoCache::GetInstance();
+    if (pFilePath == NULL)
+    {
+        cache.Close();
+        return ERROR_OK;
+    }
+
+    return cache.Open(pFilePath) ? ERROR_OK : ERROR_UNKNOWN;
+}
+
+int DriverMgr::SetReadBackend(bool ioUring)
+{
+#ifdef _WINDOWS
+    // Windows devices are read with overlapped io
+    return ioUring ? ERROR_UNKNOWN : ERROR_OK;
+#else
+    return kmk::USBKromekDataInterface::SetReadBackend(ioUring ? kmk::RB_IO_URING : kmk::RB_EPOLL) ? ERROR_OK : ERROR_UNKNOWN;
+#endif
+}
+
+// Called on the metrics server thread for each connection
+void DriverMgr::MetricsTextCallbackProc(void *pArg, std::string &textOut)
+{
+    DriverMgr *pThis = (DriverMgr*)pArg;
+    pThis->GetMetricsText(textOut);
+}
+
+void DriverMgr::UpdateDetectors(bool waitForProcessing)
+{
+	HIDSpectrometerDeviceVector::iterator it;
+	for (it = m_attachedDevices.begin(); it != m_attachedDevices.end(); ++it)
+	{
+		Detector *pDetector = it->second;
+		if (waitForProcessing)
+			pDetector->WaitForDataProcessing(VIRTUAL_TIME_PROCESSING_TIMEOUT);
+
+		pDetector->Update();
+	}
+}
+
 // Thread used to update all detectors. Started on call to Initialize and killed on call to shutdown.
 int DriverMgr::UpdateThreadProc(void *pArg)
 {
@@ -474,18 +1134,32 @@ int DriverMgr::UpdateThreadProc(void *pArg)
 	bool keepRunning;
 	do
 	{
-		// Lock the devices while we iterate over them
+		kmk::VirtualClock *pClock = kmk::VirtualClock::GetEnabled();
+		if (pClock == NULL)
 		{
-			kmk::Lock lock(pThis->m_deviceSection);
-			HIDSpectrometerDeviceVector::iterator it;
-			for (it = pThis->m_attachedDevices.begin(); it != pThis->m_attachedDevices.end(); ++it)
+			// Lock the devices while we iterate over them
 			{
-				Detector *pDetector = it->second;
-				pDetector->Update();
+				kmk::Lock lock(pThis->m_deviceSection);
+				pThis->UpdateDetectors(false);
 			}
+
+			kmk::Thread::Sleep(SLEEP_TIME_MS);
 		}
+		else
+		{
+			// Time only moves on once every detector has caught up with the last step, so each step sees exactly the
+			// same data every run
+			{
+				kmk::TryLock lock(pThis->m_deviceSection);
+				for (int waitedMs = 0; !lock.Retry() && waitedMs < VIRTUAL_TIME_DEVICE_WAIT; ++waitedMs)
+					kmk::Thread::Sleep(1);
 
-        kmk::Thread::Sleep(SLEEP_TIME_MS);
+				if (lock.IsLocked())
+					pThis->UpdateDetectors(true);
+			}
+
+			pClock->Advance(VIRTUAL_TIME_STEP);
+		}
 
 		{
 			kmk::Lock lock(pThis->m_updateThreadSection);
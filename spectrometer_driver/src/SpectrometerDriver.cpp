@@ -5,6 +5,13 @@
 #include "DriverMgr.h"
 #include "Detector.h"
 #include "devices.h"
+#include <string.h>
+
+// The default context backs the functions without a context
+static DriverMgr *GetDriverMgr(DriverContext context)
+{
+	return (context == NULL) ? DriverMgr::GetInstance() : (DriverMgr*)context;
+}
 
 ////////////////////////////////////////////////////////////////////////////
 // Name:		kr_GetVersionInformation
@@ -37,12 +44,17 @@ void stdcall kr_GetVersionInformation(int *pProduct, int *pMajor, int *pMinor, i
 //				other detector function (With the exception of kr_GetVersionInformation)
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_Initialise(ErrorCallback pErrorCallbackFunc, void *pUserData)
+{
+	return kr_InitialiseCtx(NULL, pErrorCallbackFunc, pUserData);
+}
+
+int stdcall kr_InitialiseCtx(DriverContext context, ErrorCallback pErrorCallbackFunc, void *pUserData)
 {
 	kmk::ValidDeviceIdentifierVector devices;
 	
 	GetDeviceList(devices);
-	DriverMgr::GetInstance()->SetErrorCallback(pErrorCallbackFunc, pUserData);
-    return DriverMgr::GetInstance()->Initialise(devices);
+	GetDriverMgr(context)->SetErrorCallback(pErrorCallbackFunc, pUserData);
+    return GetDriverMgr(context)->Initialise(devices);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -55,6 +67,49 @@ void stdcall kr_Destruct()
 	DriverMgr::DeleteInstance();
 }
 
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_CreateContext
+// Args:		ppAllowedDevices: Usb serials / device paths of the detectors the context may add (or NULL)
+//				numAllowedDevices: Number of entries in ppAllowedDevices, 0 to add every detector found
+//				pContextOut: Ptr to receive the new context
+// Desc:		Create a driver context independent of the default one and of any other context
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_CreateContext(const char **ppAllowedDevices, unsigned int numAllowedDevices, DriverContext *pContextOut)
+{
+	if (pContextOut == NULL || (ppAllowedDevices == NULL && numAllowedDevices != 0))
+		return ERROR_UNKNOWN;
+
+	// Serials and device paths are ASCII
+	std::vector<std::wstring> allowedDevices;
+	for (unsigned int i = 0; i < numAllowedDevices; ++i)
+	{
+		if (ppAllowedDevices[i] == NULL)
+			return ERROR_UNKNOWN;
+
+		std::string device = ppAllowedDevices[i];
+		allowedDevices.push_back(std::wstring(device.begin(), device.end()));
+	}
+
+	*pContextOut = (DriverContext)new DriverMgr(allowedDevices);
+	return ERROR_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_DestroyContext
+// Args:		context: Context from kr_CreateContext, NULL for the default context
+// Desc:		Shut the context down as kr_Destruct does and free it
+////////////////////////////////////////////////////////////////////////////
+void stdcall kr_DestroyContext(DriverContext context)
+{
+	if (context == NULL)
+	{
+		DriverMgr::DeleteInstance();
+		return;
+	}
+
+	delete (DriverMgr*)context;
+}
+
 ////////////////////////////////////////////////////////////////////////////
 // Name:		kr_GetNextDetector
 // Args:		currentDetectorID: The id of the previous detector or 0 to get the first detector in the list
@@ -63,7 +118,12 @@ void stdcall kr_Destruct()
 ////////////////////////////////////////////////////////////////////////////
 unsigned int stdcall kr_GetNextDetector(unsigned int currentDetectorID)
 {
-	return DriverMgr::GetInstance()->GetNextDevice(currentDetectorID);
+	return kr_GetNextDetectorCtx(NULL, currentDetectorID);
+}
+
+unsigned int stdcall kr_GetNextDetectorCtx(DriverContext context, unsigned int currentDetectorID)
+{
+	return GetDriverMgr(context)->GetNextDevice(currentDetectorID);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -74,7 +134,12 @@ unsigned int stdcall kr_GetNextDetector(unsigned int currentDetectorID)
 ////////////////////////////////////////////////////////////////////////////
 void stdcall kr_SetDeviceChangedCallback(DeviceChangedCallback pCallback, void *pUserData)
 {
-	DriverMgr::GetInstance()->SetDeviceChangedCallback(pCallback, pUserData);
+	kr_SetDeviceChangedCallbackCtx(NULL, pCallback, pUserData);
+}
+
+void stdcall kr_SetDeviceChangedCallbackCtx(DriverContext context, DeviceChangedCallback pCallback, void *pUserData)
+{
+	GetDriverMgr(context)->SetDeviceChangedCallback(pCallback, pUserData);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -86,7 +151,12 @@ void stdcall kr_SetDeviceChangedCallback(DeviceChangedCallback pCallback, void *
 ////////////////////////////////////////////////////////////////////////////
 void stdcall kr_SetDataReceivedCallback(DataReceivedCallback pCallback, void *pUserData)
 {
-	DriverMgr::GetInstance()->SetDataReceivedCallback(pCallback, pUserData);
+	kr_SetDataReceivedCallbackCtx(NULL, pCallback, pUserData);
+}
+
+void stdcall kr_SetDataReceivedCallbackCtx(DriverContext context, DataReceivedCallback pCallback, void *pUserData)
+{
+	GetDriverMgr(context)->SetDataReceivedCallback(pCallback, pUserData);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -100,12 +170,17 @@ void stdcall kr_SetDataReceivedCallback(DataReceivedCallback pCallback, void *pU
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_GetAcquiredData(unsigned int deviceID, unsigned int *pBuffer, unsigned int *pTotalCounts, unsigned int *pRealTime, unsigned int *pLiveTime)
 {
-	return DriverMgr::GetInstance()->GetAcquiredData(deviceID, pBuffer, pTotalCounts, pRealTime, pLiveTime);
+	return kr_GetAcquiredDataCtx(NULL, deviceID, pBuffer, pTotalCounts, pRealTime, pLiveTime, 0);
 }
 
 int stdcall kr_GetAcquiredDataEx(unsigned int deviceID, unsigned int *pBuffer, unsigned int *pTotalCounts, unsigned int *pRealTime, unsigned int *pLiveTime, unsigned int flags)
 {
-	return DriverMgr::GetInstance()->GetAcquiredData(deviceID, pBuffer, pTotalCounts, pRealTime, pLiveTime, flags);
+	return kr_GetAcquiredDataCtx(NULL, deviceID, pBuffer, pTotalCounts, pRealTime, pLiveTime, flags);
+}
+
+int stdcall kr_GetAcquiredDataCtx(DriverContext context, unsigned int deviceID, unsigned int *pBuffer, unsigned int *pTotalCounts, unsigned int *pRealTime, unsigned int *pLiveTime, unsigned int flags)
+{
+	return GetDriverMgr(context)->GetAcquiredData(deviceID, pBuffer, pTotalCounts, pRealTime, pLiveTime, flags);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -116,7 +191,12 @@ int stdcall kr_GetAcquiredDataEx(unsigned int deviceID, unsigned int *pBuffer, u
 ////////////////////////////////////////////////////////////////////////////
 USBSPECTROMETER_API int stdcall kr_ClearAcquiredData(unsigned int deviceID)
 {
-    return DriverMgr::GetInstance()->ClearAcquiredData(deviceID);
+    return kr_ClearAcquiredDataCtx(NULL, deviceID);
+}
+
+int stdcall kr_ClearAcquiredDataCtx(DriverContext context, unsigned int deviceID)
+{
+    return GetDriverMgr(context)->ClearAcquiredData(deviceID);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -127,7 +207,12 @@ USBSPECTROMETER_API int stdcall kr_ClearAcquiredData(unsigned int deviceID)
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_IsAcquiringData(unsigned int deviceID)
 {
-	return DriverMgr::GetInstance()->IsAcquiringData(deviceID);
+	return kr_IsAcquiringDataCtx(NULL, deviceID);
+}
+
+int stdcall kr_IsAcquiringDataCtx(DriverContext context, unsigned int deviceID)
+{
+	return GetDriverMgr(context)->IsAcquiringData(deviceID);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -140,7 +225,12 @@ int stdcall kr_IsAcquiringData(unsigned int deviceID)
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_BeginDataAcquisition(unsigned int deviceID, unsigned int realTime, unsigned int liveTime)
 {
-    return DriverMgr::GetInstance()->BeginDataAcquisition(deviceID, realTime, liveTime);
+    return kr_BeginDataAcquisitionCtx(NULL, deviceID, realTime, liveTime);
+}
+
+int stdcall kr_BeginDataAcquisitionCtx(DriverContext context, unsigned int deviceID, unsigned int realTime, unsigned int liveTime)
+{
+    return GetDriverMgr(context)->BeginDataAcquisition(deviceID, realTime, liveTime);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -151,7 +241,12 @@ int stdcall kr_BeginDataAcquisition(unsigned int deviceID, unsigned int realTime
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_StopDataAcquisition(unsigned int deviceID)
 {
-    return DriverMgr::GetInstance()->EndDataAcquisition(deviceID);
+    return kr_StopDataAcquisitionCtx(NULL, deviceID);
+}
+
+int stdcall kr_StopDataAcquisitionCtx(DriverContext context, unsigned int deviceID)
+{
+    return GetDriverMgr(context)->EndDataAcquisition(deviceID);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -162,9 +257,14 @@ int stdcall kr_StopDataAcquisition(unsigned int deviceID)
 // Desc:		Get device name
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_GetDeviceName(unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut)
+{
+    return kr_GetDeviceNameCtx(NULL, deviceID, pBuffer, bufferSize, pNumBytesOut);
+}
+
+int stdcall kr_GetDeviceNameCtx(DriverContext context, unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut)
 {
     std::wstring val;
-    int errorCode = DriverMgr::GetInstance()->GetDeviceName(deviceID, val);
+    int errorCode = GetDriverMgr(context)->GetDeviceName(deviceID, val);
     if (errorCode == ERROR_OK)
     {
         size_t sizeOut = 0;
@@ -188,9 +288,14 @@ int stdcall kr_GetDeviceName(unsigned int deviceID, char *pBuffer, int bufferSiz
 // Desc:		Get device name
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_GetDeviceManufacturer(unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut)
+{
+    return kr_GetDeviceManufacturerCtx(NULL, deviceID, pBuffer, bufferSize, pNumBytesOut);
+}
+
+int stdcall kr_GetDeviceManufacturerCtx(DriverContext context, unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut)
 {
     std::wstring val;
-    int errorCode = DriverMgr::GetInstance()->GetDeviceManufacturer(deviceID, val);
+    int errorCode = GetDriverMgr(context)->GetDeviceManufacturer(deviceID, val);
     if (errorCode == ERROR_OK)
     {
         size_t sizeOut;
@@ -215,9 +320,14 @@ int stdcall kr_GetDeviceManufacturer(unsigned int deviceID, char *pBuffer, int b
 // Desc:		Get device name
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_GetDeviceSerial(unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut)
+{
+    return kr_GetDeviceSerialCtx(NULL, deviceID, pBuffer, bufferSize, pNumBytesOut);
+}
+
+int stdcall kr_GetDeviceSerialCtx(DriverContext context, unsigned int deviceID, char *pBuffer, int bufferSize, int *pNumBytesOut)
 {
     std::wstring val;
-    int errorCode = DriverMgr::GetInstance()->GetDeviceSerial(deviceID, val);
+    int errorCode = GetDriverMgr(context)->GetDeviceSerial(deviceID, val);
     if (errorCode == ERROR_OK)
     {
         size_t sizeOut;
@@ -240,7 +350,12 @@ int stdcall kr_GetDeviceSerial(unsigned int deviceID, char *pBuffer, int bufferS
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_GetDeviceVendorID(unsigned int deviceID, int *pVendorIDOut)
 {
-    return DriverMgr::GetInstance()->GetDeviceVendorID(deviceID, *pVendorIDOut);
+    return kr_GetDeviceVendorIDCtx(NULL, deviceID, pVendorIDOut);
+}
+
+int stdcall kr_GetDeviceVendorIDCtx(DriverContext context, unsigned int deviceID, int *pVendorIDOut)
+{
+    return GetDriverMgr(context)->GetDeviceVendorID(deviceID, *pVendorIDOut);
 }
 
 ////////////////////////////////////////////////////////////////////////////
@@ -250,15 +365,468 @@ int stdcall kr_GetDeviceVendorID(unsigned int deviceID, int *pVendorIDOut)
 ////////////////////////////////////////////////////////////////////////////
 int stdcall kr_GetDeviceProductID(unsigned int deviceID, int *pProductIDOut)
 {
-    return DriverMgr::GetInstance()->GetDeviceProductID(deviceID, *pProductIDOut);
+    return kr_GetDeviceProductIDCtx(NULL, deviceID, pProductIDOut);
+}
+
+int stdcall kr_GetDeviceProductIDCtx(DriverContext context, unsigned int deviceID, int *pProductIDOut)
+{
+    return GetDriverMgr(context)->GetDeviceProductID(deviceID, *pProductIDOut);
 }
 
 int stdcall kr_SendInt8ConfigurationCommand(unsigned int deviceID, ConfigurationCommandsEnum configurationID, unsigned char command)
 {
-    return DriverMgr::GetInstance()->SendInt8ConfigurationCommand(deviceID, (kmk::ConfigurationID)configurationID, command);
+    return kr_SendInt8ConfigurationCommandCtx(NULL, deviceID, configurationID, command);
+}
+
+int stdcall kr_SendInt8ConfigurationCommandCtx(DriverContext context, unsigned int deviceID, ConfigurationCommandsEnum configurationID, unsigned char command)
+{
+    return GetDriverMgr(context)->SendInt8ConfigurationCommand(deviceID, (kmk::ConfigurationID)configurationID, command);
 }
 
 int stdcall kr_SendInt16ConfigurationCommand(unsigned int deviceID, ConfigurationCommandsEnum configurationID, unsigned short command)
 {
-    return DriverMgr::GetInstance()->SendInt16ConfigurationCommand(deviceID, (kmk::ConfigurationID)configurationID, command);
+    return kr_SendInt16ConfigurationCommandCtx(NULL, deviceID, configurationID, command);
+}
+
+int stdcall kr_SendInt16ConfigurationCommandCtx(DriverContext context, unsigned int deviceID, ConfigurationCommandsEnum configurationID, unsigned short command)
+{
+    return GetDriverMgr(context)->SendInt16ConfigurationCommand(deviceID, (kmk::ConfigurationID)configurationID, command);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetSpectrumPolling
+// Args:		deviceID: id of device
+//				pSettings: polling settings, NULL for the defaults
+// Desc:		Set how often a D3 family detector is asked for its spectrum
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetSpectrumPolling(unsigned int deviceID, const SSpectrumPollSettings *pSettings)
+{
+    return kr_SetSpectrumPollingCtx(NULL, deviceID, pSettings);
+}
+
+int stdcall kr_SetSpectrumPollingCtx(DriverContext context, unsigned int deviceID, const SSpectrumPollSettings *pSettings)
+{
+    kmk::SpectrumPollSettings settings;
+    if (pSettings != NULL)
+    {
+        settings.intervalMs = pSettings->intervalMs;
+        settings.adaptive = pSettings->adaptive != FALSE;
+        settings.minIntervalMs = pSettings->minIntervalMs;
+        settings.maxIntervalMs = pSettings->maxIntervalMs;
+        settings.fastCountRate = pSettings->fastCountRate;
+        settings.slowCountRate = pSettings->slowCountRate;
+        settings.slowSpectrumCount = pSettings->slowSpectrumCount;
+    }
+
+    return GetDriverMgr(context)->SetSpectrumPollSettings(deviceID, settings);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetAlarmState
+// Args:		deviceID: id of device
+//				active: TRUE while an alarm is raised
+// Desc:		Hold adaptive polling of a D3 family detector at its fastest during an alarm
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetAlarmState(unsigned int deviceID, BOOL active)
+{
+    return kr_SetAlarmStateCtx(NULL, deviceID, active);
+}
+
+int stdcall kr_SetAlarmStateCtx(DriverContext context, unsigned int deviceID, BOOL active)
+{
+    return GetDriverMgr(context)->SetAlarmState(deviceID, active != FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_AddReplayDevice
+// Args:		pCaptureFilePath: Path of a raw data capture
+//				speed: Playback speed, 1.0 for the original timing or <= 0 for as fast as possible
+//				loop: Restart from the beginning once the end of the capture is reached
+// Desc:		Add the detectors recorded in a capture file as if they had been connected
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_AddReplayDevice(const char *pCaptureFilePath, double speed, BOOL loop)
+{
+    return kr_AddReplayDeviceCtx(NULL, pCaptureFilePath, speed, loop);
+}
+
+int stdcall kr_AddReplayDeviceCtx(DriverContext context, const char *pCaptureFilePath, double speed, BOOL loop)
+{
+    return GetDriverMgr(context)->AddReplayDevice(pCaptureFilePath, speed, loop != FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_AddSimulatedDevice
+// Args:		vendorID / productID: Device to simulate
+//				countRate / neutronRate: Mean count rates (counts per second)
+//				peakChannel / peakFraction: Photopeak position and the fraction of gamma counts in it
+// Desc:		Add a simulated detector that produces data in the same format as the real device
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_AddSimulatedDevice(int vendorID, int productID, double countRate, double neutronRate, double peakChannel, double peakFraction)
+{
+    return kr_AddSimulatedDeviceCtx(NULL, vendorID, productID, countRate, neutronRate, peakChannel, peakFraction);
+}
+
+int stdcall kr_AddSimulatedDeviceCtx(DriverContext context, int vendorID, int productID, double countRate, double neutronRate, double peakChannel, double peakFraction)
+{
+    kmk::SimulationSettings settings;
+    settings.countRate = countRate;
+    settings.neutronRate = neutronRate;
+
+    // Peak width from a typical 7% FWHM resolution
+    if (peakFraction > 0)
+    {
+        double sigma = 0.07 * peakChannel / 2.355;
+        settings.peaks.push_back(kmk::SimulationPeak(peakChannel, (sigma > 1.0) ? sigma : 1.0, peakFraction));
+    }
+
+    return GetDriverMgr(context)->AddSimulatedDevice(vendorID, productID, settings);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_AddSerialDevice
+// Args:		pDevicePath: Path of the serial port
+//				vendorID / productID: Device on the port
+// Desc:		Add the detectors of a device on a serial port that is not found by enumeration
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_AddSerialDevice(const char *pDevicePath, int vendorID, int productID)
+{
+    return kr_AddSerialDeviceCtx(NULL, pDevicePath, vendorID, productID);
+}
+
+int stdcall kr_AddSerialDeviceCtx(DriverContext context, const char *pDevicePath, int vendorID, int productID)
+{
+    return GetDriverMgr(context)->AddSerialDevice(pDevicePath, vendorID, productID);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_StartCapture
+// Args:		deviceID: id of device
+//				pBasePath: Path and file name prefix, files are named <pBasePath>_NNNN.kcap
+//				maxFileSize: Start a new file once this many bytes have been written, 0 for no limit
+//				maxFiles: Delete the oldest file once there are more than this, 0 to keep them all
+// Desc:		Record the raw data read from a device for use with kr_AddReplayDevice
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_StartCapture(unsigned int deviceID, const char *pBasePath, unsigned int maxFileSize, unsigned int maxFiles)
+{
+    return kr_StartCaptureCtx(NULL, deviceID, pBasePath, maxFileSize, maxFiles);
+}
+
+int stdcall kr_StartCaptureCtx(DriverContext context, unsigned int deviceID, const char *pBasePath, unsigned int maxFileSize, unsigned int maxFiles)
+{
+    kmk::CaptureSettings settings;
+    settings.maxFileSize = maxFileSize;
+    settings.maxFiles = maxFiles;
+    return GetDriverMgr(context)->StartCapture(deviceID, pBasePath, settings);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_StopCapture
+// Args:		deviceID: id of device
+// Desc:		Stop recording the device and close the capture file
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_StopCapture(unsigned int deviceID)
+{
+    return kr_StopCaptureCtx(NULL, deviceID);
+}
+
+int stdcall kr_StopCaptureCtx(DriverContext context, unsigned int deviceID)
+{
+    return GetDriverMgr(context)->StopCapture(deviceID);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetLatencyTracing
+// Args:		deviceID: id of device
+//				sampleInterval: Trace 1 in every sampleInterval reports, 0 to turn tracing off
+// Desc:		Collect latency histograms for each stage of the data path
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetLatencyTracing(unsigned int deviceID, unsigned int sampleInterval)
+{
+    return kr_SetLatencyTracingCtx(NULL, deviceID, sampleInterval);
+}
+
+int stdcall kr_SetLatencyTracingCtx(DriverContext context, unsigned int deviceID, unsigned int sampleInterval)
+{
+    return GetDriverMgr(context)->SetLatencyTracing(deviceID, sampleInterval);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_GetLatencyStatistics
+// Args:		deviceID: id of device
+//				stage: Stage of the data path
+//				pStatsOut: Ptr to the structure to receive the statistics
+// Desc:		Get the latency statistics (microseconds) of a stage
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_GetLatencyStatistics(unsigned int deviceID, LatencyStageEnum stage, SLatencyStatistics *pStatsOut)
+{
+    return kr_GetLatencyStatisticsCtx(NULL, deviceID, stage, pStatsOut);
+}
+
+int stdcall kr_GetLatencyStatisticsCtx(DriverContext context, unsigned int deviceID, LatencyStageEnum stage, SLatencyStatistics *pStatsOut)
+{
+    if (pStatsOut == NULL)
+        return ERROR_UNKNOWN;
+
+    kmk::LatencyStatistics stats;
+    int result = GetDriverMgr(context)->GetLatencyStatistics(deviceID, (kmk::LatencyStage)stage, stats);
+    if (result != ERROR_OK)
+        return result;
+
+    pStatsOut->count = stats.count;
+    pStatsOut->min = stats.min;
+    pStatsOut->mean = stats.mean;
+    pStatsOut->p50 = stats.p50;
+    pStatsOut->p90 = stats.p90;
+    pStatsOut->p99 = stats.p99;
+    pStatsOut->p999 = stats.p999;
+    pStatsOut->max = stats.max;
+    return ERROR_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_GetMetrics
+// Args:		deviceID: id of device
+//				pMetricsOut: Ptr to the structure to receive the metrics
+// Desc:		Get a snapshot of the counters kept for a device
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_GetMetrics(unsigned int deviceID, SMetrics *pMetricsOut)
+{
+    return kr_GetMetricsCtx(NULL, deviceID, pMetricsOut);
+}
+
+int stdcall kr_GetMetricsCtx(DriverContext context, unsigned int deviceID, SMetrics *pMetricsOut)
+{
+    if (pMetricsOut == NULL)
+        return ERROR_UNKNOWN;
+
+    kmk::MetricsSnapshot snapshot;
+    int result = GetDriverMgr(context)->GetMetrics(deviceID, snapshot);
+    if (result != ERROR_OK)
+        return result;
+
+    pMetricsOut->bytesRead = snapshot.values[kmk::METRIC_BYTES_READ];
+    pMetricsOut->reportsDecoded = snapshot.values[kmk::METRIC_REPORTS_DECODED];
+    pMetricsOut->eventsCounted = snapshot.values[kmk::METRIC_EVENTS_COUNTED];
+    pMetricsOut->queueDepth = snapshot.values[kmk::METRIC_QUEUE_DEPTH];
+    pMetricsOut->queueHighWater = snapshot.values[kmk::METRIC_QUEUE_HIGH_WATER];
+    pMetricsOut->droppedQueue = snapshot.values[kmk::METRIC_DROPPED_QUEUE];
+    pMetricsOut->droppedStream = snapshot.values[kmk::METRIC_DROPPED_STREAM];
+    pMetricsOut->crcFailures = snapshot.values[kmk::METRIC_CRC_FAILURES];
+    pMetricsOut->decompressionFailures = snapshot.values[kmk::METRIC_DECOMPRESSION_FAILURES];
+    pMetricsOut->configQueries = snapshot.values[kmk::METRIC_CONFIG_QUERIES];
+    pMetricsOut->configQueryTimeUs = snapshot.values[kmk::METRIC_CONFIG_QUERY_TIME];
+    pMetricsOut->configQueryFailures = snapshot.values[kmk::METRIC_CONFIG_QUERY_FAILURES];
+    pMetricsOut->acquisitionsStarted = snapshot.values[kmk::METRIC_ACQUISITIONS_STARTED];
+    return ERROR_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_WriteMetrics
+// Args:		pFilePath: Path of the file to write
+// Desc:		Write the metrics of every device as OpenMetrics text
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_WriteMetrics(const char *pFilePath)
+{
+    return kr_WriteMetricsCtx(NULL, pFilePath);
+}
+
+int stdcall kr_WriteMetricsCtx(DriverContext context, const char *pFilePath)
+{
+    if (pFilePath == NULL)
+        return ERROR_UNKNOWN;
+
+    return GetDriverMgr(context)->WriteMetrics(pFilePath);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_StartMetricsServer
+// Args:		pSocketPath: Path of the Unix domain socket to create
+// Desc:		Serve the metrics of every device as OpenMetrics text
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_StartMetricsServer(const char *pSocketPath)
+{
+    return kr_StartMetricsServerCtx(NULL, pSocketPath);
+}
+
+int stdcall kr_StartMetricsServerCtx(DriverContext context, const char *pSocketPath)
+{
+    if (pSocketPath == NULL)
+        return ERROR_UNKNOWN;
+
+    return GetDriverMgr(context)->StartMetricsServer(pSocketPath);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_StopMetricsServer
+// Desc:		Stop serving metrics
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_StopMetricsServer()
+{
+    return kr_StopMetricsServerCtx(NULL);
+}
+
+int stdcall kr_StopMetricsServerCtx(DriverContext context)
+{
+    return GetDriverMgr(context)->StopMetricsServer();
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_GetLockProfile
+// Args:		pProfilesOut: Array to receive the statistics of each lock
+//				pNumProfilesInOut: In the size of the array, out the number of locks profiled
+// Desc:		Get the contention statistics of the driver's locks
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_GetLockProfile(SLockProfile *pProfilesOut, unsigned int *pNumProfilesInOut)
+{
+    static_assert(LOCK_PROFILE_BUCKETS == LOCK_HISTOGRAM_BUCKETS, "Lock profile buckets differ from the driver");
+
+    if (pNumProfilesInOut == NULL || (pProfilesOut == NULL && *pNumProfilesInOut != 0))
+        return ERROR_UNKNOWN;
+
+    std::vector<kmk::LockStatistics> statistics;
+    int result = DriverMgr::GetInstance()->GetLockProfile(statistics);
+    if (result != ERROR_OK)
+        return result;
+
+    for (size_t i = 0; i < statistics.size() && i < *pNumProfilesInOut; ++i)
+    {
+        const kmk::LockStatistics &lock = statistics[i];
+        SLockProfile &profile = pProfilesOut[i];
+
+        strncpy(profile.name, lock.name.c_str(), LOCK_PROFILE_NAME_SIZE - 1);
+        profile.name[LOCK_PROFILE_NAME_SIZE - 1] = 0;
+        profile.acquisitions = lock.acquisitions;
+        profile.contended = lock.contended;
+        profile.waitTimeNs = lock.waitTimeNs;
+        profile.holdTimeNs = lock.holdTimeNs;
+        for (int bucket = 0; bucket < LOCK_PROFILE_BUCKETS; ++bucket)
+        {
+            profile.waitHistogram[bucket] = lock.waitHistogram[bucket];
+            profile.holdHistogram[bucket] = lock.holdHistogram[bucket];
+        }
+    }
+
+    *pNumProfilesInOut = (unsigned int)statistics.size();
+    return ERROR_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_ResetLockProfile
+// Desc:		Zero the lock contention statistics
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_ResetLockProfile()
+{
+    return DriverMgr::GetInstance()->ResetLockProfile();
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetVirtualTime
+// Args:		enabled: TRUE to run on virtual time
+// Desc:		Run the driver on a virtual clock stepped as fast as the devices keep up
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetVirtualTime(BOOL enabled)
+{
+    return DriverMgr::GetInstance()->SetVirtualTime(enabled != FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetProcessingThreads
+// Args:		numThreads: threads shared by all devices, 0 for a thread per device
+//				workStealing: TRUE to give each thread its own queue
+// Desc:		Process the data of every device on a shared pool of threads
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetProcessingThreads(unsigned int numThreads, BOOL workStealing)
+{
+    return kr_SetProcessingThreadsCtx(NULL, numThreads, workStealing);
+}
+
+int stdcall kr_SetProcessingThreadsCtx(DriverContext context, unsigned int numThreads, BOOL workStealing)
+{
+    return GetDriverMgr(context)->SetProcessingThreads(numThreads, workStealing != FALSE);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetPacketPool
+// Args:		poolSize: packets each detector holds until they are processed
+//				blockWhenFull: TRUE to wait for room rather than drop packets
+//				blockTimeoutMs: longest wait for room before a packet is dropped
+// Desc:		Size the packet pool of D5 detectors added from now on
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetPacketPool(unsigned int poolSize, BOOL blockWhenFull, unsigned int blockTimeoutMs)
+{
+    return kr_SetPacketPoolCtx(NULL, poolSize, blockWhenFull, blockTimeoutMs);
+}
+
+int stdcall kr_SetPacketPoolCtx(DriverContext context, unsigned int poolSize, BOOL blockWhenFull, unsigned int blockTimeoutMs)
+{
+    return GetDriverMgr(context)->SetPacketPool(poolSize, blockWhenFull != FALSE, blockTimeoutMs);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetThreadPolicy
+// Args:		role: Threads to place
+//				pPolicy: Placement of the threads, NULL for the defaults
+// Desc:		Set the cpus, scheduling and stack size of threads started in a role
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetThreadPolicy(ThreadRoleEnum role, const SThreadPolicy *pPolicy)
+{
+    kmk::ThreadPolicy policy;
+    if (pPolicy != NULL)
+    {
+        if (pPolicy->scheduling < THREAD_SCHEDULING_DEFAULT || pPolicy->scheduling > THREAD_SCHEDULING_RR)
+            return ERROR_UNKNOWN;
+
+        policy.cpuMask = pPolicy->cpuMask;
+        policy.scheduling = (kmk::SchedulingPolicy)pPolicy->scheduling;
+        policy.priority = pPolicy->priority;
+        policy.stackSize = pPolicy->stackSize;
+    }
+
+    return DriverMgr::GetInstance()->SetThreadPolicy((kmk::ThreadRole)role, policy);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_GetThreadPolicyStatus
+// Args:		role: Threads to report on
+//				pStatusOut: Ptr to the structure to receive the status
+// Desc:		Get which settings of a thread policy could not be applied
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_GetThreadPolicyStatus(ThreadRoleEnum role, SThreadPolicyStatus *pStatusOut)
+{
+    if (pStatusOut == NULL)
+        return ERROR_UNKNOWN;
+
+    kmk::ThreadPolicyStatus status;
+    int result = DriverMgr::GetInstance()->GetThreadPolicyStatus((kmk::ThreadRole)role, status);
+    if (result != ERROR_OK)
+        return result;
+
+    pStatusOut->threadsStarted = status.threadsStarted;
+    pStatusOut->threadsFailed = status.threadsFailed;
+    pStatusOut->failedSettings = status.failedSettings;
+    pStatusOut->lastError = status.lastError;
+    return ERROR_OK;
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetDeviceCacheFile
+// Args:		pFilePath: Path of the cache file, NULL to stop caching
+// Desc:		Keep the serial and version of each detector in a file so they are known as soon as it is attached
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetDeviceCacheFile(const char *pFilePath)
+{
+    return DriverMgr::GetInstance()->SetDeviceCacheFile(pFilePath);
+}
+
+////////////////////////////////////////////////////////////////////////////
+// Name:		kr_SetReadBackend
+// Args:		backend: How to read the devices
+// Desc:		Read the devices on a thread each or through a single io_uring
+////////////////////////////////////////////////////////////////////////////
+int stdcall kr_SetReadBackend(ReadBackendEnum backend)
+{
+    if (backend < READ_BACKEND_EPOLL || backend > READ_BACKEND_IO_URING)
+        return ERROR_UNKNOWN;
+
+    return DriverMgr::GetInstance()->SetReadBackend(backend == READ_BACKEND_IO_URING);
 }